@@ -0,0 +1,106 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef ADAPTER_H
+#define ADAPTER_H
+
+#include <stdint.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+
+// adapters of one run; the kernel's adapter list is not limited to
+// HCI_MAX_DEV, hub racks easily have more dongles than that
+#define MAX_ADAPTERS 256
+
+// highest extended features page we keep (the spec currently defines 0..2)
+#define MAX_EXT_FEATURE_PAGES 8
+
+// controller capabilities read through the command pipeline; the have_*
+// fields stay 0 if the controller did not answer the command
+struct adapter_caps {
+    int       have_commands;
+    uint8_t   commands[64];
+
+    uint8_t   ext_page_mask;         // bit n set if page n was read
+    uint8_t   max_ext_page;
+    uint8_t   ext_features[MAX_EXT_FEATURE_PAGES][8];
+
+    int       have_buffer_size;
+    uint16_t  acl_mtu;
+    uint8_t   sco_mtu;
+    uint16_t  acl_max_pkt;
+    uint16_t  sco_max_pkt;
+
+    int       have_le_features;
+    uint8_t   le_features[8];
+
+    int       have_le_buffer_size;
+    uint16_t  le_acl_mtu;
+    uint8_t   le_max_pkt;
+};
+
+// the probe step that failed for an adapter
+enum probe_failure {
+    PROBE_OK = 0,
+    PROBE_FAILED_OPEN,
+    PROBE_FAILED_DEVINFO,
+    PROBE_FAILED_VERSION
+};
+
+// the parts of a probe, each read by one ioctl or HCI command (or a few
+// for the extended feature pages)
+enum probe_field {
+    FIELD_DEVINFO = 0,       // hciDevInfo: flags, features, buffers, stats
+    FIELD_VERSION,
+    FIELD_COMMANDS,
+    FIELD_BUFFER_SIZE,
+    FIELD_EXT_FEATURES,
+    FIELD_LE_FEATURES,
+    FIELD_LE_BUFFER_SIZE,
+    PROBE_NUM_FIELDS
+};
+
+#define FIELD_BIT(field) (1u << (field))
+
+enum field_status {
+    FIELD_UNSUPPORTED = 0,   // the adapter does not have it, nothing was asked
+    FIELD_OK,
+    FIELD_FAILED,            // error or rejected by the controller
+    FIELD_TIMEOUT,           // the deadline passed before the answer came
+    FIELD_SKIPPED            // not asked: no time left or an earlier step failed
+};
+
+// everything a probe learned about one adapter; with failed set, the fields
+// with status FIELD_OK are still valid
+struct adapter_info {
+    int                  dev_id;
+    enum probe_failure   failed;
+    int                  status;       // errno of the failed call
+    uint8_t              fields[PROBE_NUM_FIELDS];   // enum field_status
+    struct hci_dev_info  hciDevInfo;
+    struct hci_version   hciVersion;
+    struct adapter_caps  caps;
+    int                  from_cache;   // caps came from the cache
+};
+
+#endif
@@ -0,0 +1,1186 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "analyze.h"
+#include "decode.h"
+#include "trace.h"
+
+
+#define ANALYZE_MAGIC         "btsnoop\0"
+#define ANALYZE_FILE_HDR      16
+#define ANALYZE_RECORD_HDR    24     // orig_len, incl_len, flags, drops, timestamp
+
+// longer records are taken as garbage when looking for a chunk's first record
+#define ANALYZE_MAX_RECORD    0x20000
+
+// automatic jobs get at least this much of the file each
+#define ANALYZE_MIN_CHUNK     (64ULL << 20)
+#define ANALYZE_MAX_JOBS      64
+
+// a chunk starts at the first offset followed by this many valid records
+#define ANALYZE_SYNC_RECORDS  8
+// or with a timestamp this far from the first record: one year in µs
+#define ANALYZE_SYNC_SPAN     (365LL * 24 * 3600 * 1000000)
+
+// not in the BlueZ headers
+#define ANALYZE_EVT_LE_ENH_CONN_COMPLETE  0x0a
+
+// record types of the Linux monitor datalink, in the low 16 bits of the flags
+enum monitor_opcode {
+    MONITOR_NEW_INDEX = 0,
+    MONITOR_DEL_INDEX,
+    MONITOR_COMMAND_PKT,
+    MONITOR_EVENT_PKT,
+    MONITOR_ACL_TX_PKT,
+    MONITOR_ACL_RX_PKT,
+    MONITOR_SCO_TX_PKT,
+    MONITOR_SCO_RX_PKT,
+    MONITOR_ISO_TX_PKT = 18,
+    MONITOR_ISO_RX_PKT,
+    MONITOR_MAX_OPCODE = 63
+};
+
+struct capture {
+    const uint8_t*  data;
+    uint64_t        size;
+    uint32_t        datalink;
+    int64_t         first;      // timestamp of the first record
+};
+
+struct chunk {
+    const struct capture*   capture;
+    uint64_t                start;    // the records starting in [start, end)
+    uint64_t                end;
+    int                     sync;     // start is a guess, find the first record
+    struct analyze_result*  result;
+};
+
+
+static inline uint32_t load_be32(const uint8_t* p)
+{
+    uint32_t value;
+
+    memcpy(&value, p, sizeof(value));
+    return be32toh(value);
+}
+
+
+static inline int64_t load_be64(const uint8_t* p)
+{
+    uint64_t value;
+
+    memcpy(&value, p, sizeof(value));
+    return (int64_t) be64toh(value);
+}
+
+
+// Fibonacci hashing into a table of 2^bits slots
+static inline uint32_t slot_of(uint32_t key, int bits)
+{
+    return (key * 0x9e3779b9u) >> (32 - bits);
+}
+
+
+// the link of key, added if new; NULL once the table is full
+static struct analyze_link* find_link(struct analyze_result* result, uint32_t key)
+{
+    uint32_t i = slot_of(key, ANALYZE_LINK_BITS);
+
+    while (1) {
+        struct analyze_link* link = &result->link_table[i];
+
+        if (link->key == key)
+            return link;
+        if (link->key == 0) {
+            if (result->links >= ANALYZE_LINK_MAX)
+                return NULL;
+            link->key = key;
+            result->links++;
+            return link;
+        }
+        i = (i + 1) & (ANALYZE_LINK_SIZE - 1);
+    }
+}
+
+
+static struct analyze_command* find_command(struct analyze_result* result, uint32_t key)
+{
+    uint32_t i = slot_of(key, ANALYZE_COMMAND_BITS);
+
+    while (1) {
+        struct analyze_command* command = &result->command_table[i];
+
+        if (command->key == key)
+            return command;
+        if (command->key == 0) {
+            if (result->commands >= ANALYZE_COMMAND_MAX)
+                return NULL;
+            command->key = key;
+            result->commands++;
+            return command;
+        }
+        i = (i + 1) & (ANALYZE_COMMAND_SIZE - 1);
+    }
+}
+
+
+static inline uint32_t link_key(int index, uint16_t handle)
+{
+    return ANALYZE_KEY_USED | index << 12 | acl_handle(handle);
+}
+
+
+static inline uint32_t command_key(int index, uint16_t opcode)
+{
+    return ANALYZE_KEY_USED | index << 16 | opcode;
+}
+
+
+static void add_command(struct analyze_result* result, int index, uint16_t opcode, int64_t ts)
+{
+    struct analyze_command* command = find_command(result, command_key(index, opcode));
+
+    if (!command) {
+        result->overflow++;
+        return;
+    }
+
+    command->sent++;
+    if (command->pending)
+        command->unanswered++;
+    if (command->first == ANALYZE_FIRST_NONE)
+        command->first = ANALYZE_FIRST_SENT;
+    command->pending = 1;
+    command->sent_at = ts;
+}
+
+
+static void add_latency(struct analyze_command* command, int64_t answered_at)
+{
+    int64_t latency = answered_at - command->sent_at;
+
+    trace_histogram_add(&command->latency, latency > 0 ? latency * 1000 : 0);
+    command->pending = 0;
+}
+
+
+// a Command Complete or Command Status event
+static void add_answer(struct analyze_result* result, int index, uint16_t opcode,
+                       uint8_t status, int64_t ts)
+{
+    struct analyze_command* command = find_command(result, command_key(index, opcode));
+
+    if (!command) {
+        result->overflow++;
+        return;
+    }
+
+    if (status) {
+        command->failed++;
+        result->errors[status]++;
+    }
+
+    // an answer before any command of the chunk belongs to the previous one
+    if (command->pending)
+        add_latency(command, ts);
+    else if (command->first == ANALYZE_FIRST_NONE) {
+        command->first        = ANALYZE_FIRST_ANSWER;
+        command->first_answer = ts;
+    }
+}
+
+
+// the return parameters of a Command Complete, decoded as the probe does
+static void add_return_params(struct analyze_result* result, struct analyze_adapter* adapter,
+                              uint16_t opcode, const uint8_t* rp, int len)
+{
+    struct adapter_info* info = &adapter->info;
+    enum probe_field field;
+    int size;
+
+    switch (opcode) {
+    case cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_BD_ADDR):
+        if (len >= READ_BD_ADDR_RP_SIZE && rp[0] == 0) {
+            bacpy(&info->hciDevInfo.bdaddr, &((const read_bd_addr_rp*) rp)->bdaddr);
+            adapter->have |= ANALYZE_HAVE_BDADDR;
+        }
+        return;
+
+    case cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_LOCAL_FEATURES):
+        if (len >= READ_LOCAL_FEATURES_RP_SIZE && rp[0] == 0) {
+            memcpy(info->hciDevInfo.features, ((const read_local_features_rp*) rp)->features, 8);
+            adapter->have |= ANALYZE_HAVE_FEATURES;
+        }
+        return;
+
+    case cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_LOCAL_VERSION):
+        field = FIELD_VERSION;
+        size  = READ_LOCAL_VERSION_RP_SIZE;
+        break;
+
+    case cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_LOCAL_COMMANDS):
+        field = FIELD_COMMANDS;
+        size  = READ_LOCAL_COMMANDS_RP_SIZE;
+        break;
+
+    case cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_BUFFER_SIZE):
+        field = FIELD_BUFFER_SIZE;
+        size  = READ_BUFFER_SIZE_RP_SIZE;
+        break;
+
+    case cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_LOCAL_EXT_FEATURES):
+        field = FIELD_EXT_FEATURES;
+        size  = READ_LOCAL_EXT_FEATURES_RP_SIZE;
+        break;
+
+    case cmd_opcode_pack(OGF_LE_CTL, OCF_LE_READ_LOCAL_SUPPORTED_FEATURES):
+        field = FIELD_LE_FEATURES;
+        size  = LE_READ_LOCAL_SUPPORTED_FEATURES_RP_SIZE;
+        break;
+
+    case cmd_opcode_pack(OGF_LE_CTL, OCF_LE_READ_BUFFER_SIZE):
+        field = FIELD_LE_BUFFER_SIZE;
+        size  = LE_READ_BUFFER_SIZE_RP_SIZE;
+        break;
+
+    default:
+        return;
+    }
+
+    // a failed command has the status only
+    if (rp[0]) {
+        info->fields[field] = FIELD_FAILED;
+        return;
+    }
+    if (len < size) {
+        result->malformed++;
+        return;
+    }
+
+    info->fields[field] = FIELD_OK;
+    switch (field) {
+    case FIELD_VERSION:
+        decode_local_version(&info->hciVersion, (const read_local_version_rp*) rp);
+        break;
+    case FIELD_COMMANDS:
+        decode_local_commands(&info->caps, (const read_local_commands_rp*) rp);
+        break;
+    case FIELD_BUFFER_SIZE:
+        // what the kernel reports in the device info
+        decode_buffer_size(&info->caps, (const read_buffer_size_rp*) rp);
+        info->hciDevInfo.acl_mtu  = info->caps.acl_mtu;
+        info->hciDevInfo.acl_pkts = info->caps.acl_max_pkt;
+        info->hciDevInfo.sco_mtu  = info->caps.sco_mtu;
+        info->hciDevInfo.sco_pkts = info->caps.sco_max_pkt;
+        break;
+    case FIELD_EXT_FEATURES:
+        decode_ext_features(&info->caps, (const read_local_ext_features_rp*) rp);
+        break;
+    case FIELD_LE_FEATURES:
+        decode_le_features(&info->caps, (const le_read_local_supported_features_rp*) rp);
+        break;
+    case FIELD_LE_BUFFER_SIZE:
+        decode_le_buffer_size(&info->caps, (const le_read_buffer_size_rp*) rp);
+        break;
+    default:
+        break;
+    }
+}
+
+
+static void add_connection(struct analyze_result* result, int index, uint8_t status,
+                           uint16_t handle, uint8_t type)
+{
+    struct analyze_link* link;
+
+    if (status) {
+        result->errors[status]++;
+        return;
+    }
+
+    link = find_link(result, link_key(index, handle));
+    if (!link) {
+        result->overflow++;
+        return;
+    }
+    link->have_type = 1;
+    link->type      = type;
+}
+
+
+static void add_event(struct analyze_result* result, int index,
+                      const uint8_t* data, uint32_t len, int64_t ts)
+{
+    const uint8_t* p = data + HCI_EVENT_HDR_SIZE;
+    struct analyze_link* link;
+    uint32_t plen;
+
+    if (len < HCI_EVENT_HDR_SIZE || data[1] > len - HCI_EVENT_HDR_SIZE) {
+        result->malformed++;
+        return;
+    }
+    plen = data[1];
+    result->events[data[0]]++;
+
+    switch (data[0]) {
+    case EVT_CMD_COMPLETE:
+        if (plen < EVT_CMD_COMPLETE_SIZE + 1) {
+            result->malformed++;
+            break;
+        }
+        // opcode 0 only returns command credits
+        if (bt_get_le16(p + 1) == 0)
+            break;
+        add_answer(result, index, bt_get_le16(p + 1), p[3], ts);
+        add_return_params(result, &result->adapters[index], bt_get_le16(p + 1),
+                          p + EVT_CMD_COMPLETE_SIZE, plen - EVT_CMD_COMPLETE_SIZE);
+        break;
+
+    case EVT_CMD_STATUS:
+        if (plen < EVT_CMD_STATUS_SIZE) {
+            result->malformed++;
+            break;
+        }
+        if (bt_get_le16(p + 2) != 0)
+            add_answer(result, index, bt_get_le16(p + 2), p[0], ts);
+        break;
+
+    case EVT_CONN_COMPLETE:
+        if (plen < EVT_CONN_COMPLETE_SIZE) {
+            result->malformed++;
+            break;
+        }
+        add_connection(result, index, p[0], bt_get_le16(p + 1),
+                       ((const evt_conn_complete*) p)->link_type);
+        break;
+
+    case EVT_DISCONN_COMPLETE:
+        if (plen < EVT_DISCONN_COMPLETE_SIZE) {
+            result->malformed++;
+            break;
+        }
+        if (p[0]) {
+            result->errors[p[0]]++;
+            break;
+        }
+        link = find_link(result, link_key(index, bt_get_le16(p + 1)));
+        if (!link) {
+            result->overflow++;
+            break;
+        }
+        link->disconnects++;
+        link->reason = p[3];
+        result->reasons[p[3]]++;
+        break;
+
+    case EVT_HARDWARE_ERROR:
+        result->hardware_errors++;
+        break;
+
+    case EVT_LE_META_EVENT:
+        if (plen < 1)
+            break;
+        if (p[0] != EVT_LE_CONN_COMPLETE && p[0] != ANALYZE_EVT_LE_ENH_CONN_COMPLETE)
+            break;
+        if (plen < 1 + 3) {
+            result->malformed++;
+            break;
+        }
+        add_connection(result, index, p[1], bt_get_le16(p + 2), LE_LINK);
+        break;
+    }
+}
+
+
+// ACL, SCO and ISO packets all start with the handle
+static void add_data(struct analyze_result* result, int index, int received,
+                     const uint8_t* data, uint32_t len, int64_t ts)
+{
+    struct analyze_link* link;
+
+    if (len < 2) {
+        result->malformed++;
+        return;
+    }
+
+    link = find_link(result, link_key(index, bt_get_le16(data)));
+    if (!link) {
+        result->overflow++;
+        return;
+    }
+
+    link->packets[received]++;
+    link->bytes[received] += len;
+    if (link->packets[0] + link->packets[1] == 1)
+        link->first = ts;
+    link->last = ts;
+}
+
+
+void analyze_packet(struct analyze_result* result, int index, int type, int received,
+                    const uint8_t* data, uint32_t len, int64_t ts)
+{
+    struct hci_dev_stats* stat;
+
+    if (index >= ANALYZE_MAX_ADAPTERS) {
+        result->ignored++;
+        return;
+    }
+
+    result->adapters[index].seen = 1;
+    stat = &result->adapters[index].info.hciDevInfo.stat;
+    if (received)
+        stat->byte_rx += len;
+    else
+        stat->byte_tx += len;
+
+    switch (type) {
+    case HCI_COMMAND_PKT:
+        stat->cmd_tx++;
+        if (len < HCI_COMMAND_HDR_SIZE)
+            result->malformed++;
+        else
+            add_command(result, index, bt_get_le16(data), ts);
+        break;
+
+    case HCI_EVENT_PKT:
+        stat->evt_rx++;
+        add_event(result, index, data, len, ts);
+        break;
+
+    case HCI_ACLDATA_PKT:
+        if (received)
+            stat->acl_rx++;
+        else
+            stat->acl_tx++;
+        add_data(result, index, received, data, len, ts);
+        break;
+
+    case HCI_SCODATA_PKT:
+        if (received)
+            stat->sco_rx++;
+        else
+            stat->sco_tx++;
+        add_data(result, index, received, data, len, ts);
+        break;
+
+    case ANALYZE_ISO_PKT:
+        add_data(result, index, received, data, len, ts);
+        break;
+
+    default:
+        result->malformed++;
+        break;
+    }
+}
+
+
+// monitor New Index: type, bus, address and the kernel's name of the adapter
+static void add_index(struct analyze_result* result, int index,
+                      const uint8_t* data, uint32_t len)
+{
+    struct analyze_adapter* adapter;
+
+    if (index >= ANALYZE_MAX_ADAPTERS) {
+        result->ignored++;
+        return;
+    }
+    if (len < 16) {
+        result->malformed++;
+        return;
+    }
+
+    adapter = &result->adapters[index];
+    adapter->seen = 1;
+    adapter->have |= ANALYZE_HAVE_INDEX;
+    // the way HCIGETDEVINFO packs them
+    adapter->info.hciDevInfo.type = (data[1] & 0x0f) | ((data[0] & 0x03) << 4);
+    bacpy(&adapter->info.hciDevInfo.bdaddr, (const bdaddr_t*) (data + 2));
+    memcpy(adapter->info.hciDevInfo.name, data + 8, 8);
+    adapter->info.hciDevInfo.name[7] = '\0';
+}
+
+
+static void add_record(struct analyze_result* result, uint32_t datalink, uint32_t flags,
+                       const uint8_t* data, uint32_t len, int64_t ts)
+{
+    int received = flags & 0x01;
+
+    switch (datalink) {
+    case ANALYZE_DATALINK_H1:
+        // bit 1 tells commands and events from data
+        if (flags & 0x02)
+            analyze_packet(result, 0, received ? HCI_EVENT_PKT : HCI_COMMAND_PKT,
+                           received, data, len, ts);
+        else
+            analyze_packet(result, 0, HCI_ACLDATA_PKT, received, data, len, ts);
+        break;
+
+    case ANALYZE_DATALINK_H4:
+        if (len < HCI_TYPE_LEN)
+            result->malformed++;
+        else
+            analyze_packet(result, 0, data[0], received, data + HCI_TYPE_LEN, len - HCI_TYPE_LEN, ts);
+        break;
+
+    case ANALYZE_DATALINK_MONITOR:
+        switch (flags & 0xffff) {
+        case MONITOR_NEW_INDEX:
+            add_index(result, flags >> 16, data, len);
+            break;
+        case MONITOR_COMMAND_PKT:
+            analyze_packet(result, flags >> 16, HCI_COMMAND_PKT, 0, data, len, ts);
+            break;
+        case MONITOR_EVENT_PKT:
+            analyze_packet(result, flags >> 16, HCI_EVENT_PKT, 1, data, len, ts);
+            break;
+        case MONITOR_ACL_TX_PKT:
+        case MONITOR_ACL_RX_PKT:
+            analyze_packet(result, flags >> 16, HCI_ACLDATA_PKT,
+                           (flags & 0xffff) == MONITOR_ACL_RX_PKT, data, len, ts);
+            break;
+        case MONITOR_SCO_TX_PKT:
+        case MONITOR_SCO_RX_PKT:
+            analyze_packet(result, flags >> 16, HCI_SCODATA_PKT,
+                           (flags & 0xffff) == MONITOR_SCO_RX_PKT, data, len, ts);
+            break;
+        case MONITOR_ISO_TX_PKT:
+        case MONITOR_ISO_RX_PKT:
+            analyze_packet(result, flags >> 16, ANALYZE_ISO_PKT,
+                           (flags & 0xffff) == MONITOR_ISO_RX_PKT, data, len, ts);
+            break;
+        }
+        break;
+    }
+}
+
+
+// 1 and the offset of the next record if a valid record header is at offset
+static int valid_record(const struct capture* capture, uint64_t offset, uint64_t* next)
+{
+    const uint8_t* hdr = capture->data + offset;
+    uint32_t orig_len, incl_len, flags;
+    int64_t ts;
+
+    if (capture->size - offset < ANALYZE_RECORD_HDR)
+        return 0;
+
+    orig_len = load_be32(hdr);
+    incl_len = load_be32(hdr + 4);
+    flags    = load_be32(hdr + 8);
+    ts       = load_be64(hdr + 16);
+
+    if (incl_len > orig_len || incl_len > ANALYZE_MAX_RECORD ||
+        incl_len > capture->size - offset - ANALYZE_RECORD_HDR)
+        return 0;
+    if (ts - capture->first > ANALYZE_SYNC_SPAN || capture->first - ts > ANALYZE_SYNC_SPAN)
+        return 0;
+    if (capture->datalink == ANALYZE_DATALINK_MONITOR ?
+            (flags & 0xffff) > MONITOR_MAX_OPCODE : flags > 0x03)
+        return 0;
+
+    *next = offset + ANALYZE_RECORD_HDR + incl_len;
+    return 1;
+}
+
+
+// Records have no sync marker: the first record of a chunk is the first
+// offset that starts a chain of valid records. A wrong guess is caught
+// when the chunks are joined.
+static uint64_t find_record(const struct capture* capture, uint64_t offset)
+{
+    for (; offset + ANALYZE_RECORD_HDR <= capture->size; offset++) {
+        uint64_t next = offset;
+        int n;
+
+        for (n = 0; n < ANALYZE_SYNC_RECORDS && next < capture->size; n++)
+            if (!valid_record(capture, next, &next))
+                break;
+        if (n == ANALYZE_SYNC_RECORDS || next == capture->size)
+            return offset;
+    }
+
+    return capture->size;
+}
+
+
+static void* analyze_chunk(void* arg)
+{
+    struct chunk* chunk = arg;
+    const struct capture* capture = chunk->capture;
+    struct analyze_result* result = chunk->result;
+    uint64_t offset = chunk->sync ? find_record(capture, chunk->start) : chunk->start;
+
+    result->start = offset;
+    while (offset < chunk->end) {
+        const uint8_t* hdr = capture->data + offset;
+        uint32_t incl_len, drops;
+        int64_t ts;
+
+        // a cut off record ends the capture
+        if (capture->size - offset < ANALYZE_RECORD_HDR ||
+            (incl_len = load_be32(hdr + 4)) > capture->size - offset - ANALYZE_RECORD_HDR) {
+            result->truncated = offset;
+            offset = capture->size;
+            break;
+        }
+
+        ts = load_be64(hdr + 16);
+        if (result->records == 0)
+            result->first = ts;
+        result->last = ts;
+        result->records++;
+        result->bytes += incl_len;
+
+        // cumulative
+        drops = load_be32(hdr + 12);
+        if (drops > result->drops)
+            result->drops = drops;
+
+        add_record(result, capture->datalink, load_be32(hdr + 8),
+                   hdr + ANALYZE_RECORD_HDR, incl_len, ts);
+        offset += ANALYZE_RECORD_HDR + incl_len;
+    }
+    result->stop = offset;
+
+    return NULL;
+}
+
+
+static void merge_adapter(struct analyze_adapter* into, const struct analyze_adapter* from)
+{
+    const struct adapter_info* src = &from->info;
+    struct adapter_info* dst = &into->info;
+    const struct hci_dev_stats* a = &src->hciDevInfo.stat;
+    struct hci_dev_stats* b = &dst->hciDevInfo.stat;
+    int field, page;
+
+    if (!from->seen)
+        return;
+    into->seen = 1;
+
+    // the counters add up, everything else is the latest answer
+    b->err_rx  += a->err_rx;
+    b->err_tx  += a->err_tx;
+    b->cmd_tx  += a->cmd_tx;
+    b->evt_rx  += a->evt_rx;
+    b->acl_tx  += a->acl_tx;
+    b->acl_rx  += a->acl_rx;
+    b->sco_tx  += a->sco_tx;
+    b->sco_rx  += a->sco_rx;
+    b->byte_rx += a->byte_rx;
+    b->byte_tx += a->byte_tx;
+
+    if (from->have & ANALYZE_HAVE_INDEX) {
+        dst->hciDevInfo.type = src->hciDevInfo.type;
+        memcpy(dst->hciDevInfo.name, src->hciDevInfo.name, sizeof(dst->hciDevInfo.name));
+    }
+    if (from->have & (ANALYZE_HAVE_INDEX | ANALYZE_HAVE_BDADDR))
+        bacpy(&dst->hciDevInfo.bdaddr, &src->hciDevInfo.bdaddr);
+    if (from->have & ANALYZE_HAVE_FEATURES)
+        memcpy(dst->hciDevInfo.features, src->hciDevInfo.features, 8);
+    into->have |= from->have;
+
+    for (field = 0; field < PROBE_NUM_FIELDS; field++) {
+        if (src->fields[field] == FIELD_UNSUPPORTED)
+            continue;
+        dst->fields[field] = src->fields[field];
+        if (src->fields[field] != FIELD_OK)
+            continue;
+
+        switch (field) {
+        case FIELD_VERSION:
+            dst->hciVersion = src->hciVersion;
+            break;
+        case FIELD_COMMANDS:
+            memcpy(dst->caps.commands, src->caps.commands, sizeof(dst->caps.commands));
+            dst->caps.have_commands = 1;
+            break;
+        case FIELD_BUFFER_SIZE:
+            dst->caps.acl_mtu          = src->caps.acl_mtu;
+            dst->caps.sco_mtu          = src->caps.sco_mtu;
+            dst->caps.acl_max_pkt      = src->caps.acl_max_pkt;
+            dst->caps.sco_max_pkt      = src->caps.sco_max_pkt;
+            dst->caps.have_buffer_size = 1;
+            dst->hciDevInfo.acl_mtu    = src->hciDevInfo.acl_mtu;
+            dst->hciDevInfo.acl_pkts   = src->hciDevInfo.acl_pkts;
+            dst->hciDevInfo.sco_mtu    = src->hciDevInfo.sco_mtu;
+            dst->hciDevInfo.sco_pkts   = src->hciDevInfo.sco_pkts;
+            break;
+        case FIELD_EXT_FEATURES:
+            for (page = 0; page < MAX_EXT_FEATURE_PAGES; page++)
+                if (src->caps.ext_page_mask & (1 << page))
+                    memcpy(dst->caps.ext_features[page], src->caps.ext_features[page], 8);
+            dst->caps.ext_page_mask |= src->caps.ext_page_mask;
+            dst->caps.max_ext_page   = src->caps.max_ext_page;
+            break;
+        case FIELD_LE_FEATURES:
+            memcpy(dst->caps.le_features, src->caps.le_features, 8);
+            dst->caps.have_le_features = 1;
+            break;
+        case FIELD_LE_BUFFER_SIZE:
+            dst->caps.le_acl_mtu          = src->caps.le_acl_mtu;
+            dst->caps.le_max_pkt          = src->caps.le_max_pkt;
+            dst->caps.have_le_buffer_size = 1;
+            break;
+        }
+    }
+}
+
+
+static void merge_link(struct analyze_result* into, const struct analyze_link* from)
+{
+    struct analyze_link* link = find_link(into, from->key);
+
+    if (!link) {
+        into->overflow++;
+        return;
+    }
+
+    if (from->packets[0] + from->packets[1]) {
+        if (link->packets[0] + link->packets[1] == 0)
+            link->first = from->first;
+        link->last = from->last;
+    }
+    link->packets[0] += from->packets[0];
+    link->packets[1] += from->packets[1];
+    link->bytes[0]   += from->bytes[0];
+    link->bytes[1]   += from->bytes[1];
+
+    if (from->have_type) {
+        link->have_type = 1;
+        link->type      = from->type;
+    }
+    if (from->disconnects) {
+        link->disconnects += from->disconnects;
+        link->reason       = from->reason;
+    }
+}
+
+
+// joins a command of the next chunk to what the chunks before left pending
+static void merge_command(struct analyze_result* into, const struct analyze_command* from)
+{
+    struct analyze_command* command = find_command(into, from->key);
+
+    if (!command) {
+        into->overflow++;
+        return;
+    }
+
+    if (command->pending) {
+        if (from->first == ANALYZE_FIRST_ANSWER)
+            add_latency(command, from->first_answer);
+        else if (from->first == ANALYZE_FIRST_SENT)
+            command->unanswered++;
+    }
+
+    command->sent       += from->sent;
+    command->failed     += from->failed;
+    command->unanswered += from->unanswered;
+    trace_histogram_merge(&command->latency, &from->latency);
+
+    if (from->sent) {
+        command->pending = from->pending;
+        command->sent_at = from->sent_at;
+    }
+}
+
+
+// appends the result of the chunk that follows into's records
+static void merge_result(struct analyze_result* into, const struct analyze_result* from)
+{
+    int i;
+
+    if (from->records) {
+        if (into->records == 0)
+            into->first = from->first;
+        into->last = from->last;
+    }
+    into->records         += from->records;
+    into->bytes           += from->bytes;
+    into->malformed       += from->malformed;
+    into->ignored         += from->ignored;
+    into->overflow        += from->overflow;
+    into->hardware_errors += from->hardware_errors;
+    if (from->drops > into->drops)
+        into->drops = from->drops;
+    if (!into->truncated)
+        into->truncated = from->truncated;
+    into->stop = from->stop;
+
+    for (i = 0; i < 256; i++) {
+        into->errors[i]  += from->errors[i];
+        into->reasons[i] += from->reasons[i];
+        into->events[i]  += from->events[i];
+    }
+
+    for (i = 0; i < ANALYZE_MAX_ADAPTERS; i++)
+        merge_adapter(&into->adapters[i], &from->adapters[i]);
+    for (i = 0; i < ANALYZE_LINK_SIZE; i++)
+        if (from->link_table[i].key)
+            merge_link(into, &from->link_table[i]);
+    for (i = 0; i < ANALYZE_COMMAND_SIZE; i++)
+        if (from->command_table[i].key)
+            merge_command(into, &from->command_table[i]);
+}
+
+
+// what only the whole capture can tell
+static void finish_result(struct analyze_result* result)
+{
+    int i;
+
+    for (i = 0; i < ANALYZE_COMMAND_SIZE; i++)
+        if (result->command_table[i].pending)
+            result->command_table[i].unanswered++;
+
+    for (i = 0; i < ANALYZE_MAX_ADAPTERS; i++) {
+        struct adapter_info* info = &result->adapters[i].info;
+
+        if (!result->adapters[i].seen)
+            continue;
+
+        info->dev_id = i;
+        info->hciDevInfo.dev_id = i;
+        if (!(result->adapters[i].have & ANALYZE_HAVE_INDEX))
+            snprintf(info->hciDevInfo.name, sizeof(info->hciDevInfo.name), "hci%d", i);
+        info->fields[FIELD_DEVINFO] = FIELD_OK;
+    }
+}
+
+
+static int run_chunks(const struct capture* capture, struct chunk* chunks, int jobs)
+{
+    pthread_t threads[ANALYZE_MAX_JOBS];
+    int started[ANALYZE_MAX_JOBS];
+    int i;
+
+    // the first chunk runs in this thread, as do chunks without a thread
+    for (i = 1; i < jobs; i++)
+        started[i] = pthread_create(&threads[i], NULL, analyze_chunk, &chunks[i]) == 0;
+    analyze_chunk(&chunks[0]);
+
+    for (i = 1; i < jobs; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            analyze_chunk(&chunks[i]);
+    }
+
+    // a chunk must start where the one before stopped; if its first
+    // record was guessed wrong, it is walked again from there
+    for (i = 1; i < jobs; i++) {
+        if (chunks[i].result->start != chunks[0].result->stop) {
+            memset(chunks[i].result, 0x00, sizeof(*chunks[i].result));
+            chunks[i].start = chunks[0].result->stop;
+            chunks[i].sync  = 0;
+            analyze_chunk(&chunks[i]);
+        }
+        merge_result(chunks[0].result, chunks[i].result);
+    }
+
+    finish_result(chunks[0].result);
+    return 0;
+}
+
+
+static int choose_jobs(uint64_t size, int jobs)
+{
+    if (jobs <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+        jobs = cores > 0 ? cores : 1;
+        if ((uint64_t) jobs > size / ANALYZE_MIN_CHUNK)
+            jobs = size / ANALYZE_MIN_CHUNK;
+    }
+
+    // a chunk should hold more than the records needed to find its start
+    if ((uint64_t) jobs > size / 4096)
+        jobs = size / 4096;
+    if (jobs > ANALYZE_MAX_JOBS)
+        jobs = ANALYZE_MAX_JOBS;
+    return jobs > 0 ? jobs : 1;
+}
+
+
+struct analyze_result* analyze_capture(const char* path, int jobs)
+{
+    struct analyze_result* results[ANALYZE_MAX_JOBS];
+    struct chunk chunks[ANALYZE_MAX_JOBS];
+    struct capture capture;
+    struct stat st;
+    uint64_t start = trace_now();
+    void* map;
+    int fd, err, i;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    if (st.st_size < ANALYZE_FILE_HDR) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    err = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        errno = err;
+        return NULL;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    capture.data     = map;
+    capture.size     = st.st_size;
+    capture.datalink = load_be32(capture.data + 12);
+    capture.first    = capture.size >= ANALYZE_FILE_HDR + ANALYZE_RECORD_HDR ?
+                       load_be64(capture.data + ANALYZE_FILE_HDR + 16) : 0;
+
+    if (memcmp(capture.data, ANALYZE_MAGIC, 8) != 0 || load_be32(capture.data + 8) != 1 ||
+        (capture.datalink != ANALYZE_DATALINK_H1 && capture.datalink != ANALYZE_DATALINK_H4 &&
+         capture.datalink != ANALYZE_DATALINK_MONITOR)) {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // equal parts of the records; each but the first finds its first record
+    jobs = choose_jobs(capture.size - ANALYZE_FILE_HDR, jobs);
+    for (i = 0; i < jobs; i++) {
+        results[i] = calloc(1, sizeof(struct analyze_result));
+        if (!results[i]) {
+            while (i-- > 0)
+                free(results[i]);
+            munmap(map, st.st_size);
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        chunks[i].capture = &capture;
+        chunks[i].start   = ANALYZE_FILE_HDR + (capture.size - ANALYZE_FILE_HDR) * i / jobs;
+        chunks[i].end     = ANALYZE_FILE_HDR + (capture.size - ANALYZE_FILE_HDR) * (i + 1) / jobs;
+        chunks[i].sync    = i > 0;
+        chunks[i].result  = results[i];
+    }
+
+    run_chunks(&capture, chunks, jobs);
+
+    for (i = 1; i < jobs; i++)
+        free(results[i]);
+    munmap(map, st.st_size);
+
+    results[0]->datalink = capture.datalink;
+    results[0]->jobs     = jobs;
+    results[0]->seconds  = (trace_now() - start) / 1e9;
+    return results[0];
+}
+
+
+static const char* datalink_name(uint32_t datalink)
+{
+    switch (datalink) {
+    case ANALYZE_DATALINK_H1:      return "H1";
+    case ANALYZE_DATALINK_H4:      return "H4";
+    case ANALYZE_DATALINK_MONITOR: return "monitor";
+    default:                       return "unknown";
+    }
+}
+
+
+static const char* link_type_name(const struct analyze_link* link)
+{
+    if (!link->have_type)
+        return "-";
+
+    switch (link->type) {
+    case SCO_LINK:  return "SCO";
+    case ACL_LINK:  return "ACL";
+    case ESCO_LINK: return "eSCO";
+    case LE_LINK:   return "LE";
+    default:        return "?";
+    }
+}
+
+
+// the HCI error codes seen most in the field
+static const char* error_name(uint8_t code)
+{
+    switch (code) {
+    case 0x01: return "Unknown HCI Command";
+    case 0x02: return "Unknown Connection Identifier";
+    case 0x03: return "Hardware Failure";
+    case 0x04: return "Page Timeout";
+    case 0x05: return "Authentication Failure";
+    case 0x06: return "PIN or Key Missing";
+    case 0x07: return "Memory Capacity Exceeded";
+    case 0x08: return "Connection Timeout";
+    case 0x0c: return "Command Disallowed";
+    case 0x0d: return "Rejected due to Limited Resources";
+    case 0x0e: return "Rejected due to Security Reasons";
+    case 0x0f: return "Rejected due to Unacceptable BD_ADDR";
+    case 0x11: return "Unsupported Feature or Parameter Value";
+    case 0x12: return "Invalid HCI Command Parameters";
+    case 0x13: return "Remote User Terminated Connection";
+    case 0x16: return "Connection Terminated by Local Host";
+    case 0x22: return "LMP Response Timeout";
+    case 0x3b: return "Unacceptable Connection Parameters";
+    case 0x3e: return "Connection Failed to be Established";
+    default:   return "";
+    }
+}
+
+
+static int compare_keys(const void* a, const void* b)
+{
+    uint32_t ka = **(const uint32_t* const*) a;
+    uint32_t kb = **(const uint32_t* const*) b;
+
+    return ka < kb ? -1 : ka > kb;
+}
+
+
+static void print_codes(struct outbuf* out, const char* title, const uint64_t* counts)
+{
+    int i, first = 1;
+
+    for (i = 0; i < 256; i++) {
+        if (!counts[i])
+            continue;
+        if (first)
+            out_printf(out, "%s:\n", title);
+        out_printf(out, "    0x%02x %8llu  %s\n", i, (unsigned long long) counts[i], error_name(i));
+        first = 0;
+    }
+}
+
+
+void analyze_print(struct outbuf* out, const struct analyze_result* result)
+{
+    const void* sorted[ANALYZE_LINK_SIZE > ANALYZE_COMMAND_SIZE ?
+                       ANALYZE_LINK_SIZE : ANALYZE_COMMAND_SIZE];
+    double seconds = (result->last - result->first) / 1e6;
+    char buf[32];
+    int i, n;
+
+    out_printf(out, "\ncapture: %s, %llu records, %.1f MB, %.1f s; "
+               "analyzed in %.3f s with %d job%s (%.0f MB/s)\n",
+               datalink_name(result->datalink), (unsigned long long) result->records,
+               result->bytes / 1e6, seconds, result->seconds, result->jobs,
+               result->jobs == 1 ? "" : "s",
+               result->seconds > 0 ? result->stop / 1e6 / result->seconds : 0.0);
+    out_printf(out, "    %llu dropped while capturing, %llu malformed, %llu of other adapters, "
+               "%llu beyond the tables, %llu hardware errors\n",
+               (unsigned long long) result->drops, (unsigned long long) result->malformed,
+               (unsigned long long) result->ignored, (unsigned long long) result->overflow,
+               (unsigned long long) result->hardware_errors);
+    if (result->truncated)
+        out_printf(out, "    truncated at offset %llu\n", (unsigned long long) result->truncated);
+
+    // the table order is the hash order
+    for (i = n = 0; i < ANALYZE_LINK_SIZE; i++)
+        if (result->link_table[i].key)
+            sorted[n++] = &result->link_table[i];
+    qsort(sorted, n, sizeof(sorted[0]), compare_keys);
+
+    if (n) {
+        out_printf(out, "\nconnections:\n    %-7s %-6s %-4s %10s %12s %10s %12s %9s %9s %11s %s\n",
+                   "adapter", "handle", "type", "tx packets", "tx bytes", "rx packets",
+                   "rx bytes", "seconds", "kbit/s", "disconnects", "last reason");
+    }
+    for (i = 0; i < n; i++) {
+        const struct analyze_link* link = sorted[i];
+        double active = (link->last - link->first) / 1e6;
+
+        out_printf(out, "    hci%-4u 0x%04x %-4s %10llu %12llu %10llu %12llu %9.3f ",
+                   (link->key & ~ANALYZE_KEY_USED) >> 12, link->key & 0x0fff,
+                   link_type_name(link),
+                   (unsigned long long) link->packets[0], (unsigned long long) link->bytes[0],
+                   (unsigned long long) link->packets[1], (unsigned long long) link->bytes[1],
+                   active);
+        if (active > 0)
+            out_printf(out, "%9.1f ", (link->bytes[0] + link->bytes[1]) * 8 / active / 1e3);
+        else
+            out_printf(out, "%9s ", "-");
+        if (link->disconnects)
+            out_printf(out, "%11u 0x%02x\n", link->disconnects, link->reason);
+        else
+            out_printf(out, "%11u -\n", 0);
+    }
+
+    for (i = n = 0; i < ANALYZE_COMMAND_SIZE; i++)
+        if (result->command_table[i].key)
+            sorted[n++] = &result->command_table[i];
+    qsort(sorted, n, sizeof(sorted[0]), compare_keys);
+
+    if (n) {
+        out_printf(out, "\ncommands:\n    %-7s %-34s %8s %7s %10s %9s %9s %9s\n",
+                   "adapter", "command", "sent", "failed", "unanswered", "p50", "p99", "max");
+    }
+    for (i = 0; i < n; i++) {
+        const struct analyze_command* command = sorted[i];
+
+        out_printf(out, "    hci%-4u %-34s %8llu %7llu %10llu",
+                   (command->key & ~ANALYZE_KEY_USED) >> 16,
+                   trace_op_name(command->key & 0xffff, buf, sizeof(buf)),
+                   (unsigned long long) command->sent, (unsigned long long) command->failed,
+                   (unsigned long long) command->unanswered);
+        if (command->latency.count) {
+            trace_print_latency(out, trace_percentile(&command->latency, 0.50));
+            trace_print_latency(out, trace_percentile(&command->latency, 0.99));
+            trace_print_latency(out, command->latency.max);
+        }
+        out_printf(out, "\n");
+    }
+
+    out_printf(out, "\n");
+    for (i = n = 0; i < 256; i++) {
+        if (!result->events[i])
+            continue;
+        if (n++ == 0)
+            out_printf(out, "events:\n");
+        out_printf(out, "    0x%02x %8llu\n", i, (unsigned long long) result->events[i]);
+    }
+    print_codes(out, "errors (failed commands and connections)", result->errors);
+    print_codes(out, "disconnection reasons", result->reasons);
+}
@@ -0,0 +1,144 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef ANALYZE_H
+#define ANALYZE_H
+
+#include <stdint.h>
+
+#include "adapter.h"
+#include "output.h"
+#include "trace.h"
+
+
+// Offline analysis of btsnoop captures (btmon -w, Android's HCI snoop
+// log, hcidump -w): the file is mapped and the records are walked in one
+// pass, split into chunks that are analyzed in parallel and merged in file
+// order. Command Complete events go through the same decoders as the live
+// probe, so every adapter of the capture comes out as an adapter_info.
+
+// btsnoop datalink types
+#define ANALYZE_DATALINK_H1       1001
+#define ANALYZE_DATALINK_H4       1002
+#define ANALYZE_DATALINK_MONITOR  2001
+
+// the ISO data packet type, not in the BlueZ headers
+#define ANALYZE_ISO_PKT           0x05
+
+// adapter indexes above are counted as ignored (monitor captures only)
+#define ANALYZE_MAX_ADAPTERS  16
+
+#define ANALYZE_LINK_BITS     10
+#define ANALYZE_LINK_SIZE     (1 << ANALYZE_LINK_BITS)
+#define ANALYZE_LINK_MAX      (ANALYZE_LINK_SIZE / 4 * 3)
+
+#define ANALYZE_COMMAND_BITS  8
+#define ANALYZE_COMMAND_SIZE  (1 << ANALYZE_COMMAND_BITS)
+#define ANALYZE_COMMAND_MAX   (ANALYZE_COMMAND_SIZE / 4 * 3)
+
+// the used bit of the table keys, so that key 0 marks a free slot
+#define ANALYZE_KEY_USED      0x80000000u
+
+// traffic of one connection handle; timestamps are µs as in the capture
+struct analyze_link {
+    uint32_t  key;             // index << 12 | handle, ANALYZE_KEY_USED
+    uint8_t   have_type;
+    uint8_t   type;            // SCO_LINK, ACL_LINK, ESCO_LINK or LE_LINK
+    uint8_t   reason;          // of the last disconnection
+    uint32_t  disconnects;
+    uint64_t  packets[2];      // sent, received
+    uint64_t  bytes[2];
+    int64_t   first;           // first and last data packet
+    int64_t   last;
+};
+
+// what came first for a command in a chunk: decides how chunks are joined
+enum analyze_first {
+    ANALYZE_FIRST_NONE = 0,
+    ANALYZE_FIRST_SENT,
+    ANALYZE_FIRST_ANSWER       // answers a command of an earlier chunk
+};
+
+// one HCI command of one adapter; latency runs from the command to its
+// Command Complete or Command Status event
+struct analyze_command {
+    uint32_t                key;          // index << 16 | opcode, ANALYZE_KEY_USED
+    uint8_t                 pending;      // sent and not answered yet
+    uint8_t                 first;        // enum analyze_first
+    int64_t                 sent_at;      // while pending
+    int64_t                 first_answer; // with ANALYZE_FIRST_ANSWER
+    uint64_t                sent;
+    uint64_t                failed;       // answered with an error status
+    uint64_t                unanswered;   // sent again or capture ended first
+    struct trace_histogram  latency;
+};
+
+// analyze_adapter.have: what the capture told beyond the probe fields
+#define ANALYZE_HAVE_INDEX     0x01   // monitor New Index: name, type, address
+#define ANALYZE_HAVE_BDADDR    0x02   // Read BD ADDR
+#define ANALYZE_HAVE_FEATURES  0x04   // Read Local Supported Features
+
+struct analyze_adapter {
+    int                  seen;
+    unsigned int         have;
+    struct adapter_info  info;    // stat counts the packets of the capture
+};
+
+struct analyze_result {
+    uint32_t                datalink;
+    uint64_t                records;
+    uint64_t                bytes;            // captured packet bytes
+    uint64_t                drops;            // lost by the capturing side
+    uint64_t                malformed;        // too short for their packet type
+    uint64_t                ignored;          // adapter index out of range
+    uint64_t                overflow;         // links or commands beyond the tables
+    uint64_t                truncated;        // offset of a cut off record, or 0
+    int64_t                 first;            // timestamps of the first and last record
+    int64_t                 last;
+    uint64_t                hardware_errors;
+    uint64_t                errors[256];      // status of failed commands and connections
+    uint64_t                reasons[256];     // of disconnections
+    uint64_t                events[256];      // by event code
+    uint64_t                start;            // the records walked: [start, stop)
+    uint64_t                stop;
+    double                  seconds;          // wall time of the analysis
+    int                     jobs;
+    int                     links;
+    int                     commands;
+    struct analyze_adapter  adapters[ANALYZE_MAX_ADAPTERS];
+    struct analyze_link     link_table[ANALYZE_LINK_SIZE];
+    struct analyze_command  command_table[ANALYZE_COMMAND_SIZE];
+};
+
+
+// analyzes the capture at path with jobs threads (0: one per core and at
+// most one per 64 MB); returns a result to be freed with free(), or NULL
+// with errno set (EINVAL: not a btsnoop file or an unknown datalink)
+struct analyze_result* analyze_capture(const char* path, int jobs);
+
+// adds one HCI packet without its type byte, sent or received by adapter
+// index at ts µs; for analyzers that get their packets elsewhere (sniff.c)
+void analyze_packet(struct analyze_result* result, int index, int type, int received,
+                    const uint8_t* data, uint32_t len, int64_t ts);
+
+// renders the capture summary, the connections, the commands and the errors
+void analyze_print(struct outbuf* out, const struct analyze_result* result);
+
+#endif
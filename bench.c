@@ -0,0 +1,525 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+// Benchmarks of the decode, render and probe paths. Every case is first
+// calibrated to run for --time seconds, then run --runs times; the median
+// gives ns per operation. Heap allocations are counted by wrapping malloc,
+// calloc and realloc at link time (see the Makefile), so they are the
+// allocations of this tree's code, not of libbluetooth or libc. --json
+// writes the results, --baseline compares them against such a file and
+// fails on a regression.
+
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "adapter.h"
+#include "btdevinfo.h"
+#include "deadline.h"
+#include "decode.h"
+#include "output.h"
+#include "text.h"
+#include "transport.h"
+
+
+#define BENCH_MAX_RUNS     31
+#define BENCH_MAX_CASES    32
+#define BENCH_NAME_SIZE    64
+// calibration grows the iterations at most this much per round
+#define BENCH_MAX_GROWTH   100
+
+struct bench_case {
+    const char*  name;
+    void (*run)(uint64_t iterations);
+};
+
+struct bench_result {
+    char      name[BENCH_NAME_SIZE];
+    uint64_t  iterations;      // per run
+    double    ns_per_op;       // median of the runs
+    double    allocs_per_op;
+    double    bytes_per_op;
+};
+
+// options
+static double       opt_time      = 0.2;   // seconds per run
+static int          opt_runs      = 5;
+static int          opt_adapters  = 8;     // simulated adapters of the probe cases
+static const char*  opt_filter    = NULL;  // name prefix, NULL = all
+static const char*  opt_json      = NULL;
+static const char*  opt_baseline  = NULL;
+static double       opt_threshold = 10;    // percent slower that is a regression
+
+// what the cases work on, set up once
+static struct outbuf        out;
+static struct adapter_info  adapter;
+static struct btdi_context  btdi;
+static struct adapter_info  probed[MAX_ADAPTERS];
+
+
+
+// allocation counting ---------------------------------------------------------
+
+static uint64_t bench_allocs = 0;
+static uint64_t bench_bytes  = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+
+void* __wrap_malloc(size_t size)
+{
+    __sync_fetch_and_add(&bench_allocs, 1);
+    __sync_fetch_and_add(&bench_bytes, size);
+    return __real_malloc(size);
+}
+
+
+void* __wrap_calloc(size_t nmemb, size_t size)
+{
+    __sync_fetch_and_add(&bench_allocs, 1);
+    __sync_fetch_and_add(&bench_bytes, nmemb * size);
+    return __real_calloc(nmemb, size);
+}
+
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+    __sync_fetch_and_add(&bench_allocs, 1);
+    __sync_fetch_and_add(&bench_bytes, size);
+    return __real_realloc(ptr, size);
+}
+
+
+
+// the cases -------------------------------------------------------------------
+
+// a stub adapter has everything, so every decoder has work to do
+static int make_adapter(struct adapter_info* info)
+{
+    return btdi_probe(&btdi, 0, 0, info);
+}
+
+
+static void run_lmp_features(uint64_t iterations)
+{
+    while (iterations--) {
+        printBits(&out, "LMP features", &lmp_features_table, adapter.hciDevInfo.features, 8);
+        out.len = 0;
+    }
+}
+
+
+static void run_dev_flags(uint64_t iterations)
+{
+    while (iterations--) {
+        printBitValue(&out, "flags", &dev_flags_table, adapter.hciDevInfo.flags);
+        out.len = 0;
+    }
+}
+
+
+static void run_packet_types(uint64_t iterations)
+{
+    while (iterations--) {
+        printBitValue(&out, "ACL packet types", &acl_ptype_table, adapter.hciDevInfo.pkt_type);
+        printBitValue(&out, "SCO packet types", &sco_ptype_table, adapter.hciDevInfo.pkt_type);
+        out.len = 0;
+    }
+}
+
+
+static void run_commands(uint64_t iterations)
+{
+    while (iterations--) {
+        printBits(&out, "supported commands", &commands_table,
+                  adapter.caps.commands, sizeof(adapter.caps.commands));
+        out.len = 0;
+    }
+}
+
+
+static void run_bit_names(uint64_t iterations)
+{
+    const char* names[512];
+
+    while (iterations--)
+        btdi_bit_names(&commands_table, adapter.caps.commands, sizeof(adapter.caps.commands),
+                       names, 512);
+}
+
+
+static void render_text(uint64_t iterations, int verbose, int unsupported)
+{
+    text_options.verbose     = verbose;
+    text_options.unsupported = unsupported;
+    while (iterations--) {
+        print_adapter_info(&out, &adapter);
+        out.len = 0;
+    }
+    text_options.verbose     = 0;
+    text_options.unsupported = 0;
+}
+
+
+static void run_text(uint64_t iterations)
+{
+    render_text(iterations, 0, 0);
+}
+
+
+static void run_text_verbose(uint64_t iterations)
+{
+    render_text(iterations, 1, 0);
+}
+
+
+static void run_text_unsupported(uint64_t iterations)
+{
+    render_text(iterations, 1, 1);
+}
+
+
+static void run_json(uint64_t iterations)
+{
+    while (iterations--) {
+        json_emitter.adapter(&out, &adapter, 0);
+        out.len = 0;
+    }
+}
+
+
+static void run_csv(uint64_t iterations)
+{
+    while (iterations--) {
+        csv_emitter.adapter(&out, &adapter, 0);
+        out.len = 0;
+    }
+}
+
+
+static void run_list(uint64_t iterations)
+{
+    int dev_ids[MAX_ADAPTERS];
+
+    while (iterations--)
+        btdi_list(&btdi, dev_ids, MAX_ADAPTERS, NULL);
+}
+
+
+// list and probe every simulated adapter in parallel, as a run of the tool
+static void run_probe(uint64_t iterations)
+{
+    int dev_ids[MAX_ADAPTERS];
+    int count, i;
+
+    while (iterations--) {
+        count = btdi_list(&btdi, dev_ids, MAX_ADAPTERS, NULL);
+        for (i = 0; i < count; i++)
+            probed[i].dev_id = dev_ids[i];
+        btdi_probe_all(&btdi, probed, count, 0);
+    }
+}
+
+
+static const struct bench_case cases[] = {
+    { "decode/lmp_features",     run_lmp_features },
+    { "decode/dev_flags",        run_dev_flags },
+    { "decode/packet_types",     run_packet_types },
+    { "decode/commands",         run_commands },
+    { "decode/bit_names",        run_bit_names },
+    { "render/text",             run_text },
+    { "render/text_verbose",     run_text_verbose },
+    { "render/text_unsupported", run_text_unsupported },
+    { "render/json",             run_json },
+    { "render/csv",              run_csv },
+    { "probe/list",              run_list },
+    { "probe/stub",              run_probe },
+    { NULL, NULL }
+};
+
+
+
+// running and reporting ---------------------------------------------------------
+
+static int compare_doubles(const void* a, const void* b)
+{
+    double da = *(const double*) a;
+    double db = *(const double*) b;
+
+    return da < db ? -1 : da > db;
+}
+
+
+static void measure(const struct bench_case* bench, struct bench_result* result)
+{
+    double ns[BENCH_MAX_RUNS];
+    uint64_t target = opt_time * 1e9;
+    uint64_t iterations = 1;
+    uint64_t allocs, bytes;
+    int run;
+
+    // grow the iterations until one run takes the target time
+    while (1) {
+        uint64_t start = deadline_now();
+        uint64_t took;
+
+        bench->run(iterations);
+        took = deadline_now() - start;
+        if (took >= target)
+            break;
+        if (took < target / BENCH_MAX_GROWTH)
+            iterations *= BENCH_MAX_GROWTH;
+        else
+            iterations = iterations * 1.2 * target / took + 1;
+    }
+
+    allocs = bench_allocs;
+    bytes  = bench_bytes;
+    for (run = 0; run < opt_runs; run++) {
+        uint64_t start = deadline_now();
+
+        bench->run(iterations);
+        ns[run] = (double) (deadline_now() - start) / iterations;
+    }
+    qsort(ns, opt_runs, sizeof(ns[0]), compare_doubles);
+
+    result->iterations    = iterations;
+    result->ns_per_op     = ns[opt_runs / 2];
+    result->allocs_per_op = (double) (bench_allocs - allocs) / iterations / opt_runs;
+    result->bytes_per_op  = (double) (bench_bytes - bytes) / iterations / opt_runs;
+}
+
+
+static int write_json(const char* path, const struct bench_result* results, int count)
+{
+    FILE* file = fopen(path, "w");
+    int i;
+
+    if (!file)
+        return -1;
+
+    fprintf(file, "{\"adapters\": %d, \"runs\": %d, \"benchmarks\": [\n", opt_adapters, opt_runs);
+    for (i = 0; i < count; i++)
+        fprintf(file, "  {\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.3f, "
+                "\"allocs_per_op\": %.3f, \"bytes_per_op\": %.1f}%s\n",
+                results[i].name, (unsigned long long) results[i].iterations,
+                results[i].ns_per_op, results[i].allocs_per_op, results[i].bytes_per_op,
+                i + 1 < count ? "," : "");
+    fprintf(file, "]}\n");
+
+    return fclose(file);
+}
+
+
+// reads a file of write_json, one benchmark per line
+static int read_json(const char* path, struct bench_result* results, int max)
+{
+    FILE* file = fopen(path, "r");
+    char line[512];
+    int count = 0;
+
+    if (!file)
+        return -1;
+
+    while (count < max && fgets(line, sizeof(line), file)) {
+        struct bench_result* result = &results[count];
+        unsigned long long iterations;
+
+        if (sscanf(line, " {\"name\": \"%63[^\"]\", \"iterations\": %llu, \"ns_per_op\": %lf, "
+                   "\"allocs_per_op\": %lf, \"bytes_per_op\": %lf",
+                   result->name, &iterations, &result->ns_per_op,
+                   &result->allocs_per_op, &result->bytes_per_op) == 5) {
+            result->iterations = iterations;
+            count++;
+        }
+    }
+
+    fclose(file);
+    return count;
+}
+
+
+static const struct bench_result* find_result(const struct bench_result* results, int count,
+                                              const char* name)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        if (strcmp(results[i].name, name) == 0)
+            return &results[i];
+    return NULL;
+}
+
+
+static void show_help(const char* program_name)
+{
+    printf("Usage: %s [OPTION]\n"\
+           "Benchmarks the decode, render and probe paths of bt_device_info.\n\n"\
+           "Available options:\n\n"\
+           "      --time <seconds>      length of one run of a benchmark (default 0.2)\n"\
+           "      --runs <n>            runs per benchmark, the median counts (default 5)\n"\
+           "      --adapters <n>        simulated adapters of the probe benchmarks (default 8)\n"\
+           "      --filter <prefix>     only the benchmarks whose name starts with <prefix>\n"\
+           "      --json <file>         also write the results to <file>\n"\
+           "      --baseline <file>     compare with the results of an earlier --json and\n"\
+           "                            fail if a benchmark got slower or allocates more\n"\
+           "      --threshold <percent> slowdown that counts as a regression (default 10)\n"\
+           "  -h, --help                this text\n", program_name);
+}
+
+
+int main(int argc, char** argv)
+{
+    static struct bench_result results[BENCH_MAX_CASES];
+    static struct bench_result baseline[BENCH_MAX_CASES];
+    const struct option long_options[] = {
+        {"time",      required_argument, 0, 't'},
+        {"runs",      required_argument, 0, 'r'},
+        {"adapters",  required_argument, 0, 'a'},
+        {"filter",    required_argument, 0, 'f'},
+        {"json",      required_argument, 0, 'j'},
+        {"baseline",  required_argument, 0, 'b'},
+        {"threshold", required_argument, 0, 'T'},
+        {"help",      no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+    int count = 0, baseline_count = 0, regressions = 0;
+    int opt, i;
+
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 't':
+            opt_time = atof(optarg);
+            if (opt_time <= 0) {
+                printf("invalid time: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            opt_runs = atoi(optarg);
+            if (opt_runs <= 0 || opt_runs > BENCH_MAX_RUNS) {
+                printf("invalid number of runs: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'a':
+            opt_adapters = atoi(optarg);
+            if (opt_adapters <= 0 || opt_adapters > MAX_ADAPTERS) {
+                printf("invalid number of adapters: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'f':
+            opt_filter = optarg;
+            break;
+        case 'j':
+            opt_json = optarg;
+            break;
+        case 'b':
+            opt_baseline = optarg;
+            break;
+        case 'T':
+            opt_threshold = atof(optarg);
+            if (opt_threshold < 0) {
+                printf("invalid threshold: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'h':
+            show_help(argv[0]);
+            return 0;
+        default:
+            printf("try --help to see all valid options\n");
+            return 1;
+        }
+    }
+
+    if (opt_baseline && (baseline_count = read_json(opt_baseline, baseline, BENCH_MAX_CASES)) < 0) {
+        fprintf(stderr, "Can't read baseline %s: %s (%d)\n", opt_baseline, strerror(errno), errno);
+        return 1;
+    }
+
+    outbuf_init(&out, 65536);
+    if (btdi_init(&btdi, transport_stub(opt_adapters)) < 0) {
+        fprintf(stderr, "Can't set up the stub adapters: %s (%d)\n", strerror(errno), errno);
+        return 1;
+    }
+    btdi.own_transport = 1;
+    if (make_adapter(&adapter) < 0) {
+        fprintf(stderr, "Can't probe stub adapter 0: %s (%d)\n", strerror(errno), errno);
+        return 1;
+    }
+
+    printf("%-26s %12s %12s %10s %12s%s\n",
+           "benchmark", "iterations", "ns/op", "allocs/op", "bytes/op",
+           opt_baseline ? "  vs baseline" : "");
+    for (i = 0; cases[i].name; i++) {
+        struct bench_result* result = &results[count];
+        const struct bench_result* base;
+
+        if (opt_filter && strncmp(cases[i].name, opt_filter, strlen(opt_filter)) != 0)
+            continue;
+
+        measure(&cases[i], result);
+        snprintf(result->name, sizeof(result->name), "%s", cases[i].name);
+        count++;
+
+        printf("%-26s %12llu %12.1f %10.2f %12.1f", result->name,
+               (unsigned long long) result->iterations, result->ns_per_op,
+               result->allocs_per_op, result->bytes_per_op);
+
+        base = find_result(baseline, baseline_count, result->name);
+        if (base && base->ns_per_op > 0) {
+            double change = (result->ns_per_op / base->ns_per_op - 1) * 100;
+            int slower = change > opt_threshold;
+            int allocates = result->allocs_per_op > base->allocs_per_op + 0.005;
+
+            printf("  %+6.1f%%%s%s", change, slower ? " SLOWER" : "",
+                   allocates ? " MORE ALLOCATIONS" : "");
+            regressions += slower || allocates;
+        } else if (opt_baseline) {
+            printf("  new");
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    btdi_free(&btdi);
+    outbuf_free(&out);
+
+    if (opt_json && write_json(opt_json, results, count) != 0) {
+        fprintf(stderr, "Can't write %s: %s (%d)\n", opt_json, strerror(errno), errno);
+        return 1;
+    }
+    if (opt_baseline)
+        printf("%d regression%s against %s\n", regressions, regressions == 1 ? "" : "s",
+               opt_baseline);
+
+    return regressions > 0;
+}
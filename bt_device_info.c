@@ -26,6 +26,7 @@
 
 
 #include <errno.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,526 +34,721 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/prctl.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <limits.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
 
+#include "adapter.h"
+#include "analyze.h"
+#include "btdevinfo.h"
+#include "cache.h"
+#include "connections.h"
+#include "deadline.h"
+#include "decode.h"
+#include "exporter.h"
+#include "fingerprint.h"
+#include "hotplug.h"
+#include "loopback.h"
+#include "output.h"
+#include "publish.h"
+#include "scan.h"
+#include "server.h"
+#include "sniff.h"
+#include "snapshot.h"
+#include "statlog.h"
+#include "text.h"
+#include "trace.h"
+#include "transport.h"
+#include "watch.h"
+
 
 #define OPT_NO_OPTION 0
 #define OPT_REQUIRED  1
 #define OPT_OPTIONAL  2
 
 // program options
-static int  opt_verbose     = 0;
-static int  opt_unsupported = 0;
-static int  opt_color       = 0;
+static double opt_watch     = 0;    // sampling interval in seconds, 0 = off
+static int  opt_monitor     = 0;
+static const char* opt_cache = NULL;  // cache file, NULL = no cache
+static const char* opt_format = "text";
+static const char* opt_export = NULL;  // metrics address, NULL = off
+static int  opt_stub        = 0;    // simulated adapters instead of the kernel's
+static const char* opt_publish = NULL; // shared memory name, NULL = off
+static const char* opt_read = NULL;    // shared memory name, NULL = off
+static int  opt_stats       = 0;
+static const char* opt_trace = NULL;   // Chrome trace file, NULL = off
+
+static const char* opt_record = NULL;  // recording file, NULL = off
+static const char* opt_replay = NULL;  // recording file, NULL = live
+static int  opt_realtime    = 0;
+
+static int  opt_connections = 0;
+static double opt_scan      = 0;    // LE scan duration in seconds, 0 = off
+static double opt_loopback  = 0;    // loopback test duration in seconds, 0 = off
+static int  opt_sniff       = 0;
+static const char* opt_sniff_types = NULL;  // see sniff_parse_filter, NULL = all
+
+static const char* opt_analyze = NULL; // btsnoop capture, NULL = off
+static int  opt_jobs        = 0;    // analyzer threads, 0 = automatic
+
+static const char* opt_log = NULL;     // statistics log of --watch, NULL = off
+static const char* opt_query = NULL;   // statistics log to query, NULL = off
+static const char* opt_since = NULL;   // query range, see statlog_parse_time
+static const char* opt_until = NULL;
+static double opt_step      = 0;    // query step in seconds, 0 = every sample
+static int  opt_dev         = -1;   // only this adapter, -1 = all
+
+// the adapters a run looks at (see --dev and --flags)
+static struct btdi_filter adapter_filter;
+// --changes lists the adapters whatever their flags; this is what it reports
+static struct btdi_filter changes_filter;
+
+// the values to print instead of everything (see --fields)
+static struct projection projection;
+static int  opt_fields      = 0;
+static const char* opt_changes = NULL; // snapshot file, NULL = full output
+
+static const char* opt_serve = NULL;   // daemon socket, NULL = off
+static const char* opt_connect = NULL; // daemon socket to ask, NULL = probe
+static int  opt_ttl         = 1000; // ms a daemon keeps a result
+static int  opt_rate        = 20;   // HCI commands per second and controller
+static int  opt_diff        = 0;    // the files after the options are diffed
+
+static int  opt_budget      = 5000; // ms for the whole run, 0 = unlimited
+static int  opt_timeout     = 2000; // ms per adapter
+static int  opt_retries     = 2;    // per step of a probe
+
+// end of the run's budget on CLOCK_MONOTONIC, 0 = none (see deadline.h)
+static uint64_t run_deadline = 0;
+
+// the kernel, or a recording of it (see --record and --replay)
+static struct transport* transport = NULL;
+
+// the probe itself, set up from the options above (see btdevinfo.h)
+static struct btdi_context btdi;
+
+// all adapters of one run, filled by the enumeration and the probe workers
+struct adapter_list {
+    int                  count;
+    struct adapter_info  adapters[MAX_ADAPTERS];
+};
+
+// adds the adapters that pass the filter, by default all that are up
+int collect_adapters(struct adapter_list* list)
+{
+    int count;
 
-// bash font styles vor colorized output mode
-#define STYLE_HEADLINE  "[1;35m"  // bold magenta
-#define STYLE_LABEL     "[21;32m" // normal green
-#define STYLE_TEXT      "[21;97m" // normal white
+    count = btdi_list_info(&btdi, list->adapters + list->count,
+                           MAX_ADAPTERS - list->count, &adapter_filter);
+    if (count < 0)
+        return -1;
 
+    list->count += count;
+    return 0;
+}
 
 
-static char ESC=27;
-void switch_to_style(char* color)
+// probes all adapters of the list in parallel within the run's budget;
+// not at all if the list already has everything btdi.fields asks for
+void probe_all_adapters(struct adapter_list* list)
 {
-    if(opt_color)
-        printf("%c%s" , ESC, color);
-}
+    int i;
+
+    if (!(btdi.fields & BTDI_ALL_FIELDS))
+        return;
 
+    if (btdi.fields == FIELD_BIT(FIELD_DEVINFO)) {
+        for (i = 0; i < list->count; i++)
+            if (list->adapters[i].fields[FIELD_DEVINFO] != FIELD_OK)
+                break;
+        if (i == list->count)
+            return;
+    }
 
-// from bluez v1.13 lib/hci.c
-typedef struct {
-    char *str;
-    unsigned int val;
-} hci_map;
+    btdi_probe_all(&btdi, list->adapters, list->count, run_deadline);
+}
 
 
-void printDeviceFlags(uint32_t dev_flags)
+// fills the list from the segment of a --publish process, in dev_id order
+int read_published(struct adapter_list* list, const char* name)
 {
+    struct publish_reader reader;
+    struct publish_data data;
+    int i, j;
 
-    // from bluez v1.13 lib/hci.c
-    hci_map dev_flags_map[] = {
-        { "UP",      HCI_UP      },
-        { "INIT",    HCI_INIT    },
-        { "RUNNING", HCI_RUNNING },
-        { "RAW",     HCI_RAW     },
-        { "PSCAN",   HCI_PSCAN   },
-        { "ISCAN",   HCI_ISCAN   },
-        { "INQUIRY", HCI_INQUIRY },
-        { "AUTH",    HCI_AUTH    },
-        { "ENCRYPT", HCI_ENCRYPT },
-        { NULL }
-    };
+    if (publish_reader_open(&reader, name) < 0)
+        return -1;
 
-    hci_map *map_ptr = dev_flags_map;
-
-    // HCI flags
-    switch_to_style(STYLE_LABEL);
-    printf("    flags:\t\n");
-    switch_to_style(STYLE_TEXT);
-
-    // print all features
-    if(opt_unsupported) {
-        while (map_ptr->str) {
-            printf("        %s:\t", map_ptr->str);
-            if(strlen(map_ptr->str) < 7 )
-                printf("\t");
-            printf("%u\n", (hci_test_bit(map_ptr->val, &dev_flags) > 0));
-            map_ptr++;
+    for (i = 0; i < PUBLISH_MAX_RECORDS && list->count < MAX_ADAPTERS; i++) {
+        struct adapter_info* info;
+
+        if (publish_read(&reader, i, &data) <= 0)
+            continue;
+
+        for (j = list->count; j > 0 && list->adapters[j - 1].dev_id > data.info.dev_id; j--)
+            list->adapters[j] = list->adapters[j - 1];
+
+        info = &list->adapters[j];
+        memset(info, 0x00, sizeof(*info));
+        info->dev_id     = data.info.dev_id;
+        info->hciDevInfo = data.info;
+        info->fields[FIELD_DEVINFO] = FIELD_OK;
+        if (data.have_version) {
+            info->hciVersion = data.version;
+            info->fields[FIELD_VERSION] = FIELD_OK;
         }
-        return;
+        list->count++;
     }
 
-    // only print features supported by the adapter
-    while (map_ptr->str) {
-        if (hci_test_bit(map_ptr->val, &dev_flags))
-            printf("        %s\n", map_ptr->str);
-        map_ptr++;
+    publish_reader_close(&reader);
+    return 0;
+}
+
+
+void print_probe_error(struct adapter_info* info)
+{
+    switch (info->failed) {
+    case PROBE_OK:
+        break;
+
+    case PROBE_FAILED_OPEN:
+        fprintf(stderr, "adapterState unsupported on device %d\n",
+                info->dev_id);
+        break;
+
+    case PROBE_FAILED_DEVINFO:
+        fprintf(stderr, "Can't get device info for hci%d: %s (%d)\n",
+                info->dev_id, strerror(info->status), info->status);
+        break;
+
+    case PROBE_FAILED_VERSION:
+        fprintf(stderr, "Can't read version info for hci%d: %s (%d)\n",
+                info->dev_id, strerror(info->status), info->status);
+        break;
     }
 }
 
 
-void printLmpFeatures(uint8_t* lmp_features)
+// exit statuses of a run that printed adapters: a step of a probe failed
+// (device info, open or version), or every step ran but some requested
+// read is missing (failed, timed out or skipped)
+#define EXIT_FAILED   1
+#define EXIT_PARTIAL  2
+
+// folds an adapter into the run's exit status; a failure outweighs a
+// partial result
+static int probe_exit_status(int status, const struct adapter_info* info)
 {
+    int field;
 
-    // from bluez v1.13 lib/hci.c
-    /* LMP features mapping */
-    static hci_map lmp_features_map[8][9] = {
-        {	/* Byte 0 */
-            { "3-slot packets",	    LMP_3SLOT	},	/* Bit 0 */
-            { "5-slot packets",	    LMP_5SLOT	},	/* Bit 1 */
-            { "encryption",	        LMP_ENCRYPT	},	/* Bit 2 */
-            { "slot offset",	    LMP_SOFFSET	},	/* Bit 3 */
-            { "timing accuracy",	LMP_TACCURACY	},	/* Bit 4 */
-            { "role switch",	    LMP_RSWITCH	},	/* Bit 5 */
-            { "hold mode",	        LMP_HOLD	},	/* Bit 6 */
-            { "sniff mode",	        LMP_SNIFF	},	/* Bit 7 */
-            { NULL }
-        },
-        {	/* Byte 1 */
-            { "park state",	        LMP_PARK	},	/* Bit 0 */
-            { "RSSI",		        LMP_RSSI	},	/* Bit 1 */
-            { "channel quality",	LMP_QUALITY	},	/* Bit 2 */
-            { "SCO link",		    LMP_SCO		},	/* Bit 3 */
-            { "HV2 packets",	    LMP_HV2		},	/* Bit 4 */
-            { "HV3 packets",	    LMP_HV3		},	/* Bit 5 */
-            { "u-law log",	        LMP_ULAW	},	/* Bit 6 */
-            { "A-law log",	        LMP_ALAW	},	/* Bit 7 */
-            { NULL }
-        },
-        {	/* Byte 2 */
-            { "CVSD",		        LMP_CVSD	},	/* Bit 0 */
-            { "paging scheme",	    LMP_PSCHEME	},	/* Bit 1 */
-            { "power control",	    LMP_PCONTROL	},	/* Bit 2 */
-            { "transparent SCO",	LMP_TRSP_SCO	},	/* Bit 3 */
-            { "broadcast encrypt",  LMP_BCAST_ENC	},	/* Bit 7 */
-            { NULL }
-        },
-        {	/* Byte 3 */
-            { "no. 24>",		    0x01		},	/* Bit 0 */
-            { "EDR ACL 2 Mbps",	    LMP_EDR_ACL_2M	},	/* Bit 1 */
-            { "EDR ACL 3 Mbps",	    LMP_EDR_ACL_3M	},	/* Bit 2 */
-            { "enhanced iscan",	    LMP_ENH_ISCAN	},	/* Bit 3 */
-            { "interlaced iscan",	LMP_ILACE_ISCAN	},	/* Bit 4 */
-            { "interlaced pscan",	LMP_ILACE_PSCAN	},	/* Bit 5 */
-            { "inquiry with RSSI",  LMP_RSSI_INQ	},	/* Bit 6 */
-            { "extended SCO",	    LMP_ESCO	},	/* Bit 7 */
-            { NULL }
-        },
-        {	/* Byte 4 */
-            { "EV4 packets",	    LMP_EV4		},	/* Bit 0 */
-            { "EV5 packets",	    LMP_EV5		},	/* Bit 1 */
-            { "no. 34",		        0x04		},	/* Bit 2 */
-            { "AFH cap. slave",	    LMP_AFH_CAP_SLV	},	/* Bit 3 */
-            { "AFH class. slave",	LMP_AFH_CLS_SLV	},	/* Bit 4 */
-            { "BR/EDR not supp.",	LMP_NO_BREDR	},	/* Bit 5 */
-            { "LE support",	        LMP_LE		},	/* Bit 6 */
-            { "3-slot EDR ACL",	    LMP_EDR_3SLOT	},	/* Bit 7 */
-            { NULL }
-        },
-        {	/* Byte 5 */
-            { "5-slot EDR ACL",	    LMP_EDR_5SLOT	},	/* Bit 0 */
-            { "sniff subrating",	LMP_SNIFF_SUBR	},	/* Bit 1 */
-            { "pause encryption",	LMP_PAUSE_ENC	},	/* Bit 2 */
-            { "AFH cap. master",	LMP_AFH_CAP_MST	},	/* Bit 3 */
-            { "AFH class. master",  LMP_AFH_CLS_MST	},	/* Bit 4 */
-            { "EDR eSCO 2 Mbps",	LMP_EDR_ESCO_2M	},	/* Bit 5 */
-            { "EDR eSCO 3 Mbps",	LMP_EDR_ESCO_3M	},	/* Bit 6 */
-            { "3-slot EDR eSCO",	LMP_EDR_3S_ESCO	},	/* Bit 7 */
-            { NULL }
-        },
-        {	/* Byte 6 */
-            { "extended inquiry",	LMP_EXT_INQ	},	/* Bit 0 */
-            { "LE and BR/EDR",	    LMP_LE_BREDR	},	/* Bit 1 */
-            { "no. 50",		        0x04		},	/* Bit 2 */
-            { "simple pairing",	    LMP_SIMPLE_PAIR	},	/* Bit 3 */
-            { "encapsulated PDU",	LMP_ENCAPS_PDU	},	/* Bit 4 */
-            { "err. data report",	LMP_ERR_DAT_REP	},	/* Bit 5 */
-            { "non-flush flag",	    LMP_NFLUSH_PKTS	},	/* Bit 6 */
-            { "no. 55",		        0x80		},	/* Bit 7 */
-            { NULL }
-        },
-        {	/* Byte 7 */
-            { "LSTO",		        LMP_LSTO	},	/* Bit 1 */
-            { "inquiry TX power",	LMP_INQ_TX_PWR	},	/* Bit 1 */
-            { "EPC",		        LMP_EPC		},	/* Bit 2 */
-            { "no. 59",		        0x08		},	/* Bit 3 */
-            { "no. 60",		        0x10		},	/* Bit 4 */
-            { "no. 61",		        0x20		},	/* Bit 5 */
-            { "no. 62",		        0x40		},	/* Bit 6 */
-            { "extended features",  LMP_EXT_FEAT	},	/* Bit 7 */
-            { NULL }
-        },
-    };
+    if (info->failed != PROBE_OK)
+        return EXIT_FAILED;
+    if (status)
+        return status;
+
+    for (field = 0; field < PROBE_NUM_FIELDS; field++)
+        if (info->fields[field] != FIELD_OK && info->fields[field] != FIELD_UNSUPPORTED)
+            return EXIT_PARTIAL;
+
+    return 0;
+}
 
-    // lmp features
-    char *tmp = lmp_featurestostr(lmp_features, "\t", 63);
-    switch_to_style(STYLE_LABEL);
-    printf("    LMP features:\n");
-    switch_to_style(STYLE_TEXT);
 
-    char *str;
+static const struct emitter* emitters[] = {
+    &text_emitter, &json_emitter, &csv_emitter, &tlv_emitter, NULL
+};
+
+
+const struct emitter* find_emitter(const char* name)
+{
     int i;
 
-    // print all features
-    if(opt_unsupported) {
-        for (i = 0; i < 8; i++) {
-            hci_map *map_ptr = lmp_features_map[i];
-
-            while (map_ptr->str) {
-                if (map_ptr->val & lmp_features[i]) {
-                    printf("        %s:\t", map_ptr->str);
-                    if(strlen(map_ptr->str) < 15 )
-                        printf("\t");
-                    if(strlen(map_ptr->str) < 7 )
-                        printf("\t");
-                    printf("%u\n", (hci_test_bit(map_ptr->val, &lmp_features[i]) > 0));
-                } //endif
-                map_ptr++;
-            } //endwhile
-        } //endfor
-        return;
+    for (i = 0; emitters[i]; i++) {
+        if (strcmp(emitters[i]->name, name) == 0)
+            return emitters[i];
     }
 
+    return NULL;
+}
 
-    // only print features supported by the adapter
-    for (i = 0; i < 8; i++) {
-        hci_map *map_ptr = lmp_features_map[i];
 
-        while (map_ptr->str) {
-            if ( (map_ptr->val & lmp_features[i]) &&
-                    (hci_test_bit(map_ptr->val, &lmp_features[i]) > 0) ) {
-                printf("        %s\n", map_ptr->str);
-            } //endif
-            map_ptr++;
-        } //endwhile
-    } //endfor
+// monitor mode: keeps the adapter table of the monitor channel and probes
+// an adapter only when it comes up
+void on_adapter_change(struct hotplug_table* table, int index,
+                       enum hotplug_change change, void* user)
+{
+    struct outbuf* out = user;
+    struct hotplug_adapter* adapter = &table->adapters[index];
+    struct adapter_info info;
+    char addr[18];
+
+    switch (change) {
+    case HOTPLUG_ADDED:
+        ba2str(&adapter->bdaddr, addr);
+        switch_to_style(out, STYLE_LABEL);
+        out_printf(out, "hci%d added:\t", index);
+        switch_to_style(out, STYLE_TEXT);
+        out_printf(out, "%s %s (%d adapters)\n", adapter->name, addr, table->count);
+        break;
+
+    case HOTPLUG_REMOVED:
+        switch_to_style(out, STYLE_LABEL);
+        out_printf(out, "hci%d removed\t", index);
+        switch_to_style(out, STYLE_TEXT);
+        out_printf(out, "(%d adapters)\n", table->count);
+        break;
+
+    case HOTPLUG_DOWN:
+        switch_to_style(out, STYLE_LABEL);
+        out_printf(out, "hci%d down\n", index);
+        break;
+
+    case HOTPLUG_UP:
+        switch_to_style(out, STYLE_LABEL);
+        out_printf(out, "hci%d up\n", index);
+
+        btdi_probe(&btdi, index, 0, &info);
+        if (info.failed != PROBE_OK) {
+            outbuf_flush(out, STDOUT_FILENO);
+            print_probe_error(&info);
+        }
+        if (info.fields[FIELD_DEVINFO] == FIELD_OK)
+            print_adapter_info(out, &info);
+        break;
+
+    case HOTPLUG_INFO:
+        break;
+    }
+
+    outbuf_flush(out, STDOUT_FILENO);
 }
 
 
+// the monitor reports an adapter open before its setup and HCI init ran;
+// probing it then reads zeroes or fails
+static int adapter_is_up(int index, void* user)
+{
+    struct hci_dev_info di;
 
+    return transport_dev_info(btdi.transport, index, &di) == 0 &&
+           (di.flags & (1 << HCI_UP));
+}
 
 
-void printPackedTypes(uint32_t pkt_type)
+int monitor_adapters(void)
 {
+    static struct hotplug_table table;
+    struct outbuf out;
+    int fd;
+
+    fd = hotplug_open_monitor();
+    if (fd < 0) {
+        fprintf(stderr, "Can't open HCI monitor channel: %s (%d)\n",
+                strerror(errno), errno);
+        return -1;
+    }
 
-    // from bluez v1.13 lib/hci.c
-    /* HCI packet type mapping */
-    hci_map pkt_type_map[] = {
-        { "DM1",   HCI_DM1  },
-        { "DM3",   HCI_DM3  },
-        { "DM5",   HCI_DM5  },
-        { "DH1",   HCI_DH1  },
-        { "DH3",   HCI_DH3  },
-        { "DH5",   HCI_DH5  },
-        { "HV1",   HCI_HV1  },
-        { "HV2",   HCI_HV2  },
-        { "HV3",   HCI_HV3  },
-        { "2-DH1", HCI_2DH1 },
-        { "2-DH3", HCI_2DH3 },
-        { "2-DH5", HCI_2DH5 },
-        { "3-DH1", HCI_3DH1 },
-        { "3-DH3", HCI_3DH3 },
-        { "3-DH5", HCI_3DH5 },
-        { NULL }
-    };
-
-    // from bluez v1.13 lib/hci.c
-    hci_map sco_ptype_map[] = {
-        { "HV1",   0x0001   },
-        { "HV2",   0x0002   },
-        { "HV3",   0x0004   },
-        { "EV3",   HCI_EV3  },
-        { "EV4",   HCI_EV4  },
-        { "EV5",   HCI_EV5  },
-        { "2-EV3", HCI_2EV3 },
-        { "2-EV5", HCI_2EV5 },
-        { "3-EV3", HCI_3EV3 },
-        { "3-EV5", HCI_3EV5 },
-        { NULL }
-    };
+    outbuf_init(&out, 16384);
+    table.is_up = adapter_is_up;
 
+    if (hotplug_run(fd, &table, on_adapter_change, &out) < 0) {
+        fprintf(stderr, "Can't read HCI monitor channel: %s (%d)\n",
+                strerror(errno), errno);
+        outbuf_free(&out);
+        close(fd);
+        return -1;
+    }
 
-    switch_to_style(STYLE_LABEL);
-    printf("    ACL packet types:\n");
-    switch_to_style(STYLE_TEXT);
+    outbuf_free(&out);
+    close(fd);
+    return 0;
+}
 
-    hci_map* pkt_types = pkt_type_map;
-    hci_map* sco_pkt_types = sco_ptype_map;
 
+// renders every adapter with what could be read; returns the exit status
+int emit_adapters(struct outbuf* out, const struct emitter* emitter,
+                  struct adapter_list* list)
+{
+    int incomplete = 0;
+    int i;
 
-    // print all packet types
-    if(opt_unsupported) {
-        // acl packet types
-        while (pkt_types->str) {
-            printf("        %s\t\t", pkt_types->str);
-            printf("%u\n", (hci_test_bit(pkt_types->val, &pkt_type) > 0));
-            pkt_types++;
+    emitter->begin(out);
+    for (i = 0; i < list->count; i++) {
+        struct adapter_info* info = &list->adapters[i];
+
+        incomplete = probe_exit_status(incomplete, info);
+        if (info->failed != PROBE_OK) {
+            if (!emitter->reports_errors) {
+                outbuf_flush(out, STDOUT_FILENO);
+                print_probe_error(info);
+                if (info->fields[FIELD_DEVINFO] != FIELD_OK)
+                    continue;
+            }
         }
 
-        switch_to_style(STYLE_LABEL);
-        printf("    SCO packet types:\n");
-        switch_to_style(STYLE_TEXT);
+        emitter->adapter(out, info, i);
+    }
+    emitter->end(out);
 
-        // synchronous connection packet types
-        while (sco_pkt_types->str) {
-            printf("        %s\t\t", sco_pkt_types->str);
-            printf("%u\n", (hci_test_bit(sco_pkt_types->val, &pkt_type) > 0));
-            sco_pkt_types++;
-        }
+    return incomplete;
+}
 
-        return;
+
+// --changes: what differs from the snapshot, which is then replaced;
+// returns the exit status, EXIT_FAILED if the snapshot could not be used
+int emit_changes(struct outbuf* out, int json, struct adapter_list* list)
+{
+    int incomplete = 0;
+    int i;
+
+    for (i = 0; i < list->count; i++) {
+        incomplete = probe_exit_status(incomplete, &list->adapters[i]);
+        print_probe_error(&list->adapters[i]);
+    }
+
+    if (snapshot_changes(opt_changes, list->adapters, list->count, &changes_filter,
+                         json, out) < 0) {
+        fprintf(stderr, "Can't use snapshot %s: %s (%d)\n",
+                opt_changes, strerror(errno), errno);
+        return EXIT_FAILED;
     }
 
+    return incomplete;
+}
 
-    // only print packet types supported by the adapter
-    // acl packet types
-    while (pkt_types->str) {
-        if (hci_test_bit(pkt_types->val, &pkt_type))
-            printf("        %s\n", pkt_types->str);
-        pkt_types++;
+
+// --fields: only the columns asked for, errors go to stderr; returns the
+// exit status
+int emit_projection(struct outbuf* out, enum projection_format format,
+                    struct adapter_list* list)
+{
+    int incomplete = 0;
+    int i;
+
+    for (i = 0; i < list->count; i++) {
+        incomplete = probe_exit_status(incomplete, &list->adapters[i]);
+        print_probe_error(&list->adapters[i]);
     }
 
-    switch_to_style(STYLE_LABEL);
-    printf("    SCO packet types:\n");
-    switch_to_style(STYLE_TEXT);
+    projection_print(out, format, &projection, list->adapters, list->count);
+    return incomplete;
+}
 
-    // synchronous connection packet types
-    while (sco_pkt_types->str) {
-        if (hci_test_bit(sco_pkt_types->val, &pkt_type))
-            printf("        %s\n", sco_pkt_types->str);
-        sco_pkt_types++;
+
+// --connect: the adapters as a --serve daemon probed them, rendered like
+// a probe of our own; returns the exit status
+int query_daemon(const struct emitter* emitter, enum projection_format format)
+{
+    static struct adapter_list list;
+    struct outbuf out;
+    unsigned int fields = opt_fields ? projection_fields(&projection) : BTDI_ALL_FIELDS;
+    int incomplete;
+
+    if (adapter_filter.have_bdaddr) {
+        printf("--connect needs --dev hciN, the daemon probes by index\n");
+        return 1;
     }
 
+    // the daemon has everything in one answer, dev_id and flags included
+    list.count = server_query(opt_connect,
+                              adapter_filter.dev_id >= 0 ? adapter_filter.dev_id
+                                                         : SERVER_ALL_ADAPTERS,
+                              fields ? fields : FIELD_BIT(FIELD_DEVINFO),
+                              list.adapters, MAX_ADAPTERS);
+    if (list.count < 0) {
+        fprintf(stderr, "Can't ask %s: %s (%d)\n", opt_connect, strerror(errno), errno);
+        return 1;
+    }
 
+    outbuf_init(&out, 65536);
+    if (opt_fields)
+        incomplete = emit_projection(&out, format, &list);
+    else
+        incomplete = emit_adapters(&out, emitter, &list);
+
+    if (outbuf_flush(&out, STDOUT_FILENO) < 0) {
+        fprintf(stderr, "Can't write output: %s (%d)\n", strerror(errno), errno);
+        return 1;
+    }
+    outbuf_free(&out);
+    return incomplete;
 }
 
 
-void printLinkPolicy(uint32_t link_policy) {
+// connections view: the links of every adapter that is up, one adapter
+// after the other; -1 if any list could not be read
+int show_connections(struct outbuf* out, struct adapter_list* list)
+{
+    static struct conn_entry conns[CONN_MAX];
+    int failed = 0;
+    int i, count;
+
+    for (i = 0; i < list->count; i++) {
+        int dev_id = list->adapters[i].dev_id;
+
+        count = conn_query(transport, dev_id, conns, CONN_MAX,
+                           deadline_after(opt_timeout, run_deadline));
+        if (count < 0) {
+            outbuf_flush(out, STDOUT_FILENO);
+            fprintf(stderr, "Can't get connection list for hci%d: %s (%d)\n",
+                    dev_id, strerror(errno), errno);
+            failed = 1;
+            continue;
+        }
+
+        conn_print(out, dev_id, conns, count);
+    }
 
-    // link policy
-    switch_to_style(STYLE_LABEL);
-    printf("    link_policy:\n");
-    switch_to_style(STYLE_TEXT);
+    return failed ? -1 : 0;
+}
 
-    if(opt_unsupported){
-        printf("        HCI_LP_RSWITCH:\t%u\n", hci_test_bit(HCI_LP_RSWITCH, &link_policy) > 0);
-        printf("        HCI_LP_HOLD:\t%u\n",    hci_test_bit(HCI_LP_HOLD,    &link_policy) > 0);
-        printf("        HCI_LP_SNIFF:\t%u\n",   hci_test_bit(HCI_LP_SNIFF,   &link_policy) > 0);
-        printf("        HCI_LP_PARK:\t%u\n",    hci_test_bit(HCI_LP_PARK,    &link_policy) > 0);
-        return;
+
+// LE scan mode: the advertisers the first adapter that is up receives
+int scan_adapter(struct outbuf* out, struct adapter_list* list)
+{
+    static struct scan_table table;
+    int dev_id, ret;
+
+    if (list->count == 0) {
+        fprintf(stderr, "No adapter is up\n");
+        return -1;
     }
 
+    dev_id = list->adapters[0].dev_id;
+    ret = scan_run(transport, dev_id, opt_scan, &table);
+    if (ret < 0)
+        fprintf(stderr, "LE scan on hci%d failed: %s (%d)\n",
+                dev_id, strerror(errno), errno);
 
-    if (hci_test_bit(HCI_LP_RSWITCH, &link_policy))
-        printf("        HCI_LP_RSWITCH\n");
-    if (hci_test_bit(HCI_LP_HOLD,    &link_policy))
-        printf("        HCI_LP_HOLD\n");
-    if (hci_test_bit(HCI_LP_SNIFF,   &link_policy))
-        printf("        HCI_LP_SNIFF\n");
-    if (hci_test_bit(HCI_LP_PARK,    &link_policy))
-        printf("        HCI_LP_PARK\n");
+    scan_print(out, dev_id, &table);
+    return ret;
 }
 
 
-// TODO (simon): implement unsupported option
-void printVerbose(struct hci_dev_info hciDevInfo, struct hci_version hciVersion)
+// self-test: ACL round trips through the controller in local loopback on
+// the first adapter that is up, or the one of --dev
+int loopback_adapter(struct outbuf* out, struct adapter_list* list)
 {
-    printDeviceFlags(hciDevInfo.flags);
-
-    printLmpFeatures(hciDevInfo.features);
-
-    printPackedTypes(hciDevInfo.pkt_type);
-
-    printLinkPolicy(hciDevInfo.link_policy);
-
-    // link mode
-    switch_to_style(STYLE_LABEL);
-    printf("    link_mode:\t\t");
-    switch_to_style(STYLE_TEXT);
-    printf("%s\n", hci_lmtostr(hciDevInfo.link_mode));
-
-    // asynchronous connection-less mtu
-    switch_to_style(STYLE_LABEL);
-    printf("    acl_mtu:\t\t");
-    switch_to_style(STYLE_TEXT);
-    printf("%u\n", hciDevInfo.acl_mtu);
-
-    // asynchronous connection-less packets
-    switch_to_style(STYLE_LABEL);
-    printf("    acl_pkts:\t\t");
-    switch_to_style(STYLE_TEXT);
-    printf("%u\n", hciDevInfo.acl_pkts);
-
-    // synchronous connection-based mtu
-    switch_to_style(STYLE_LABEL);
-    printf("    sco_mtu:\t\t");
-    switch_to_style(STYLE_TEXT);
-    printf("%u\n", hciDevInfo.sco_mtu);
-
-    // synchronous connection-based packets
-    switch_to_style(STYLE_LABEL);
-    printf("    sco_pkts:\t\t");
-    switch_to_style(STYLE_TEXT);
-    printf("%u\n", hciDevInfo.sco_pkts);
-
-    // device statistcs
-    switch_to_style(STYLE_LABEL);
-    printf("    device stats:\t\n");
-    switch_to_style(STYLE_TEXT);
-    struct hci_dev_stats hciDevStats = hciDevInfo.stat;
-    printf("        err_rx:\t\t%u\n", hciDevStats.err_rx);
-    printf("        err_tx:\t\t%u\n", hciDevStats.err_tx);
-    printf("        cmd_tx:\t\t%u\n", hciDevStats.cmd_tx);
-    printf("        evt_rx:\t\t%u\n", hciDevStats.evt_rx);
-    printf("        acl_tx:\t\t%u\n", hciDevStats.acl_tx);
-    printf("        acl_rx:\t\t%u\n", hciDevStats.acl_rx);
-    printf("        sco_tx:\t\t%u\n", hciDevStats.sco_tx);
-    printf("        sco_rx:\t\t%u\n", hciDevStats.sco_rx);
-    printf("        byte_rx:\t%u\n", hciDevStats.byte_rx);
-    printf("        byte_tx:\t%u\n", hciDevStats.byte_tx);
+    static struct loopback_result result;
+    int dev_id, ret;
+
+    if (list->count == 0) {
+        fprintf(stderr, "No adapter is up\n");
+        return -1;
+    }
+
+    dev_id = list->adapters[0].dev_id;
+
+    ret = loopback_run(transport, dev_id, opt_loopback, &result);
+    if (ret < 0)
+        fprintf(stderr, "Loopback test on hci%d failed: %s (%d)\n",
+                dev_id, strerror(errno), errno);
+
+    if (result.sent)
+        loopback_print(out, dev_id, &result);
+    return ret;
 }
 
 
+// a recording is fed to the analyzer through a socketpair
+struct sniff_feeder {
+    int                       fd;
+    int                       dev_id;
+    const struct hci_filter*  filter;
+};
+
 
-int print_each_adapter_info(int socket, int dev_id, long arg)
+static void* feed_recording(void* arg)
 {
+    struct sniff_feeder* feeder = arg;
 
-    int hciSocket;
-    struct hci_dev_info hciDevInfo;
-    struct hci_version  hciVersion;
+    if (sniff_feed(feeder->fd, opt_replay, feeder->dev_id, feeder->filter, opt_realtime) < 0)
+        fprintf(stderr, "Can't feed recording %s: %s (%d)\n",
+                opt_replay, strerror(errno), errno);
+    return NULL;
+}
 
-    // zero memory for the device info struct
-    memset(&hciDevInfo, 0x00, sizeof(hciDevInfo));
 
-    // open HCI socket
-    hciSocket = hci_open_dev(dev_id);
-    if (hciSocket == -1) {
-        fprintf(stderr, "adapterState unsupported on device %d\n",
-                dev_id);
+// live analysis: the traffic of the first adapter that is up, or with
+// --replay the packets of that adapter in the recording
+int sniff_adapter(struct adapter_list* list)
+{
+    struct hci_filter filter;
+    struct sniff_feeder feeder;
+    pthread_t thread;
+    int fds[2], dev_id, ret;
+
+    if (list->count == 0) {
+        fprintf(stderr, "No adapter is up\n");
+        return -1;
+    }
+    if (sniff_parse_filter(opt_sniff_types, &filter) < 0) {
+        fprintf(stderr, "invalid packet types: %s\n", opt_sniff_types);
         return -1;
     }
-    hciDevInfo.dev_id = dev_id;
 
-    if (hci_devinfo(dev_id, &hciDevInfo) < 0) {
-        fprintf(stderr, "Can't get device info for hci%d: %s (%d)\n",
-                dev_id, strerror(errno), errno);
-        hci_close_dev(hciSocket);
-        exit(1);
+    dev_id = list->adapters[0].dev_id;
+
+    if (!opt_replay) {
+        fds[0] = sniff_open(dev_id, &filter);
+        if (fds[0] < 0) {
+            fprintf(stderr, "Can't open raw socket on hci%d: %s (%d)\n",
+                    dev_id, strerror(errno), errno);
+            return -1;
+        }
+        ret = sniff_run(fds[0], dev_id, opt_watch > 0 ? opt_watch : 1, 0);
+        if (ret < 0)
+            fprintf(stderr, "Analysis of hci%d failed: %s (%d)\n", dev_id, strerror(errno), errno);
+        hci_close_dev(fds[0]);
+        return ret;
     }
 
-    if (hci_read_local_version(hciSocket, &hciVersion, 1000) < 0) {
-        fprintf(stderr, "Can't read version info for hci%d: %s (%d)\n",
-                dev_id, strerror(errno), errno);
-        hci_close_dev(hciSocket);
-        exit(1);
-    }
-
-    // Link Management Protocol features
-    uint8_t* lmp_features = &hciDevInfo.features;
-
-    switch_to_style(STYLE_HEADLINE);
-    printf("\n%s ------------------------------------------- \n",   hciDevInfo.name);
-
-    // device id
-    switch_to_style(STYLE_LABEL);
-    printf("    device id:\t\t");
-    switch_to_style(STYLE_TEXT);
-    printf("%u\n", hciDevInfo.dev_id);
-
-    // manufacturer
-    char *ver = lmp_vertostr(hciVersion.lmp_ver);
-    switch_to_style(STYLE_LABEL);
-    printf("    Manufacturer:\t");
-    switch_to_style(STYLE_TEXT);
-    printf("%s (%d)\n",
-           bt_compidtostr(hciVersion.manufacturer),
-           hciVersion.manufacturer);
-
-    // lmp version (link management protocol)
-    switch_to_style(STYLE_LABEL);
-    printf("    LMP version:");
-    switch_to_style(STYLE_TEXT);
-    printf("\t%s (0x%x) [subver 0x%x]\n",
-           ver ? ver : "n/a",
-           hciVersion.lmp_ver, hciVersion.lmp_subver);
-    if (ver)
-        bt_free(ver);
-
-    // device type
-    switch_to_style(STYLE_LABEL);
-    printf("    device type:\t");
-    switch_to_style(STYLE_TEXT);
-    if (((hciDevInfo.type & 0x30) >> 4) != HCI_AMP)
-        printf("AMP\n");
-    else if (((hciDevInfo.type & 0x30) >> 4) != HCI_BREDR)
-        printf("BR/EDR\n");
-    else
-        printf("UNKNOWN\n");
-
-    // BLE
-    switch_to_style(STYLE_LABEL);
-    printf("    BLE:\t\t");
-    switch_to_style(STYLE_TEXT);
-    if(hciVersion.lmp_ver >= 0x06) {
-
-        if (lmp_features[6] & LMP_LE_BREDR)
-            printf("capable (dual mode)");
-        else if (lmp_features[4] & LMP_LE)
-            printf("capable (single mode)");
-        else
-            printf("UNKNOWN MODE");
-    } else
-        printf("incapable");
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+        fprintf(stderr, "Can't create socketpair: %s (%d)\n", strerror(errno), errno);
+        return -1;
+    }
+    feeder.fd     = fds[1];
+    feeder.dev_id = dev_id;
+    feeder.filter = &filter;
+    if ((errno = pthread_create(&thread, NULL, feed_recording, &feeder)) != 0) {
+        fprintf(stderr, "Can't start feeder: %s (%d)\n", strerror(errno), errno);
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    ret = sniff_run(fds[0], dev_id, opt_watch > 0 ? opt_watch : 1, 0);
+    if (ret < 0)
+        fprintf(stderr, "Analysis of hci%d failed: %s (%d)\n", dev_id, strerror(errno), errno);
+    // the feeder gets EPIPE if the analysis ended first
+    close(fds[0]);
+    pthread_join(thread, NULL);
+    return ret;
+}
+
 
-    printf("\n");
+// history mode: the rates the statistics log of --watch --log holds
+int query_log(void)
+{
+    struct stat_log log;
+    struct statlog_stats stats;
+    struct outbuf out;
+    int64_t now = statlog_now();
+    int64_t from = 0, to = INT64_MAX;
+    uint64_t start;
+    int ret;
+
+    if (opt_since && (from = statlog_parse_time(opt_since, now)) < 0) {
+        fprintf(stderr, "invalid time: %s\n", opt_since);
+        return -1;
+    }
+    if (opt_until && (to = statlog_parse_time(opt_until, now)) < 0) {
+        fprintf(stderr, "invalid time: %s\n", opt_until);
+        return -1;
+    }
 
+    if (statlog_open(&log, opt_query, 0) < 0) {
+        fprintf(stderr, "Can't open statistics log %s: %s (%d)\n",
+                opt_query, strerror(errno), errno);
+        return -1;
+    }
 
+    outbuf_init(&out, 65536);
+    start = trace_now();
+    ret = statlog_query(&log, from, to, (int64_t) (opt_step * 1000), opt_dev, &out, &stats);
+    if (ret < 0)
+        fprintf(stderr, "Can't query statistics log %s: %s (%d)\n",
+                opt_query, strerror(errno), errno);
+    else
+        fprintf(stderr, "%llu rows from %llu samples in %d blocks, %.3f ms\n",
+                (unsigned long long) stats.rows, (unsigned long long) stats.frames,
+                stats.blocks, (trace_now() - start) / 1e6);
+    statlog_close(&log);
+
+    if (outbuf_flush(&out, STDOUT_FILENO) < 0) {
+        fprintf(stderr, "Can't write output: %s (%d)\n", strerror(errno), errno);
+        ret = -1;
+    }
+    outbuf_free(&out);
+    return ret;
+}
 
 
-    // get bluetooth device address
-    bdaddr_t* bdaddr = &hciDevInfo.bdaddr;
-    switch_to_style(STYLE_LABEL);
-    printf("    device address:\t");
-    switch_to_style(STYLE_TEXT);
+// offline mode: the adapters of a btsnoop capture rendered like probed ones;
+// the traffic summary follows in the text format and goes to stderr else
+int analyze_file(const struct emitter* emitter)
+{
+    static struct adapter_list list;
+    struct analyze_result* result;
+    struct outbuf out;
     int i;
-    for(i=5; i>1; i--) {
-        printf("%02X:", bdaddr->b[i]);
+
+    result = analyze_capture(opt_analyze, opt_jobs);
+    if (!result) {
+        fprintf(stderr, "Can't analyze %s: %s (%d)\n", opt_analyze, strerror(errno), errno);
+        return -1;
+    }
+
+    for (i = 0; i < ANALYZE_MAX_ADAPTERS; i++)
+        if (result->adapters[i].seen)
+            list.adapters[list.count++] = result->adapters[i].info;
+
+    outbuf_init(&out, 65536);
+    emit_adapters(&out, emitter, &list);
+    if (emitter == &text_emitter)
+        analyze_print(&out, result);
+    else {
+        struct outbuf summary;
+
+        outbuf_init(&summary, 16384);
+        analyze_print(&summary, result);
+        outbuf_flush(&summary, STDERR_FILENO);
+        outbuf_free(&summary);
+    }
+    free(result);
+
+    if (outbuf_flush(&out, STDOUT_FILENO) < 0) {
+        fprintf(stderr, "Can't write output: %s (%d)\n", strerror(errno), errno);
+        outbuf_free(&out);
+        return -1;
     }
-    printf("%02X\n", bdaddr->b[0]);
+    outbuf_free(&out);
+    return 0;
+}
 
 
-    if(opt_verbose)
-        printVerbose(hciDevInfo, hciVersion);
+// offline mode: groups the capability vectors in the JSON or CSV output of
+// many hosts and diffs each group against the largest
+int diff_fleet(const char* const* paths, int count)
+{
+    struct fleet fleet;
+    struct outbuf out;
+
+    if (count == 0) {
+        printf("--diff needs the output files of the hosts to compare\n");
+        return -1;
+    }
+
+    if (fleet_load(&fleet, paths, count) < 0) {
+        fprintf(stderr, "Can't load capability vectors: %s (%d)\n", strerror(errno), errno);
+        return -1;
+    }
 
-    printf("\n");
+    outbuf_init(&out, 65536);
+    fleet_print(&out, &fleet, text_options.verbose);
+    fleet_free(&fleet);
 
-    close(hciSocket);
+    if (outbuf_flush(&out, STDOUT_FILENO) < 0) {
+        fprintf(stderr, "Can't write output: %s (%d)\n", strerror(errno), errno);
+        outbuf_free(&out);
+        return -1;
+    }
+    outbuf_free(&out);
     return 0;
 }
 
@@ -572,7 +768,94 @@ void show_help(char* program_name)
            "                             or are simply not activated/active at the moment\n"
            "                             (will be marked as not supported; implies --verbose)\n"\
            "  -c, --color                colorized output for improved readability\n"\
-
+           "  -w, --watch <seconds>      keep running and print the device stats as\n"\
+           "                             per second rates every <seconds>\n"\
+
+           "  -m, --monitor              keep running, report adapters being added, removed,\n"\
+           "                             going up or down and probe adapters coming up\n"\
+           "  -C, --cache[=<file>]       keep the static controller data (features,\n"\
+           "                             commands) in a cache file keyed by address and\n"\
+           "                             version; only flags, stats and version are read live\n"\
+           "                             (default: ~/.cache/bt_device_info.cache)\n"\
+           "  -f, --format <format>      output format: text (default), json, csv or tlv\n"\
+           "                             (binary, see output.h); machine readable formats\n"\
+           "                             always contain all details\n"\
+           "  -e, --export <address>     keep running and serve OpenMetrics over HTTP on\n"\
+           "                             <address>, a unix socket path or [host:]port\n"\
+           "                             (default host 127.0.0.1); samples every 10\n"\
+           "                             seconds or as given with --watch\n"\
+           "      --stub[=<count>]       use <count> (default 2) simulated adapters\n"\
+           "                             instead of the real ones, for testing without\n"\
+           "                             bluetooth hardware\n"\
+           "  -P, --publish[=<name>]     keep running and publish the adapters' info,\n"\
+           "                             version and stats in the shared memory segment\n"\
+           "                             <name> (default /bt_device_info) every second or\n"\
+           "                             as given with --watch\n"\
+           "  -R, --read[=<name>]        print the adapters a --publish process shares\n"\
+           "                             instead of querying them\n"\
+           "  -s, --stats                print count, timeouts and p50/p99/max latency of\n"\
+           "                             every HCI command and ioctl to stderr\n"\
+           "  -T, --trace <file>         write a Chrome trace-event timeline of the HCI\n"\
+           "                             commands and ioctls (chrome://tracing, Perfetto)\n"\
+           "      --record <file>        write every ioctl and HCI command/event exchange\n"\
+           "                             of the run with its timing to <file>\n"\
+           "      --replay <file>        run against a recording instead of the kernel\n"\
+           "      --realtime             replay with the recorded timing instead of as\n"\
+           "                             fast as possible\n"\
+           "      --connections          list the connections of every adapter with their\n"\
+           "                             RSSI, link quality, TX power and AFH channels\n"\
+           "      --scan[=<seconds>]     LE scan on the first adapter that is up for\n"\
+           "                             <seconds> (default 10) or until ^C and list the\n"\
+           "                             advertisers with report count and RSSI\n"\
+           "      --loopback[=<seconds>] self-test of the adapter of --dev or the first\n"\
+           "                             one that is up: ACL throughput and round trips\n"\
+           "                             in local loopback for <seconds> (default 5)\n"\
+           "      --sniff[=<types>]      per connection handle rates, event counts and\n"\
+           "                             command latencies of the traffic of the adapter\n"\
+           "                             of --dev or the first one that is up, every second\n"\
+           "                             or as given with --watch, until ^C; <types> e.g.\n"\
+           "                             acl,cmd,0x13 (default: all packets and events)\n"\
+           "      --budget <ms>          time for probing all adapters (default 5000,\n"\
+           "                             0 = unlimited); adapters not reached in time\n"\
+           "                             are reported as skipped\n"\
+           "      --timeout <ms>         time for probing one adapter (default 2000)\n"\
+           "      --retries <n>          retries of a failed or timed out read, with a\n"\
+           "                             growing random pause (default 2)\n"\
+           "      --analyze <file>       print the adapters, connections, command latencies\n"\
+           "                             and errors of a btsnoop capture (btmon -w,\n"\
+           "                             Android HCI snoop log) instead of probing\n"\
+           "      --jobs <n>             threads for --analyze (default: one per core and\n"\
+           "                             per 64 MB of the capture)\n"\
+           "      --log <file>           with --watch: also append every sample to the\n"\
+           "                             statistics log <file> (a 16 MB ring)\n"\
+           "      --query <file>         print the rates a statistics log holds\n"\
+           "      --since <time>         query from <time>: now, -<n>[smhd] (ago), unix\n"\
+           "                             seconds or \"YYYY-MM-DD[ HH:MM[:SS]]\" (local)\n"\
+           "      --until <time>         query up to <time> (default: the end)\n"\
+           "      --step <seconds>       query: one row per adapter and <seconds>\n"\
+           "                             instead of one per sample\n"\
+           "      --dev <hciN|bdaddr>    only this adapter, by index or address\n"\
+           "      --flags <flags>        only adapters with these flags, e.g. UP,!PSCAN\n"\
+           "                             (default: UP)\n"\
+           "      --fields <names>       print only these values, one column each, and\n"\
+           "                             read only what they need, e.g. bdaddr,flags;\n"\
+           "                             text, csv or json (see README for the names)\n"\
+           "      --changes <file>       print only what changed since the run that last\n"\
+           "                             used the snapshot <file>: added and removed\n"\
+           "                             adapters, changed values and counter deltas;\n"\
+           "                             text or json (one object per line)\n"\
+           "      --serve <path>         keep running and answer probe requests on the\n"\
+           "                             unix socket <path>; requests for the same\n"\
+           "                             adapter share one probe\n"\
+           "      --ttl <ms>             serve: answer from a result this young (default\n"\
+           "                             1000, 0 = only share running probes)\n"\
+           "      --rate <n>             serve: at most <n> HCI commands per second to a\n"\
+           "                             controller (default 20, 0 = unlimited)\n"\
+           "      --connect <path>       ask the --serve daemon on <path> instead of\n"\
+           "                             probing; works with --dev hciN and --fields\n"\
+           "      --diff <file>...       group the adapters in the json or csv output of\n"\
+           "                             many hosts by capabilities and list the features\n"\
+           "                             and commands each group differs in\n"\
            "  -h, --help                 this text\n", program_name);
 }
 
@@ -586,17 +869,56 @@ int main(int argc, char* const  argv[])
         {"verbose",     OPT_NO_OPTION,        0, 'v'},
         {"unsupported", OPT_NO_OPTION,        0, 'u'},
         {"color",       OPT_NO_OPTION,        0, 'c'},
+        {"watch",       OPT_REQUIRED,         0, 'w'},
+        {"monitor",     OPT_NO_OPTION,        0, 'm'},
+        {"cache",       OPT_OPTIONAL,         0, 'C'},
+        {"format",      OPT_REQUIRED,         0, 'f'},
+        {"export",      OPT_REQUIRED,         0, 'e'},
+        {"stub",        OPT_OPTIONAL,         0, 'S'},
+        {"publish",     OPT_OPTIONAL,         0, 'P'},
+        {"read",        OPT_OPTIONAL,         0, 'R'},
+        {"stats",       OPT_NO_OPTION,        0, 's'},
+        {"trace",       OPT_REQUIRED,         0, 'T'},
+        {"record",      OPT_REQUIRED,         0, 'r'},
+        {"replay",      OPT_REQUIRED,         0, 'y'},
+        {"realtime",    OPT_NO_OPTION,        0, 't'},
+        {"connections", OPT_NO_OPTION,        0, 'L'},
+        {"scan",        OPT_OPTIONAL,         0, 'a'},
+        {"loopback",    OPT_OPTIONAL,         0, 'k'},
+        {"sniff",       OPT_OPTIONAL,         0, 'x'},
+        {"budget",      OPT_REQUIRED,         0, 'b'},
+        {"timeout",     OPT_REQUIRED,         0, 'o'},
+        {"retries",     OPT_REQUIRED,         0, 'n'},
+        {"analyze",     OPT_REQUIRED,         0, 'A'},
+        {"jobs",        OPT_REQUIRED,         0, 'j'},
+        {"log",         OPT_REQUIRED,         0, 'l'},
+        {"query",       OPT_REQUIRED,         0, 'Q'},
+        {"since",       OPT_REQUIRED,         0, 'F'},
+        {"until",       OPT_REQUIRED,         0, 'U'},
+        {"step",        OPT_REQUIRED,         0, 'p'},
+        {"dev",         OPT_REQUIRED,         0, 'D'},
+        {"flags",       OPT_REQUIRED,         0, 'g'},
+        {"fields",      OPT_REQUIRED,         0, 'i'},
+        {"changes",     OPT_REQUIRED,         0, 'z'},
+        {"serve",       OPT_REQUIRED,         0, 'E'},
+        {"connect",     OPT_REQUIRED,         0, 'N'},
+        {"ttl",         OPT_REQUIRED,         0, 'G'},
+        {"rate",        OPT_REQUIRED,         0, 'H'},
+        {"diff",        OPT_NO_OPTION,        0, 'd'},
         {"help",        OPT_NO_OPTION,        0, 'h'},
         {0,0,0,0},
     };
 
+    char cache_path[PATH_MAX];
     int opt;
 
+    btdi_filter_init(&adapter_filter);
+
     while (1) {
         /* getopt_long stores the option index here. */
         int getopt_long_index = 0;
 
-        opt = getopt_long (argc, argv, "vuch",
+        opt = getopt_long (argc, argv, "vucw:mC::f:e:P::R::sT:h",
                            long_options, &getopt_long_index);
 
         /* Detect the end of the options. */
@@ -615,15 +937,226 @@ int main(int argc, char* const  argv[])
             break;
 
         case 'v':
-            opt_verbose = 1;
+            text_options.verbose = 1;
             break;
 
         case 'u':
-            opt_unsupported = 1;
+            text_options.unsupported = 1;
             break;
 
         case 'c':
-            opt_color = 1;
+            text_options.color = 1;
+            break;
+
+        case 'w':
+            opt_watch = atof(optarg);
+            if (opt_watch <= 0) {
+                printf("invalid watch interval: %s\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'm':
+            opt_monitor = 1;
+            break;
+
+        case 'C':
+            opt_cache = optarg ? optarg : cache_default_path(cache_path, sizeof(cache_path));
+            if (!opt_cache) {
+                printf("no default cache location, use --cache=<file>\n");
+                return 1;
+            }
+            break;
+
+        case 'f':
+            opt_format = optarg;
+            break;
+
+        case 'e':
+            opt_export = optarg;
+            break;
+
+        case 'P':
+            opt_publish = optarg ? optarg : PUBLISH_DEFAULT_NAME;
+            break;
+
+        case 'R':
+            opt_read = optarg ? optarg : PUBLISH_DEFAULT_NAME;
+            break;
+
+        case 's':
+            opt_stats = 1;
+            break;
+
+        case 'T':
+            opt_trace = optarg;
+            break;
+
+        case 'r':
+            opt_record = optarg;
+            break;
+
+        case 'y':
+            opt_replay = optarg;
+            break;
+
+        case 't':
+            opt_realtime = 1;
+            break;
+
+        case 'L':
+            opt_connections = 1;
+            break;
+
+        case 'a':
+            opt_scan = optarg ? atof(optarg) : 10;
+            if (opt_scan <= 0) {
+                printf("invalid scan duration: %s\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'b':
+            opt_budget = atoi(optarg);
+            if (opt_budget < 0) {
+                printf("invalid budget: %s\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'o':
+            opt_timeout = atoi(optarg);
+            if (opt_timeout <= 0) {
+                printf("invalid timeout: %s\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'n':
+            opt_retries = atoi(optarg);
+            if (opt_retries < 0) {
+                printf("invalid number of retries: %s\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'A':
+            opt_analyze = optarg;
+            break;
+
+        case 'j':
+            opt_jobs = atoi(optarg);
+            if (opt_jobs <= 0) {
+                printf("invalid number of jobs: %s\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'l':
+            opt_log = optarg;
+            break;
+
+        case 'Q':
+            opt_query = optarg;
+            break;
+
+        case 'F':
+            opt_since = optarg;
+            break;
+
+        case 'U':
+            opt_until = optarg;
+            break;
+
+        case 'p':
+            opt_step = atof(optarg);
+            if (opt_step < 0.001) {
+                printf("invalid step: %s\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'D':
+            if (bachk(optarg) == 0) {
+                adapter_filter.have_bdaddr = 1;
+                str2ba(optarg, &adapter_filter.bdaddr);
+                break;
+            }
+            opt_dev = atoi(strncmp(optarg, "hci", 3) == 0 ? optarg + 3 : optarg);
+            if (opt_dev < 0 || opt_dev > 0xffff) {
+                printf("invalid adapter: %s\n", optarg);
+                return 1;
+            }
+            adapter_filter.dev_id = opt_dev;
+            break;
+
+        case 'g':
+            if (btdi_filter_flags(&adapter_filter, optarg) < 0) {
+                printf("invalid adapter flags: %s\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'i':
+            if (projection_parse(&projection, optarg) < 0) {
+                printf("invalid field list: %s\n", optarg);
+                printf("known fields: %s\n", projection_names);
+                return 1;
+            }
+            opt_fields = 1;
+            break;
+
+        case 'z':
+            opt_changes = optarg;
+            break;
+
+        case 'E':
+            opt_serve = optarg;
+            break;
+
+        case 'N':
+            opt_connect = optarg;
+            break;
+
+        case 'G':
+            opt_ttl = atoi(optarg);
+            if (opt_ttl < 0) {
+                printf("invalid ttl: %s\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'H':
+            opt_rate = atoi(optarg);
+            if (opt_rate < 0) {
+                printf("invalid rate: %s\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'd':
+            opt_diff = 1;
+            break;
+
+        case 'k':
+            opt_loopback = optarg ? atof(optarg) : 5;
+            if (opt_loopback <= 0) {
+                printf("invalid loopback duration: %s\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'x':
+            opt_sniff = 1;
+            opt_sniff_types = optarg;
+            break;
+
+        case 'S':
+            opt_stub = optarg ? atoi(optarg) : 2;
+            if (opt_stub <= 0 || opt_stub > MAX_ADAPTERS) {
+                printf("invalid number of stub adapters: %s\n", optarg);
+                return 1;
+            }
             break;
 
         case 'h':
@@ -645,12 +1178,209 @@ int main(int argc, char* const  argv[])
     }
 
 
-    switch_to_style(STYLE_TEXT);
-    printf("Bluetooth adapter info:\n");
+    trace_enable(opt_stats, opt_trace != NULL);
 
-    // loop through all adapters
-    hci_for_each_dev(HCI_UP, print_each_adapter_info, 0);
+    const struct emitter* emitter = find_emitter(opt_format);
+    if (!emitter) {
+        printf("unknown output format: %s\n", opt_format);
+        printf("try --help to see all valid options\n");
+        return 1;
+    }
 
-    return 0;
+    enum projection_format projection_format = PROJECTION_TEXT;
+    if (opt_fields) {
+        if (emitter == &json_emitter)
+            projection_format = PROJECTION_JSON;
+        else if (emitter == &csv_emitter)
+            projection_format = PROJECTION_CSV;
+        else if (emitter != &text_emitter) {
+            printf("--fields prints text, csv or json\n");
+            return 1;
+        }
+    }
+
+    if (opt_changes && emitter != &text_emitter && emitter != &json_emitter) {
+        printf("--changes prints text or json\n");
+        return 1;
+    }
+    if (opt_changes && opt_fields) {
+        printf("--changes prints the device info, not --fields\n");
+        return 1;
+    }
+
+    // an adapter leaving the --flags filter is a flags change, not removed
+    if (opt_changes) {
+        changes_filter = adapter_filter;
+        adapter_filter.flags_set   = 0;
+        adapter_filter.flags_clear = 0;
+    }
+
+    // a capture or the log need neither the kernel nor a recording
+    if (opt_analyze)
+        return analyze_file(emitter) < 0;
+    if (opt_query) {
+        if (adapter_filter.have_bdaddr) {
+            printf("--query needs --dev hciN, the log does not know addresses\n");
+            return 1;
+        }
+        return query_log() < 0;
+    }
+    if (opt_connect)
+        return query_daemon(emitter, projection_format);
+    if (opt_diff)
+        return diff_fleet((const char* const*) argv + optind, argc - optind) < 0;
+
+    if (opt_log && opt_watch <= 0) {
+        printf("--log needs --watch\n");
+        return 1;
+    }
+
+    // a published segment is rendered without touching the adapters
+    int offline = opt_read && !opt_connections && !opt_scan && !opt_loopback;
+
+    if (opt_replay)
+        transport = transport_replay(opt_replay, opt_realtime);
+    else if (opt_stub > 0)
+        transport = transport_stub(opt_stub);
+    else if (!offline)
+        transport = transport_live();
+    if (!transport && !offline) {
+        if (opt_replay)
+            fprintf(stderr, "Can't read recording %s: %s (%d)\n", opt_replay, strerror(errno), errno);
+        else if (opt_stub > 0)
+            fprintf(stderr, "Can't set up the stub adapters: %s (%d)\n", strerror(errno), errno);
+        else
+            fprintf(stderr, "Can't open HCI socket: %s (%d)\n", strerror(errno), errno);
+        return 1;
+    }
+
+    if (opt_record && transport) {
+        struct transport* recorder = transport_recorder(transport, opt_record);
+        if (!recorder) {
+            fprintf(stderr, "Can't write recording %s: %s (%d)\n", opt_record, strerror(errno), errno);
+            return 1;
+        }
+        transport = recorder;
+    }
+
+    if (transport)
+        btdi_init(&btdi, transport);
+    btdi.timeout = opt_timeout;
+    btdi.retries = opt_retries;
+    if (opt_fields)
+        btdi.fields = projection_fields(&projection);
+    if (opt_changes)
+        btdi.fields = FIELD_BIT(FIELD_DEVINFO);
+
+    // a cache that cannot be used only costs speed
+    struct caps_cache cache;
+    if (opt_cache) {
+        if (cache_open(&cache, opt_cache) == 0)
+            btdi.cache = &cache;
+        else
+            fprintf(stderr, "Can't open cache %s: %s (%d)\n",
+                    opt_cache, strerror(errno), errno);
+    }
+
+    if (opt_serve)
+        return server_run(&btdi, &adapter_filter, opt_serve, opt_ttl, opt_rate) < 0;
+
+    // the exporter and the publisher sample on their own schedule,
+    // including adapters added later
+    if (opt_export || opt_publish) {
+        struct exporter_source source;
+
+        exporter_source_live(&source, transport);
+
+        if (opt_publish)
+            return publish_run(&source, opt_publish, opt_watch > 0 ? opt_watch : 1) < 0;
+        return exporter_run(&source, opt_export, opt_watch > 0 ? opt_watch : 10) < 0;
+    }
+
+    // the monitor channel reports all existing adapters by itself
+    if (opt_monitor)
+        return monitor_adapters() < 0;
+
+    static struct adapter_list adapterList;
+
+    int i;
+
+    // everything was probed by the publisher already
+    if (opt_read) {
+        if (read_published(&adapterList, opt_read) < 0) {
+            fprintf(stderr, "Can't read shared memory %s: %s (%d)\n",
+                    opt_read, strerror(errno), errno);
+            return 1;
+        }
+    } else {
+        // find all adapters that are up
+        if (collect_adapters(&adapterList) < 0) {
+            fprintf(stderr, "Can't get device list: %s (%d)\n", strerror(errno), errno);
+            return 1;
+        }
+
+        // --watch is its interval
+        if (opt_sniff)
+            return sniff_adapter(&adapterList) < 0;
+
+        if (opt_watch > 0) {
+            int dev_ids[MAX_ADAPTERS];
+            struct stat_log log;
+
+            for (i = 0; i < adapterList.count; i++)
+                dev_ids[i] = adapterList.adapters[i].dev_id;
+
+            if (opt_log && statlog_open(&log, opt_log, 1) < 0) {
+                fprintf(stderr, "Can't open statistics log %s: %s (%d)\n",
+                        opt_log, strerror(errno), errno);
+                return 1;
+            }
+
+            return watch_adapters(transport, dev_ids, adapterList.count, opt_watch,
+                                  opt_log ? &log : NULL) < 0;
+        }
+
+        // probe them in parallel and render them in dev_id order
+        if (opt_budget > 0)
+            run_deadline = deadline_after(opt_budget, 0);
+        if (!opt_connections && !opt_scan && !opt_loopback)
+            probe_all_adapters(&adapterList);
+    }
+
+    struct outbuf out;
+    outbuf_init(&out, 65536);
+
+    // the exit status tells whether everything could be read
+    int incomplete;
+
+    if (opt_connections)
+        incomplete = show_connections(&out, &adapterList) < 0;
+    else if (opt_scan)
+        incomplete = scan_adapter(&out, &adapterList) < 0;
+    else if (opt_loopback)
+        incomplete = loopback_adapter(&out, &adapterList) < 0;
+    else if (opt_changes)
+        incomplete = emit_changes(&out, emitter == &json_emitter, &adapterList);
+    else if (opt_fields)
+        incomplete = emit_projection(&out, projection_format, &adapterList);
+    else
+        incomplete = emit_adapters(&out, emitter, &adapterList);
+
+    if (outbuf_flush(&out, STDOUT_FILENO) < 0) {
+        fprintf(stderr, "Can't write output: %s (%d)\n", strerror(errno), errno);
+        return 1;
+    }
+    outbuf_free(&out);
+
+    transport_destroy(transport);
+
+    if (opt_stats)
+        trace_print_stats(STDERR_FILENO);
+    if (opt_trace && trace_write_events(opt_trace) < 0) {
+        fprintf(stderr, "Can't write trace %s: %s (%d)\n", opt_trace, strerror(errno), errno);
+        return 1;
+    }
+
+    return incomplete;
 }
 
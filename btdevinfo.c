@@ -0,0 +1,739 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "btdevinfo.h"
+#include "deadline.h"
+#include "hci_pipeline.h"
+#include "trace.h"
+
+
+int btdi_init(struct btdi_context* ctx, struct transport* transport)
+{
+    memset(ctx, 0x00, sizeof(*ctx));
+    ctx->timeout = BTDI_DEFAULT_TIMEOUT;
+    ctx->retries = BTDI_DEFAULT_RETRIES;
+    ctx->fields  = BTDI_ALL_FIELDS;
+
+    if (!transport) {
+        transport = transport_live();
+        if (!transport)
+            return -1;
+        ctx->own_transport = 1;
+    }
+    ctx->transport = transport;
+
+    return 0;
+}
+
+
+void btdi_free(struct btdi_context* ctx)
+{
+    if (ctx->own_transport && ctx->transport)
+        transport_destroy(ctx->transport);
+    ctx->transport = NULL;
+}
+
+
+void btdi_filter_init(struct btdi_filter* filter)
+{
+    memset(filter, 0x00, sizeof(*filter));
+    filter->dev_id    = -1;
+    filter->flags_set = 1 << HCI_UP;
+}
+
+
+int btdi_filter_flags(struct btdi_filter* filter, const char* names)
+{
+    const char* name = names;
+    int bit, negate, len;
+
+    while (*name) {
+        negate = *name == '!';
+        name += negate;
+        len = strcspn(name, ",");
+
+        for (bit = 0; bit < dev_flags_table.nbits; bit++) {
+            const char* flag = bit_table_name(&dev_flags_table, bit);
+
+            if (flag && (int) strlen(flag) == len && strncasecmp(flag, name, len) == 0)
+                break;
+        }
+        if (bit == dev_flags_table.nbits) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        if (negate) {
+            filter->flags_clear |= 1u << bit;
+            filter->flags_set &= ~(1u << bit);
+        } else {
+            filter->flags_set |= 1u << bit;
+            filter->flags_clear &= ~(1u << bit);
+        }
+
+        name += len;
+        name += *name == ',';
+    }
+
+    return 0;
+}
+
+
+static int flags_pass(const struct btdi_filter* filter, uint32_t flags)
+{
+    return (flags & filter->flags_set) == filter->flags_set && !(flags & filter->flags_clear);
+}
+
+
+int btdi_filter_match(const struct btdi_filter* filter, int dev_id, const bdaddr_t* bdaddr,
+                      uint32_t flags)
+{
+    if (filter->dev_id >= 0 && dev_id != filter->dev_id)
+        return 0;
+    if (filter->have_bdaddr && bdaddr && bacmp(bdaddr, &filter->bdaddr) != 0)
+        return 0;
+    return flags_pass(filter, flags);
+}
+
+
+// one adapter by dev_id: its device info is a single ioctl, like the list
+static int list_one(struct btdi_context* ctx, const struct btdi_filter* filter,
+                    int* dev_ids, struct adapter_info* infos)
+{
+    struct hci_dev_info di;
+    uint64_t start = trace_now();
+    int ret;
+
+    ret = transport_dev_info(ctx->transport, filter->dev_id, &di);
+    trace_record(filter->dev_id, TRACE_OP_DEVINFO, start, trace_now(), 0);
+    if (ret < 0)
+        return errno == ENODEV ? 0 : -1;
+    if (!flags_pass(filter, di.flags))
+        return 0;
+
+    if (dev_ids)
+        dev_ids[0] = filter->dev_id;
+    if (infos) {
+        memset(&infos[0], 0x00, sizeof(infos[0]));
+        infos[0].dev_id     = filter->dev_id;
+        infos[0].hciDevInfo = di;
+        infos[0].fields[FIELD_DEVINFO] = FIELD_OK;
+    }
+    return 1;
+}
+
+
+// btdi_list into dev_ids, btdi_list_info into infos
+static int list_adapters(struct btdi_context* ctx, const struct btdi_filter* filter, int max,
+                         int* dev_ids, struct adapter_info* infos)
+{
+    struct btdi_filter defaults;
+    struct hci_dev_req* devs;
+    struct hci_dev_info di;
+    uint64_t start;
+    int count, i, n = 0;
+
+    if (!filter) {
+        btdi_filter_init(&defaults);
+        filter = &defaults;
+    }
+    if (max <= 0)
+        return 0;
+    if (filter->dev_id >= 0 && !filter->have_bdaddr)
+        return list_one(ctx, filter, dev_ids, infos);
+
+    start = trace_now();
+    count = transport_dev_snapshot(ctx->transport, &devs);
+    trace_record(-1, TRACE_OP_DEVLIST, start, trace_now(), 0);
+    if (count < 0)
+        return -1;
+
+    for (i = 0; i < count && n < max; i++) {
+        if (filter->dev_id >= 0 && devs[i].dev_id != filter->dev_id)
+            continue;
+        if (!flags_pass(filter, devs[i].dev_opt))
+            continue;
+
+        // adapters removed in between are skipped
+        if (filter->have_bdaddr) {
+            start = trace_now();
+            if (transport_dev_info(ctx->transport, devs[i].dev_id, &di) < 0 ||
+                    bacmp(&di.bdaddr, &filter->bdaddr) != 0) {
+                trace_record(devs[i].dev_id, TRACE_OP_DEVINFO, start, trace_now(), 0);
+                continue;
+            }
+            trace_record(devs[i].dev_id, TRACE_OP_DEVINFO, start, trace_now(), 0);
+        }
+
+        if (dev_ids)
+            dev_ids[n] = devs[i].dev_id;
+        if (infos) {
+            memset(&infos[n], 0x00, sizeof(infos[n]));
+            infos[n].dev_id = devs[i].dev_id;
+            if (filter->have_bdaddr) {
+                infos[n].hciDevInfo = di;
+                infos[n].fields[FIELD_DEVINFO] = FIELD_OK;
+            } else {
+                infos[n].hciDevInfo.dev_id = devs[i].dev_id;
+                infos[n].hciDevInfo.flags  = devs[i].dev_opt;
+            }
+        }
+        n++;
+    }
+
+    free(devs);
+    return n;
+}
+
+
+int btdi_list(struct btdi_context* ctx, int* dev_ids, int max,
+              const struct btdi_filter* filter)
+{
+    return list_adapters(ctx, filter, max, dev_ids, NULL);
+}
+
+
+int btdi_list_info(struct btdi_context* ctx, struct adapter_info* infos, int max,
+                   const struct btdi_filter* filter)
+{
+    return list_adapters(ctx, filter, max, NULL, infos);
+}
+
+
+// answers of one capability query; the pipeline copies the return
+// parameters here and the completion callbacks decode them
+struct capability_query {
+    struct adapter_info*                 info;
+    read_local_version_rp                version;
+    read_local_commands_rp               commands;
+    read_buffer_size_rp                  buffer_size;
+    read_local_ext_features_rp           ext_features[MAX_EXT_FEATURE_PAGES];
+    le_read_local_supported_features_rp  le_features;
+    le_read_buffer_size_rp               le_buffer_size;
+};
+
+
+static void on_local_version(struct hci_pipeline* pipeline, struct hci_pipeline_cmd* cmd)
+{
+    struct capability_query* query = cmd->user;
+
+    decode_local_version(&query->info->hciVersion, &query->version);
+}
+
+
+static void on_local_commands(struct hci_pipeline* pipeline, struct hci_pipeline_cmd* cmd)
+{
+    struct capability_query* query = cmd->user;
+
+    decode_local_commands(&query->info->caps, &query->commands);
+}
+
+
+static void on_buffer_size(struct hci_pipeline* pipeline, struct hci_pipeline_cmd* cmd)
+{
+    struct capability_query* query = cmd->user;
+
+    decode_buffer_size(&query->info->caps, &query->buffer_size);
+}
+
+
+static void on_ext_features(struct hci_pipeline* pipeline, struct hci_pipeline_cmd* cmd)
+{
+    struct capability_query* query = cmd->user;
+    read_local_ext_features_rp* rp = cmd->rparam;
+
+    // page 1 tells us how many pages there are: queue the rest right away
+    if (decode_ext_features(&query->info->caps, rp) == 1) {
+        read_local_ext_features_cp cp;
+
+        for (cp.page_num = 2; cp.page_num <= rp->max_page_num &&
+                cp.page_num < MAX_EXT_FEATURE_PAGES; cp.page_num++)
+            hci_pipeline_add(pipeline, OGF_INFO_PARAM, OCF_READ_LOCAL_EXT_FEATURES,
+                             &cp, READ_LOCAL_EXT_FEATURES_CP_SIZE,
+                             &query->ext_features[cp.page_num],
+                             READ_LOCAL_EXT_FEATURES_RP_SIZE,
+                             on_ext_features, query);
+    }
+}
+
+
+static void on_le_features(struct hci_pipeline* pipeline, struct hci_pipeline_cmd* cmd)
+{
+    struct capability_query* query = cmd->user;
+
+    decode_le_features(&query->info->caps, &query->le_features);
+}
+
+
+static void on_le_buffer_size(struct hci_pipeline* pipeline, struct hci_pipeline_cmd* cmd)
+{
+    struct capability_query* query = cmd->user;
+
+    decode_le_buffer_size(&query->info->caps, &query->le_buffer_size);
+}
+
+
+// the probe field a capability command reads
+static enum probe_field command_field(uint16_t opcode)
+{
+    switch (opcode) {
+    case cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_LOCAL_VERSION):
+        return FIELD_VERSION;
+    case cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_LOCAL_COMMANDS):
+        return FIELD_COMMANDS;
+    case cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_BUFFER_SIZE):
+        return FIELD_BUFFER_SIZE;
+    case cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_LOCAL_EXT_FEATURES):
+        return FIELD_EXT_FEATURES;
+    case cmd_opcode_pack(OGF_LE_CTL, OCF_LE_READ_LOCAL_SUPPORTED_FEATURES):
+        return FIELD_LE_FEATURES;
+    default:
+        return FIELD_LE_BUFFER_SIZE;
+    }
+}
+
+
+// reads the requested fields (FIELD_BIT mask) with all commands pipelined on
+// one socket and sets their status. Returns the fields worth asking again:
+// those that timed out or failed without an answer. A command the controller
+// rejected is not retried, the answer would be the same. Adds the commands
+// sent, the extended feature pages included, to *sent.
+static unsigned int query_capabilities(struct transport_dev* dev, struct adapter_info* info,
+                                       unsigned int fields, uint64_t deadline, int timeout,
+                                       int* sent)
+{
+    struct capability_query query;
+    struct hci_pipeline pipeline;
+    unsigned int retry = 0, rejected = 0;
+    int field;
+
+    memset(&query, 0x00, sizeof(query));
+    query.info = info;
+
+    hci_pipeline_init(&pipeline, dev);
+    pipeline.deadline = deadline;
+
+    if (fields & FIELD_BIT(FIELD_VERSION))
+        hci_pipeline_add(&pipeline, OGF_INFO_PARAM, OCF_READ_LOCAL_VERSION,
+                         NULL, 0, &query.version, READ_LOCAL_VERSION_RP_SIZE,
+                         on_local_version, &query);
+
+    if (fields & FIELD_BIT(FIELD_COMMANDS))
+        hci_pipeline_add(&pipeline, OGF_INFO_PARAM, OCF_READ_LOCAL_COMMANDS,
+                         NULL, 0, &query.commands, READ_LOCAL_COMMANDS_RP_SIZE,
+                         on_local_commands, &query);
+
+    if (fields & FIELD_BIT(FIELD_BUFFER_SIZE))
+        hci_pipeline_add(&pipeline, OGF_INFO_PARAM, OCF_READ_BUFFER_SIZE,
+                         NULL, 0, &query.buffer_size, READ_BUFFER_SIZE_RP_SIZE,
+                         on_buffer_size, &query);
+
+    if (fields & FIELD_BIT(FIELD_EXT_FEATURES)) {
+        read_local_ext_features_cp cp = { 1 };
+        hci_pipeline_add(&pipeline, OGF_INFO_PARAM, OCF_READ_LOCAL_EXT_FEATURES,
+                         &cp, READ_LOCAL_EXT_FEATURES_CP_SIZE,
+                         &query.ext_features[1], READ_LOCAL_EXT_FEATURES_RP_SIZE,
+                         on_ext_features, &query);
+    }
+
+    if (fields & FIELD_BIT(FIELD_LE_FEATURES))
+        hci_pipeline_add(&pipeline, OGF_LE_CTL, OCF_LE_READ_LOCAL_SUPPORTED_FEATURES,
+                         NULL, 0, &query.le_features,
+                         LE_READ_LOCAL_SUPPORTED_FEATURES_RP_SIZE,
+                         on_le_features, &query);
+
+    if (fields & FIELD_BIT(FIELD_LE_BUFFER_SIZE))
+        hci_pipeline_add(&pipeline, OGF_LE_CTL, OCF_LE_READ_BUFFER_SIZE,
+                         NULL, 0, &query.le_buffer_size, LE_READ_BUFFER_SIZE_RP_SIZE,
+                         on_le_buffer_size, &query);
+
+    int ret = hci_pipeline_run(&pipeline, timeout);
+    int timed_out = ret < 0 && errno == ETIMEDOUT;
+    int err = ret < 0 ? errno : EIO;
+    int i;
+
+    for (i = 0; i < pipeline.count; i++) {
+        struct hci_pipeline_cmd* cmd = &pipeline.cmds[i];
+        unsigned int bit = FIELD_BIT(command_field(cmd->opcode));
+
+        if (cmd->sent)
+            (*sent)++;
+        if (cmd->answered)
+            trace_record(info->dev_id, cmd->opcode, cmd->sent, cmd->answered, 0);
+        else if (cmd->sent && timed_out)
+            trace_record(info->dev_id, cmd->opcode, cmd->sent, trace_now(), 1);
+
+        // the pipeline fails unanswered commands too, without a status
+        if (cmd->state == HCI_CMD_FAILED && cmd->status)
+            rejected |= bit;
+        else if (cmd->state != HCI_CMD_DONE)
+            retry |= bit;
+    }
+
+    // a field spread over several commands (the feature pages) is only
+    // complete if all of them were answered
+    for (field = 0; field < PROBE_NUM_FIELDS; field++) {
+        unsigned int bit = FIELD_BIT(field);
+
+        if (!(fields & bit))
+            continue;
+        if (retry & bit)
+            info->fields[field] = timed_out ? FIELD_TIMEOUT : FIELD_FAILED;
+        else if (rejected & bit)
+            info->fields[field] = FIELD_FAILED;
+        else
+            info->fields[field] = FIELD_OK;
+    }
+
+    if (retry & FIELD_BIT(FIELD_VERSION) || rejected & FIELD_BIT(FIELD_VERSION))
+        info->status = err;
+
+    return retry;
+}
+
+
+// the fields a probe asks the controller for, after the device info
+static unsigned int capability_fields(const struct hci_dev_info* di)
+{
+    unsigned int fields = FIELD_BIT(FIELD_VERSION) | FIELD_BIT(FIELD_COMMANDS) |
+                          FIELD_BIT(FIELD_BUFFER_SIZE);
+
+    if (di->features[7] & LMP_EXT_FEAT)
+        fields |= FIELD_BIT(FIELD_EXT_FEATURES);
+    if (di->features[4] & LMP_LE)
+        fields |= FIELD_BIT(FIELD_LE_FEATURES) | FIELD_BIT(FIELD_LE_BUFFER_SIZE);
+
+    return fields;
+}
+
+
+static void set_fields(struct adapter_info* info, unsigned int fields,
+                       enum field_status status)
+{
+    int field;
+
+    for (field = 0; field < PROBE_NUM_FIELDS; field++)
+        if (fields & FIELD_BIT(field))
+            info->fields[field] = status;
+}
+
+
+// asks with the context's retries, every attempt with a share of the
+// adapter's time, so a single lost event does not use it all up. Returns
+// the fields that never got an answer.
+static unsigned int query_retrying(struct btdi_context* ctx, struct transport_dev* dev,
+                                   struct adapter_info* info, unsigned int fields,
+                                   uint64_t deadline, unsigned int* seed, int* sent)
+{
+    int attempt;
+
+    for (attempt = 1; fields; attempt++) {
+        fields = query_capabilities(dev, info, fields, deadline,
+                                    ctx->timeout / (ctx->retries + 1), sent);
+        if (!fields || attempt > ctx->retries ||
+                deadline_backoff(deadline, BTDI_BACKOFF_MS, attempt, seed) < 0)
+            break;
+    }
+
+    return fields;
+}
+
+
+// the capability fields (not the version) that were read
+static unsigned int fields_read(const struct adapter_info* info)
+{
+    unsigned int ok = 0;
+    int field;
+
+    for (field = FIELD_COMMANDS; field < PROBE_NUM_FIELDS; field++)
+        if (info->fields[field] == FIELD_OK)
+            ok |= FIELD_BIT(field);
+
+    return ok;
+}
+
+
+// 0 for a complete probe, else -1 with errno of the failed step
+static int probe_result(const struct adapter_info* info)
+{
+    int field;
+
+    for (field = 0; field < PROBE_NUM_FIELDS; field++) {
+        if (info->fields[field] != FIELD_OK && info->fields[field] != FIELD_UNSUPPORTED) {
+            errno = info->status ? info->status : EIO;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+// btdi_probe without the throttle; *sent counts the HCI commands sent
+static int probe_adapter(struct btdi_context* ctx, int dev_id, uint64_t deadline,
+                         struct adapter_info* info, int* sent)
+{
+    struct transport_dev dev;
+    unsigned int seed = dev_id ^ (unsigned int) deadline_now();
+    // the capabilities need the device info to know what to ask
+    unsigned int wanted = ctx->fields & ~FIELD_BIT(FIELD_DEVINFO);
+    unsigned int fields, cached = 0, hit = 0;
+    uint64_t start;
+    int attempt, ret;
+
+    memset(info, 0x00, sizeof(*info));
+    memset(info->fields, FIELD_UNSUPPORTED, sizeof(info->fields));
+    info->dev_id = dev_id;
+    info->hciDevInfo.dev_id = dev_id;
+
+    if (deadline == 0)
+        deadline = deadline_after(ctx->timeout, 0);
+
+    // no field asked for: what the adapter list had is all there is
+    if (!(ctx->fields & BTDI_ALL_FIELDS))
+        return 0;
+
+    // the run's budget was spent on other adapters
+    if (deadline_remaining_ms(deadline, 1) == 0) {
+        info->failed = PROBE_FAILED_DEVINFO;
+        info->status = ETIMEDOUT;
+        set_fields(info, FIELD_BIT(FIELD_DEVINFO) | (wanted & FIELD_BIT(FIELD_VERSION)),
+                   FIELD_SKIPPED);
+        return probe_result(info);
+    }
+
+    // the live part: flags, stats, link settings
+    for (attempt = 1; ; attempt++) {
+        start = trace_now();
+        ret = transport_dev_info(ctx->transport, dev_id, &info->hciDevInfo);
+        trace_record(dev_id, TRACE_OP_DEVINFO, start, trace_now(), 0);
+        if (ret == 0)
+            break;
+
+        // a removed adapter does not come back by asking again
+        info->status = errno;
+        if (info->status == ENODEV || attempt > ctx->retries ||
+                deadline_backoff(deadline, BTDI_BACKOFF_MS, attempt, &seed) < 0) {
+            info->failed = PROBE_FAILED_DEVINFO;
+            info->fields[FIELD_DEVINFO] = FIELD_FAILED;
+            set_fields(info, wanted & FIELD_BIT(FIELD_VERSION), FIELD_SKIPPED);
+            return probe_result(info);
+        }
+    }
+    info->fields[FIELD_DEVINFO] = FIELD_OK;
+    fields = capability_fields(&info->hciDevInfo) & wanted;
+
+    // nothing the controller has to answer: the socket is not opened
+    if (!fields)
+        return probe_result(info);
+
+    // open HCI socket
+    for (attempt = 1; ; attempt++) {
+        start = trace_now();
+        ret = transport_open(ctx->transport, dev_id, &dev);
+        trace_record(dev_id, TRACE_OP_OPEN, start, trace_now(), 0);
+        if (ret >= 0)
+            break;
+
+        info->status = errno;
+        if (attempt > ctx->retries ||
+                deadline_backoff(deadline, BTDI_BACKOFF_MS, attempt, &seed) < 0) {
+            info->failed = PROBE_FAILED_OPEN;
+            set_fields(info, fields, FIELD_SKIPPED);
+            return probe_result(info);
+        }
+    }
+
+    // with a cache the version comes first: one command, and the key that
+    // notices a firmware update. The rest of the static part comes from an
+    // earlier run, as far as it has it.
+    if (ctx->cache) {
+        query_retrying(ctx, &dev, info, FIELD_BIT(FIELD_VERSION), deadline, &seed, sent);
+        if (info->fields[FIELD_VERSION] == FIELD_OK) {
+            // all of the record goes back in with what this run adds
+            hit    = cache_lookup(ctx->cache, &info->hciDevInfo, &info->hciVersion,
+                                  &info->caps);
+            cached = hit & fields;
+            info->from_cache = cached != 0;
+            set_fields(info, cached, FIELD_OK);
+        } else if (!(wanted & FIELD_BIT(FIELD_VERSION))) {
+            // only read for the key
+            info->fields[FIELD_VERSION] = FIELD_UNSUPPORTED;
+            info->status = 0;
+        }
+        fields &= ~(cached | FIELD_BIT(FIELD_VERSION));
+    }
+
+    query_retrying(ctx, &dev, info, fields, deadline, &seed, sent);
+    transport_close(&dev);
+
+    if ((wanted & FIELD_BIT(FIELD_VERSION)) && info->fields[FIELD_VERSION] != FIELD_OK) {
+        info->failed = PROBE_FAILED_VERSION;
+        return probe_result(info);
+    }
+    info->status = 0;
+
+    // what the controller answered, merged with what came from the cache,
+    // including the fields this run did not ask for (info->caps has them)
+    if (ctx->cache && info->fields[FIELD_VERSION] == FIELD_OK && (fields & fields_read(info)))
+        cache_store(ctx->cache, &info->hciDevInfo, &info->hciVersion, &info->caps,
+                    hit | fields_read(info));
+
+    return probe_result(info);
+}
+
+
+// the throttle waits for one command per field asked for before the
+// adapter's time starts, and books the difference to what was actually
+// sent afterwards: feature pages and retries cost more, a cache hit less
+int btdi_probe(struct btdi_context* ctx, int dev_id, uint64_t deadline,
+               struct adapter_info* info)
+{
+    int planned = __builtin_popcount(ctx->fields & BTDI_ALL_FIELDS & ~FIELD_BIT(FIELD_DEVINFO));
+    int sent = 0;
+    int ret, err;
+
+    if (ctx->throttle && planned)
+        ctx->throttle(ctx->throttle_arg, dev_id, planned, 1);
+
+    ret = probe_adapter(ctx, dev_id, deadline, info, &sent);
+
+    if (ctx->throttle && sent != planned) {
+        err = errno;
+        ctx->throttle(ctx->throttle_arg, dev_id, sent - planned, 0);
+        errno = err;
+    }
+
+    return ret;
+}
+
+
+// the adapters of one btdi_probe_all, picked up by the workers in turn
+struct probe_batch {
+    struct btdi_context*  ctx;
+    struct adapter_info*  infos;
+    int                   count;
+    int                   next;
+    int                   incomplete;
+    uint64_t              deadline;
+};
+
+
+static void* probe_worker(void* arg)
+{
+    struct probe_batch* batch = arg;
+    int i;
+
+    while ((i = __sync_fetch_and_add(&batch->next, 1)) < batch->count) {
+        struct adapter_info* info = &batch->infos[i];
+        // what the adapter list had, for when the device info cannot be read
+        uint32_t flags = info->hciDevInfo.flags;
+
+        // the listing already read all that is asked for
+        if ((batch->ctx->fields & BTDI_ALL_FIELDS) == FIELD_BIT(FIELD_DEVINFO) &&
+                info->fields[FIELD_DEVINFO] == FIELD_OK)
+            continue;
+
+        // without a run deadline the adapter's time starts after the throttle
+        if (btdi_probe(batch->ctx, info->dev_id, batch->deadline ?
+                       deadline_after(batch->ctx->timeout, batch->deadline) : 0, info) < 0)
+            __sync_fetch_and_add(&batch->incomplete, 1);
+        if (info->fields[FIELD_DEVINFO] != FIELD_OK)
+            info->hciDevInfo.flags = flags;
+    }
+
+    return NULL;
+}
+
+
+// all adapters at once, so a run takes as long as the slowest adapter
+// instead of the sum of all of them; an adapter that times out holds up
+// no other
+int btdi_probe_all(struct btdi_context* ctx, struct adapter_info* infos, int count,
+                   uint64_t deadline)
+{
+    pthread_t workers[BTDI_MAX_WORKERS];
+    pthread_attr_t attr;
+    struct probe_batch batch;
+    int num_workers = count;
+    int started = 0;
+    int i;
+
+    memset(&batch, 0x00, sizeof(batch));
+    batch.ctx      = ctx;
+    batch.infos    = infos;
+    batch.count    = count;
+    batch.deadline = deadline;
+
+    if (num_workers > BTDI_MAX_WORKERS)
+        num_workers = BTDI_MAX_WORKERS;
+
+    // the default stack of 8 MB per thread adds up with many adapters
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, BTDI_WORKER_STACK);
+
+    for (i = 0; i < num_workers; i++) {
+        if (pthread_create(&workers[i], &attr, probe_worker, &batch) != 0)
+            break;
+        started++;
+    }
+    pthread_attr_destroy(&attr);
+
+    // no thread could be started: probe in this thread instead
+    if (started == 0)
+        probe_worker(&batch);
+
+    for (i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    return batch.incomplete;
+}
+
+
+int btdi_bit_names(const struct bit_table* table, const void* bitmap, int nbytes,
+                   const char** names, int max)
+{
+    struct bit_iter it;
+    int bit, n = 0;
+
+    bit_iter_init(&it, bitmap, nbytes);
+    while ((bit = bit_iter_next(&it)) >= 0) {
+        const char* name = bit_table_name(table, bit);
+
+        if (!name)
+            continue;
+        if (n < max)
+            names[n] = name;
+        n++;
+    }
+
+    return n;
+}
@@ -0,0 +1,142 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BTDEVINFO_H
+#define BTDEVINFO_H
+
+#include <stdint.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "adapter.h"
+#include "cache.h"
+#include "decode.h"
+#include "transport.h"
+
+
+// libbtdevinfo: the adapter probe without the command line. Everything a
+// probe needs lives in a context and the results go into structs the
+// caller provides, so a daemon can probe from its own threads or event
+// loop instead of running the tool and parsing its output. Nothing
+// prints, and no state is global except the opt-in tracing of trace.h.
+// The README lists the sources of the library.
+
+#define BTDI_DEFAULT_TIMEOUT  2000    // ms per adapter
+#define BTDI_DEFAULT_RETRIES  2
+
+// first pause before a retry, doubled for each further one
+#define BTDI_BACKOFF_MS       20
+
+// btdi_probe_all runs one probe thread per adapter, up to this many, so a
+// run takes as long as the slowest adapter; the threads have small stacks
+#define BTDI_MAX_WORKERS      MAX_ADAPTERS
+#define BTDI_WORKER_STACK     (256 * 1024)
+
+// every part of an adapter (btdi_context.fields)
+#define BTDI_ALL_FIELDS       ((1u << PROBE_NUM_FIELDS) - 1)
+
+// may be shared by any number of threads once set up
+struct btdi_context {
+    struct transport*   transport;
+    struct caps_cache*  cache;          // static controller data, NULL = none
+    int                 timeout;        // ms per adapter
+    int                 retries;        // per step of a probe
+    unsigned int        fields;         // FIELD_BIT mask of what a probe reads
+    int                 own_transport;  // destroyed by btdi_free
+
+    // called before a probe sends commands to dev_id, one per field asked
+    // for, and may block until the controller may get them; afterwards,
+    // with wait 0, for what was sent beyond that (negative: less) so it can
+    // be booked. NULL = none (see server.c)
+    void                (*throttle)(void* arg, int dev_id, int commands, int wait);
+    void*               throttle_arg;
+};
+
+
+// sets the defaults (all fields); with transport NULL the context opens the kernel's
+// HCI control socket itself. -1 with errno set.
+int btdi_init(struct btdi_context* ctx, struct transport* transport);
+void btdi_free(struct btdi_context* ctx);
+
+// which adapters btdi_list reports; btdi_filter_init selects all that are up
+struct btdi_filter {
+    int       dev_id;           // -1: any
+    int       have_bdaddr;
+    bdaddr_t  bdaddr;
+    uint32_t  flags_set;        // 1 << HCI_UP etc. that must be set
+    uint32_t  flags_clear;      // and that must not be set
+};
+
+void btdi_filter_init(struct btdi_filter* filter);
+
+// adds "UP,!PSCAN" style names of dev_flags_table to the filter; -1 with
+// errno EINVAL for unknown names
+int btdi_filter_flags(struct btdi_filter* filter, const char* names);
+
+// whether an adapter with that dev_id, address (NULL: not known) and flags
+// passes the filter
+int btdi_filter_match(const struct btdi_filter* filter, int dev_id, const bdaddr_t* bdaddr,
+                      uint32_t flags);
+
+// fills at most max dev_ids of the adapters that pass filter (NULL: the
+// defaults) from one snapshot of the kernel's adapter list, any number of
+// adapters; returns their number or -1 with errno set. The bdaddr filter
+// asks each adapter's device info over the context's control socket.
+int btdi_list(struct btdi_context* ctx, int* dev_ids, int max,
+              const struct btdi_filter* filter);
+
+// like btdi_list, into infos: the dev_id and hciDevInfo.flags of each
+// adapter. Where the listing had to read the device info anyway (the
+// bdaddr filter), or could read it instead of the list (a filter on one
+// dev_id), all of hciDevInfo is set and fields[FIELD_DEVINFO] is FIELD_OK,
+// so a caller that only needs the device info need not probe.
+int btdi_list_info(struct btdi_context* ctx, struct adapter_info* infos, int max,
+                   const struct btdi_filter* filter);
+
+// Probes adapter dev_id into info: the device info (flags, features,
+// stats) and the version and capabilities the controller reports, as far
+// as the context's fields ask for them. The capabilities need the device
+// info, which is read for them in any case; with only the device info
+// asked for, the adapter is not opened at all.
+// Failed reads are retried with a jittered backoff until deadline
+// (CLOCK_MONOTONIC, see deadline.h; 0: the context's timeout from now).
+// Whatever could be read is kept, info->fields tells which parts are
+// valid. Returns 0 if the probe is complete, else -1 with errno set to
+// the error of the failed step.
+int btdi_probe(struct btdi_context* ctx, int dev_id, uint64_t deadline,
+               struct adapter_info* info);
+
+// probes the adapters of infos[].dev_id in parallel, one thread each up to
+// BTDI_MAX_WORKERS, each within the context's timeout and all of them
+// within deadline (0: none); returns the number of incomplete probes.
+// infos[] as btdi_list_info filled them: an adapter whose device info the
+// listing already read is not probed again for that alone, and one whose
+// device info cannot be read keeps the flags of the list
+int btdi_probe_all(struct btdi_context* ctx, struct adapter_info* infos, int count,
+                   uint64_t deadline);
+
+// the names of the bits set in a bitmap of the controller (the tables of
+// decode.h: features, LE features, supported commands); fills at most max
+// names and returns the number of named bits set
+int btdi_bit_names(const struct bit_table* table, const void* bitmap, int nbytes,
+                   const char** names, int max);
+
+#endif
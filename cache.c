@@ -0,0 +1,230 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+
+
+static void fnv1a(uint64_t* hash, const void* data, size_t len)
+{
+    const uint8_t* p = data;
+
+    while (len--) {
+        *hash ^= *p++;
+        *hash *= 0x100000001b3ULL;
+    }
+}
+
+
+uint64_t cache_fingerprint(const struct hci_dev_info* di)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    // only what the controller reports; name, flags, packet types and the
+    // link settings are configurable and do not identify the firmware
+    fnv1a(&hash, &di->bdaddr,   sizeof(di->bdaddr));
+    fnv1a(&hash, &di->type,     sizeof(di->type));
+    fnv1a(&hash, di->features,  sizeof(di->features));
+    fnv1a(&hash, &di->acl_mtu,  sizeof(di->acl_mtu));
+    fnv1a(&hash, &di->acl_pkts, sizeof(di->acl_pkts));
+    fnv1a(&hash, &di->sco_mtu,  sizeof(di->sco_mtu));
+    fnv1a(&hash, &di->sco_pkts, sizeof(di->sco_pkts));
+
+    return hash;
+}
+
+
+const char* cache_default_path(char* buf, size_t size)
+{
+    const char* dir = getenv("XDG_CACHE_HOME");
+
+    if (dir && *dir) {
+        snprintf(buf, size, "%s/bt_device_info.cache", dir);
+        return buf;
+    }
+
+    dir = getenv("HOME");
+    if (dir && *dir) {
+        // ~/.cache may not exist yet on a fresh account
+        snprintf(buf, size, "%s/.cache", dir);
+        mkdir(buf, 0700);
+        snprintf(buf, size, "%s/.cache/bt_device_info.cache", dir);
+        return buf;
+    }
+
+    return NULL;
+}
+
+
+static int header_valid(const struct cache_file* file)
+{
+    return memcmp(file->magic, CACHE_MAGIC, sizeof(file->magic)) == 0 &&
+           file->version == CACHE_VERSION &&
+           file->record_size == sizeof(struct cache_record) &&
+           file->num_records == CACHE_RECORDS;
+}
+
+
+int cache_open(struct caps_cache* cache, const char* path)
+{
+    struct stat st;
+    int err;
+
+    cache->file = NULL;
+    cache->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (cache->fd < 0)
+        return -1;
+
+    if (flock(cache->fd, LOCK_EX) < 0 || fstat(cache->fd, &st) < 0)
+        goto fail;
+
+    // new file or one written by another version: start empty
+    if (st.st_size != sizeof(struct cache_file)) {
+        if (ftruncate(cache->fd, 0) < 0 ||
+                ftruncate(cache->fd, sizeof(struct cache_file)) < 0)
+            goto fail;
+    }
+
+    cache->file = mmap(NULL, sizeof(struct cache_file), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, cache->fd, 0);
+    if (cache->file == MAP_FAILED) {
+        cache->file = NULL;
+        goto fail;
+    }
+
+    if (!header_valid(cache->file)) {
+        memset(cache->file, 0x00, sizeof(struct cache_file));
+        memcpy(cache->file->magic, CACHE_MAGIC, sizeof(cache->file->magic));
+        cache->file->version     = CACHE_VERSION;
+        cache->file->record_size = sizeof(struct cache_record);
+        cache->file->num_records = CACHE_RECORDS;
+    }
+
+    flock(cache->fd, LOCK_UN);
+    pthread_mutex_init(&cache->lock, NULL);
+    return 0;
+
+fail:
+    err = errno;
+    close(cache->fd);
+    cache->fd = -1;
+    errno = err;
+    return -1;
+}
+
+
+void cache_close(struct caps_cache* cache)
+{
+    if (cache->file) {
+        munmap(cache->file, sizeof(struct cache_file));
+        pthread_mutex_destroy(&cache->lock);
+    }
+    if (cache->fd >= 0)
+        close(cache->fd);
+
+    cache->file = NULL;
+    cache->fd = -1;
+}
+
+
+static int same_version(const struct hci_version* a, const struct hci_version* b)
+{
+    return a->manufacturer == b->manufacturer &&
+           a->hci_ver == b->hci_ver && a->hci_rev == b->hci_rev &&
+           a->lmp_ver == b->lmp_ver && a->lmp_subver == b->lmp_subver;
+}
+
+
+unsigned int cache_lookup(struct caps_cache* cache, const struct hci_dev_info* di,
+                          const struct hci_version* version, struct adapter_caps* caps)
+{
+    uint64_t fingerprint = cache_fingerprint(di);
+    unsigned int hit = 0;
+    int i;
+
+    pthread_mutex_lock(&cache->lock);
+    flock(cache->fd, LOCK_SH);
+
+    for (i = 0; i < CACHE_RECORDS; i++) {
+        struct cache_record* record = &cache->file->records[i];
+
+        if (record->in_use && bacmp(&record->bdaddr, &di->bdaddr) == 0) {
+            if (record->fingerprint == fingerprint &&
+                    same_version(&record->version, version)) {
+                *caps = record->caps;
+                hit   = record->fields;
+            }
+            break;
+        }
+    }
+
+    flock(cache->fd, LOCK_UN);
+    pthread_mutex_unlock(&cache->lock);
+
+    return hit;
+}
+
+
+void cache_store(struct caps_cache* cache, const struct hci_dev_info* di,
+                 const struct hci_version* version, const struct adapter_caps* caps,
+                 unsigned int fields)
+{
+    struct cache_record* slot = NULL;
+    int i;
+
+    pthread_mutex_lock(&cache->lock);
+    flock(cache->fd, LOCK_EX);
+
+    // the adapter's own record, else a free one, else the oldest
+    for (i = 0; i < CACHE_RECORDS; i++) {
+        struct cache_record* record = &cache->file->records[i];
+
+        if (record->in_use && bacmp(&record->bdaddr, &di->bdaddr) == 0) {
+            slot = record;
+            break;
+        }
+        if (!slot || (slot->in_use &&
+                      (!record->in_use || record->stored_at < slot->stored_at)))
+            slot = record;
+    }
+
+    memset(slot, 0x00, sizeof(*slot));
+    bacpy(&slot->bdaddr, &di->bdaddr);
+    slot->fingerprint = cache_fingerprint(di);
+    slot->stored_at   = time(NULL);
+    slot->version     = *version;
+    slot->fields      = fields;
+    slot->caps        = *caps;
+    slot->in_use      = 1;
+
+    flock(cache->fd, LOCK_UN);
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,88 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "adapter.h"
+
+
+// Memory-mapped file of fixed-size records holding the controller
+// capabilities per bdaddr. Read Local Version is still sent on every run,
+// a single command: a record is only used while both the version (incl.
+// LMP subversion) and the fingerprint over the static hci_dev_info fields
+// match, so a firmware update invalidates it even if it changes nothing
+// else. Only the fields the controller answered are kept; a command it
+// rejected is asked again next time.
+
+#define CACHE_MAGIC    "BTDICACH"
+#define CACHE_VERSION  2
+#define CACHE_RECORDS  64
+
+struct cache_record {
+    uint32_t             in_use;
+    bdaddr_t             bdaddr;
+    uint64_t             fingerprint;
+    int64_t              stored_at;    // time() of the last store, for eviction
+    struct hci_version   version;      // part of the key
+    uint32_t             fields;       // FIELD_BIT()s of caps that were read
+    struct adapter_caps  caps;
+};
+
+struct cache_file {
+    char                 magic[8];
+    uint32_t             version;
+    uint32_t             record_size;  // detects a changed struct layout
+    uint32_t             num_records;
+    uint32_t             padding;
+    struct cache_record  records[CACHE_RECORDS];
+};
+
+struct caps_cache {
+    int                  fd;
+    struct cache_file*   file;
+    pthread_mutex_t      lock;         // flock() does not separate our own threads
+};
+
+
+// maps (and if needed creates or resets) the cache file; -1 with errno set
+int cache_open(struct caps_cache* cache, const char* path);
+void cache_close(struct caps_cache* cache);
+
+// default location: $XDG_CACHE_HOME or ~/.cache; NULL if neither is known
+const char* cache_default_path(char* buf, size_t size);
+
+uint64_t cache_fingerprint(const struct hci_dev_info* di);
+
+// copies the caps of the record matching the device info and version;
+// returns the FIELD_BIT()s they hold, 0 on a miss
+unsigned int cache_lookup(struct caps_cache* cache, const struct hci_dev_info* di,
+                          const struct hci_version* version, struct adapter_caps* caps);
+
+// keeps the FIELD_BIT()s fields of caps, replacing the adapter's record
+void cache_store(struct caps_cache* cache, const struct hci_dev_info* di,
+                 const struct hci_version* version, const struct adapter_caps* caps,
+                 unsigned int fields);
+
+#endif
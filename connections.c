@@ -0,0 +1,271 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <errno.h>
+#include <string.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "connections.h"
+#include "hci_pipeline.h"
+#include "trace.h"
+
+
+// per-link reads of one handle at most, and handles per pipeline run
+#define CONN_CMDS   4
+#define CONN_BATCH  (HCI_PIPELINE_MAX_CMDS / CONN_CMDS)
+
+// time a batch may wait for its next answer, within the deadline
+#define CONN_EVENT_TIMEOUT 1000
+
+// return parameters of one connection's reads
+struct conn_answers {
+    struct conn_entry*            conn;
+    read_rssi_rp                  rssi;
+    get_link_quality_rp           link_quality;
+    read_transmit_power_level_rp  tx_power;
+    read_afh_map_rp               afh_map;
+};
+
+
+static void on_rssi(struct hci_pipeline* pipeline, struct hci_pipeline_cmd* cmd)
+{
+    struct conn_answers* answers = cmd->user;
+
+    answers->conn->rssi  = answers->rssi.rssi;
+    answers->conn->have |= CONN_RSSI;
+}
+
+
+static void on_link_quality(struct hci_pipeline* pipeline, struct hci_pipeline_cmd* cmd)
+{
+    struct conn_answers* answers = cmd->user;
+
+    answers->conn->link_quality = answers->link_quality.link_quality;
+    answers->conn->have        |= CONN_LINK_QUALITY;
+}
+
+
+static void on_tx_power(struct hci_pipeline* pipeline, struct hci_pipeline_cmd* cmd)
+{
+    struct conn_answers* answers = cmd->user;
+
+    answers->conn->tx_power = answers->tx_power.level;
+    answers->conn->have    |= CONN_TX_POWER;
+}
+
+
+static void on_afh_map(struct hci_pipeline* pipeline, struct hci_pipeline_cmd* cmd)
+{
+    struct conn_answers* answers = cmd->user;
+
+    answers->conn->afh_mode = answers->afh_map.mode;
+    memcpy(answers->conn->afh_map, answers->afh_map.map, sizeof(answers->conn->afh_map));
+    answers->conn->have    |= CONN_AFH_MAP;
+}
+
+
+// queues a read whose parameters start with the connection handle, which
+// its answer repeats; that keeps the answers of different links apart
+static void add_read(struct hci_pipeline* pipeline, uint16_t ogf, uint16_t ocf,
+                     const void* param, uint8_t plen, void* rparam, int rlen,
+                     hci_pipeline_cb complete, struct conn_answers* answers)
+{
+    struct hci_pipeline_cmd* cmd;
+
+    cmd = hci_pipeline_add(pipeline, ogf, ocf, param, plen, rparam, rlen,
+                           complete, answers);
+    if (cmd)
+        cmd->echo = 2;
+}
+
+
+// reads the link values of up to CONN_BATCH connections in one run
+static void query_batch(struct transport_dev* dev, struct conn_entry* conns,
+                        int count, uint64_t deadline)
+{
+    struct conn_answers answers[CONN_BATCH];
+    struct hci_pipeline pipeline;
+    int i;
+
+    hci_pipeline_init(&pipeline, dev);
+    pipeline.deadline = deadline;
+
+    for (i = 0; i < count; i++) {
+        struct conn_entry* conn = &conns[i];
+        uint16_t handle = htobs(conn->info.handle);
+        read_transmit_power_level_cp tx = { handle, 0x00 };   // current level
+
+        memset(&answers[i], 0x00, sizeof(answers[i]));
+        answers[i].conn = conn;
+
+        // the reads take the handle of the ACL link, not of SCO on top of it
+        if (conn->info.type == SCO_LINK || conn->info.type == ESCO_LINK)
+            continue;
+
+        add_read(&pipeline, OGF_STATUS_PARAM, OCF_READ_RSSI, &handle, 2,
+                 &answers[i].rssi, READ_RSSI_RP_SIZE, on_rssi, &answers[i]);
+        add_read(&pipeline, OGF_HOST_CTL, OCF_READ_TRANSMIT_POWER_LEVEL,
+                 &tx, READ_TRANSMIT_POWER_LEVEL_CP_SIZE,
+                 &answers[i].tx_power, READ_TRANSMIT_POWER_LEVEL_RP_SIZE,
+                 on_tx_power, &answers[i]);
+
+        // link quality and channel hopping only exist on BR/EDR links
+        if (conn->info.type != ACL_LINK)
+            continue;
+
+        add_read(&pipeline, OGF_STATUS_PARAM, OCF_GET_LINK_QUALITY, &handle, 2,
+                 &answers[i].link_quality, GET_LINK_QUALITY_RP_SIZE,
+                 on_link_quality, &answers[i]);
+        add_read(&pipeline, OGF_STATUS_PARAM, OCF_READ_AFH_MAP, &handle, 2,
+                 &answers[i].afh_map, READ_AFH_MAP_RP_SIZE, on_afh_map, &answers[i]);
+    }
+
+    // a read the controller rejects just leaves its value out
+    int ret = hci_pipeline_run(&pipeline, CONN_EVENT_TIMEOUT);
+    int timed_out = ret < 0 && errno == ETIMEDOUT;
+
+    for (i = 0; i < pipeline.count; i++) {
+        struct hci_pipeline_cmd* cmd = &pipeline.cmds[i];
+
+        if (cmd->answered)
+            trace_record(dev->dev_id, cmd->opcode, cmd->sent, cmd->answered, 0);
+        else if (cmd->sent && timed_out)
+            trace_record(dev->dev_id, cmd->opcode, cmd->sent, trace_now(), 1);
+    }
+}
+
+
+int conn_query(struct transport* transport, int dev_id,
+               struct conn_entry* conns, int max, uint64_t deadline)
+{
+    struct hci_conn_info info[CONN_MAX];
+    struct transport_dev dev;
+    uint64_t start;
+    int count, ret, i;
+
+    if (max > CONN_MAX)
+        max = CONN_MAX;
+
+    start = trace_now();
+    count = transport_conn_list(transport, dev_id, info, max);
+    trace_record(dev_id, TRACE_OP_CONNLIST, start, trace_now(), 0);
+    if (count < 0)
+        return -1;
+
+    for (i = 0; i < count; i++) {
+        memset(&conns[i], 0x00, sizeof(conns[i]));
+        conns[i].info = info[i];
+    }
+
+    if (count == 0)
+        return 0;
+
+    // without the adapter socket the list is still worth showing
+    start = trace_now();
+    ret = transport_open(transport, dev_id, &dev);
+    trace_record(dev_id, TRACE_OP_OPEN, start, trace_now(), 0);
+    if (ret < 0)
+        return count;
+
+    for (i = 0; i < count; i += CONN_BATCH)
+        query_batch(&dev, &conns[i], count - i < CONN_BATCH ? count - i : CONN_BATCH,
+                    deadline);
+
+    transport_close(&dev);
+    return count;
+}
+
+
+static const char* link_type_name(uint8_t type)
+{
+    switch (type) {
+    case SCO_LINK:  return "SCO";
+    case ACL_LINK:  return "ACL";
+    case ESCO_LINK: return "eSCO";
+    case LE_LINK:   return "LE";
+    }
+    return "?";
+}
+
+
+static const char* conn_state_name(uint16_t state)
+{
+    static const char* const names[] = {
+        "?", "connected", "open", "bound", "listen", "connecting",
+        "connecting", "config", "disconnecting", "closed"
+    };
+
+    return state < sizeof(names) / sizeof(names[0]) ? names[state] : "?";
+}
+
+
+void conn_print(struct outbuf* out, int dev_id, const struct conn_entry* conns, int count)
+{
+    char addr[18];
+    int i;
+
+    out_printf(out, "hci%d: %d connection%s\n", dev_id, count, count == 1 ? "" : "s");
+    if (count == 0)
+        return;
+
+    out_printf(out, "    %-6s %-17s %-4s %-3s %-6s %-13s %5s %7s %8s %s\n",
+               "handle", "address", "type", "dir", "role", "state",
+               "RSSI", "quality", "TX power", "AFH channels");
+
+    for (i = 0; i < count; i++) {
+        const struct conn_entry* conn = &conns[i];
+
+        ba2str(&conn->info.bdaddr, addr);
+        out_printf(out, "    0x%04x %-17s %-4s %-3s %-6s %-13s ",
+                   conn->info.handle, addr, link_type_name(conn->info.type),
+                   conn->info.out ? "out" : "in",
+                   conn->info.link_mode & HCI_LM_MASTER ? "master" : "slave",
+                   conn_state_name(conn->info.state));
+
+        if (conn->have & CONN_RSSI)
+            out_printf(out, "%5d ", conn->rssi);
+        else
+            out_printf(out, "%5s ", "-");
+
+        if (conn->have & CONN_LINK_QUALITY)
+            out_printf(out, "%7u ", conn->link_quality);
+        else
+            out_printf(out, "%7s ", "-");
+
+        if (conn->have & CONN_TX_POWER)
+            out_printf(out, "%4d dBm ", conn->tx_power);
+        else
+            out_printf(out, "%8s ", "-");
+
+        // 79 channels; the top bit of the last octet is reserved
+        if (conn->have & CONN_AFH_MAP) {
+            int used = 0, j;
+
+            for (j = 0; j < 10; j++)
+                used += __builtin_popcount(j == 9 ? conn->afh_map[j] & 0x7f : conn->afh_map[j]);
+            out_printf(out, "%s, %d/79\n", conn->afh_mode ? "on" : "off", used);
+        } else
+            out_printf(out, "-\n");
+    }
+}
@@ -0,0 +1,69 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef CONNECTIONS_H
+#define CONNECTIONS_H
+
+#include <stdint.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "output.h"
+#include "transport.h"
+
+
+// The links of an adapter (HCIGETCONNLIST) and what the controller knows
+// about each of them: RSSI, link quality, transmit power level and the
+// AFH channel map. The per-link reads of all handles go out as one
+// pipelined batch, so many links cost little more than one.
+
+// upper bound of connections listed per adapter
+#define CONN_MAX 64
+
+enum conn_value {
+    CONN_RSSI         = 1 << 0,
+    CONN_LINK_QUALITY = 1 << 1,
+    CONN_TX_POWER     = 1 << 2,
+    CONN_AFH_MAP      = 1 << 3
+};
+
+struct conn_entry {
+    struct hci_conn_info  info;
+    uint8_t               have;          // enum conn_value bits that were read
+    int8_t                rssi;          // dB
+    uint8_t               link_quality;  // 0..255
+    int8_t                tx_power;      // dBm, current level
+    uint8_t               afh_mode;
+    uint8_t               afh_map[10];   // 79 channels, LSB first
+};
+
+
+// lists the connections of adapter dev_id and reads their link values,
+// asking no longer than until deadline (see deadline.h); values that
+// could not be read are left out of have. Returns the number of
+// connections or -1 with errno set.
+int conn_query(struct transport* transport, int dev_id,
+               struct conn_entry* conns, int max, uint64_t deadline);
+
+// renders the connections of one adapter as a table
+void conn_print(struct outbuf* out, int dev_id, const struct conn_entry* conns, int count);
+
+#endif
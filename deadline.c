@@ -0,0 +1,81 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "deadline.h"
+
+
+uint64_t deadline_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+uint64_t deadline_after(int ms, uint64_t limit)
+{
+    uint64_t deadline = deadline_now() + ms * 1000000ULL;
+
+    return limit && limit < deadline ? limit : deadline;
+}
+
+
+int deadline_remaining_ms(uint64_t deadline, int cap)
+{
+    uint64_t now;
+    uint64_t ms;
+
+    if (!deadline)
+        return cap;
+
+    now = deadline_now();
+    if (now >= deadline)
+        return 0;
+
+    // round up, a wait of 0 ms would not wait at all
+    ms = (deadline - now + 999999) / 1000000;
+    return ms < (uint64_t) cap ? (int) ms : cap;
+}
+
+
+int deadline_backoff(uint64_t deadline, int base, int attempt, unsigned int* seed)
+{
+    uint64_t delay = (uint64_t) base << (attempt > 16 ? 15 : attempt - 1);
+    struct timespec wake;
+    uint64_t at;
+
+    // 50 % .. 150 % of the nominal delay
+    delay = delay / 2 + (uint64_t) rand_r(seed) % (delay + 1);
+    at = deadline_now() + delay * 1000000ULL;
+    if (deadline && at >= deadline)
+        return -1;
+
+    wake.tv_sec  = at / 1000000000ULL;
+    wake.tv_nsec = at % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+        ;
+    return 0;
+}
@@ -0,0 +1,42 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#include <stdint.h>
+
+
+// Absolute deadlines on CLOCK_MONOTONIC, in ns. 0 means no deadline.
+
+uint64_t deadline_now(void);
+
+// now + ms, but never later than limit (unless limit is 0)
+uint64_t deadline_after(int ms, uint64_t limit);
+
+// ms until deadline, capped to cap; 0 once it passed
+int deadline_remaining_ms(uint64_t deadline, int cap);
+
+// sleeps before retry number attempt (1, 2, ...): base << (attempt - 1) ms,
+// with +-50 % jitter so adapters sharing a bus do not retry in lockstep.
+// Returns -1 without sleeping if the retry would start past deadline.
+int deadline_backoff(uint64_t deadline, int base, int attempt, unsigned int* seed);
+
+#endif
@@ -0,0 +1,596 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "decode.h"
+
+
+// table entries; the width is a compile time constant
+#define BIT(bit, str)         [bit] = { str, sizeof(str) - 1 },
+#define MASK(mask, str)       BIT(__builtin_ctz(mask), str)
+#define LMP(byte, mask, str)  BIT((byte) * 8 + __builtin_ctz(mask), str)
+#define CMD(octet, bit, str)  BIT((octet) * 8 + (bit), str)
+
+#define TABLE(names, column) \
+    { names, sizeof(names) / sizeof(names[0]), column }
+
+
+// from bluez v1.13 lib/hci.c
+static const struct bit_name dev_flags_names[] = {
+    BIT(HCI_UP,      "UP")
+    BIT(HCI_INIT,    "INIT")
+    BIT(HCI_RUNNING, "RUNNING")
+    BIT(HCI_RAW,     "RAW")
+    BIT(HCI_PSCAN,   "PSCAN")
+    BIT(HCI_ISCAN,   "ISCAN")
+    BIT(HCI_INQUIRY, "INQUIRY")
+    BIT(HCI_AUTH,    "AUTH")
+    BIT(HCI_ENCRYPT, "ENCRYPT")
+};
+
+const struct bit_table dev_flags_table = TABLE(dev_flags_names, 16);
+
+
+// from bluez v1.13 lib/hci.c
+static const struct bit_name lmp_features_names[] = {
+    LMP(0, LMP_3SLOT,       "3-slot packets")
+    LMP(0, LMP_5SLOT,       "5-slot packets")
+    LMP(0, LMP_ENCRYPT,     "encryption")
+    LMP(0, LMP_SOFFSET,     "slot offset")
+    LMP(0, LMP_TACCURACY,   "timing accuracy")
+    LMP(0, LMP_RSWITCH,     "role switch")
+    LMP(0, LMP_HOLD,        "hold mode")
+    LMP(0, LMP_SNIFF,       "sniff mode")
+
+    LMP(1, LMP_PARK,        "park state")
+    LMP(1, LMP_RSSI,        "RSSI")
+    LMP(1, LMP_QUALITY,     "channel quality")
+    LMP(1, LMP_SCO,         "SCO link")
+    LMP(1, LMP_HV2,         "HV2 packets")
+    LMP(1, LMP_HV3,         "HV3 packets")
+    LMP(1, LMP_ULAW,        "u-law log")
+    LMP(1, LMP_ALAW,        "A-law log")
+
+    LMP(2, LMP_CVSD,        "CVSD")
+    LMP(2, LMP_PSCHEME,     "paging scheme")
+    LMP(2, LMP_PCONTROL,    "power control")
+    LMP(2, LMP_TRSP_SCO,    "transparent SCO")
+    LMP(2, LMP_BCAST_ENC,   "broadcast encrypt")
+
+    LMP(3, 0x01,            "no. 24")
+    LMP(3, LMP_EDR_ACL_2M,  "EDR ACL 2 Mbps")
+    LMP(3, LMP_EDR_ACL_3M,  "EDR ACL 3 Mbps")
+    LMP(3, LMP_ENH_ISCAN,   "enhanced iscan")
+    LMP(3, LMP_ILACE_ISCAN, "interlaced iscan")
+    LMP(3, LMP_ILACE_PSCAN, "interlaced pscan")
+    LMP(3, LMP_RSSI_INQ,    "inquiry with RSSI")
+    LMP(3, LMP_ESCO,        "extended SCO")
+
+    LMP(4, LMP_EV4,         "EV4 packets")
+    LMP(4, LMP_EV5,         "EV5 packets")
+    LMP(4, 0x04,            "no. 34")
+    LMP(4, LMP_AFH_CAP_SLV, "AFH cap. slave")
+    LMP(4, LMP_AFH_CLS_SLV, "AFH class. slave")
+    LMP(4, LMP_NO_BREDR,    "BR/EDR not supp.")
+    LMP(4, LMP_LE,          "LE support")
+    LMP(4, LMP_EDR_3SLOT,   "3-slot EDR ACL")
+
+    LMP(5, LMP_EDR_5SLOT,   "5-slot EDR ACL")
+    LMP(5, LMP_SNIFF_SUBR,  "sniff subrating")
+    LMP(5, LMP_PAUSE_ENC,   "pause encryption")
+    LMP(5, LMP_AFH_CAP_MST, "AFH cap. master")
+    LMP(5, LMP_AFH_CLS_MST, "AFH class. master")
+    LMP(5, LMP_EDR_ESCO_2M, "EDR eSCO 2 Mbps")
+    LMP(5, LMP_EDR_ESCO_3M, "EDR eSCO 3 Mbps")
+    LMP(5, LMP_EDR_3S_ESCO, "3-slot EDR eSCO")
+
+    LMP(6, LMP_EXT_INQ,     "extended inquiry")
+    LMP(6, LMP_LE_BREDR,    "LE and BR/EDR")
+    LMP(6, 0x04,            "no. 50")
+    LMP(6, LMP_SIMPLE_PAIR, "simple pairing")
+    LMP(6, LMP_ENCAPS_PDU,  "encapsulated PDU")
+    LMP(6, LMP_ERR_DAT_REP, "err. data report")
+    LMP(6, LMP_NFLUSH_PKTS, "non-flush flag")
+    LMP(6, 0x80,            "no. 55")
+
+    LMP(7, LMP_LSTO,        "LSTO")
+    LMP(7, LMP_INQ_TX_PWR,  "inquiry TX power")
+    LMP(7, LMP_EPC,         "EPC")
+    LMP(7, 0x08,            "no. 59")
+    LMP(7, 0x10,            "no. 60")
+    LMP(7, 0x20,            "no. 61")
+    LMP(7, 0x40,            "no. 62")
+    LMP(7, LMP_EXT_FEAT,    "extended features")
+};
+
+const struct bit_table lmp_features_table = TABLE(lmp_features_names, 24);
+
+
+// page 1 holds what the host enabled, page 2 newer controller features
+static const struct bit_name lmp_ext_page1_names[] = {
+    BIT(0,  "SSP (host)")
+    BIT(1,  "LE (host)")
+    BIT(2,  "LE and BR/EDR (host)")
+    BIT(3,  "secure connections (host)")
+};
+
+static const struct bit_name lmp_ext_page2_names[] = {
+    BIT(0,  "CSB master")
+    BIT(1,  "CSB slave")
+    BIT(2,  "sync train")
+    BIT(3,  "sync scan")
+    BIT(4,  "inquiry resp. notification")
+    BIT(5,  "generalized interlaced scan")
+    BIT(6,  "coarse clock adjustment")
+    BIT(8,  "secure connections")
+    BIT(9,  "ping")
+    BIT(10, "slot availability mask")
+    BIT(11, "train nudging")
+};
+
+const struct bit_table lmp_ext_features_tables[] = {
+    TABLE(lmp_features_names,  24),
+    TABLE(lmp_ext_page1_names, 32),
+    TABLE(lmp_ext_page2_names, 32),
+};
+
+const int lmp_ext_features_pages =
+    sizeof(lmp_ext_features_tables) / sizeof(lmp_ext_features_tables[0]);
+
+
+static const struct bit_name le_features_names[] = {
+    BIT(0,  "LE encryption")
+    BIT(1,  "conn. parameters request")
+    BIT(2,  "extended reject indication")
+    BIT(3,  "slave-initiated features exch.")
+    BIT(4,  "LE ping")
+    BIT(5,  "data packet length ext.")
+    BIT(6,  "LL privacy")
+    BIT(7,  "extended scanner filter policies")
+    BIT(8,  "LE 2M PHY")
+    BIT(9,  "stable modulation index TX")
+    BIT(10, "stable modulation index RX")
+    BIT(11, "LE coded PHY")
+    BIT(12, "LE extended advertising")
+    BIT(13, "LE periodic advertising")
+    BIT(14, "channel selection algorithm #2")
+    BIT(15, "LE power class 1")
+    BIT(16, "min. number of used channels")
+    BIT(17, "CTE request")
+    BIT(18, "CTE response")
+    BIT(19, "connectionless CTE TX")
+    BIT(20, "connectionless CTE RX")
+    BIT(21, "antenna switching during CTE TX")
+    BIT(22, "antenna switching during CTE RX")
+    BIT(23, "receiving CTE")
+    BIT(24, "periodic adv. sync transfer send.")
+    BIT(25, "periodic adv. sync transfer recv.")
+    BIT(26, "sleep clock accuracy updates")
+    BIT(27, "remote public key validation")
+    BIT(28, "CIS central")
+    BIT(29, "CIS peripheral")
+    BIT(30, "isochronous broadcaster")
+    BIT(31, "synchronized receiver")
+    BIT(32, "isochronous channels (host)")
+    BIT(33, "LE power control request")
+    BIT(34, "LE power change indication")
+    BIT(35, "LE path loss monitoring")
+    BIT(36, "periodic adv. ADI support")
+    BIT(37, "connection subrating")
+    BIT(38, "connection subrating (host)")
+    BIT(39, "channel classification")
+};
+
+const struct bit_table le_features_table = TABLE(le_features_names, 36);
+
+
+// HCI supported commands, octet and bit as in the core spec
+static const struct bit_name commands_names[] = {
+    CMD(0, 0, "Inquiry")
+    CMD(0, 1, "Inquiry Cancel")
+    CMD(0, 2, "Periodic Inquiry Mode")
+    CMD(0, 3, "Exit Periodic Inquiry Mode")
+    CMD(0, 4, "Create Connection")
+    CMD(0, 5, "Disconnect")
+    CMD(0, 6, "Add SCO Connection")
+    CMD(0, 7, "Create Connection Cancel")
+    CMD(1, 0, "Accept Connection Request")
+    CMD(1, 1, "Reject Connection Request")
+    CMD(1, 2, "Link Key Request Reply")
+    CMD(1, 3, "Link Key Request Negative Reply")
+    CMD(1, 4, "PIN Code Request Reply")
+    CMD(1, 5, "PIN Code Request Negative Reply")
+    CMD(1, 6, "Change Connection Packet Type")
+    CMD(1, 7, "Authentication Requested")
+    CMD(2, 0, "Set Connection Encryption")
+    CMD(2, 1, "Change Connection Link Key")
+    CMD(2, 2, "Master Link Key")
+    CMD(2, 3, "Remote Name Request")
+    CMD(2, 4, "Remote Name Request Cancel")
+    CMD(2, 5, "Read Remote Supported Features")
+    CMD(2, 6, "Read Remote Extended Features")
+    CMD(2, 7, "Read Remote Version Information")
+    CMD(3, 0, "Read Clock Offset")
+    CMD(3, 1, "Read LMP Handle")
+    CMD(4, 1, "Hold Mode")
+    CMD(4, 2, "Sniff Mode")
+    CMD(4, 3, "Exit Sniff Mode")
+    CMD(4, 4, "Park State")
+    CMD(4, 5, "Exit Park State")
+    CMD(4, 6, "QoS Setup")
+    CMD(4, 7, "Role Discovery")
+    CMD(5, 0, "Switch Role")
+    CMD(5, 1, "Read Link Policy Settings")
+    CMD(5, 2, "Write Link Policy Settings")
+    CMD(5, 3, "Read Default Link Policy Settings")
+    CMD(5, 4, "Write Default Link Policy Settings")
+    CMD(5, 5, "Flow Specification")
+    CMD(5, 6, "Set Event Mask")
+    CMD(5, 7, "Reset")
+    CMD(6, 0, "Set Event Filter")
+    CMD(6, 1, "Flush")
+    CMD(6, 2, "Read PIN Type")
+    CMD(6, 3, "Write PIN Type")
+    CMD(6, 4, "Create New Unit Key")
+    CMD(6, 5, "Read Stored Link Key")
+    CMD(6, 6, "Write Stored Link Key")
+    CMD(6, 7, "Delete Stored Link Key")
+    CMD(7, 0, "Write Local Name")
+    CMD(7, 1, "Read Local Name")
+    CMD(7, 2, "Read Connection Accept Timeout")
+    CMD(7, 3, "Write Connection Accept Timeout")
+    CMD(7, 4, "Read Page Timeout")
+    CMD(7, 5, "Write Page Timeout")
+    CMD(7, 6, "Read Scan Enable")
+    CMD(7, 7, "Write Scan Enable")
+    CMD(8, 0, "Read Page Scan Activity")
+    CMD(8, 1, "Write Page Scan Activity")
+    CMD(8, 2, "Read Inquiry Scan Activity")
+    CMD(8, 3, "Write Inquiry Scan Activity")
+    CMD(8, 4, "Read Authentication Enable")
+    CMD(8, 5, "Write Authentication Enable")
+    CMD(8, 6, "Read Encryption Mode")
+    CMD(8, 7, "Write Encryption Mode")
+    CMD(9, 0, "Read Class Of Device")
+    CMD(9, 1, "Write Class Of Device")
+    CMD(9, 2, "Read Voice Setting")
+    CMD(9, 3, "Write Voice Setting")
+    CMD(9, 4, "Read Automatic Flush Timeout")
+    CMD(9, 5, "Write Automatic Flush Timeout")
+    CMD(9, 6, "Read Num Broadcast Retransmissions")
+    CMD(9, 7, "Write Num Broadcast Retransmissions")
+    CMD(10, 0, "Read Hold Mode Activity")
+    CMD(10, 1, "Write Hold Mode Activity")
+    CMD(10, 2, "Read Transmit Power Level")
+    CMD(10, 3, "Read Synchronous Flow Control Enable")
+    CMD(10, 4, "Write Synchronous Flow Control Enable")
+    CMD(10, 5, "Set Controller To Host Flow Control")
+    CMD(10, 6, "Host Buffer Size")
+    CMD(10, 7, "Host Number Of Completed Packets")
+    CMD(11, 0, "Read Link Supervision Timeout")
+    CMD(11, 1, "Write Link Supervision Timeout")
+    CMD(11, 2, "Read Number of Supported IAC")
+    CMD(11, 3, "Read Current IAC LAP")
+    CMD(11, 4, "Write Current IAC LAP")
+    CMD(11, 5, "Read Page Scan Mode Period")
+    CMD(11, 6, "Write Page Scan Mode Period")
+    CMD(11, 7, "Read Page Scan Mode")
+    CMD(12, 0, "Write Page Scan Mode")
+    CMD(12, 1, "Set AFH Host Channel Classification")
+    CMD(12, 4, "Read Inquiry Scan Type")
+    CMD(12, 5, "Write Inquiry Scan Type")
+    CMD(12, 6, "Read Inquiry Mode")
+    CMD(12, 7, "Write Inquiry Mode")
+    CMD(13, 0, "Read Page Scan Type")
+    CMD(13, 1, "Write Page Scan Type")
+    CMD(13, 2, "Read AFH Channel Assessment Mode")
+    CMD(13, 3, "Write AFH Channel Assessment Mode")
+    CMD(14, 3, "Read Local Version Information")
+    CMD(14, 5, "Read Local Supported Features")
+    CMD(14, 6, "Read Local Extended Features")
+    CMD(14, 7, "Read Buffer Size")
+    CMD(15, 0, "Read Country Code")
+    CMD(15, 1, "Read BD ADDR")
+    CMD(15, 2, "Read Failed Contact Counter")
+    CMD(15, 3, "Reset Failed Contact Counter")
+    CMD(15, 4, "Read Link Quality")
+    CMD(15, 5, "Read RSSI")
+    CMD(15, 6, "Read AFH Channel Map")
+    CMD(15, 7, "Read Clock")
+    CMD(16, 0, "Read Loopback Mode")
+    CMD(16, 1, "Write Loopback Mode")
+    CMD(16, 2, "Enable Device Under Test Mode")
+    CMD(16, 3, "Setup Synchronous Connection")
+    CMD(16, 4, "Accept Synchronous Connection Request")
+    CMD(16, 5, "Reject Synchronous Connection Request")
+    CMD(17, 0, "Read Extended Inquiry Response")
+    CMD(17, 1, "Write Extended Inquiry Response")
+    CMD(17, 2, "Refresh Encryption Key")
+    CMD(17, 4, "Sniff Subrating")
+    CMD(17, 5, "Read Simple Pairing Mode")
+    CMD(17, 6, "Write Simple Pairing Mode")
+    CMD(17, 7, "Read Local OOB Data")
+    CMD(18, 0, "Read Inquiry Response Transmit Power Level")
+    CMD(18, 1, "Write Inquiry Transmit Power Level")
+    CMD(18, 2, "Read Default Erroneous Data Reporting")
+    CMD(18, 3, "Write Default Erroneous Data Reporting")
+    CMD(18, 7, "IO Capability Request Reply")
+    CMD(19, 0, "User Confirmation Request Reply")
+    CMD(19, 1, "User Confirmation Request Negative Reply")
+    CMD(19, 2, "User Passkey Request Reply")
+    CMD(19, 3, "User Passkey Request Negative Reply")
+    CMD(19, 4, "Remote OOB Data Request Reply")
+    CMD(19, 5, "Write Simple Pairing Debug Mode")
+    CMD(19, 6, "Enhanced Flush")
+    CMD(19, 7, "Remote OOB Data Request Negative Reply")
+    CMD(20, 2, "Send Keypress Notification")
+    CMD(20, 3, "IO Capability Request Negative Reply")
+    CMD(20, 4, "Read Encryption Key Size")
+    CMD(21, 0, "Create Physical Link")
+    CMD(21, 1, "Accept Physical Link")
+    CMD(21, 2, "Disconnect Physical Link")
+    CMD(21, 3, "Create Logical Link")
+    CMD(21, 4, "Accept Logical Link")
+    CMD(21, 5, "Disconnect Logical Link")
+    CMD(21, 6, "Logical Link Cancel")
+    CMD(21, 7, "Flow Spec Modify")
+    CMD(22, 0, "Read Logical Link Accept Timeout")
+    CMD(22, 1, "Write Logical Link Accept Timeout")
+    CMD(22, 2, "Set Event Mask Page 2")
+    CMD(22, 3, "Read Location Data")
+    CMD(22, 4, "Write Location Data")
+    CMD(22, 5, "Read Local AMP Info")
+    CMD(22, 6, "Read Local AMP ASSOC")
+    CMD(22, 7, "Write Remote AMP ASSOC")
+    CMD(23, 0, "Read Flow Control Mode")
+    CMD(23, 1, "Write Flow Control Mode")
+    CMD(23, 2, "Read Data Block Size")
+    CMD(23, 5, "Enable AMP Receiver Reports")
+    CMD(23, 6, "AMP Test End")
+    CMD(23, 7, "AMP Test")
+    CMD(24, 0, "Read Enhanced Transmit Power Level")
+    CMD(24, 2, "Read Best Effort Flush Timeout")
+    CMD(24, 3, "Write Best Effort Flush Timeout")
+    CMD(24, 4, "Short Range Mode")
+    CMD(24, 5, "Read LE Host Supported")
+    CMD(24, 6, "Write LE Host Supported")
+    CMD(25, 0, "LE Set Event Mask")
+    CMD(25, 1, "LE Read Buffer Size")
+    CMD(25, 2, "LE Read Local Supported Features")
+    CMD(25, 4, "LE Set Random Address")
+    CMD(25, 5, "LE Set Advertising Parameters")
+    CMD(25, 6, "LE Read Advertising Channel TX Power")
+    CMD(25, 7, "LE Set Advertising Data")
+    CMD(26, 0, "LE Set Scan Response Data")
+    CMD(26, 1, "LE Set Advertise Enable")
+    CMD(26, 2, "LE Set Scan Parameters")
+    CMD(26, 3, "LE Set Scan Enable")
+    CMD(26, 4, "LE Create Connection")
+    CMD(26, 5, "LE Create Connection Cancel")
+    CMD(26, 6, "LE Read White List Size")
+    CMD(26, 7, "LE Clear White List")
+    CMD(27, 0, "LE Add Device To White List")
+    CMD(27, 1, "LE Remove Device From White List")
+    CMD(27, 2, "LE Connection Update")
+    CMD(27, 3, "LE Set Host Channel Classification")
+    CMD(27, 4, "LE Read Channel Map")
+    CMD(27, 5, "LE Read Remote Used Features")
+    CMD(27, 6, "LE Encrypt")
+    CMD(27, 7, "LE Rand")
+    CMD(28, 0, "LE Start Encryption")
+    CMD(28, 1, "LE Long Term Key Request Reply")
+    CMD(28, 2, "LE Long Term Key Request Negative Reply")
+    CMD(28, 3, "LE Read Supported States")
+    CMD(28, 4, "LE Receiver Test")
+    CMD(28, 5, "LE Transmitter Test")
+    CMD(28, 6, "LE Test End")
+    CMD(29, 3, "Enhanced Setup Synchronous Connection")
+    CMD(29, 4, "Enhanced Accept Synchronous Connection")
+    CMD(29, 5, "Read Local Supported Codecs")
+    CMD(29, 6, "Set MWS Channel Parameters")
+    CMD(29, 7, "Set External Frame Configuration")
+    CMD(30, 0, "Set MWS Signaling")
+    CMD(30, 1, "Set MWS Transport Layer")
+    CMD(30, 2, "Set MWS Scan Frequency Table")
+    CMD(30, 3, "Get MWS Transport Layer Configuration")
+    CMD(30, 4, "Set MWS PATTERN Configuration")
+    CMD(30, 5, "Set Triggered Clock Capture")
+    CMD(30, 6, "Truncated Page")
+    CMD(30, 7, "Truncated Page Cancel")
+    CMD(31, 0, "Set Connectionless Slave Broadcast")
+    CMD(31, 1, "Set Connectionless Slave Broadcast Receive")
+    CMD(31, 2, "Start Synchronization Train")
+    CMD(31, 3, "Receive Synchronization Train")
+    CMD(31, 4, "Set Reserved LT_ADDR")
+    CMD(31, 5, "Delete Reserved LT_ADDR")
+    CMD(31, 6, "Set Connectionless Slave Broadcast Data")
+    CMD(31, 7, "Read Synchronization Train Parameters")
+    CMD(32, 0, "Write Synchronization Train Parameters")
+    CMD(32, 1, "Remote OOB Extended Data Request Reply")
+    CMD(32, 2, "Read Secure Connections Host Support")
+    CMD(32, 3, "Write Secure Connections Host Support")
+    CMD(32, 4, "Read Authenticated Payload Timeout")
+    CMD(32, 5, "Write Authenticated Payload Timeout")
+    CMD(32, 6, "Read Local OOB Extended Data")
+    CMD(32, 7, "Write Secure Connections Test Mode")
+    CMD(33, 0, "Read Extended Page Timeout")
+    CMD(33, 1, "Write Extended Page Timeout")
+    CMD(33, 2, "Read Extended Inquiry Length")
+    CMD(33, 3, "Write Extended Inquiry Length")
+    CMD(33, 4, "LE Remote Connection Parameter Request Reply")
+    CMD(33, 5, "LE Remote Connection Parameter Request Negative Reply")
+    CMD(33, 6, "LE Set Data Length")
+    CMD(33, 7, "LE Read Suggested Default Data Length")
+    CMD(34, 0, "LE Write Suggested Default Data Length")
+    CMD(34, 1, "LE Read Local P-256 Public Key")
+    CMD(34, 2, "LE Generate DHKey")
+    CMD(34, 3, "LE Add Device To Resolving List")
+    CMD(34, 4, "LE Remove Device From Resolving List")
+    CMD(34, 5, "LE Clear Resolving List")
+    CMD(34, 6, "LE Read Resolving List Size")
+    CMD(34, 7, "LE Read Peer Resolvable Address")
+    CMD(35, 0, "LE Read Local Resolvable Address")
+    CMD(35, 1, "LE Set Address Resolution Enable")
+    CMD(35, 2, "LE Set Resolvable Private Address Timeout")
+    CMD(35, 3, "LE Read Maximum Data Length")
+    CMD(35, 4, "LE Read PHY")
+    CMD(35, 5, "LE Set Default PHY")
+    CMD(35, 6, "LE Set PHY")
+    CMD(35, 7, "LE Enhanced Receiver Test")
+    CMD(36, 0, "LE Enhanced Transmitter Test")
+    CMD(36, 1, "LE Set Advertising Set Random Address")
+    CMD(36, 2, "LE Set Extended Advertising Parameters")
+    CMD(36, 3, "LE Set Extended Advertising Data")
+    CMD(36, 4, "LE Set Extended Scan Response Data")
+    CMD(36, 5, "LE Set Extended Advertising Enable")
+    CMD(36, 6, "LE Read Maximum Advertising Data Length")
+    CMD(36, 7, "LE Read Number of Supported Advertising Sets")
+    CMD(37, 0, "LE Remove Advertising Set")
+    CMD(37, 1, "LE Clear Advertising Sets")
+    CMD(37, 2, "LE Set Periodic Advertising Parameters")
+    CMD(37, 3, "LE Set Periodic Advertising Data")
+    CMD(37, 4, "LE Set Periodic Advertising Enable")
+    CMD(37, 5, "LE Set Extended Scan Parameters")
+    CMD(37, 6, "LE Set Extended Scan Enable")
+    CMD(37, 7, "LE Extended Create Connection")
+    CMD(38, 0, "LE Periodic Advertising Create Sync")
+    CMD(38, 1, "LE Periodic Advertising Create Sync Cancel")
+    CMD(38, 2, "LE Periodic Advertising Terminate Sync")
+    CMD(38, 3, "LE Add Device To Periodic Advertiser List")
+    CMD(38, 4, "LE Remove Device From Periodic Advertiser List")
+    CMD(38, 5, "LE Clear Periodic Advertiser List")
+    CMD(38, 6, "LE Read Periodic Advertiser List Size")
+    CMD(38, 7, "LE Read Transmit Power")
+    CMD(39, 0, "LE Read RF Path Compensation")
+    CMD(39, 1, "LE Write RF Path Compensation")
+    CMD(39, 2, "LE Set Privacy Mode")
+};
+
+const struct bit_table commands_table = TABLE(commands_names, 56);
+
+
+// from bluez v1.13 lib/hci.c
+static const struct bit_name acl_ptype_names[] = {
+    MASK(HCI_DM1,  "DM1")
+    MASK(HCI_DM3,  "DM3")
+    MASK(HCI_DM5,  "DM5")
+    MASK(HCI_DH1,  "DH1")
+    MASK(HCI_DH3,  "DH3")
+    MASK(HCI_DH5,  "DH5")
+    MASK(HCI_HV1,  "HV1")
+    MASK(HCI_HV2,  "HV2")
+    MASK(HCI_HV3,  "HV3")
+    MASK(HCI_2DH1, "2-DH1")
+    MASK(HCI_2DH3, "2-DH3")
+    MASK(HCI_2DH5, "2-DH5")
+    MASK(HCI_3DH1, "3-DH1")
+    MASK(HCI_3DH3, "3-DH3")
+    MASK(HCI_3DH5, "3-DH5")
+};
+
+const struct bit_table acl_ptype_table = TABLE(acl_ptype_names, 8);
+
+
+// from bluez v1.13 lib/hci.c
+static const struct bit_name sco_ptype_names[] = {
+    MASK(0x0001,   "HV1")
+    MASK(0x0002,   "HV2")
+    MASK(0x0004,   "HV3")
+    MASK(HCI_EV3,  "EV3")
+    MASK(HCI_EV4,  "EV4")
+    MASK(HCI_EV5,  "EV5")
+    MASK(HCI_2EV3, "2-EV3")
+    MASK(HCI_2EV5, "2-EV5")
+    MASK(HCI_3EV3, "3-EV3")
+    MASK(HCI_3EV5, "3-EV5")
+};
+
+const struct bit_table sco_ptype_table = TABLE(sco_ptype_names, 8);
+
+
+static const struct bit_name link_policy_names[] = {
+    MASK(HCI_LP_RSWITCH, "HCI_LP_RSWITCH")
+    MASK(HCI_LP_HOLD,    "HCI_LP_HOLD")
+    MASK(HCI_LP_SNIFF,   "HCI_LP_SNIFF")
+    MASK(HCI_LP_PARK,    "HCI_LP_PARK")
+};
+
+const struct bit_table link_policy_table = TABLE(link_policy_names, 16);
+
+
+
+// return parameters ------------------------------------------------------
+
+void decode_local_version(struct hci_version* ver, const read_local_version_rp* rp)
+{
+    ver->manufacturer = btohs(rp->manufacturer);
+    ver->hci_ver      = rp->hci_ver;
+    ver->hci_rev      = btohs(rp->hci_rev);
+    ver->lmp_ver      = rp->lmp_ver;
+    ver->lmp_subver   = btohs(rp->lmp_subver);
+}
+
+
+void decode_local_commands(struct adapter_caps* caps, const read_local_commands_rp* rp)
+{
+    memcpy(caps->commands, rp->commands, sizeof(caps->commands));
+    caps->have_commands = 1;
+}
+
+
+void decode_buffer_size(struct adapter_caps* caps, const read_buffer_size_rp* rp)
+{
+    caps->acl_mtu          = btohs(rp->acl_mtu);
+    caps->sco_mtu          = rp->sco_mtu;
+    caps->acl_max_pkt      = btohs(rp->acl_max_pkt);
+    caps->sco_max_pkt      = btohs(rp->sco_max_pkt);
+    caps->have_buffer_size = 1;
+}
+
+
+int decode_ext_features(struct adapter_caps* caps, const read_local_ext_features_rp* rp)
+{
+    if (rp->page_num >= MAX_EXT_FEATURE_PAGES)
+        return -1;
+
+    memcpy(caps->ext_features[rp->page_num], rp->features, 8);
+    caps->ext_page_mask |= 1 << rp->page_num;
+    caps->max_ext_page   = rp->max_page_num;
+    return rp->page_num;
+}
+
+
+void decode_le_features(struct adapter_caps* caps, const le_read_local_supported_features_rp* rp)
+{
+    memcpy(caps->le_features, rp->features, 8);
+    caps->have_le_features = 1;
+}
+
+
+void decode_le_buffer_size(struct adapter_caps* caps, const le_read_buffer_size_rp* rp)
+{
+    caps->le_acl_mtu          = btohs(rp->pkt_len);
+    caps->le_max_pkt          = rp->max_pkt;
+    caps->have_le_buffer_size = 1;
+}
@@ -0,0 +1,141 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "adapter.h"
+
+
+// Name tables for the bitmaps the controller and the kernel report. Each
+// table is indexed by bit number and generated at compile time, including
+// the display width of every name, so decoding needs neither strlen() nor
+// a test per table entry: only the set bits are visited.
+
+struct bit_name {
+    const char*  name;     // NULL for bits without a meaning
+    uint8_t      width;    // strlen(name)
+};
+
+struct bit_table {
+    const struct bit_name*  names;
+    uint16_t                nbits;
+    uint8_t                 column;   // names are padded to this width
+};
+
+extern const struct bit_table dev_flags_table;
+extern const struct bit_table lmp_features_table;        // page 0
+extern const struct bit_table lmp_ext_features_tables[]; // index = page
+extern const int              lmp_ext_features_pages;
+extern const struct bit_table le_features_table;
+extern const struct bit_table commands_table;
+extern const struct bit_table acl_ptype_table;
+extern const struct bit_table sco_ptype_table;
+extern const struct bit_table link_policy_table;
+
+
+static inline const char* bit_table_name(const struct bit_table* table, int bit)
+{
+    return bit < table->nbits ? table->names[bit].name : NULL;
+}
+
+
+// walks the set bits of a little endian bitmap or a plain integer value
+struct bit_iter {
+    const uint8_t*  bitmap;
+    int             nbytes;
+    int             base;      // bit number of bit 0 of word
+    uint64_t        word;      // bits not visited yet
+};
+
+static inline uint64_t bit_iter_load(const uint8_t* bitmap, int nbytes, int offset)
+{
+    uint64_t word = 0;
+    int i;
+
+    if (nbytes - offset >= 8) {
+        memcpy(&word, bitmap + offset, 8);
+        return le64toh(word);
+    }
+
+    for (i = nbytes - offset - 1; i >= 0; i--)
+        word = (word << 8) | bitmap[offset + i];
+    return word;
+}
+
+static inline void bit_iter_init(struct bit_iter* it, const void* bitmap, int nbytes)
+{
+    it->bitmap = bitmap;
+    it->nbytes = nbytes;
+    it->base   = 0;
+    it->word   = nbytes > 0 ? bit_iter_load(bitmap, nbytes, 0) : 0;
+}
+
+static inline void bit_iter_init_value(struct bit_iter* it, uint64_t value)
+{
+    it->bitmap = NULL;
+    it->nbytes = 8;
+    it->base   = 0;
+    it->word   = value;
+}
+
+// next set bit, or -1 when there is none left
+static inline int bit_iter_next(struct bit_iter* it)
+{
+    int bit;
+
+    while (it->word == 0) {
+        it->base += 64;
+        if (!it->bitmap || it->base >= it->nbytes * 8)
+            return -1;
+        it->word = bit_iter_load(it->bitmap, it->nbytes, it->base / 8);
+    }
+
+    bit = it->base + __builtin_ctzll(it->word);
+    it->word &= it->word - 1;
+    return bit;
+}
+
+static inline int bitmap_test(const uint8_t* bitmap, int bit)
+{
+    return (bitmap[bit >> 3] >> (bit & 7)) & 1;
+}
+
+
+// Return parameters of the capability commands (status byte included),
+// decoded into an adapter's version and caps; shared by the live probe
+// and the capture analyzer.
+void decode_local_version(struct hci_version* ver, const read_local_version_rp* rp);
+void decode_local_commands(struct adapter_caps* caps, const read_local_commands_rp* rp);
+void decode_buffer_size(struct adapter_caps* caps, const read_buffer_size_rp* rp);
+// returns the page, or -1 if it is beyond MAX_EXT_FEATURE_PAGES
+int  decode_ext_features(struct adapter_caps* caps, const read_local_ext_features_rp* rp);
+void decode_le_features(struct adapter_caps* caps, const le_read_local_supported_features_rp* rp);
+void decode_le_buffer_size(struct adapter_caps* caps, const le_read_buffer_size_rp* rp);
+
+#endif
@@ -0,0 +1,674 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "deadline.h"
+#include "decode.h"
+#include "exporter.h"
+#include "hci_pipeline.h"
+#include "output.h"
+#include "watch.h"
+
+
+#define CONTENT_TYPE "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+// scrapes served at once; more wait in the listen backlog
+#define MAX_SCRAPES    64
+// a client that has not sent its request by then, or stops reading the
+// reply for as long, is dropped
+#define SCRAPE_IDLE_MS 2000
+// no new connections for this long when out of file descriptors
+#define ACCEPT_BACKOFF_MS 100
+
+// a pre-rendered HTTP response; readers counts the scrapes copying it
+struct snapshot {
+    struct outbuf  response;
+    int            readers;
+};
+
+// one exported adapter; the counters are widened to 64 bit like in --watch
+struct exporter_adapter {
+    struct hci_dev_info   di;
+    struct watch_adapter  stats;
+};
+
+struct exporter {
+    struct exporter_source*  source;
+    double                   interval;
+    struct snapshot          snapshots[2];
+    struct snapshot*         current;      // the published snapshot
+
+    struct exporter_adapter  adapters[EXPORTER_MAX_ADAPTERS];
+    int                      count;
+    struct outbuf            body;
+};
+
+// hci_dev_stats counters exported as one counter family each; a direction
+// of -1 does not exist for the family
+static const struct {
+    const char*  name;
+    const char*  help;
+    int          rx;
+    int          tx;
+} counter_families[] = {
+    { "bluetooth_adapter_errors",       "Receive and transmit errors.", ERR_RX,  ERR_TX  },
+    { "bluetooth_adapter_hci_commands", "HCI commands sent.",           -1,      CMD_TX  },
+    { "bluetooth_adapter_hci_events",   "HCI events received.",         EVT_RX,  -1      },
+    { "bluetooth_adapter_acl_packets",  "ACL data packets.",            ACL_RX,  ACL_TX  },
+    { "bluetooth_adapter_sco_packets",  "SCO data packets.",            SCO_RX,  SCO_TX  },
+    { "bluetooth_adapter_bytes",        "Bytes of data transferred.",   BYTE_RX, BYTE_TX },
+};
+
+
+static int sample_live(struct exporter_source* source, struct hci_dev_info* adapters, int max)
+{
+    struct hci_dev_req* devs;
+    int i, count = 0;
+    int num = transport_dev_snapshot(source->transport, &devs);
+
+    if (num < 0)
+        return -1;
+
+    for (i = 0; i < num && count < max; i++) {
+        // adapters removed in between are skipped
+        if (transport_dev_info(source->transport, devs[i].dev_id, &adapters[count]) == 0)
+            count++;
+    }
+
+    free(devs);
+    return count;
+}
+
+
+static int version_live(struct exporter_source* source, int dev_id, struct hci_version* ver)
+{
+    read_local_version_rp rp;
+    struct transport_dev dev;
+    struct hci_pipeline pipeline;
+    int ret;
+
+    if (transport_open(source->transport, dev_id, &dev) < 0)
+        return -1;
+
+    hci_pipeline_init(&pipeline, &dev);
+    hci_pipeline_add(&pipeline, OGF_INFO_PARAM, OCF_READ_LOCAL_VERSION,
+                     NULL, 0, &rp, READ_LOCAL_VERSION_RP_SIZE, NULL, NULL);
+    ret = hci_pipeline_run(&pipeline, 1000);
+    transport_close(&dev);
+
+    if (ret < 0 || pipeline.cmds[0].state != HCI_CMD_DONE)
+        return -1;
+
+    decode_local_version(ver, &rp);
+    return 0;
+}
+
+
+void exporter_source_live(struct exporter_source* source, struct transport* transport)
+{
+    memset(source, 0x00, sizeof(*source));
+    source->sample    = sample_live;
+    source->version   = version_live;
+    source->transport = transport;
+}
+
+
+static void print_label_value(struct outbuf* out, const char* value)
+{
+    for (; *value; value++) {
+        if (*value == '"' || *value == '\\')
+            out_printf(out, "\\%c", *value);
+        else if (*value == '\n')
+            out_write(out, "\\n", 2);
+        else
+            out_write(out, value, 1);
+    }
+}
+
+
+static void render(struct exporter* ex, double timestamp, double duration)
+{
+    struct outbuf* out = &ex->body;
+    unsigned int f;
+    int i;
+
+    out->len = 0;
+
+    out_printf(out, "# TYPE bluetooth_adapter info\n"
+                    "# HELP bluetooth_adapter Bluetooth adapters known to the kernel.\n");
+    for (i = 0; i < ex->count; i++) {
+        struct hci_dev_info* di = &ex->adapters[i].di;
+        char addr[18];
+
+        ba2str(&di->bdaddr, addr);
+        out_printf(out, "bluetooth_adapter_info{adapter=\"hci%d\",address=\"%s\",name=\"",
+                   di->dev_id, addr);
+        print_label_value(out, di->name);
+        out_printf(out, "\",bus=\"%s\"} 1\n", hci_bustostr(di->type & 0x0f));
+    }
+
+    out_printf(out, "# TYPE bluetooth_adapter_up gauge\n"
+                    "# HELP bluetooth_adapter_up Whether the adapter is up.\n");
+    for (i = 0; i < ex->count; i++) {
+        struct hci_dev_info* di = &ex->adapters[i].di;
+        out_printf(out, "bluetooth_adapter_up{adapter=\"hci%d\"} %d\n",
+                   di->dev_id, hci_test_bit(HCI_UP, &di->flags) != 0);
+    }
+
+    out_printf(out, "# TYPE bluetooth_adapter_buffer_mtu_bytes gauge\n"
+                    "# UNIT bluetooth_adapter_buffer_mtu_bytes bytes\n"
+                    "# HELP bluetooth_adapter_buffer_mtu_bytes Size of the controller's data buffers.\n");
+    for (i = 0; i < ex->count; i++) {
+        struct hci_dev_info* di = &ex->adapters[i].di;
+        out_printf(out, "bluetooth_adapter_buffer_mtu_bytes{adapter=\"hci%d\",link=\"acl\"} %u\n"
+                        "bluetooth_adapter_buffer_mtu_bytes{adapter=\"hci%d\",link=\"sco\"} %u\n",
+                   di->dev_id, di->acl_mtu, di->dev_id, di->sco_mtu);
+    }
+
+    out_printf(out, "# TYPE bluetooth_adapter_buffer_packets gauge\n"
+                    "# HELP bluetooth_adapter_buffer_packets Number of the controller's data buffers.\n");
+    for (i = 0; i < ex->count; i++) {
+        struct hci_dev_info* di = &ex->adapters[i].di;
+        out_printf(out, "bluetooth_adapter_buffer_packets{adapter=\"hci%d\",link=\"acl\"} %u\n"
+                        "bluetooth_adapter_buffer_packets{adapter=\"hci%d\",link=\"sco\"} %u\n",
+                   di->dev_id, di->acl_pkts, di->dev_id, di->sco_pkts);
+    }
+
+    for (f = 0; f < sizeof(counter_families) / sizeof(counter_families[0]); f++) {
+        out_printf(out, "# TYPE %s counter\n# HELP %s %s\n",
+                   counter_families[f].name, counter_families[f].name, counter_families[f].help);
+        for (i = 0; i < ex->count; i++) {
+            struct exporter_adapter* adapter = &ex->adapters[i];
+
+            if (counter_families[f].rx >= 0)
+                out_printf(out, "%s_total{adapter=\"hci%d\",direction=\"rx\"} %llu\n",
+                           counter_families[f].name, adapter->di.dev_id,
+                           (unsigned long long) adapter->stats.total[counter_families[f].rx]);
+            if (counter_families[f].tx >= 0)
+                out_printf(out, "%s_total{adapter=\"hci%d\",direction=\"tx\"} %llu\n",
+                           counter_families[f].name, adapter->di.dev_id,
+                           (unsigned long long) adapter->stats.total[counter_families[f].tx]);
+        }
+    }
+
+    out_printf(out, "# TYPE bluetooth_exporter_last_sample_timestamp_seconds gauge\n"
+                    "# UNIT bluetooth_exporter_last_sample_timestamp_seconds seconds\n"
+                    "bluetooth_exporter_last_sample_timestamp_seconds %.3f\n"
+                    "# TYPE bluetooth_exporter_sample_duration_seconds gauge\n"
+                    "# UNIT bluetooth_exporter_sample_duration_seconds seconds\n"
+                    "bluetooth_exporter_sample_duration_seconds %.6f\n"
+                    "# EOF\n", timestamp, duration);
+}
+
+
+// renders the response into the buffer scrapes do not see and swaps it in
+static void publish(struct exporter* ex)
+{
+    struct snapshot* front = __atomic_load_n(&ex->current, __ATOMIC_SEQ_CST);
+    struct snapshot* back = front == &ex->snapshots[0] ? &ex->snapshots[1] : &ex->snapshots[0];
+
+    // scrapes that picked up the back buffer before the last swap; they
+    // only copy it, so this is short
+    while (__atomic_load_n(&back->readers, __ATOMIC_SEQ_CST) > 0)
+        sched_yield();
+
+    back->response.len = 0;
+    out_printf(&back->response,
+               "HTTP/1.0 200 OK\r\n"
+               "Content-Type: " CONTENT_TYPE "\r\n"
+               "Content-Length: %zu\r\n"
+               "\r\n", ex->body.len);
+    out_write(&back->response, ex->body.data, ex->body.len);
+
+    __atomic_store_n(&ex->current, back, __ATOMIC_SEQ_CST);
+}
+
+
+// copies the published response; this is all a scrape does with it
+static void copy_snapshot(struct exporter* ex, struct outbuf* out)
+{
+    struct snapshot* snapshot;
+
+    while (1) {
+        snapshot = __atomic_load_n(&ex->current, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&snapshot->readers, 1, __ATOMIC_SEQ_CST);
+        // still published, so the sampler will not write it
+        if (__atomic_load_n(&ex->current, __ATOMIC_SEQ_CST) == snapshot)
+            break;
+        __atomic_fetch_sub(&snapshot->readers, 1, __ATOMIC_SEQ_CST);
+    }
+
+    out->len = 0;
+    out_write(out, snapshot->response.data, snapshot->response.len);
+
+    __atomic_fetch_sub(&snapshot->readers, 1, __ATOMIC_SEQ_CST);
+}
+
+
+static struct exporter_adapter* find_adapter(struct exporter_adapter* adapters, int count, int dev_id)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        if (adapters[i].di.dev_id == dev_id)
+            return &adapters[i];
+    return NULL;
+}
+
+
+static void sample(struct exporter* ex)
+{
+    static struct hci_dev_info devs[EXPORTER_MAX_ADAPTERS];
+    static struct exporter_adapter adapters[EXPORTER_MAX_ADAPTERS];
+    struct timespec start, end, now;
+    unsigned int c;
+    int count, i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    count = ex->source->sample(ex->source, devs, EXPORTER_MAX_ADAPTERS);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    // on errors the last sample stays published
+    if (count < 0)
+        return;
+
+    // adapters keep their counters across samples, removed ones are dropped
+    for (i = 0; i < count; i++) {
+        struct exporter_adapter* old = find_adapter(ex->adapters, ex->count, devs[i].dev_id);
+        struct exporter_adapter* adapter = &adapters[i];
+
+        if (old) {
+            *adapter = *old;
+        } else {
+            memset(adapter, 0x00, sizeof(*adapter));
+            adapter->stats.dev_id = devs[i].dev_id;
+        }
+
+        adapter->di = devs[i];
+        watch_update(&adapter->stats, &devs[i].stat);
+        // a new adapter starts with what the kernel counted so far
+        if (!old)
+            for (c = 0; c < WATCH_NUM_COUNTERS; c++)
+                adapter->stats.total[c] = adapter->stats.last[c];
+    }
+
+    memcpy(ex->adapters, adapters, count * sizeof(adapters[0]));
+    ex->count = count;
+
+    render(ex, now.tv_sec + now.tv_nsec / 1e9,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    publish(ex);
+}
+
+
+static void* sampler(void* arg)
+{
+    struct exporter* ex = arg;
+    struct timespec tick, now;
+    long interval_ns = (long) (ex->interval * 1e9);
+
+    clock_gettime(CLOCK_MONOTONIC, &tick);
+
+    while (1) {
+        // absolute deadlines keep the sampling period free of drift
+        tick.tv_nsec += interval_ns % 1000000000L;
+        tick.tv_sec  += interval_ns / 1000000000L + tick.tv_nsec / 1000000000L;
+        tick.tv_nsec %= 1000000000L;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > tick.tv_sec || (now.tv_sec == tick.tv_sec && now.tv_nsec > tick.tv_nsec))
+            tick = now;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tick, NULL) == EINTR)
+            ;
+
+        sample(ex);
+    }
+
+    return NULL;
+}
+
+
+int listen_unix(const char* path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0x00, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        // a socket file nobody listens on is left over from an earlier run
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int stale = errno == EADDRINUSE && probe >= 0 &&
+                    connect(probe, (struct sockaddr*) &addr, sizeof(addr)) < 0 &&
+                    errno == ECONNREFUSED;
+
+        if (probe >= 0)
+            close(probe);
+        if (!stale || unlink(path) < 0 ||
+            bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+            if (!stale)
+                errno = EADDRINUSE;
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (listen(fd, 16) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+static int listen_tcp(const char* address)
+{
+    struct sockaddr_in addr;
+    const char* port = strrchr(address, ':');
+    char host[64] = "127.0.0.1";
+    int fd, on = 1;
+
+    if (port) {
+        if ((size_t) (port - address) >= sizeof(host)) {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy(host, address, port - address);
+        host[port - address] = 0;
+        port++;
+    } else {
+        port = address;
+    }
+
+    memset(&addr, 0x00, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(port));
+    if (strcmp(host, "localhost") == 0)
+        strcpy(host, "127.0.0.1");
+    if (atoi(port) <= 0 || inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+// one connection: its request as far as it came in, then the reply as far
+// as it went out
+struct scrape {
+    int            fd;         // -1 = free
+    uint64_t       deadline;   // dropped when it passes without progress
+    char           request[1024];
+    size_t         len;
+    int            replying;
+    struct outbuf  reply;
+    size_t         sent;
+};
+
+
+// reads what the client sent; once the request is complete, the reply is
+// ready to go: everything but GET /metrics (or /) is refused. -1 when the
+// connection is done with.
+static int scrape_read(struct exporter* ex, struct scrape* scrape)
+{
+    static const char not_found[] =
+        "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+    ssize_t n;
+
+    n = recv(scrape->fd, scrape->request + scrape->len,
+             sizeof(scrape->request) - 1 - scrape->len, 0);
+    if (n < 0)
+        return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    if (n == 0)
+        return -1;
+    scrape->len += n;
+    scrape->request[scrape->len] = 0;
+
+    if (!strstr(scrape->request, "\r\n\r\n") && !strstr(scrape->request, "\n\n") &&
+            scrape->len < sizeof(scrape->request) - 1)
+        return 0;
+
+    if (strncmp(scrape->request, "GET /metrics ", 13) != 0 &&
+            strncmp(scrape->request, "GET / ", 6) != 0) {
+        scrape->reply.len = 0;
+        out_write(&scrape->reply, not_found, sizeof(not_found) - 1);
+    } else {
+        copy_snapshot(ex, &scrape->reply);
+    }
+    scrape->replying = 1;
+    scrape->sent     = 0;
+    return 0;
+}
+
+
+// sends as much of the reply as the socket takes; -1 when it is all out
+// or the client is gone
+static int scrape_write(struct scrape* scrape)
+{
+    ssize_t n = send(scrape->fd, scrape->reply.data + scrape->sent,
+                     scrape->reply.len - scrape->sent, MSG_NOSIGNAL);
+
+    if (n < 0)
+        return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    scrape->sent += n;
+    return scrape->sent == scrape->reply.len ? -1 : 0;
+}
+
+
+static void scrape_close(struct scrape* scrape)
+{
+    close(scrape->fd);
+    scrape->fd = -1;
+}
+
+
+// takes the pending connections into free scrapes. Out of file
+// descriptors, the one in front is accepted on the spare descriptor and
+// dropped, and accepting pauses a little, instead of polling the same
+// pending connection over and over.
+static void accept_scrapes(int fd, struct scrape* scrapes, int* spare, uint64_t* paused)
+{
+    int conn, i;
+
+    for (i = 0; i < MAX_SCRAPES; i++) {
+        if (scrapes[i].fd >= 0)
+            continue;
+
+        conn = accept(fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EMFILE || errno == ENFILE) {
+                if (*spare >= 0) {
+                    close(*spare);
+                    conn = accept(fd, NULL, NULL);
+                    if (conn >= 0)
+                        close(conn);
+                    *spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                }
+                *paused = deadline_after(ACCEPT_BACKOFF_MS, 0);
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+                       errno != ECONNABORTED) {
+                fprintf(stderr, "Can't accept: %s (%d)\n", strerror(errno), errno);
+            }
+            return;
+        }
+
+        fcntl(conn, F_SETFL, fcntl(conn, F_GETFL) | O_NONBLOCK);
+        fcntl(conn, F_SETFD, FD_CLOEXEC);
+        scrapes[i].fd       = conn;
+        scrapes[i].deadline = deadline_after(SCRAPE_IDLE_MS, 0);
+        scrapes[i].len      = 0;
+        scrapes[i].replying = 0;
+    }
+}
+
+
+// Scrapes are served by one poll loop over non-blocking sockets, so a
+// client that connects and sends nothing holds up no other scrape.
+int exporter_run(struct exporter_source* source, const char* address, double interval)
+{
+    static struct exporter ex;
+    static struct scrape scrapes[MAX_SCRAPES];
+    struct pollfd pfds[MAX_SCRAPES + 1];
+    int slots[MAX_SCRAPES + 1];
+    uint64_t paused = 0;
+    pthread_t thread;
+    int fd, spare, count, timeout, i, n;
+
+    ex.source   = source;
+    ex.interval = interval;
+    outbuf_init(&ex.body, 16384);
+    outbuf_init(&ex.snapshots[0].response, 16384);
+    outbuf_init(&ex.snapshots[1].response, 16384);
+    ex.current = &ex.snapshots[0];
+
+    for (i = 0; i < MAX_SCRAPES; i++) {
+        scrapes[i].fd = -1;
+        outbuf_init(&scrapes[i].reply, 16384);
+    }
+
+    fd = strchr(address, '/') ? listen_unix(address) : listen_tcp(address);
+    if (fd < 0) {
+        fprintf(stderr, "Can't listen on %s: %s (%d)\n", address, strerror(errno), errno);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    // kept free to drop a connection when all others are taken
+    spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    // the first scrape already gets a complete sample
+    sample(&ex);
+
+    errno = pthread_create(&thread, NULL, sampler, &ex);
+    if (errno) {
+        fprintf(stderr, "Can't start sampler: %s (%d)\n", strerror(errno), errno);
+        close(fd);
+        return -1;
+    }
+
+    while (1) {
+        count   = 0;
+        timeout = -1;
+
+        for (i = 0; i < MAX_SCRAPES; i++) {
+            if (scrapes[i].fd < 0)
+                continue;
+            pfds[count].fd     = scrapes[i].fd;
+            pfds[count].events = scrapes[i].replying ? POLLOUT : POLLIN;
+            slots[count++] = i;
+
+            n = deadline_remaining_ms(scrapes[i].deadline, SCRAPE_IDLE_MS);
+            if (timeout < 0 || n < timeout)
+                timeout = n;
+        }
+
+        // a full table leaves the rest in the backlog
+        if (count < MAX_SCRAPES) {
+            n = paused ? deadline_remaining_ms(paused, ACCEPT_BACKOFF_MS) : 0;
+            if (n == 0) {
+                paused = 0;
+                pfds[count].fd     = fd;
+                pfds[count].events = POLLIN;
+                slots[count++] = -1;
+            } else if (timeout < 0 || n < timeout) {
+                timeout = n;
+            }
+        }
+
+        n = poll(pfds, count, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Can't poll: %s (%d)\n", strerror(errno), errno);
+            break;
+        }
+
+        for (i = 0; i < count; i++) {
+            struct scrape* scrape;
+            int done;
+
+            if (!pfds[i].revents)
+                continue;
+            if (slots[i] < 0) {
+                accept_scrapes(fd, scrapes, &spare, &paused);
+                continue;
+            }
+
+            scrape = &scrapes[slots[i]];
+            if (scrape->replying) {
+                size_t sent = scrape->sent;
+
+                done = scrape_write(scrape);
+                if (scrape->sent != sent)
+                    scrape->deadline = deadline_after(SCRAPE_IDLE_MS, 0);
+            } else {
+                done = scrape_read(&ex, scrape);
+            }
+            if (done < 0)
+                scrape_close(scrape);
+        }
+
+        // the request did not come, or the reply is not read
+        for (i = 0; i < MAX_SCRAPES; i++)
+            if (scrapes[i].fd >= 0 && deadline_remaining_ms(scrapes[i].deadline, 1) == 0)
+                scrape_close(&scrapes[i]);
+    }
+
+    close(fd);
+    return -1;
+}
@@ -0,0 +1,63 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef EXPORTER_H
+#define EXPORTER_H
+
+#include <stdint.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "adapter.h"
+#include "transport.h"
+
+
+// Prometheus/OpenMetrics exporter. A sampler thread reads the device info
+// of all adapters on its own schedule and renders the complete HTTP
+// response into the back one of two buffers, which is then swapped in
+// atomically. Scrapes copy the front buffer and never wait for HCI I/O.
+
+// as many adapters as a run lists
+#define EXPORTER_MAX_ADAPTERS MAX_ADAPTERS
+
+// where the samples come from; a stub transport makes the exporter
+// testable without any bluetooth hardware
+struct exporter_source {
+    // fills at most max device infos, returns their number or -1
+    int  (*sample)(struct exporter_source* source, struct hci_dev_info* adapters, int max);
+    // reads the version of an adapter that is up; 0 on success
+    int  (*version)(struct exporter_source* source, int dev_id, struct hci_version* ver);
+    struct transport*  transport;
+};
+
+// the adapters the transport knows about, including the ones that are down
+void exporter_source_live(struct exporter_source* source, struct transport* transport);
+
+// serves the metrics on address until killed; address is a unix socket
+// path or [host:]port, host defaults to 127.0.0.1. Samples every interval
+// seconds. Returns only on error.
+int exporter_run(struct exporter_source* source, const char* address, double interval);
+
+// a listening stream socket on path, replacing a stale socket file left by
+// an earlier run; -1 with errno set (EADDRINUSE if someone listens on it)
+int listen_unix(const char* path);
+
+#endif
@@ -0,0 +1,541 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "decode.h"
+#include "fingerprint.h"
+#include "trace.h"
+
+
+// first size of the fingerprint table of a fleet, grown at 3/4 load
+#define FLEET_TABLE_BITS  10
+
+// records shown per group unless verbose
+#define FLEET_EXAMPLES    3
+
+
+// a bit range of the vector and the names of its bits
+struct capvec_section {
+    const char*              name;
+    int                      first;     // bit of the vector
+    int                      nbits;
+    const struct bit_table*  table;     // NULL: bits are numbered only
+};
+
+static const struct capvec_section sections[] = {
+    { "features",        64 * CAPVEC_W_FEATURES,       64, &lmp_features_table },
+    { "features page 1", 64 * (CAPVEC_W_FEATURES + 1), 64, &lmp_ext_features_tables[1] },
+    { "features page 2", 64 * (CAPVEC_W_FEATURES + 2), 64, &lmp_ext_features_tables[2] },
+    { "features page 3", 64 * (CAPVEC_W_FEATURES + 3), 64, NULL },
+    { "features page 4", 64 * (CAPVEC_W_FEATURES + 4), 64, NULL },
+    { "features page 5", 64 * (CAPVEC_W_FEATURES + 5), 64, NULL },
+    { "features page 6", 64 * (CAPVEC_W_FEATURES + 6), 64, NULL },
+    { "features page 7", 64 * (CAPVEC_W_FEATURES + 7), 64, NULL },
+    { "LE features",     64 * CAPVEC_W_LE,             64, &le_features_table },
+    { "commands",        64 * CAPVEC_W_COMMANDS,      512, &commands_table },
+    { "packet types",    64 * CAPVEC_W_LINK,           32, &acl_ptype_table },
+    { "link policy",     64 * CAPVEC_W_LINK + 32,      16, &link_policy_table },
+};
+
+// the plain values packed into word 0
+struct capvec_value {
+    const char*  name;
+    int          shift;
+    int          bits;
+    const char*  format;
+};
+
+static const struct capvec_value values[] = {
+    { "manufacturer", 0,  16, "%u -> %u" },
+    { "lmp_ver",      16, 8,  "0x%x -> 0x%x" },
+    { "lmp_subver",   24, 16, "0x%x -> 0x%x" },
+    { "hci_ver",      40, 8,  "0x%x -> 0x%x" },
+    { "max_ext_page", 48, 8,  "%u -> %u" },
+    { "have",         56, 8,  "0x%02x -> 0x%02x" },
+};
+
+
+static inline uint64_t load_le64(const uint8_t* p)
+{
+    uint64_t value;
+
+    memcpy(&value, p, sizeof(value));
+    return le64toh(value);
+}
+
+
+static inline int hex_digit(uint8_t c)
+{
+    if ((unsigned int) (c - '0') < 10)
+        return c - '0';
+    c |= 0x20;
+    if ((unsigned int) (c - 'a') < 6)
+        return c - 'a' + 10;
+    return -1;
+}
+
+
+void capvec_build(struct capvec* vec, const struct adapter_info* info)
+{
+    const struct hci_dev_info* di = &info->hciDevInfo;
+    const struct hci_version* ver = &info->hciVersion;
+    const struct adapter_caps* caps = &info->caps;
+    uint64_t have = 0;
+    int page, i;
+
+    memset(vec, 0x00, sizeof(*vec));
+
+    if (info->fields[FIELD_VERSION] == FIELD_OK) {
+        vec->w[CAPVEC_W_ID] = (uint64_t) ver->manufacturer |
+                              (uint64_t) ver->lmp_ver << 16 |
+                              (uint64_t) ver->lmp_subver << 24 |
+                              (uint64_t) ver->hci_ver << 40;
+        have |= CAPVEC_HAVE_VERSION;
+    }
+
+    vec->w[CAPVEC_W_FEATURES] = load_le64(di->features);
+    for (page = 1; page < MAX_EXT_FEATURE_PAGES; page++)
+        if (caps->ext_page_mask & (1 << page))
+            vec->w[CAPVEC_W_FEATURES + page] = load_le64(caps->ext_features[page]);
+    if (caps->ext_page_mask & ~0x01)
+        vec->w[CAPVEC_W_ID] |= (uint64_t) caps->max_ext_page << 48;
+
+    if (caps->have_le_features) {
+        vec->w[CAPVEC_W_LE] = load_le64(caps->le_features);
+        have |= CAPVEC_HAVE_LE;
+    }
+
+    if (caps->have_commands) {
+        for (i = 0; i < 8; i++)
+            vec->w[CAPVEC_W_COMMANDS + i] = load_le64(caps->commands + 8 * i);
+        have |= CAPVEC_HAVE_COMMANDS;
+    }
+
+    vec->w[CAPVEC_W_LINK] = (uint64_t) di->pkt_type |
+                            (uint64_t) (di->link_policy & 0xffff) << 32;
+    vec->w[CAPVEC_W_ID] |= have << 56;
+}
+
+
+void capvec_pack(const struct capvec* vec, uint8_t bytes[CAPVEC_BYTES])
+{
+    uint64_t le;
+    int i;
+
+    for (i = 0; i < CAPVEC_WORDS; i++) {
+        le = htole64(vec->w[i]);
+        memcpy(bytes + 8 * i, &le, 8);
+    }
+}
+
+
+int capvec_parse(struct capvec* vec, const char* hex)
+{
+    uint8_t bytes[CAPVEC_BYTES];
+    int i, hi, lo;
+
+    for (i = 0; i < CAPVEC_BYTES; i++) {
+        hi = hex_digit(hex[2 * i]);
+        if (hi < 0)
+            return -1;
+        lo = hex_digit(hex[2 * i + 1]);
+        if (lo < 0)
+            return -1;
+        bytes[i] = hi << 4 | lo;
+    }
+
+    for (i = 0; i < CAPVEC_WORDS; i++)
+        vec->w[i] = load_le64(bytes + 8 * i);
+    return 0;
+}
+
+
+uint64_t capvec_fingerprint(const struct capvec* vec)
+{
+    uint8_t bytes[CAPVEC_BYTES];
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    int i;
+
+    capvec_pack(vec, bytes);
+    for (i = 0; i < CAPVEC_BYTES; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+
+int capvec_distance(const struct capvec* a, const struct capvec* b)
+{
+    int bits = 0;
+    int i;
+
+    for (i = 0; i < CAPVEC_WORDS; i++)
+        bits += __builtin_popcountll(a->w[i] ^ b->w[i]);
+    return bits;
+}
+
+
+static void print_label(struct outbuf* out, const char* name)
+{
+    out_printf(out, "        %-18s", name);
+}
+
+
+void capvec_print_diff(struct outbuf* out, const struct capvec* a, const struct capvec* b)
+{
+    uint64_t diff, mask;
+    unsigned int i;
+    int word, bit, end;
+
+    for (i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        mask = (1ULL << values[i].bits) - 1;
+        if (!(((a->w[CAPVEC_W_ID] ^ b->w[CAPVEC_W_ID]) >> values[i].shift) & mask))
+            continue;
+        print_label(out, values[i].name);
+        out_printf(out, values[i].format,
+                   (unsigned int) ((a->w[CAPVEC_W_ID] >> values[i].shift) & mask),
+                   (unsigned int) ((b->w[CAPVEC_W_ID] >> values[i].shift) & mask));
+        out_write(out, "\n", 1);
+    }
+
+    // whole words first, then the set bits of what differs
+    for (i = 0; i < sizeof(sections) / sizeof(sections[0]); i++) {
+        const struct capvec_section* section = &sections[i];
+
+        end = section->first + section->nbits;
+        for (word = section->first / 64; word * 64 < end; word++) {
+            diff = a->w[word] ^ b->w[word];
+            if (section->first > word * 64)
+                diff &= ~0ULL << (section->first - word * 64);
+            if (end < word * 64 + 64)
+                diff &= ~(~0ULL << (end - word * 64));
+
+            while (diff) {
+                const char* name = NULL;
+
+                bit = word * 64 + __builtin_ctzll(diff) - section->first;
+                diff &= diff - 1;
+
+                if (section->table)
+                    name = bit_table_name(section->table, bit);
+                print_label(out, section->name);
+                out_write(out, (b->w[word] >> ((section->first + bit) % 64)) & 1 ? "+" : "-", 1);
+                if (name)
+                    out_printf(out, "%s\n", name);
+                else
+                    out_printf(out, "bit %d\n", bit);
+            }
+        }
+    }
+}
+
+
+
+// fleet diff ----------------------------------------------------------------
+
+// Fibonacci hashing into a table of 2^bits slots
+static inline uint32_t slot_of(uint64_t key, int bits)
+{
+    return (key * 0x9e3779b97f4a7c15ULL) >> (64 - bits);
+}
+
+
+static int grow_table(struct fleet* fleet)
+{
+    int bits = fleet->table ? fleet->table_bits + 1 : FLEET_TABLE_BITS;
+    int* table = calloc(1 << bits, sizeof(int));
+    uint32_t mask = (1u << bits) - 1;
+    uint32_t slot;
+    int i;
+
+    if (!table)
+        return -1;
+
+    for (i = 0; i < fleet->num_groups; i++) {
+        slot = slot_of(fleet->groups[i].fingerprint, bits);
+        while (table[slot])
+            slot = (slot + 1) & mask;
+        table[slot] = i + 1;
+    }
+
+    free(fleet->table);
+    fleet->table = table;
+    fleet->table_bits = bits;
+    return 0;
+}
+
+
+// the group of vec, added if new; -1 if memory runs out
+static int find_group(struct fleet* fleet, const struct capvec* vec)
+{
+    uint64_t fingerprint = capvec_fingerprint(vec);
+    struct fleet_group* group;
+    uint32_t mask, slot;
+    int index;
+
+    if (!fleet->table || fleet->num_groups + 1 > (1 << fleet->table_bits) / 4 * 3)
+        if (grow_table(fleet) < 0)
+            return -1;
+
+    // equal fingerprints of different vectors are different groups
+    mask = (1u << fleet->table_bits) - 1;
+    slot = slot_of(fingerprint, fleet->table_bits);
+    while ((index = fleet->table[slot]) != 0) {
+        group = &fleet->groups[index - 1];
+        if (group->fingerprint == fingerprint && !memcmp(&group->vec, vec, sizeof(*vec)))
+            return index - 1;
+        slot = (slot + 1) & mask;
+    }
+
+    if (fleet->num_groups == fleet->groups_cap) {
+        int cap = fleet->groups_cap ? fleet->groups_cap * 2 : 64;
+        struct fleet_group* groups = realloc(fleet->groups, cap * sizeof(*groups));
+
+        if (!groups)
+            return -1;
+        fleet->groups = groups;
+        fleet->groups_cap = cap;
+    }
+
+    group = &fleet->groups[fleet->num_groups];
+    group->fingerprint = fingerprint;
+    group->vec = *vec;
+    group->count = 0;
+    group->first = -1;
+    group->last = -1;
+    fleet->table[slot] = fleet->num_groups + 1;
+    return fleet->num_groups++;
+}
+
+
+static int add_record(struct fleet* fleet, int file, uint32_t ordinal, const struct capvec* vec)
+{
+    struct fleet_record* record;
+    struct fleet_group* group;
+    int index;
+
+    if (fleet->count == fleet->cap) {
+        int cap = fleet->cap ? fleet->cap * 2 : 1024;
+        struct fleet_record* records = realloc(fleet->records, cap * sizeof(*records));
+
+        if (!records)
+            return -1;
+        fleet->records = records;
+        fleet->cap = cap;
+    }
+
+    index = find_group(fleet, vec);
+    if (index < 0)
+        return -1;
+    group = &fleet->groups[index];
+
+    record = &fleet->records[fleet->count];
+    record->file = file;
+    record->ordinal = ordinal;
+    record->next = -1;
+
+    if (group->last >= 0)
+        fleet->records[group->last].next = fleet->count;
+    else
+        group->first = fleet->count;
+    group->last = fleet->count;
+    group->count++;
+    fleet->count++;
+    return 0;
+}
+
+
+// every run of exactly CAPVEC_HEX hex digits is a vector: a JSON string
+// or a CSV column, nothing else in the output is that long
+static int load_vectors(struct fleet* fleet, int file, const uint8_t* data, size_t size)
+{
+    struct capvec vec;
+    uint32_t ordinal = 0;
+    size_t i = 0, start;
+
+    while (i < size) {
+        if (hex_digit(data[i]) < 0) {
+            i++;
+            continue;
+        }
+        start = i;
+        while (i < size && hex_digit(data[i]) >= 0)
+            i++;
+        if (i - start != CAPVEC_HEX)
+            continue;
+
+        capvec_parse(&vec, (const char*) data + start);
+        if (add_record(fleet, file, ordinal++, &vec) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+
+// -1 if the file cannot be read, -2 if memory runs out
+static int load_file(struct fleet* fleet, int file)
+{
+    struct stat st;
+    void* map;
+    int fd, err, ret;
+
+    fd = open(fleet->paths[file], O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    err = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        errno = err;
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    ret = load_vectors(fleet, file, map, st.st_size) < 0 ? -2 : 0;
+    munmap(map, st.st_size);
+    return ret;
+}
+
+
+// largest first, then in the order they were first seen
+static int compare_groups(const void* a, const void* b)
+{
+    const struct fleet_group* ga = a;
+    const struct fleet_group* gb = b;
+
+    if (ga->count != gb->count)
+        return gb->count - ga->count;
+    return ga->first - gb->first;
+}
+
+
+int fleet_load(struct fleet* fleet, const char* const* paths, int count)
+{
+    uint64_t start = trace_now();
+    int file, ret;
+
+    memset(fleet, 0x00, sizeof(*fleet));
+    fleet->paths = paths;
+    fleet->num_files = count;
+
+    for (file = 0; file < count; file++) {
+        ret = load_file(fleet, file);
+        if (ret == -2) {
+            fleet_free(fleet);
+            errno = ENOMEM;
+            return -1;
+        }
+        if (ret < 0) {
+            fprintf(stderr, "Can't read %s: %s (%d)\n", paths[file], strerror(errno), errno);
+            fleet->failed_files++;
+        }
+    }
+
+    // the table indexes the groups in insertion order
+    free(fleet->table);
+    fleet->table = NULL;
+    if (fleet->num_groups)
+        qsort(fleet->groups, fleet->num_groups, sizeof(*fleet->groups), compare_groups);
+
+    fleet->elapsed = trace_now() - start;
+    return 0;
+}
+
+
+void fleet_free(struct fleet* fleet)
+{
+    free(fleet->records);
+    free(fleet->groups);
+    free(fleet->table);
+    memset(fleet, 0x00, sizeof(*fleet));
+}
+
+
+static void print_records(struct outbuf* out, const struct fleet* fleet,
+                          const struct fleet_group* group, int verbose)
+{
+    int index = group->first;
+    int shown = 0;
+
+    out_printf(out, "    ");
+    while (index >= 0 && (verbose || shown < FLEET_EXAMPLES)) {
+        const struct fleet_record* record = &fleet->records[index];
+
+        out_printf(out, "%s%s#%u", shown ? ", " : "", fleet->paths[record->file],
+                   record->ordinal);
+        index = record->next;
+        shown++;
+    }
+    if (shown < group->count)
+        out_printf(out, " and %d more", group->count - shown);
+    out_write(out, "\n", 1);
+}
+
+
+void fleet_print(struct outbuf* out, const struct fleet* fleet, int verbose)
+{
+    const struct fleet_group* reference = fleet->groups;
+    int i, distance;
+
+    out_printf(out, "%d adapters in %d files, %d capability sets (%.1f ms)\n",
+               fleet->count, fleet->num_files - fleet->failed_files, fleet->num_groups,
+               fleet->elapsed / 1e6);
+
+    for (i = 0; i < fleet->num_groups; i++) {
+        const struct fleet_group* group = &fleet->groups[i];
+
+        out_printf(out, "\nset %d: fingerprint %016llx, %d adapters (%.1f%%)\n",
+                   i + 1, (unsigned long long) group->fingerprint, group->count,
+                   100.0 * group->count / fleet->count);
+        print_records(out, fleet, group, verbose);
+
+        if (i == 0)
+            continue;
+        distance = capvec_distance(&reference->vec, &group->vec);
+        out_printf(out, "    %d bits differ from set 1:\n", distance);
+        capvec_print_diff(out, &reference->vec, &group->vec);
+    }
+}
@@ -0,0 +1,126 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+#include <stdint.h>
+
+#include "adapter.h"
+#include "output.h"
+
+
+// The capabilities of an adapter as one canonical bit vector, so adapters
+// of many hosts can be compared with a few XORs: 64 bit words, written out
+// as little endian bytes in hex. Bit i of a bitmap word is bit i of the
+// bitmap as the controller reports it.
+//
+//   word 0      manufacturer (16), lmp_ver (8), lmp_subver (16), hci_ver (8),
+//               max_ext_page (8), CAPVEC_HAVE_* (8)
+//   word 1      LMP features page 0
+//   words 2-8   LMP features pages 1-7, zero if not read
+//   word 9      LE features
+//   words 10-17 supported commands
+//   word 18     pkt_type (32), link_policy (16)
+
+#define CAPVEC_WORDS        19
+#define CAPVEC_BYTES        (CAPVEC_WORDS * 8)
+#define CAPVEC_HEX          (CAPVEC_BYTES * 2)
+
+#define CAPVEC_W_ID         0
+#define CAPVEC_W_FEATURES   1
+#define CAPVEC_W_LE         9
+#define CAPVEC_W_COMMANDS   10
+#define CAPVEC_W_LINK       18
+
+// which of the optional reads the vector contains (word 0, top byte)
+#define CAPVEC_HAVE_VERSION   0x01
+#define CAPVEC_HAVE_COMMANDS  0x02
+#define CAPVEC_HAVE_LE        0x04
+
+struct capvec {
+    uint64_t  w[CAPVEC_WORDS];
+};
+
+// needs the device info of the probe, the other parts are optional
+void capvec_build(struct capvec* vec, const struct adapter_info* info);
+
+void capvec_pack(const struct capvec* vec, uint8_t bytes[CAPVEC_BYTES]);
+// -1 unless hex is CAPVEC_HEX hex digits
+int  capvec_parse(struct capvec* vec, const char* hex);
+
+// FNV-1a over the packed bytes: stable across hosts, builds and versions
+// of the vector that only append words
+uint64_t capvec_fingerprint(const struct capvec* vec);
+
+// the number of bits that differ
+int  capvec_distance(const struct capvec* a, const struct capvec* b);
+
+// one line per differing field or named bit, "+" for bits only b has
+void capvec_print_diff(struct outbuf* out, const struct capvec* a, const struct capvec* b);
+
+
+// Fleet diff: the vectors in the JSON or CSV output of many hosts, grouped
+// by fingerprint. Each file may hold any number of adapters; a record is
+// named by its file and its position in it ("host.json#1").
+
+struct fleet_group {
+    uint64_t       fingerprint;
+    struct capvec  vec;
+    int            count;
+    int            first;         // record index, chained by next
+    int            last;
+};
+
+struct fleet_record {
+    uint32_t  file;
+    uint32_t  ordinal;            // position in the file
+    int       next;               // next record of the same group, -1 = none
+};
+
+struct fleet {
+    const char* const*    paths;
+    int                   num_files;
+    int                   failed_files;
+
+    struct fleet_record*  records;
+    int                   count;
+    int                   cap;
+
+    struct fleet_group*   groups;     // by size after fleet_load
+    int                   num_groups;
+    int                   groups_cap;
+
+    int*                  table;      // group index + 1 by fingerprint, 0 = free
+    int                   table_bits;
+
+    uint64_t              elapsed;    // ns
+};
+
+// loads all paths; unreadable files are reported on stderr and counted.
+// -1 with errno set if memory runs out.
+int  fleet_load(struct fleet* fleet, const char* const* paths, int count);
+void fleet_free(struct fleet* fleet);
+
+// the groups, largest first, each diffed against the largest; all records
+// of a group if verbose, else a few
+void fleet_print(struct outbuf* out, const struct fleet* fleet, int verbose);
+
+#endif
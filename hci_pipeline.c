@@ -0,0 +1,249 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "deadline.h"
+#include "hci_pipeline.h"
+
+
+void hci_pipeline_init(struct hci_pipeline* pipeline, struct transport_dev* dev)
+{
+    memset(pipeline, 0x00, sizeof(*pipeline));
+    pipeline->dev = dev;
+
+    // until the controller tells us otherwise only one command may be
+    // outstanding
+    pipeline->credits = 1;
+}
+
+
+struct hci_pipeline_cmd* hci_pipeline_add(struct hci_pipeline* pipeline,
+                                          uint16_t ogf, uint16_t ocf,
+                                          const void* param, uint8_t plen,
+                                          void* rparam, int rlen,
+                                          hci_pipeline_cb complete, void* user)
+{
+    struct hci_pipeline_cmd* cmd;
+
+    if (pipeline->count >= HCI_PIPELINE_MAX_CMDS ||
+            plen > HCI_PIPELINE_MAX_PARAM) {
+        errno = ENOSPC;
+        return NULL;
+    }
+
+    cmd = &pipeline->cmds[pipeline->count++];
+    memset(cmd, 0x00, sizeof(*cmd));
+    cmd->opcode   = cmd_opcode_pack(ogf, ocf);
+    cmd->plen     = plen;
+    if (plen)
+        memcpy(cmd->param, param, plen);
+    cmd->rparam   = rparam;
+    cmd->rlen     = rlen;
+    cmd->state    = HCI_CMD_QUEUED;
+    cmd->complete = complete;
+    cmd->user     = user;
+
+    return cmd;
+}
+
+
+// sends queued commands while the controller has credits left
+static int send_queued(struct hci_pipeline* pipeline)
+{
+    while (pipeline->credits > 0 && pipeline->next < pipeline->count) {
+        struct hci_pipeline_cmd* cmd = &pipeline->cmds[pipeline->next];
+
+        cmd->sent = deadline_now();
+        if (transport_send_cmd(pipeline->dev, cmd->opcode, cmd->plen, cmd->param) < 0)
+            return -1;
+
+        cmd->state = HCI_CMD_SENT;
+        pipeline->next++;
+        pipeline->pending++;
+        pipeline->credits--;
+    }
+
+    return 0;
+}
+
+
+// oldest command with this opcode still waiting for its answer; with
+// return parameters given, commands that echo a parameter (the handle of
+// the per-connection reads) only match an answer that repeats it
+static struct hci_pipeline_cmd* find_sent(struct hci_pipeline* pipeline,
+                                          uint16_t opcode,
+                                          const uint8_t* rparam, int rlen)
+{
+    int i;
+
+    for (i = 0; i < pipeline->next; i++) {
+        struct hci_pipeline_cmd* cmd = &pipeline->cmds[i];
+        if (cmd->state != HCI_CMD_SENT || cmd->opcode != opcode)
+            continue;
+        if (rparam && cmd->echo && (rlen < 1 + cmd->echo ||
+                memcmp(rparam + 1, cmd->param, cmd->echo) != 0))
+            continue;
+        return cmd;
+    }
+
+    return NULL;
+}
+
+
+static void finish_cmd(struct hci_pipeline* pipeline,
+                       struct hci_pipeline_cmd* cmd, uint8_t status)
+{
+    pipeline->pending--;
+    cmd->answered = deadline_now();
+
+    if (status) {
+        cmd->state  = HCI_CMD_FAILED;
+        cmd->status = status;
+        return;
+    }
+
+    cmd->state = HCI_CMD_DONE;
+    if (cmd->complete)
+        cmd->complete(pipeline, cmd);
+}
+
+
+static void handle_event(struct hci_pipeline* pipeline,
+                         uint8_t* buf, int len)
+{
+    hci_event_hdr* hdr;
+    uint8_t* ptr;
+    struct hci_pipeline_cmd* cmd;
+
+    if (len < HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE || buf[0] != HCI_EVENT_PKT)
+        return;
+
+    hdr = (void*) (buf + HCI_TYPE_LEN);
+    ptr = buf + HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE;
+    len -= HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE;
+    if (hdr->plen > len)
+        return;
+    len = hdr->plen;
+
+    switch (hdr->evt) {
+    case EVT_CMD_COMPLETE: {
+        evt_cmd_complete* cc = (void*) ptr;
+
+        if (len < EVT_CMD_COMPLETE_SIZE)
+            return;
+
+        pipeline->credits = cc->ncmd;
+        ptr += EVT_CMD_COMPLETE_SIZE;
+        len -= EVT_CMD_COMPLETE_SIZE;
+
+        // an error answer may come without the echoed parameters
+        cmd = find_sent(pipeline, btohs(cc->opcode), len > 1 ? ptr : NULL, len);
+        if (!cmd)
+            return;
+
+        if (cmd->rparam) {
+            memset(cmd->rparam, 0x00, cmd->rlen);
+            memcpy(cmd->rparam, ptr, len < cmd->rlen ? len : cmd->rlen);
+        }
+
+        // all commands we pipeline start their return parameters with
+        // the status byte
+        finish_cmd(pipeline, cmd, len > 0 ? ptr[0] : 0);
+        break;
+    }
+
+    case EVT_CMD_STATUS: {
+        evt_cmd_status* cs = (void*) ptr;
+
+        if (len < EVT_CMD_STATUS_SIZE)
+            return;
+
+        pipeline->credits = cs->ncmd;
+
+        // a successful status only means the command is still running
+        if (cs->status == 0)
+            return;
+
+        cmd = find_sent(pipeline, btohs(cs->opcode), NULL, 0);
+        if (cmd)
+            finish_cmd(pipeline, cmd, cs->status);
+        break;
+    }
+    }
+}
+
+
+int hci_pipeline_run(struct hci_pipeline* pipeline, int timeout)
+{
+    uint8_t buf[HCI_MAX_EVENT_SIZE];
+    int err = 0;
+    int i;
+
+    while (pipeline->next < pipeline->count || pipeline->pending > 0) {
+        int wait = deadline_remaining_ms(pipeline->deadline, timeout);
+        int len;
+
+        if (wait == 0) {
+            err = ETIMEDOUT;
+            break;
+        }
+
+        if (send_queued(pipeline) < 0) {
+            err = errno;
+            break;
+        }
+
+        len = transport_read_event(pipeline->dev, buf, sizeof(buf), wait);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            err = errno;
+            break;
+        }
+        if (len == 0) {
+            err = ETIMEDOUT;
+            break;
+        }
+
+        handle_event(pipeline, buf, len);
+    }
+
+    if (err) {
+        // whatever did not get an answer failed
+        for (i = 0; i < pipeline->count; i++) {
+            struct hci_pipeline_cmd* cmd = &pipeline->cmds[i];
+            if (cmd->state == HCI_CMD_QUEUED || cmd->state == HCI_CMD_SENT)
+                cmd->state = HCI_CMD_FAILED;
+        }
+        pipeline->pending = 0;
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef HCI_PIPELINE_H
+#define HCI_PIPELINE_H
+
+#include <stdint.h>
+
+#include "transport.h"
+
+
+// Sends a batch of HCI commands to one adapter and keeps as many of them in
+// flight as the controller grants command credits (Num_HCI_Command_Packets).
+// Command Complete/Status events are matched back to the oldest outstanding
+// command with the same opcode (and the same connection handle, see echo).
+
+#define HCI_PIPELINE_MAX_CMDS   32
+#define HCI_PIPELINE_MAX_PARAM  16
+
+
+enum hci_pipeline_state {
+    HCI_CMD_QUEUED = 0,
+    HCI_CMD_SENT,
+    HCI_CMD_DONE,
+    HCI_CMD_FAILED
+};
+
+struct hci_pipeline;
+struct hci_pipeline_cmd;
+
+// called once a command completed successfully; may add more commands
+typedef void (*hci_pipeline_cb)(struct hci_pipeline* pipeline,
+                                struct hci_pipeline_cmd* cmd);
+
+struct hci_pipeline_cmd {
+    uint16_t                 opcode;
+    uint8_t                  plen;
+    uint8_t                  param[HCI_PIPELINE_MAX_PARAM];
+    uint8_t                  echo;      // leading param bytes the answer repeats
+                                        // after its status, e.g. 2 for a handle
+
+    void*                    rparam;    // return parameters incl. status byte
+    int                      rlen;
+
+    enum hci_pipeline_state  state;
+    uint8_t                  status;    // HCI status if the command failed
+
+    uint64_t                 sent;      // CLOCK_MONOTONIC in ns, 0 = not sent
+    uint64_t                 answered;  // 0 = no answer
+
+    hci_pipeline_cb          complete;
+    void*                    user;
+};
+
+struct hci_pipeline {
+    struct transport_dev*    dev;
+    int                      credits;   // commands the controller accepts right now
+    int                      count;
+    int                      next;      // first command not sent yet
+    int                      pending;   // sent but not answered
+    uint64_t                 deadline;  // CLOCK_MONOTONIC in ns, 0 = none
+    struct hci_pipeline_cmd  cmds[HCI_PIPELINE_MAX_CMDS];
+};
+
+
+void hci_pipeline_init(struct hci_pipeline* pipeline, struct transport_dev* dev);
+
+// queues a command; returns NULL if the pipeline is full or plen too big
+struct hci_pipeline_cmd* hci_pipeline_add(struct hci_pipeline* pipeline,
+                                          uint16_t ogf, uint16_t ocf,
+                                          const void* param, uint8_t plen,
+                                          void* rparam, int rlen,
+                                          hci_pipeline_cb complete, void* user);
+
+// runs until every queued command is answered; timeout (ms) is the time
+// allowed between two events, and nothing waits past the pipeline's
+// deadline. Returns 0 or -1 with errno set (ETIMEDOUT for both limits).
+int hci_pipeline_run(struct hci_pipeline* pipeline, int timeout);
+
+#endif
@@ -0,0 +1,236 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "deadline.h"
+#include "hotplug.h"
+
+
+// large enough for all index frames; longer traffic frames get truncated,
+// which is fine since only their header is looked at
+#define HOTPLUG_BUF_SIZE 2048
+
+
+int hotplug_open_monitor(void)
+{
+    struct sockaddr_hci addr;
+    int fd;
+
+    fd = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI);
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0x00, sizeof(addr));
+    addr.hci_family  = AF_BLUETOOTH;
+    addr.hci_dev     = HCI_DEV_NONE;
+    addr.hci_channel = HCI_CHANNEL_MONITOR;
+
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    return fd;
+}
+
+
+void hotplug_handle_frame(struct hotplug_table* table, const uint8_t* buf, int len,
+                          hotplug_cb cb, void* user)
+{
+    const struct hci_mon_hdr* hdr = (const void*) buf;
+    struct hotplug_adapter* adapter;
+    enum hotplug_change change;
+    uint16_t opcode, index, plen;
+
+    if (len < HCI_MON_HDR_SIZE)
+        return;
+
+    opcode = btohs(hdr->opcode);
+    index  = btohs(hdr->index);
+    plen   = btohs(hdr->len);
+
+    if (index >= HOTPLUG_MAX_INDEX)
+        return;
+    adapter = &table->adapters[index];
+
+    buf += HCI_MON_HDR_SIZE;
+    len -= HCI_MON_HDR_SIZE;
+
+    switch (opcode) {
+    case HCI_MON_NEW_INDEX: {
+        const struct hci_mon_new_index* ni = (const void*) buf;
+
+        if (plen < HCI_MON_NEW_INDEX_SIZE || len < HCI_MON_NEW_INDEX_SIZE)
+            return;
+
+        if (!adapter->present)
+            table->count++;
+        if (adapter->opening)
+            table->opening--;
+        memset(adapter, 0x00, sizeof(*adapter));
+        adapter->present = 1;
+        adapter->type    = ni->type;
+        adapter->bus     = ni->bus;
+        bacpy(&adapter->bdaddr, &ni->bdaddr);
+        memcpy(adapter->name, ni->name, sizeof(ni->name));
+        change = HOTPLUG_ADDED;
+        break;
+    }
+
+    case HCI_MON_DEL_INDEX:
+        if (!adapter->present)
+            return;
+        table->count--;
+        if (adapter->opening)
+            table->opening--;
+        adapter->present = 0;
+        adapter->up = 0;
+        adapter->opening = 0;
+        change = HOTPLUG_REMOVED;
+        break;
+
+    case HCI_MON_OPEN_INDEX:
+        if (!adapter->present || adapter->up || adapter->opening)
+            return;
+        if (table->is_up) {
+            adapter->opening = 1;
+            adapter->opened  = deadline_now();
+            table->opening++;
+            return;
+        }
+        adapter->up = 1;
+        change = HOTPLUG_UP;
+        break;
+
+    case HCI_MON_CLOSE_INDEX:
+        // closed before its setup finished: it never was up
+        if (adapter->opening) {
+            adapter->opening = 0;
+            table->opening--;
+            return;
+        }
+        if (!adapter->present || !adapter->up)
+            return;
+        adapter->up = 0;
+        change = HOTPLUG_DOWN;
+        break;
+
+    case HCI_MON_INDEX_INFO: {
+        const struct hci_mon_index_info* ii = (const void*) buf;
+
+        if (!adapter->present ||
+                plen < HCI_MON_INDEX_INFO_SIZE || len < HCI_MON_INDEX_INFO_SIZE)
+            return;
+        bacpy(&adapter->bdaddr, &ii->bdaddr);
+        adapter->manufacturer = btohs(ii->manufacturer);
+        change = HOTPLUG_INFO;
+        break;
+    }
+
+    default:
+        // hci traffic and log messages
+        return;
+    }
+
+    if (cb)
+        cb(table, index, change, user);
+}
+
+
+// reports the opened adapters that finished their setup, or gave up on it
+static void check_opening(struct hotplug_table* table, hotplug_cb cb, void* user)
+{
+    uint64_t now = deadline_now();
+    int index;
+
+    for (index = 0; table->opening > 0 && index < HOTPLUG_MAX_INDEX; index++) {
+        struct hotplug_adapter* adapter = &table->adapters[index];
+
+        if (!adapter->opening)
+            continue;
+        if (!table->is_up(index, user) &&
+                now - adapter->opened < HOTPLUG_SETUP_MS * 1000000ull)
+            continue;
+
+        adapter->opening = 0;
+        adapter->up = 1;
+        table->opening--;
+        if (cb)
+            cb(table, index, HOTPLUG_UP, user);
+    }
+}
+
+
+int hotplug_run(int fd, struct hotplug_table* table, hotplug_cb cb, void* user)
+{
+    uint8_t buf[HOTPLUG_BUF_SIZE];
+    uint64_t tick = 0;      // next check of the opening adapters, 0 = none
+
+    while (1) {
+        ssize_t len;
+
+        // the setup of an opened adapter sends no frame of its own when
+        // done, and the traffic of a busy farm must not turn into one
+        // ioctl per frame: the opening adapters are checked on a tick
+        if (table->opening > 0) {
+            struct pollfd pfd = { fd, POLLIN, 0 };
+            int wait, ret = 0;
+
+            if (!tick)
+                tick = deadline_after(HOTPLUG_POLL_MS, 0);
+            wait = deadline_remaining_ms(tick, HOTPLUG_POLL_MS);
+            if (wait > 0)
+                ret = poll(&pfd, 1, wait);
+            if (ret < 0 && errno != EINTR)
+                return -1;
+            if (deadline_remaining_ms(tick, 1) == 0) {
+                tick = 0;
+                check_opening(table, cb, user);
+                continue;
+            }
+            if (ret <= 0)
+                continue;
+        } else {
+            tick = 0;
+        }
+
+        len = recv(fd, buf, sizeof(buf), 0);
+        if (len < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return -1;
+        }
+        if (len == 0)
+            return 0;
+
+        hotplug_handle_frame(table, buf, len, cb, user);
+    }
+}
@@ -0,0 +1,115 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+#include <stdint.h>
+
+#include <bluetooth/bluetooth.h>
+
+
+// frames of the kernel's HCI monitor channel (see bluez monitor/control.c)
+#define HCI_MON_NEW_INDEX     0
+#define HCI_MON_DEL_INDEX     1
+#define HCI_MON_OPEN_INDEX    8
+#define HCI_MON_CLOSE_INDEX   9
+#define HCI_MON_INDEX_INFO    10
+
+struct hci_mon_hdr {
+    uint16_t  opcode;
+    uint16_t  index;
+    uint16_t  len;
+} __attribute__ ((packed));
+#define HCI_MON_HDR_SIZE 6
+
+struct hci_mon_new_index {
+    uint8_t   type;
+    uint8_t   bus;
+    bdaddr_t  bdaddr;
+    char      name[8];
+} __attribute__ ((packed));
+#define HCI_MON_NEW_INDEX_SIZE 16
+
+struct hci_mon_index_info {
+    bdaddr_t  bdaddr;
+    uint16_t  manufacturer;
+} __attribute__ ((packed));
+#define HCI_MON_INDEX_INFO_SIZE 8
+
+
+// adapters with a higher index are ignored
+#define HOTPLUG_MAX_INDEX 256
+
+// the kernel reports an adapter open before its driver setup and HCI init
+// ran; it is reported up only once is_up says so, checked this often
+// however many frames come in, or after the setup timeout regardless
+#define HOTPLUG_POLL_MS   100
+#define HOTPLUG_SETUP_MS  10000
+
+struct hotplug_adapter {
+    int       present;
+    int       up;
+    int       opening;      // open, waiting for is_up
+    uint64_t  opened;       // CLOCK_MONOTONIC in ns
+    uint8_t   type;
+    uint8_t   bus;
+    bdaddr_t  bdaddr;
+    char      name[9];
+    uint16_t  manufacturer;
+};
+
+// whether the adapter at index finished its setup, e.g. has HCI_UP set
+typedef int (*hotplug_up_fn)(int index, void* user);
+
+struct hotplug_table {
+    int                     count;          // adapters present
+    int                     opening;        // adapters waiting for is_up
+    hotplug_up_fn           is_up;          // NULL: up as soon as open
+    struct hotplug_adapter  adapters[HOTPLUG_MAX_INDEX];
+};
+
+enum hotplug_change {
+    HOTPLUG_ADDED,
+    HOTPLUG_REMOVED,
+    HOTPLUG_UP,
+    HOTPLUG_DOWN,
+    HOTPLUG_INFO
+};
+
+// called after the table was updated for the adapter at index
+typedef void (*hotplug_cb)(struct hotplug_table* table, int index,
+                           enum hotplug_change change, void* user);
+
+
+// opens a socket on the monitor channel; the kernel starts it with a
+// replay of all existing adapters. Returns -1 with errno set on failure.
+int hotplug_open_monitor(void);
+
+// applies one monitor frame to the table; traffic frames are ignored
+void hotplug_handle_frame(struct hotplug_table* table, const uint8_t* buf, int len,
+                          hotplug_cb cb, void* user);
+
+// reads monitor frames from fd (a monitor socket or e.g. one end of a
+// socketpair with recorded frames) until EOF, and reports the adapters
+// that came up; returns 0 or -1 on error
+int hotplug_run(int fd, struct hotplug_table* table, hotplug_cb cb, void* user);
+
+#endif
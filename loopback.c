@@ -0,0 +1,454 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "deadline.h"
+#include "loopback.h"
+
+
+// packets per read and the room of each one
+#define LOOPBACK_BATCH     TRANSPORT_MAX_BATCH
+#define LOOPBACK_PKT_SIZE  (HCI_TYPE_LEN + HCI_ACL_HDR_SIZE + HCI_MAX_ACL_SIZE)
+
+// ms for a command, for the link to come up and for the last answers
+#define LOOPBACK_TIMEOUT   1000
+
+#define LOOPBACK_OPCODE(ocf)  cmd_opcode_pack(LOOPBACK_OGF_TESTING, ocf)
+
+// no link yet
+#define LOOPBACK_NO_HANDLE 0xffff
+
+
+struct loopback_state {
+    struct transport_dev*    dev;
+    struct loopback_result*  result;
+    int                      credits;      // free controller buffers
+    uint32_t                 next_seq;
+    uint64_t                 sent_at[LOOPBACK_MAX_WINDOW];   // by seq, 0 = answered
+    uint64_t                 last_answer;
+    int                      link_lost;
+
+    // the command waiting for its Command Complete
+    uint16_t                 opcode;
+    int                      answered;
+    uint8_t                  rparam[8];
+
+    uint8_t                  pkt[HCI_ACL_HDR_SIZE + HCI_MAX_ACL_SIZE];
+    uint8_t                  buf[LOOPBACK_BATCH * LOOPBACK_PKT_SIZE];
+};
+
+
+static volatile sig_atomic_t loopback_stop = 0;
+
+static void on_sigint(int sig)
+{
+    loopback_stop = 1;
+}
+
+
+// payload byte i of packet seq, after the sequence number
+static inline uint8_t pattern(uint32_t seq, int i)
+{
+    return (uint8_t) (seq * 31 + i);
+}
+
+
+static void on_acl(struct loopback_state* state, const uint8_t* ptr, int len, uint64_t now)
+{
+    struct loopback_result* result = state->result;
+    const hci_acl_hdr* hdr = (const void*) ptr;
+    uint32_t seq;
+    int dlen, i;
+
+    if (len < HCI_ACL_HDR_SIZE + LOOPBACK_SEQ_SIZE)
+        return;
+    dlen = btohs(hdr->dlen);
+    if (acl_handle(btohs(hdr->handle)) != result->handle ||
+            dlen < LOOPBACK_SEQ_SIZE || dlen > len - HCI_ACL_HDR_SIZE)
+        return;
+
+    ptr += HCI_ACL_HDR_SIZE;
+    seq = bt_get_le32(ptr);
+    if (state->sent_at[seq % LOOPBACK_MAX_WINDOW] == 0 || seq >= state->next_seq ||
+            state->next_seq - seq > (uint32_t) result->window) {
+        result->corrupt++;
+        return;
+    }
+
+    trace_histogram_add(&result->latency, now - state->sent_at[seq % LOOPBACK_MAX_WINDOW]);
+    state->sent_at[seq % LOOPBACK_MAX_WINDOW] = 0;
+    state->last_answer = now;
+    result->received++;
+    result->bytes += dlen;
+
+    for (i = LOOPBACK_SEQ_SIZE; i < dlen; i++) {
+        if (ptr[i] != pattern(seq, i)) {
+            result->corrupt++;
+            break;
+        }
+    }
+}
+
+
+static void on_event(struct loopback_state* state, const uint8_t* ptr, int len)
+{
+    struct loopback_result* result = state->result;
+    const hci_event_hdr* hdr = (const void*) ptr;
+    int plen, i;
+
+    if (len < HCI_EVENT_HDR_SIZE)
+        return;
+    plen = hdr->plen;
+    if (plen > len - HCI_EVENT_HDR_SIZE)
+        return;
+    ptr += HCI_EVENT_HDR_SIZE;
+
+    switch (hdr->evt) {
+    case EVT_CMD_COMPLETE: {
+        const evt_cmd_complete* cc = (const void*) ptr;
+        int rlen = plen - EVT_CMD_COMPLETE_SIZE;
+
+        if (plen < EVT_CMD_COMPLETE_SIZE + 1 || btohs(cc->opcode) != state->opcode)
+            break;
+        if (rlen > (int) sizeof(state->rparam))
+            rlen = sizeof(state->rparam);
+        memcpy(state->rparam, ptr + EVT_CMD_COMPLETE_SIZE, rlen);
+        state->answered = 1;
+        break;
+    }
+
+    case EVT_CMD_STATUS: {
+        const evt_cmd_status* cs = (const void*) ptr;
+
+        // only a failure ends a command with a status
+        if (plen < EVT_CMD_STATUS_SIZE || btohs(cs->opcode) != state->opcode || !cs->status)
+            break;
+        state->rparam[0] = cs->status;
+        state->answered = 1;
+        break;
+    }
+
+    // local loopback also reports SCO links; the first ACL link is the one
+    case EVT_CONN_COMPLETE: {
+        const evt_conn_complete* conn = (const void*) ptr;
+
+        if (plen >= EVT_CONN_COMPLETE_SIZE && !conn->status && conn->link_type == ACL_LINK &&
+                result->handle == LOOPBACK_NO_HANDLE)
+            result->handle = acl_handle(btohs(conn->handle));
+        break;
+    }
+
+    case EVT_DISCONN_COMPLETE: {
+        const evt_disconn_complete* disconn = (const void*) ptr;
+
+        if (plen >= EVT_DISCONN_COMPLETE_SIZE && !disconn->status &&
+                acl_handle(btohs(disconn->handle)) == result->handle)
+            state->link_lost = 1;
+        break;
+    }
+
+    // buffers the controller has free again
+    case EVT_NUM_COMP_PKTS:
+        if (plen < 1 || plen < 1 + ptr[0] * 4)
+            break;
+        for (i = 0; i < ptr[0]; i++) {
+            if (acl_handle(bt_get_le16(ptr + 1 + i * 4)) == result->handle)
+                state->credits += bt_get_le16(ptr + 3 + i * 4);
+        }
+        if (state->credits > result->window)
+            state->credits = result->window;
+        break;
+    }
+}
+
+
+// reads what arrived within timeout ms; -1 with errno set on errors
+static int read_packets(struct loopback_state* state, int timeout)
+{
+    int lens[LOOPBACK_BATCH];
+    uint64_t now;
+    int n, i;
+
+    n = transport_read_events(state->dev, state->buf, LOOPBACK_PKT_SIZE, lens,
+                              LOOPBACK_BATCH, timeout);
+    if (n <= 0)
+        return n;
+
+    now = deadline_now();
+    for (i = 0; i < n; i++) {
+        const uint8_t* pkt = state->buf + i * LOOPBACK_PKT_SIZE;
+
+        if (lens[i] < HCI_TYPE_LEN)
+            continue;
+        if (pkt[0] == HCI_ACLDATA_PKT)
+            on_acl(state, pkt + 1, lens[i] - 1, now);
+        else if (pkt[0] == HCI_EVENT_PKT)
+            on_event(state, pkt + 1, lens[i] - 1);
+    }
+    return n;
+}
+
+
+// sends one testing command and waits for its answer, handling whatever
+// else arrives meanwhile; the HCI status is in state->rparam[0]
+static int command(struct loopback_state* state, uint16_t ocf, const void* param, uint8_t plen)
+{
+    uint64_t start = trace_now();
+    uint64_t end = deadline_after(LOOPBACK_TIMEOUT, 0);
+    int wait;
+
+    state->opcode = LOOPBACK_OPCODE(ocf);
+    state->answered = 0;
+    if (transport_send_cmd(state->dev, state->opcode, plen, param) < 0)
+        return -1;
+
+    while (!state->answered) {
+        wait = deadline_remaining_ms(end, LOOPBACK_TIMEOUT);
+        if (wait == 0) {
+            trace_record(state->dev->dev_id, state->opcode, start, trace_now(), 1);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (read_packets(state, wait) < 0 && errno != EINTR)
+            return -1;
+    }
+
+    trace_record(state->dev->dev_id, state->opcode, start, trace_now(), 0);
+    if (state->rparam[0]) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+
+static int send_packet(struct loopback_state* state)
+{
+    struct loopback_result* result = state->result;
+    hci_acl_hdr* hdr = (void*) state->pkt;
+    uint8_t* payload = state->pkt + HCI_ACL_HDR_SIZE;
+    uint32_t seq = state->next_seq;
+    int i;
+
+    hdr->handle = htobs(acl_handle_pack(result->handle, ACL_START));
+    hdr->dlen   = htobs(result->mtu);
+    bt_put_le32(seq, payload);
+    for (i = LOOPBACK_SEQ_SIZE; i < result->mtu; i++)
+        payload[i] = pattern(seq, i);
+
+    state->sent_at[seq % LOOPBACK_MAX_WINDOW] = deadline_now();
+    if (transport_send_acl(state->dev, state->pkt, HCI_ACL_HDR_SIZE + result->mtu) < 0) {
+        state->sent_at[seq % LOOPBACK_MAX_WINDOW] = 0;
+        return -1;
+    }
+
+    state->next_seq++;
+    state->credits--;
+    result->sent++;
+    return 0;
+}
+
+
+// the measurement itself: keeps every buffer busy until the time is up,
+// then waits for the packets still out
+static int pump(struct loopback_state* state, double duration)
+{
+    struct loopback_result* result = state->result;
+    uint64_t start = deadline_now();
+    uint64_t end = start + (uint64_t) (duration * 1e9);
+    int wait;
+
+    state->credits = result->window;
+    state->last_answer = start;
+
+    while (!loopback_stop && !state->link_lost) {
+        if (deadline_now() >= end)
+            break;
+
+        while (state->credits > 0 && send_packet(state) == 0)
+            ;
+        if (state->credits > 0) {
+            // a fast replay reaches the end of the recorded sends early
+            if (errno == EPROTO)
+                break;
+            return -1;
+        }
+        result->stalls++;
+
+        wait = deadline_remaining_ms(end, 100);
+        if (wait == 0)
+            break;
+        if (read_packets(state, wait) < 0 && errno != EINTR)
+            return -1;
+    }
+
+    end = deadline_after(LOOPBACK_TIMEOUT, 0);
+    while (result->received < result->sent && !state->link_lost) {
+        wait = deadline_remaining_ms(end, LOOPBACK_TIMEOUT);
+        if (wait == 0 || (read_packets(state, wait) < 0 && errno != EINTR))
+            break;
+    }
+
+    result->duration = state->last_answer - start;
+    return 0;
+}
+
+
+int loopback_run(struct transport* transport, int dev_id, double duration,
+                 struct loopback_result* result)
+{
+    struct loopback_state* state;
+    struct transport_dev dev;
+    struct hci_dev_info di;
+    struct hci_filter filter;
+    struct sigaction action, old_action;
+    uint64_t end;
+    uint8_t mode;
+    int err = 0;
+
+    memset(result, 0x00, sizeof(*result));
+    result->handle = LOOPBACK_NO_HANDLE;
+
+    // the buffers the kernel learned from Read Buffer Size
+    if (transport_dev_info(transport, dev_id, &di) < 0)
+        return -1;
+    result->mtu = di.acl_mtu < HCI_MAX_ACL_SIZE ? di.acl_mtu : HCI_MAX_ACL_SIZE;
+    result->window = di.acl_pkts < LOOPBACK_MAX_WINDOW ? di.acl_pkts : LOOPBACK_MAX_WINDOW;
+    if (result->mtu < LOOPBACK_SEQ_SIZE || result->window == 0) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    state = calloc(1, sizeof(*state));
+    if (!state)
+        return -1;
+    state->result = result;
+
+    if (transport_open(transport, dev_id, &dev) < 0) {
+        err = errno;
+        free(state);
+        errno = err;
+        return -1;
+    }
+    state->dev = &dev;
+
+    hci_filter_clear(&filter);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &filter);
+    hci_filter_set_ptype(HCI_ACLDATA_PKT, &filter);
+    hci_filter_set_event(EVT_CMD_STATUS, &filter);
+    hci_filter_set_event(EVT_CMD_COMPLETE, &filter);
+    hci_filter_set_event(EVT_CONN_COMPLETE, &filter);
+    hci_filter_set_event(EVT_DISCONN_COMPLETE, &filter);
+    hci_filter_set_event(EVT_NUM_COMP_PKTS, &filter);
+    if (transport_set_filter(&dev, &filter) < 0 ||
+            command(state, OCF_READ_LOOPBACK_MODE, NULL, 0) < 0) {
+        err = errno;
+        goto out;
+    }
+    result->original_mode = state->rparam[1];
+
+    // ^C ends the test like the time running out
+    memset(&action, 0x00, sizeof(action));
+    action.sa_handler = on_sigint;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &old_action);
+    loopback_stop = 0;
+
+    mode = LOOPBACK_MODE_LOCAL;
+    if (command(state, OCF_WRITE_LOOPBACK_MODE, &mode, 1) < 0) {
+        err = errno;
+        goto restore;
+    }
+
+    // the Connection Complete of the loopback link follows the command
+    end = deadline_after(LOOPBACK_TIMEOUT, 0);
+    while (result->handle == LOOPBACK_NO_HANDLE && !loopback_stop) {
+        int wait = deadline_remaining_ms(end, LOOPBACK_TIMEOUT);
+
+        if (wait == 0) {
+            err = ETIMEDOUT;
+            goto restore;
+        }
+        if (read_packets(state, wait) < 0 && errno != EINTR) {
+            err = errno;
+            goto restore;
+        }
+    }
+
+    if (result->handle != LOOPBACK_NO_HANDLE && pump(state, duration) < 0)
+        err = errno;
+    if (!err && state->link_lost)
+        err = ECONNRESET;
+
+restore:
+    sigaction(SIGINT, &old_action, NULL);
+    mode = result->original_mode;
+    if (command(state, OCF_WRITE_LOOPBACK_MODE, &mode, 1) == 0)
+        result->restored = 1;
+    else if (!err)
+        err = errno;
+
+out:
+    transport_close(&dev);
+    free(state);
+    errno = err;
+    return err ? -1 : 0;
+}
+
+
+
+// output --------------------------------------------------------------------
+
+void loopback_print(struct outbuf* out, int dev_id, const struct loopback_result* result)
+{
+    double seconds = result->duration / 1e9;
+
+    out_printf(out, "hci%d local loopback: %llu packets of %d bytes, %d in flight, %.1f s\n",
+               dev_id, (unsigned long long) result->sent, result->mtu, result->window, seconds);
+    if (result->received == 0) {
+        out_printf(out, "    no packet came back\n");
+    } else {
+        out_printf(out, "    throughput:   %.2f MB/s, %.0f packets/s each way\n",
+                   seconds > 0 ? result->bytes / seconds / 1e6 : 0,
+                   seconds > 0 ? result->received / seconds : 0);
+        out_printf(out, "    round trip:  ");
+        trace_print_latency(out, trace_percentile(&result->latency, 0.5));
+        out_printf(out, " p50");
+        trace_print_latency(out, trace_percentile(&result->latency, 0.99));
+        out_printf(out, " p99");
+        trace_print_latency(out, result->latency.max);
+        out_printf(out, " max\n");
+    }
+    out_printf(out, "    lost %llu, corrupt %llu, waited for a buffer %llu times\n",
+               (unsigned long long) (result->sent - result->received),
+               (unsigned long long) result->corrupt, (unsigned long long) result->stalls);
+    if (result->restored)
+        out_printf(out, "    loopback mode 0x%02x restored\n", result->original_mode);
+    else
+        out_printf(out, "    loopback mode 0x%02x NOT restored\n", result->original_mode);
+}
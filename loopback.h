@@ -0,0 +1,74 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef LOOPBACK_H
+#define LOOPBACK_H
+
+#include <stdint.h>
+
+#include "output.h"
+#include "trace.h"
+#include "transport.h"
+
+
+// Controller self-test: puts an adapter into local loopback (Write
+// Loopback Mode), so the controller answers with a Connection Complete for
+// a link to itself and sends every ACL packet on it straight back. The
+// test fills packets of acl_mtu bytes, keeps no more of them in flight
+// than the acl_pkts buffers the adapter has, and only sends again when a
+// Number Of Completed Packets event hands a buffer back, like a host stack
+// does. Every round trip is timed. The original mode is restored at the
+// end. Nothing goes over the air: this is the host to controller path only.
+
+// the testing commands are OGF 0x06; BlueZ's OGF_TESTING_CMD is 0x3e
+#define LOOPBACK_OGF_TESTING  0x06
+
+#define LOOPBACK_MODE_NONE    0x00
+#define LOOPBACK_MODE_LOCAL   0x01
+
+// packets in flight at most, whatever the adapter reports
+#define LOOPBACK_MAX_WINDOW   64
+
+// the first bytes of every payload: a little endian sequence number
+#define LOOPBACK_SEQ_SIZE     4
+
+struct loopback_result {
+    uint8_t                 original_mode;
+    int                     restored;      // the original mode is back
+    uint16_t                handle;        // of the loopback link
+    int                     mtu;           // payload bytes per packet
+    int                     window;        // packets in flight at most
+    uint64_t                sent;
+    uint64_t                received;
+    uint64_t                bytes;         // payload received
+    uint64_t                corrupt;       // payload not as sent
+    uint64_t                stalls;        // waits for a free buffer
+    uint64_t                duration;      // ns, first packet to last answer
+    struct trace_histogram  latency;       // round trips
+};
+
+// runs the test on adapter dev_id for duration seconds or until SIGINT.
+// Returns 0 or -1 with errno set; result holds whatever was measured.
+int loopback_run(struct transport* transport, int dev_id, double duration,
+                 struct loopback_result* result);
+
+void loopback_print(struct outbuf* out, int dev_id, const struct loopback_result* result);
+
+#endif
@@ -0,0 +1,1059 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "decode.h"
+#include "fingerprint.h"
+#include "output.h"
+
+
+void outbuf_init(struct outbuf* out, size_t initial)
+{
+    out->data   = malloc(initial);
+    out->len    = 0;
+    out->cap    = out->data ? initial : 0;
+    out->failed = out->data == NULL;
+}
+
+
+void outbuf_free(struct outbuf* out)
+{
+    free(out->data);
+    out->data = NULL;
+    out->len = out->cap = 0;
+}
+
+
+static int reserve(struct outbuf* out, size_t len)
+{
+    size_t cap = out->cap ? out->cap : 256;
+    char* data;
+
+    if (out->failed)
+        return -1;
+    if (out->len + len <= out->cap)
+        return 0;
+
+    while (cap < out->len + len)
+        cap *= 2;
+
+    data = realloc(out->data, cap);
+    if (!data) {
+        out->failed = 1;
+        return -1;
+    }
+
+    out->data = data;
+    out->cap  = cap;
+    return 0;
+}
+
+
+void out_write(struct outbuf* out, const void* data, size_t len)
+{
+    if (len == 0 || reserve(out, len) < 0)
+        return;
+
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+}
+
+
+void out_printf(struct outbuf* out, const char* fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (out->failed)
+        return;
+
+    va_start(ap, fmt);
+    n = vsnprintf(out->data + out->len, out->cap - out->len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+
+    // did not fit: grow and format again
+    if ((size_t) n >= out->cap - out->len) {
+        if (reserve(out, n + 1) < 0)
+            return;
+        va_start(ap, fmt);
+        vsnprintf(out->data + out->len, out->cap - out->len, fmt, ap);
+        va_end(ap);
+    }
+
+    out->len += n;
+}
+
+
+int outbuf_flush(struct outbuf* out, int fd)
+{
+    size_t done = 0;
+
+    while (done < out->len) {
+        ssize_t n = write(fd, out->data + done, out->len - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += n;
+    }
+
+    out->len = 0;
+    return out->failed ? -1 : 0;
+}
+
+
+static const char* failure_name(enum probe_failure failed)
+{
+    switch (failed) {
+    case PROBE_OK:             return "ok";
+    case PROBE_FAILED_OPEN:    return "open";
+    case PROBE_FAILED_DEVINFO: return "devinfo";
+    case PROBE_FAILED_VERSION: return "version";
+    }
+    return "unknown";
+}
+
+
+const char* probe_field_name(enum probe_field field)
+{
+    static const char* const names[PROBE_NUM_FIELDS] = {
+        "devinfo", "version", "commands", "buffer_size",
+        "ext_features", "le_features", "le_buffer_size"
+    };
+
+    return field < PROBE_NUM_FIELDS ? names[field] : "unknown";
+}
+
+
+const char* field_status_name(enum field_status status)
+{
+    switch (status) {
+    case FIELD_UNSUPPORTED: return "unsupported";
+    case FIELD_OK:          return "ok";
+    case FIELD_FAILED:      return "failed";
+    case FIELD_TIMEOUT:     return "timeout";
+    case FIELD_SKIPPED:     return "skipped";
+    }
+    return "unknown";
+}
+
+
+void out_hex(struct outbuf* out, const uint8_t* data, int len)
+{
+    static const char digits[] = "0123456789abcdef";
+    char buf[2];
+    int i;
+
+    for (i = 0; i < len; i++) {
+        buf[0] = digits[data[i] >> 4];
+        buf[1] = digits[data[i] & 0x0f];
+        out_write(out, buf, 2);
+    }
+}
+
+
+void out_bdaddr(struct outbuf* out, const bdaddr_t* bdaddr)
+{
+    char addr[18];
+
+    ba2str(bdaddr, addr);
+    out_write(out, addr, 17);
+}
+
+
+// the adapter name is not guaranteed to be terminated or printable
+static size_t name_len(const struct hci_dev_info* di)
+{
+    return strnlen(di->name, sizeof(di->name));
+}
+
+
+
+// JSON ----------------------------------------------------------------------
+
+void out_json_string(struct outbuf* out, const char* str, size_t len)
+{
+    size_t i;
+
+    out_write(out, "\"", 1);
+    for (i = 0; i < len; i++) {
+        unsigned char c = str[i];
+
+        if (c == '"' || c == '\\')
+            out_printf(out, "\\%c", c);
+        else if (c < 0x20)
+            out_printf(out, "\\u%04x", c);
+        else
+            out_write(out, &c, 1);
+    }
+    out_write(out, "\"", 1);
+}
+
+
+static void json_hex(struct outbuf* out, const char* key, const uint8_t* data, int len)
+{
+    out_printf(out, ",\"%s\":\"", key);
+    out_hex(out, data, len);
+    out_write(out, "\"", 1);
+}
+
+
+// the capability vector and its fingerprint, see fingerprint.h
+static void out_capvec(struct outbuf* out, const struct adapter_info* info,
+                       const char* separator)
+{
+    uint8_t bytes[CAPVEC_BYTES];
+    struct capvec vec;
+
+    capvec_build(&vec, info);
+    capvec_pack(&vec, bytes);
+    out_printf(out, "%016llx%s", (unsigned long long) capvec_fingerprint(&vec), separator);
+    out_hex(out, bytes, CAPVEC_BYTES);
+}
+
+
+static void json_begin(struct outbuf* out)
+{
+    out_write(out, "[\n", 2);
+}
+
+
+static void json_adapter(struct outbuf* out, const struct adapter_info* info, int index)
+{
+    const struct hci_dev_info* di = &info->hciDevInfo;
+    const struct hci_dev_stats* st = &di->stat;
+    const struct hci_version* ver = &info->hciVersion;
+    const struct adapter_caps* caps = &info->caps;
+    int page, field;
+
+    out_printf(out, "%s{\"dev_id\":%d", index ? ",\n" : "", info->dev_id);
+
+    if (info->failed != PROBE_OK) {
+        out_printf(out, ",\"error\":\"%s\",\"errno\":%d,\"message\":",
+                   failure_name(info->failed), info->status);
+        out_json_string(out, strerror(info->status), strlen(strerror(info->status)));
+    }
+
+    out_write(out, ",\"fields\":{", 11);
+    for (field = 0; field < PROBE_NUM_FIELDS; field++)
+        out_printf(out, "%s\"%s\":\"%s\"", field ? "," : "",
+                   probe_field_name(field), field_status_name(info->fields[field]));
+    out_write(out, "}", 1);
+
+    // a failed probe still reports the fields it got
+    if (info->fields[FIELD_DEVINFO] != FIELD_OK)
+        goto done;
+
+    out_write(out, ",\"name\":", 8);
+    out_json_string(out, di->name, name_len(di));
+    out_write(out, ",\"bdaddr\":\"", 11);
+    out_bdaddr(out, &di->bdaddr);
+    out_printf(out, "\",\"type\":%u,\"flags\":%u", di->type, di->flags);
+    json_hex(out, "features", di->features, 8);
+    out_printf(out, ",\"pkt_type\":%u,\"link_policy\":%u,\"link_mode\":%u",
+               di->pkt_type, di->link_policy, di->link_mode);
+    out_printf(out, ",\"acl_mtu\":%u,\"acl_pkts\":%u,\"sco_mtu\":%u,\"sco_pkts\":%u",
+               di->acl_mtu, di->acl_pkts, di->sco_mtu, di->sco_pkts);
+    out_printf(out, ",\"stats\":{\"err_rx\":%u,\"err_tx\":%u,\"cmd_tx\":%u,\"evt_rx\":%u,"
+               "\"acl_tx\":%u,\"acl_rx\":%u,\"sco_tx\":%u,\"sco_rx\":%u,"
+               "\"byte_rx\":%u,\"byte_tx\":%u}",
+               st->err_rx, st->err_tx, st->cmd_tx, st->evt_rx,
+               st->acl_tx, st->acl_rx, st->sco_tx, st->sco_rx,
+               st->byte_rx, st->byte_tx);
+
+    if (info->fields[FIELD_VERSION] == FIELD_OK) {
+        out_printf(out, ",\"manufacturer\":%u,\"manufacturer_name\":", ver->manufacturer);
+        out_json_string(out, bt_compidtostr(ver->manufacturer),
+                    strlen(bt_compidtostr(ver->manufacturer)));
+        out_printf(out, ",\"hci_ver\":%u,\"hci_rev\":%u,\"lmp_ver\":%u,\"lmp_subver\":%u",
+                   ver->hci_ver, ver->hci_rev, ver->lmp_ver, ver->lmp_subver);
+    }
+
+    if (caps->have_commands)
+        json_hex(out, "commands", caps->commands, 64);
+
+    if (caps->ext_page_mask & ~0x01) {
+        int first = 1;
+
+        out_printf(out, ",\"max_ext_page\":%u,\"ext_features\":{", caps->max_ext_page);
+        for (page = 1; page < MAX_EXT_FEATURE_PAGES; page++) {
+            if (!(caps->ext_page_mask & (1 << page)))
+                continue;
+            out_printf(out, "%s\"%d\":\"", first ? "" : ",", page);
+            out_hex(out, caps->ext_features[page], 8);
+            out_write(out, "\"", 1);
+            first = 0;
+        }
+        out_write(out, "}", 1);
+    }
+
+    if (caps->have_buffer_size)
+        out_printf(out, ",\"buffer_size\":{\"acl_mtu\":%u,\"acl_max_pkt\":%u,"
+                   "\"sco_mtu\":%u,\"sco_max_pkt\":%u}",
+                   caps->acl_mtu, caps->acl_max_pkt, caps->sco_mtu, caps->sco_max_pkt);
+
+    if (caps->have_le_features)
+        json_hex(out, "le_features", caps->le_features, 8);
+
+    if (caps->have_le_buffer_size)
+        out_printf(out, ",\"le_buffer_size\":{\"acl_mtu\":%u,\"max_pkt\":%u}",
+                   caps->le_acl_mtu, caps->le_max_pkt);
+
+    out_write(out, ",\"fingerprint\":\"", 16);
+    out_capvec(out, info, "\",\"capvec\":\"");
+    out_write(out, "\"", 1);
+
+done:
+    out_printf(out, ",\"cached\":%s}", info->from_cache ? "true" : "false");
+}
+
+
+static void json_end(struct outbuf* out)
+{
+    out_write(out, "\n]\n", 3);
+}
+
+
+const struct emitter json_emitter = {
+    "json", 1, json_begin, json_adapter, json_end
+};
+
+
+
+// CSV -----------------------------------------------------------------------
+
+static void csv_begin(struct outbuf* out)
+{
+    out_printf(out, "dev_id,status,errno,name,bdaddr,type,flags,features,"
+               "pkt_type,link_policy,link_mode,acl_mtu,acl_pkts,sco_mtu,sco_pkts,"
+               "err_rx,err_tx,cmd_tx,evt_rx,acl_tx,acl_rx,sco_tx,sco_rx,byte_rx,byte_tx,"
+               "manufacturer,hci_ver,hci_rev,lmp_ver,lmp_subver,"
+               "commands,le_features,cached,incomplete,fingerprint,capvec\n");
+}
+
+
+static void csv_adapter(struct outbuf* out, const struct adapter_info* info, int index)
+{
+    const struct hci_dev_info* di = &info->hciDevInfo;
+    const struct hci_dev_stats* st = &di->stat;
+    const struct hci_version* ver = &info->hciVersion;
+    const struct adapter_caps* caps = &info->caps;
+    size_t i, len;
+    int field, first = 1;
+
+    out_printf(out, "%d,%s,%d,", info->dev_id,
+               failure_name(info->failed), info->status);
+
+    if (info->fields[FIELD_DEVINFO] != FIELD_OK) {
+        out_printf(out, ",,,,,,,,,,,,,,,,,,,,,,,,,,,,");
+        goto done;
+    }
+
+    // quote the name, doubling quotes inside
+    out_write(out, "\"", 1);
+    len = name_len(di);
+    for (i = 0; i < len; i++) {
+        if (di->name[i] == '"')
+            out_write(out, "\"", 1);
+        out_write(out, &di->name[i], 1);
+    }
+    out_write(out, "\",", 2);
+
+    out_bdaddr(out, &di->bdaddr);
+    out_printf(out, ",%u,%u,", di->type, di->flags);
+    out_hex(out, di->features, 8);
+    out_printf(out, ",%u,%u,%u,%u,%u,%u,%u,",
+               di->pkt_type, di->link_policy, di->link_mode,
+               di->acl_mtu, di->acl_pkts, di->sco_mtu, di->sco_pkts);
+    out_printf(out, "%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,",
+               st->err_rx, st->err_tx, st->cmd_tx, st->evt_rx,
+               st->acl_tx, st->acl_rx, st->sco_tx, st->sco_rx,
+               st->byte_rx, st->byte_tx);
+    if (info->fields[FIELD_VERSION] == FIELD_OK)
+        out_printf(out, "%u,%u,%u,%u,%u,",
+                   ver->manufacturer, ver->hci_ver, ver->hci_rev,
+                   ver->lmp_ver, ver->lmp_subver);
+    else
+        out_write(out, ",,,,,", 5);
+    if (caps->have_commands)
+        out_hex(out, caps->commands, 64);
+    out_write(out, ",", 1);
+    if (caps->have_le_features)
+        out_hex(out, caps->le_features, 8);
+
+done:
+    // the fields that were asked for but not read, as name=status;...
+    out_printf(out, ",%d,", info->from_cache);
+    for (field = 0; field < PROBE_NUM_FIELDS; field++) {
+        if (info->fields[field] == FIELD_OK || info->fields[field] == FIELD_UNSUPPORTED)
+            continue;
+        out_printf(out, "%s%s=%s", first ? "" : ";", probe_field_name(field),
+                   field_status_name(info->fields[field]));
+        first = 0;
+    }
+
+    out_write(out, ",", 1);
+    if (info->fields[FIELD_DEVINFO] == FIELD_OK)
+        out_capvec(out, info, ",");
+    else
+        out_write(out, ",", 1);
+    out_write(out, "\n", 1);
+}
+
+
+static void csv_end(struct outbuf* out)
+{
+}
+
+
+const struct emitter csv_emitter = {
+    "csv", 1, csv_begin, csv_adapter, csv_end
+};
+
+
+
+// binary TLV ----------------------------------------------------------------
+
+static void tlv(struct outbuf* out, uint8_t tag, const void* value, uint16_t len)
+{
+    uint8_t hdr[3] = { tag };
+
+    bt_put_le16(len, &hdr[1]);
+    out_write(out, hdr, sizeof(hdr));
+    out_write(out, value, len);
+}
+
+
+static void tlv_u8(struct outbuf* out, uint8_t tag, uint8_t val)
+{
+    tlv(out, tag, &val, 1);
+}
+
+
+static void tlv_u16(struct outbuf* out, uint8_t tag, uint16_t val)
+{
+    uint8_t buf[2] = { 0 };
+
+    bt_put_le16(val, buf);
+    tlv(out, tag, buf, sizeof(buf));
+}
+
+
+static void tlv_u32(struct outbuf* out, uint8_t tag, uint32_t val)
+{
+    uint8_t buf[4] = { 0 };
+
+    bt_put_le32(val, buf);
+    tlv(out, tag, buf, sizeof(buf));
+}
+
+
+static void tlv_begin(struct outbuf* out)
+{
+    uint8_t version = TLV_VERSION;
+
+    out_write(out, TLV_MAGIC, 4);
+    out_write(out, &version, 1);
+}
+
+
+static void tlv_adapter(struct outbuf* out, const struct adapter_info* info, int index)
+{
+    const struct hci_dev_info* di = &info->hciDevInfo;
+    const struct hci_version* ver = &info->hciVersion;
+    const struct adapter_caps* caps = &info->caps;
+    const uint32_t* stats = (const uint32_t*) &di->stat;
+    uint8_t capvec[CAPVEC_BYTES];
+    struct capvec vec;
+    uint8_t buf[64];
+    size_t start;
+    int i;
+
+    // the container length is patched in once its content is known
+    tlv(out, TLV_ADAPTER, NULL, 0);
+    start = out->len;
+
+    tlv_u16(out, TLV_DEV_ID, info->dev_id);
+
+    if (info->failed != PROBE_OK) {
+        buf[0] = info->failed;
+        bt_put_le32(info->status, &buf[1]);
+        tlv(out, TLV_ERROR, buf, 5);
+    }
+
+    tlv(out, TLV_FIELD_STATUS, info->fields, PROBE_NUM_FIELDS);
+    if (info->fields[FIELD_DEVINFO] != FIELD_OK)
+        goto done;
+
+    tlv(out, TLV_NAME, di->name, name_len(di));
+    tlv(out, TLV_BDADDR, &di->bdaddr, sizeof(di->bdaddr));
+    tlv_u8(out, TLV_TYPE, di->type);
+    tlv_u32(out, TLV_FLAGS, di->flags);
+    tlv(out, TLV_FEATURES, di->features, 8);
+    tlv_u32(out, TLV_PKT_TYPE, di->pkt_type);
+    tlv_u32(out, TLV_LINK_POLICY, di->link_policy);
+    tlv_u32(out, TLV_LINK_MODE, di->link_mode);
+
+    bt_put_le16(di->acl_mtu,  &buf[0]);
+    bt_put_le16(di->acl_pkts, &buf[2]);
+    bt_put_le16(di->sco_mtu,  &buf[4]);
+    bt_put_le16(di->sco_pkts, &buf[6]);
+    tlv(out, TLV_MTU, buf, 8);
+
+    for (i = 0; i < (int) (sizeof(di->stat) / sizeof(uint32_t)); i++)
+        bt_put_le32(stats[i], &buf[i * 4]);
+    tlv(out, TLV_STATS, buf, sizeof(di->stat));
+
+    if (info->fields[FIELD_VERSION] == FIELD_OK) {
+        bt_put_le16(ver->manufacturer, &buf[0]);
+        buf[2] = ver->hci_ver;
+        bt_put_le16(ver->hci_rev, &buf[3]);
+        buf[5] = ver->lmp_ver;
+        bt_put_le16(ver->lmp_subver, &buf[6]);
+        tlv(out, TLV_VERSION_INFO, buf, 8);
+    }
+
+    if (caps->have_commands)
+        tlv(out, TLV_COMMANDS, caps->commands, 64);
+
+    for (i = 1; i < MAX_EXT_FEATURE_PAGES; i++) {
+        if (!(caps->ext_page_mask & (1 << i)))
+            continue;
+        buf[0] = i;
+        memcpy(&buf[1], caps->ext_features[i], 8);
+        tlv(out, TLV_EXT_FEATURES, buf, 9);
+    }
+
+    if (caps->have_buffer_size) {
+        bt_put_le16(caps->acl_mtu, &buf[0]);
+        buf[2] = caps->sco_mtu;
+        bt_put_le16(caps->acl_max_pkt, &buf[3]);
+        bt_put_le16(caps->sco_max_pkt, &buf[5]);
+        tlv(out, TLV_BUFFER_SIZE, buf, 7);
+    }
+
+    if (caps->have_le_features)
+        tlv(out, TLV_LE_FEATURES, caps->le_features, 8);
+
+    if (caps->have_le_buffer_size) {
+        bt_put_le16(caps->le_acl_mtu, &buf[0]);
+        buf[2] = caps->le_max_pkt;
+        tlv(out, TLV_LE_BUFFER_SIZE, buf, 3);
+    }
+
+    if (info->from_cache)
+        tlv(out, TLV_CACHED, NULL, 0);
+
+    capvec_build(&vec, info);
+    capvec_pack(&vec, capvec);
+    tlv(out, TLV_CAPVEC, capvec, CAPVEC_BYTES);
+
+done:
+    if (!out->failed)
+        bt_put_le16(out->len - start, out->data + start - 2);
+}
+
+
+static void tlv_end(struct outbuf* out)
+{
+}
+
+
+const struct emitter tlv_emitter = {
+    "tlv", 1, tlv_begin, tlv_adapter, tlv_end
+};
+
+
+// the value of one TLV_ADAPTER container; unknown tags are skipped, known
+// ones shorter than their format are an error
+static int tlv_parse_adapter(const uint8_t* data, size_t len, struct adapter_info* info)
+{
+    struct hci_dev_info* di = &info->hciDevInfo;
+    struct hci_version* ver = &info->hciVersion;
+    struct adapter_caps* caps = &info->caps;
+    uint32_t* stats = (uint32_t*) &di->stat;
+    size_t pos = 0;
+    int i;
+
+    memset(info, 0x00, sizeof(*info));
+
+    while (pos + 3 <= len) {
+        uint8_t tag = data[pos];
+        size_t vlen = bt_get_le16(&data[pos + 1]);
+        const uint8_t* v = &data[pos + 3];
+        size_t need = 0;
+
+        if (pos + 3 + vlen > len)
+            goto bad;
+        pos += 3 + vlen;
+
+        switch (tag) {
+        case TLV_DEV_ID:         need = 2;  break;
+        case TLV_ERROR:          need = 5;  break;
+        case TLV_BDADDR:         need = 6;  break;
+        case TLV_TYPE:           need = 1;  break;
+        case TLV_FLAGS:
+        case TLV_PKT_TYPE:
+        case TLV_LINK_POLICY:
+        case TLV_LINK_MODE:      need = 4;  break;
+        case TLV_FEATURES:
+        case TLV_MTU:
+        case TLV_VERSION_INFO:
+        case TLV_LE_FEATURES:    need = 8;  break;
+        case TLV_STATS:          need = sizeof(di->stat); break;
+        case TLV_COMMANDS:       need = 64; break;
+        case TLV_EXT_FEATURES:   need = 9;  break;
+        case TLV_BUFFER_SIZE:    need = 7;  break;
+        case TLV_LE_BUFFER_SIZE: need = 3;  break;
+        }
+        if (vlen < need)
+            goto bad;
+
+        switch (tag) {
+        case TLV_DEV_ID:
+            info->dev_id = di->dev_id = bt_get_le16(v);
+            break;
+        case TLV_ERROR:
+            info->failed = v[0];
+            info->status = bt_get_le32(&v[1]);
+            break;
+        case TLV_FIELD_STATUS:
+            memcpy(info->fields, v, vlen < PROBE_NUM_FIELDS ? vlen : PROBE_NUM_FIELDS);
+            break;
+        case TLV_NAME:
+            memcpy(di->name, v, vlen < sizeof(di->name) ? vlen : sizeof(di->name));
+            break;
+        case TLV_BDADDR:       memcpy(&di->bdaddr, v, 6);         break;
+        case TLV_TYPE:         di->type = v[0];                   break;
+        case TLV_FLAGS:        di->flags = bt_get_le32(v);        break;
+        case TLV_FEATURES:     memcpy(di->features, v, 8);        break;
+        case TLV_PKT_TYPE:     di->pkt_type = bt_get_le32(v);     break;
+        case TLV_LINK_POLICY:  di->link_policy = bt_get_le32(v);  break;
+        case TLV_LINK_MODE:    di->link_mode = bt_get_le32(v);    break;
+        case TLV_MTU:
+            di->acl_mtu  = bt_get_le16(&v[0]);
+            di->acl_pkts = bt_get_le16(&v[2]);
+            di->sco_mtu  = bt_get_le16(&v[4]);
+            di->sco_pkts = bt_get_le16(&v[6]);
+            break;
+        case TLV_STATS:
+            for (i = 0; i < (int) (sizeof(di->stat) / sizeof(uint32_t)); i++)
+                stats[i] = bt_get_le32(&v[i * 4]);
+            break;
+        case TLV_VERSION_INFO:
+            ver->manufacturer = bt_get_le16(&v[0]);
+            ver->hci_ver      = v[2];
+            ver->hci_rev      = bt_get_le16(&v[3]);
+            ver->lmp_ver      = v[5];
+            ver->lmp_subver   = bt_get_le16(&v[6]);
+            break;
+        case TLV_COMMANDS:
+            memcpy(caps->commands, v, 64);
+            caps->have_commands = 1;
+            break;
+        // the highest page is not sent, the highest one read comes closest
+        case TLV_EXT_FEATURES:
+            if (v[0] == 0 || v[0] >= MAX_EXT_FEATURE_PAGES)
+                break;
+            memcpy(caps->ext_features[v[0]], &v[1], 8);
+            caps->ext_page_mask |= 1 << v[0];
+            if (v[0] > caps->max_ext_page)
+                caps->max_ext_page = v[0];
+            break;
+        case TLV_BUFFER_SIZE:
+            caps->acl_mtu     = bt_get_le16(&v[0]);
+            caps->sco_mtu     = v[2];
+            caps->acl_max_pkt = bt_get_le16(&v[3]);
+            caps->sco_max_pkt = bt_get_le16(&v[5]);
+            caps->have_buffer_size = 1;
+            break;
+        case TLV_LE_FEATURES:
+            memcpy(caps->le_features, v, 8);
+            caps->have_le_features = 1;
+            break;
+        case TLV_LE_BUFFER_SIZE:
+            caps->le_acl_mtu = bt_get_le16(&v[0]);
+            caps->le_max_pkt = v[2];
+            caps->have_le_buffer_size = 1;
+            break;
+        case TLV_CACHED:
+            info->from_cache = 1;
+            break;
+        }
+    }
+
+    if (pos == len)
+        return 0;
+bad:
+    errno = EBADMSG;
+    return -1;
+}
+
+
+int tlv_parse(const uint8_t* data, size_t len, struct adapter_info* infos, int max)
+{
+    size_t pos = 5;
+    int count = 0;
+
+    if (len < 5 || memcmp(data, TLV_MAGIC, 4) != 0 || data[4] != TLV_VERSION) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    while (pos < len && count < max) {
+        size_t vlen;
+
+        if (pos + 3 > len || data[pos] != TLV_ADAPTER)
+            goto bad;
+        vlen = bt_get_le16(&data[pos + 1]);
+        if (pos + 3 + vlen > len)
+            goto bad;
+        if (tlv_parse_adapter(&data[pos + 3], vlen, &infos[count]) < 0)
+            return -1;
+        count++;
+        pos += 3 + vlen;
+    }
+
+    return count;
+
+bad:
+    errno = EBADMSG;
+    return -1;
+}
+
+
+
+// field projection ----------------------------------------------------------
+
+enum column {
+    COL_DEV_ID, COL_FLAGS, COL_NAME, COL_BDADDR, COL_TYPE, COL_FEATURES,
+    COL_PKT_TYPE, COL_LINK_POLICY, COL_LINK_MODE,
+    COL_ACL_MTU, COL_ACL_PKTS, COL_SCO_MTU, COL_SCO_PKTS, COL_STATS,
+    COL_MANUFACTURER, COL_HCI_VER, COL_HCI_REV, COL_LMP_VER, COL_LMP_SUBVER,
+    COL_COMMANDS, COL_BUFFER_SIZE, COL_EXT_FEATURES, COL_LE_FEATURES, COL_LE_BUFFER_SIZE,
+    COL_FINGERPRINT, COL_CAPVEC,
+    NUM_COLUMNS
+};
+
+#define LIST_ONLY   -1
+#define DEVINFO     FIELD_BIT(FIELD_DEVINFO)
+#define ALL_FIELDS  ((1u << PROBE_NUM_FIELDS) - 1)
+
+// field: the probe field whose status tells if the value is there;
+// reads: what the probe has to read for it
+static const struct {
+    const char*   name;
+    int           field;
+    unsigned int  reads;
+} columns[NUM_COLUMNS] = {
+    [COL_DEV_ID]         = { "dev_id",         LIST_ONLY,            0 },
+    [COL_FLAGS]          = { "flags",          LIST_ONLY,            0 },
+    [COL_NAME]           = { "name",           FIELD_DEVINFO,        DEVINFO },
+    [COL_BDADDR]         = { "bdaddr",         FIELD_DEVINFO,        DEVINFO },
+    [COL_TYPE]           = { "type",           FIELD_DEVINFO,        DEVINFO },
+    [COL_FEATURES]       = { "features",       FIELD_DEVINFO,        DEVINFO },
+    [COL_PKT_TYPE]       = { "pkt_type",       FIELD_DEVINFO,        DEVINFO },
+    [COL_LINK_POLICY]    = { "link_policy",    FIELD_DEVINFO,        DEVINFO },
+    [COL_LINK_MODE]      = { "link_mode",      FIELD_DEVINFO,        DEVINFO },
+    [COL_ACL_MTU]        = { "acl_mtu",        FIELD_DEVINFO,        DEVINFO },
+    [COL_ACL_PKTS]       = { "acl_pkts",       FIELD_DEVINFO,        DEVINFO },
+    [COL_SCO_MTU]        = { "sco_mtu",        FIELD_DEVINFO,        DEVINFO },
+    [COL_SCO_PKTS]       = { "sco_pkts",       FIELD_DEVINFO,        DEVINFO },
+    [COL_STATS]          = { "stats",          FIELD_DEVINFO,        DEVINFO },
+    [COL_MANUFACTURER]   = { "manufacturer",   FIELD_VERSION,        FIELD_BIT(FIELD_VERSION) },
+    [COL_HCI_VER]        = { "hci_ver",        FIELD_VERSION,        FIELD_BIT(FIELD_VERSION) },
+    [COL_HCI_REV]        = { "hci_rev",        FIELD_VERSION,        FIELD_BIT(FIELD_VERSION) },
+    [COL_LMP_VER]        = { "lmp_ver",        FIELD_VERSION,        FIELD_BIT(FIELD_VERSION) },
+    [COL_LMP_SUBVER]     = { "lmp_subver",     FIELD_VERSION,        FIELD_BIT(FIELD_VERSION) },
+    [COL_COMMANDS]       = { "commands",       FIELD_COMMANDS,       FIELD_BIT(FIELD_COMMANDS) },
+    [COL_BUFFER_SIZE]    = { "buffer_size",    FIELD_BUFFER_SIZE,    FIELD_BIT(FIELD_BUFFER_SIZE) },
+    [COL_EXT_FEATURES]   = { "ext_features",   FIELD_EXT_FEATURES,   FIELD_BIT(FIELD_EXT_FEATURES) },
+    [COL_LE_FEATURES]    = { "le_features",    FIELD_LE_FEATURES,    FIELD_BIT(FIELD_LE_FEATURES) },
+    [COL_LE_BUFFER_SIZE] = { "le_buffer_size", FIELD_LE_BUFFER_SIZE, FIELD_BIT(FIELD_LE_BUFFER_SIZE) },
+    // the vector covers everything; without the optional parts it is
+    // still valid, only different
+    [COL_FINGERPRINT]    = { "fingerprint",    FIELD_DEVINFO,        ALL_FIELDS },
+    [COL_CAPVEC]         = { "capvec",         FIELD_DEVINFO,        ALL_FIELDS },
+};
+
+const char projection_names[] =
+    "dev_id,flags,name,bdaddr,type,features,pkt_type,link_policy,link_mode,"
+    "acl_mtu,acl_pkts,sco_mtu,sco_pkts,stats,"
+    "manufacturer,hci_ver,hci_rev,lmp_ver,lmp_subver,"
+    "commands,buffer_size,ext_features,le_features,le_buffer_size,"
+    "fingerprint,capvec";
+
+
+int projection_parse(struct projection* proj, const char* names)
+{
+    const char* name = names;
+    uint32_t seen = 0;
+    size_t len;
+    int col;
+
+    proj->count = 0;
+    while (*name) {
+        len = strcspn(name, ",");
+
+        for (col = 0; col < NUM_COLUMNS; col++)
+            if (strlen(columns[col].name) == len && !strncmp(columns[col].name, name, len))
+                break;
+        if (col == NUM_COLUMNS || (seen & (1u << col)) ||
+                proj->count == PROJECTION_MAX_COLUMNS) {
+            errno = EINVAL;
+            return -1;
+        }
+        seen |= 1u << col;
+        proj->columns[proj->count++] = col;
+
+        name += len;
+        if (*name == ',')
+            name++;
+    }
+
+    if (proj->count == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+
+unsigned int projection_fields(const struct projection* proj)
+{
+    unsigned int fields = 0;
+    int i;
+
+    for (i = 0; i < proj->count; i++)
+        fields |= columns[proj->columns[i]].reads;
+
+    return fields;
+}
+
+
+// hex strings and addresses are quoted in JSON only
+static void column_hex(struct outbuf* out, enum projection_format format,
+                       const uint8_t* data, int len)
+{
+    if (format == PROJECTION_JSON)
+        out_write(out, "\"", 1);
+    out_hex(out, data, len);
+    if (format == PROJECTION_JSON)
+        out_write(out, "\"", 1);
+}
+
+
+// one value; objects in JSON, ':' joined in text and CSV
+static void column_value(struct outbuf* out, enum projection_format format,
+                         const struct adapter_info* info, int col)
+{
+    const struct hci_dev_info* di = &info->hciDevInfo;
+    const struct hci_dev_stats* st = &di->stat;
+    const struct hci_version* ver = &info->hciVersion;
+    const struct adapter_caps* caps = &info->caps;
+    int json = format == PROJECTION_JSON;
+    struct bit_iter it;
+    size_t i, len;
+    int bit, page, first = 1;
+
+    switch (col) {
+    case COL_DEV_ID:
+        out_printf(out, "%d", info->dev_id);
+        break;
+
+    case COL_FLAGS:
+        if (format != PROJECTION_TEXT) {
+            out_printf(out, "%u", di->flags);
+            break;
+        }
+        bit_iter_init_value(&it, di->flags);
+        while ((bit = bit_iter_next(&it)) >= 0) {
+            const char* name = bit_table_name(&dev_flags_table, bit);
+
+            if (name)
+                out_printf(out, "%s%s", first ? "" : ",", name);
+            else
+                out_printf(out, "%s%d", first ? "" : ",", bit);
+            first = 0;
+        }
+        if (first)
+            out_write(out, "-", 1);
+        break;
+
+    case COL_NAME:
+        len = name_len(di);
+        if (json) {
+            out_json_string(out, di->name, len);
+        } else if (format == PROJECTION_CSV) {
+            out_write(out, "\"", 1);
+            for (i = 0; i < len; i++) {
+                if (di->name[i] == '"')
+                    out_write(out, "\"", 1);
+                out_write(out, &di->name[i], 1);
+            }
+            out_write(out, "\"", 1);
+        } else {
+            out_write(out, di->name, len);
+        }
+        break;
+
+    case COL_BDADDR:
+        if (json)
+            out_write(out, "\"", 1);
+        out_bdaddr(out, &di->bdaddr);
+        if (json)
+            out_write(out, "\"", 1);
+        break;
+
+    case COL_TYPE:         out_printf(out, "%u", di->type);        break;
+    case COL_FEATURES:     column_hex(out, format, di->features, 8); break;
+    case COL_PKT_TYPE:     out_printf(out, "%u", di->pkt_type);    break;
+    case COL_LINK_POLICY:  out_printf(out, "%u", di->link_policy); break;
+    case COL_LINK_MODE:    out_printf(out, "%u", di->link_mode);   break;
+    case COL_ACL_MTU:      out_printf(out, "%u", di->acl_mtu);     break;
+    case COL_ACL_PKTS:     out_printf(out, "%u", di->acl_pkts);    break;
+    case COL_SCO_MTU:      out_printf(out, "%u", di->sco_mtu);     break;
+    case COL_SCO_PKTS:     out_printf(out, "%u", di->sco_pkts);    break;
+
+    case COL_STATS:
+        out_printf(out, json ? "{\"err_rx\":%u,\"err_tx\":%u,\"cmd_tx\":%u,\"evt_rx\":%u,"
+                               "\"acl_tx\":%u,\"acl_rx\":%u,\"sco_tx\":%u,\"sco_rx\":%u,"
+                               "\"byte_rx\":%u,\"byte_tx\":%u}"
+                             : "%u:%u:%u:%u:%u:%u:%u:%u:%u:%u",
+                   st->err_rx, st->err_tx, st->cmd_tx, st->evt_rx,
+                   st->acl_tx, st->acl_rx, st->sco_tx, st->sco_rx,
+                   st->byte_rx, st->byte_tx);
+        break;
+
+    case COL_MANUFACTURER: out_printf(out, "%u", ver->manufacturer); break;
+    case COL_HCI_VER:      out_printf(out, "%u", ver->hci_ver);      break;
+    case COL_HCI_REV:      out_printf(out, "%u", ver->hci_rev);      break;
+    case COL_LMP_VER:      out_printf(out, "%u", ver->lmp_ver);      break;
+    case COL_LMP_SUBVER:   out_printf(out, "%u", ver->lmp_subver);   break;
+
+    case COL_COMMANDS:     column_hex(out, format, caps->commands, 64);   break;
+    case COL_LE_FEATURES:  column_hex(out, format, caps->le_features, 8); break;
+
+    case COL_BUFFER_SIZE:
+        out_printf(out, json ? "{\"acl_mtu\":%u,\"acl_max_pkt\":%u,"
+                               "\"sco_mtu\":%u,\"sco_max_pkt\":%u}"
+                             : "%u:%u:%u:%u",
+                   caps->acl_mtu, caps->acl_max_pkt, caps->sco_mtu, caps->sco_max_pkt);
+        break;
+
+    case COL_LE_BUFFER_SIZE:
+        out_printf(out, json ? "{\"acl_mtu\":%u,\"max_pkt\":%u}" : "%u:%u",
+                   caps->le_acl_mtu, caps->le_max_pkt);
+        break;
+
+    // page:features of every page read beyond page 0
+    case COL_EXT_FEATURES:
+        if (json)
+            out_write(out, "{", 1);
+        for (page = 1; page < MAX_EXT_FEATURE_PAGES; page++) {
+            if (!(caps->ext_page_mask & (1 << page)))
+                continue;
+            out_printf(out, json ? "%s\"%d\":\"" : "%s%d:", first ? "" : json ? "," : ";", page);
+            out_hex(out, caps->ext_features[page], 8);
+            if (json)
+                out_write(out, "\"", 1);
+            first = 0;
+        }
+        if (json)
+            out_write(out, "}", 1);
+        break;
+
+    case COL_FINGERPRINT:
+    case COL_CAPVEC: {
+        uint8_t bytes[CAPVEC_BYTES];
+        struct capvec vec;
+
+        capvec_build(&vec, info);
+        if (col == COL_CAPVEC) {
+            capvec_pack(&vec, bytes);
+            column_hex(out, format, bytes, CAPVEC_BYTES);
+        } else {
+            out_printf(out, json ? "\"%016llx\"" : "%016llx",
+                       (unsigned long long) capvec_fingerprint(&vec));
+        }
+        break;
+    }
+    }
+}
+
+
+void projection_print(struct outbuf* out, enum projection_format format,
+                      const struct projection* proj,
+                      const struct adapter_info* infos, int count)
+{
+    const char* separator = format == PROJECTION_CSV ? "," : "\t";
+    int i, j;
+
+    if (format == PROJECTION_JSON)
+        out_write(out, "[\n", 2);
+    else {
+        for (j = 0; j < proj->count; j++)
+            out_printf(out, "%s%s", j ? separator : "", columns[proj->columns[j]].name);
+        out_write(out, "\n", 1);
+    }
+
+    for (i = 0; i < count; i++) {
+        const struct adapter_info* info = &infos[i];
+
+        if (format == PROJECTION_JSON)
+            out_write(out, i ? ",\n{" : "{", i ? 3 : 1);
+
+        for (j = 0; j < proj->count; j++) {
+            int col = proj->columns[j];
+            int field = columns[col].field;
+
+            if (format == PROJECTION_JSON)
+                out_printf(out, "%s\"%s\":", j ? "," : "", columns[col].name);
+            else if (j)
+                out_write(out, separator, 1);
+
+            if (field == LIST_ONLY || info->fields[field] == FIELD_OK)
+                column_value(out, format, info, col);
+            else if (format == PROJECTION_JSON)
+                out_write(out, "null", 4);
+            else if (format == PROJECTION_TEXT)
+                out_write(out, "-", 1);
+        }
+
+        out_write(out, format == PROJECTION_JSON ? "}" : "\n", 1);
+    }
+
+    if (format == PROJECTION_JSON)
+        out_write(out, count ? "\n]\n" : "]\n", count ? 3 : 2);
+}
@@ -0,0 +1,144 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "adapter.h"
+
+
+// Everything a run prints is rendered into one growing buffer and written
+// with a single write() at the end (or per event in the long running modes).
+
+struct outbuf {
+    char*   data;
+    size_t  len;
+    size_t  cap;
+    int     failed;        // out of memory; further output is dropped
+};
+
+void outbuf_init(struct outbuf* out, size_t initial);
+void outbuf_free(struct outbuf* out);
+
+void out_write(struct outbuf* out, const void* data, size_t len);
+void out_printf(struct outbuf* out, const char* fmt, ...)
+    __attribute__ ((format (printf, 2, 3)));
+
+// lower case hex digits, a 00:11:22:33:44:55 address, and a quoted and
+// escaped JSON string of len bytes
+void out_hex(struct outbuf* out, const uint8_t* data, int len);
+void out_bdaddr(struct outbuf* out, const bdaddr_t* bdaddr);
+void out_json_string(struct outbuf* out, const char* str, size_t len);
+
+// writes everything to fd and empties the buffer; -1 with errno on error
+int outbuf_flush(struct outbuf* out, int fd);
+
+
+// renders the probe results in one output format
+struct emitter {
+    const char*  name;
+    int          reports_errors;   // failed adapters are part of the output
+    void (*begin)(struct outbuf* out);
+    void (*adapter)(struct outbuf* out, const struct adapter_info* info, int index);
+    void (*end)(struct outbuf* out);
+};
+
+extern const struct emitter json_emitter;
+extern const struct emitter csv_emitter;
+extern const struct emitter tlv_emitter;
+
+// names for the per-field probe status, as used in all formats
+const char* probe_field_name(enum probe_field field);
+const char* field_status_name(enum field_status status);
+
+
+// --fields: a subset of an adapter's values, one column each, in the order
+// they were asked for. Text is a header line and tab separated rows, CSV the
+// same with commas, JSON one object per adapter with only those keys; values
+// that could not be read are "-", empty or null.
+#define PROJECTION_MAX_COLUMNS 32
+
+struct projection {
+    int      count;
+    uint8_t  columns[PROJECTION_MAX_COLUMNS];
+};
+
+enum projection_format {
+    PROJECTION_TEXT,
+    PROJECTION_CSV,
+    PROJECTION_JSON
+};
+
+// "name,bdaddr,flags"; -1 with errno EINVAL for an unknown or repeated
+// name or more than PROJECTION_MAX_COLUMNS
+int projection_parse(struct projection* proj, const char* names);
+
+// the column names, comma separated, for the help text
+extern const char projection_names[];
+
+// FIELD_BIT()s the probe has to read for the columns; 0 if the adapter
+// list alone (dev_id and flags) has everything
+unsigned int projection_fields(const struct projection* proj);
+
+void projection_print(struct outbuf* out, enum projection_format format,
+                      const struct projection* proj,
+                      const struct adapter_info* infos, int count);
+
+
+// binary format: "BTDI" and a version byte, followed by one TLV_ADAPTER
+// per adapter. Every TLV is a tag byte, a little endian 16 bit length and
+// the value; integers are little endian with the width of the hci struct
+// field they come from.
+#define TLV_MAGIC    "BTDI"
+#define TLV_VERSION  1
+
+enum tlv_tag {
+    TLV_ADAPTER = 0x01,     // container for the TLVs below
+    TLV_DEV_ID,             // u16
+    TLV_ERROR,              // u8 failed probe step, u32 errno
+    TLV_NAME,               // string, not terminated
+    TLV_BDADDR,             // 6 bytes, as in bdaddr_t
+    TLV_TYPE,               // u8
+    TLV_FLAGS,              // u32
+    TLV_FEATURES,           // 8 bytes, LMP features page 0
+    TLV_PKT_TYPE,           // u32
+    TLV_LINK_POLICY,        // u32
+    TLV_LINK_MODE,          // u32
+    TLV_MTU,                // u16 acl_mtu, u16 acl_pkts, u16 sco_mtu, u16 sco_pkts
+    TLV_STATS,              // 10 x u32 in struct hci_dev_stats order
+    TLV_VERSION_INFO,       // u16 manufacturer, u8 hci_ver, u16 hci_rev, u8 lmp_ver, u16 lmp_subver
+    TLV_COMMANDS,           // 64 bytes supported commands
+    TLV_EXT_FEATURES,       // u8 page, 8 bytes features; once per page
+    TLV_BUFFER_SIZE,        // u16 acl_mtu, u8 sco_mtu, u16 acl_max_pkt, u16 sco_max_pkt
+    TLV_LE_FEATURES,        // 8 bytes
+    TLV_LE_BUFFER_SIZE,     // u16 le_acl_mtu, u8 le_max_pkt
+    TLV_CACHED,             // no value; caps came from the cache
+    TLV_FIELD_STATUS,       // u8 enum field_status per enum probe_field
+    TLV_CAPVEC              // CAPVEC_BYTES, the capability vector of fingerprint.h
+};
+
+// reads what the tlv emitter wrote back into at most max infos; returns
+// their number, or -1 with errno EBADMSG for anything else
+int tlv_parse(const uint8_t* data, size_t len, struct adapter_info* infos, int max);
+
+#endif
@@ -0,0 +1,298 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "publish.h"
+
+
+// a reader gives up on a record the writer never finishes (it died)
+#define PUBLISH_READ_RETRIES 1000000
+
+
+static uint64_t realtime_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+static int layout_matches(const struct publish_segment* segment)
+{
+    return memcmp(segment->magic, PUBLISH_MAGIC, sizeof(PUBLISH_MAGIC)) == 0 &&
+           segment->version     == PUBLISH_VERSION &&
+           segment->record_size == sizeof(struct publish_record) &&
+           segment->max_records == PUBLISH_MAX_RECORDS;
+}
+
+
+int publish_reader_open(struct publish_reader* reader, const char* name)
+{
+    struct stat st;
+    void* map;
+    int fd;
+
+    reader->segment = NULL;
+
+    fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size < (off_t) sizeof(struct publish_segment)) {
+        close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+
+    map = mmap(NULL, sizeof(struct publish_segment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    if (!layout_matches(map)) {
+        munmap(map, sizeof(struct publish_segment));
+        errno = EPROTO;
+        return -1;
+    }
+
+    reader->segment = map;
+    return 0;
+}
+
+
+void publish_reader_close(struct publish_reader* reader)
+{
+    if (reader->segment)
+        munmap((void*) reader->segment, sizeof(struct publish_segment));
+    reader->segment = NULL;
+}
+
+
+int publish_read(const struct publish_reader* reader, int index, struct publish_data* data)
+{
+    const struct publish_record* record = &reader->segment->records[index];
+    uint32_t begin, end;
+    long retries = 0;
+
+    do {
+        if (retries++ == PUBLISH_READ_RETRIES) {
+            errno = EBUSY;
+            return -1;
+        }
+
+        begin = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+        if (begin & 1)
+            continue;
+        memcpy(data, (const void*) &record->data, sizeof(*data));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        end = __atomic_load_n(&record->seq, __ATOMIC_RELAXED);
+    } while ((begin & 1) || begin != end);
+
+    return data->present != 0;
+}
+
+
+// the writer is the only one changing seq, so it needs no atomic increment
+static void record_write(struct publish_record* record, const struct publish_data* data)
+{
+    uint32_t seq = record->seq;
+
+    __atomic_store_n(&record->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&record->data, data, sizeof(*data));
+    __atomic_store_n(&record->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+
+static struct publish_segment* open_writer(const char* name)
+{
+    struct publish_segment* segment;
+    int fd;
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return NULL;
+
+    if (ftruncate(fd, sizeof(struct publish_segment)) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    segment = mmap(NULL, sizeof(struct publish_segment), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED)
+        return NULL;
+
+    // one writer per segment
+    if (layout_matches(segment) && segment->writer_pid != 0 &&
+        (pid_t) segment->writer_pid != getpid() &&
+        (kill(segment->writer_pid, 0) == 0 || errno == EPERM)) {
+        munmap(segment, sizeof(struct publish_segment));
+        errno = EBUSY;
+        return NULL;
+    }
+
+    // readers check the magic, so it is written last
+    if (!layout_matches(segment)) {
+        memset(segment, 0x00, sizeof(*segment));
+        segment->version     = PUBLISH_VERSION;
+        segment->record_size = sizeof(struct publish_record);
+        segment->max_records = PUBLISH_MAX_RECORDS;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(segment->magic, PUBLISH_MAGIC, sizeof(PUBLISH_MAGIC));
+    }
+
+    segment->writer_pid = getpid();
+    return segment;
+}
+
+
+int publish_run(struct exporter_source* source, const char* name, double interval)
+{
+    static struct hci_dev_info devs[PUBLISH_MAX_RECORDS];
+    // the writer's own copy of what it published, so it never reads the segment
+    static struct publish_data published[PUBLISH_MAX_RECORDS];
+    static struct watch_adapter stats[PUBLISH_MAX_RECORDS];
+    static char taken[PUBLISH_MAX_RECORDS];
+    struct publish_segment* segment;
+    struct timespec tick, now;
+    long interval_ns = (long) (interval * 1e9);
+    int i, j;
+
+    segment = open_writer(name);
+    if (!segment) {
+        fprintf(stderr, "Can't open shared memory %s: %s (%d)\n", name, strerror(errno), errno);
+        return -1;
+    }
+
+    // records left by an earlier writer are stale
+    for (i = 0; i < PUBLISH_MAX_RECORDS; i++)
+        record_write(&segment->records[i], &published[i]);
+
+    clock_gettime(CLOCK_MONOTONIC, &tick);
+
+    while (1) {
+        uint64_t updated = realtime_ns();
+        int count = source->sample(source, devs, PUBLISH_MAX_RECORDS);
+
+        memset(taken, 0x00, sizeof(taken));
+
+        // on errors the last state stays published
+        for (i = 0; count >= 0 && i < PUBLISH_MAX_RECORDS; i++) {
+            struct publish_data* data = &published[i];
+            struct hci_dev_info* di = NULL;
+
+            if (!data->present)
+                continue;
+
+            for (j = 0; j < count; j++) {
+                if (!taken[j] && devs[j].dev_id == data->info.dev_id) {
+                    di = &devs[j];
+                    taken[j] = 1;
+                    break;
+                }
+            }
+
+            if (!di) {
+                memset(data, 0x00, sizeof(*data));
+                record_write(&segment->records[i], data);
+                continue;
+            }
+
+            data->info = *di;
+        }
+
+        // adapters not published so far take a free record
+        for (j = 0; count >= 0 && j < count; j++) {
+            if (taken[j])
+                continue;
+            for (i = 0; i < PUBLISH_MAX_RECORDS && published[i].present; i++)
+                ;
+            if (i == PUBLISH_MAX_RECORDS)
+                break;
+
+            memset(&published[i], 0x00, sizeof(published[i]));
+            memset(&stats[i], 0x00, sizeof(stats[i]));
+            published[i].present = 1;
+            published[i].info = devs[j];
+            stats[i].dev_id = devs[j].dev_id;
+        }
+
+        for (i = 0; count >= 0 && i < PUBLISH_MAX_RECORDS; i++) {
+            struct publish_data* data = &published[i];
+            unsigned int c;
+
+            if (!data->present)
+                continue;
+
+            // the version does not change, it is read once the adapter is up
+            if (!data->have_version && hci_test_bit(HCI_UP, &data->info.flags) &&
+                source->version(source, data->info.dev_id, &data->version) == 0)
+                data->have_version = 1;
+
+            // a new adapter starts with what the kernel counted so far
+            if (!stats[i].valid) {
+                watch_update(&stats[i], &data->info.stat);
+                for (c = 0; c < WATCH_NUM_COUNTERS; c++)
+                    stats[i].total[c] = stats[i].last[c];
+            } else {
+                watch_update(&stats[i], &data->info.stat);
+            }
+            memcpy(data->total, stats[i].total, sizeof(data->total));
+            data->updated = updated;
+
+            record_write(&segment->records[i], data);
+        }
+
+        __atomic_store_n(&segment->heartbeat, updated, __ATOMIC_RELEASE);
+
+        // absolute deadlines keep the sampling period free of drift
+        tick.tv_nsec += interval_ns % 1000000000L;
+        tick.tv_sec  += interval_ns / 1000000000L + tick.tv_nsec / 1000000000L;
+        tick.tv_nsec %= 1000000000L;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > tick.tv_sec || (now.tv_sec == tick.tv_sec && now.tv_nsec > tick.tv_nsec))
+            tick = now;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tick, NULL) == EINTR)
+            ;
+    }
+
+    return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef PUBLISH_H
+#define PUBLISH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "adapter.h"
+#include "exporter.h"
+#include "watch.h"
+
+
+// Adapter state in a POSIX shared memory segment: one writer (--publish)
+// and any number of readers. Every record is guarded by its own seqlock,
+// so a reader copies a consistent record without a single system call
+// once the segment is mapped, and never blocks the writer.
+
+#define PUBLISH_DEFAULT_NAME  "/bt_device_info"
+#define PUBLISH_MAGIC         "BTDISHM"
+#define PUBLISH_VERSION       2
+#define PUBLISH_MAX_RECORDS   MAX_ADAPTERS
+
+// the published state of one adapter
+struct publish_data {
+    uint32_t             present;      // 0 = free slot
+    uint32_t             have_version;
+    uint64_t             updated;      // CLOCK_REALTIME of the sample, in ns
+    struct hci_dev_info  info;
+    struct hci_version   version;
+    uint64_t             total[WATCH_NUM_COUNTERS];  // stats widened to 64 bit
+};
+
+struct publish_record {
+    uint32_t             seq;          // odd while the writer updates data
+    uint32_t             pad;
+    struct publish_data  data;
+} __attribute__ ((aligned (64)));
+
+struct publish_segment {
+    char                   magic[8];
+    uint32_t               version;
+    uint32_t               record_size;
+    uint32_t               max_records;
+    uint32_t               writer_pid;
+    uint64_t               heartbeat;  // CLOCK_REALTIME of the last tick, in ns
+    struct publish_record  records[PUBLISH_MAX_RECORDS];
+};
+
+
+struct publish_reader {
+    const struct publish_segment*  segment;
+};
+
+// maps the segment name read only; -1 with errno on error, EPROTO if the
+// layout is not the one this reader knows
+int publish_reader_open(struct publish_reader* reader, const char* name);
+void publish_reader_close(struct publish_reader* reader);
+
+// consistent copy of record index; returns 1 if it holds an adapter
+int publish_read(const struct publish_reader* reader, int index, struct publish_data* data);
+
+// samples source every interval seconds and publishes the adapters in
+// the segment name until killed; returns only on error
+int publish_run(struct exporter_source* source, const char* name, double interval);
+
+#endif
@@ -0,0 +1,491 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "deadline.h"
+#include "hci_pipeline.h"
+#include "scan.h"
+#include "trace.h"
+
+
+// not in older BlueZ headers
+#define SCAN_OCF_SET_EXT_SCAN_PARAMETERS  0x0041
+#define SCAN_OCF_SET_EXT_SCAN_ENABLE      0x0042
+#define SCAN_EVT_EXT_ADVERTISING_REPORT   0x0d
+
+// LE features octet 1, bit 4: LE Extended Advertising
+#define SCAN_LE_EXT_ADV(features) ((features)[1] & 0x10)
+
+// packets per read and the room of each one
+#define SCAN_BATCH     TRANSPORT_MAX_BATCH
+#define SCAN_PKT_SIZE  (HCI_TYPE_LEN + HCI_MAX_EVENT_SIZE)
+
+// no RSSI in a report
+#define SCAN_RSSI_NONE 127
+
+#define SCAN_KEY_USED  (1ULL << 63)
+
+
+void scan_table_init(struct scan_table* table, uint64_t start)
+{
+    memset(table, 0x00, sizeof(*table));
+    table->start = start;
+}
+
+
+// Fibonacci hashing: the top bits of key * 2^64 / phi
+static uint32_t slot_of(uint64_t key)
+{
+    return (key * 0x9e3779b97f4a7c15ULL) >> (64 - SCAN_TABLE_BITS);
+}
+
+
+static uint32_t fnv1a(const uint8_t* data, int len)
+{
+    uint32_t hash = 2166136261u;
+    int i;
+
+    for (i = 0; i < len; i++)
+        hash = (hash ^ data[i]) * 16777619u;
+    return hash;
+}
+
+
+// the device of key, added if new; NULL once the table is full
+static struct scan_device* find_device(struct scan_table* table, uint64_t key)
+{
+    uint32_t i = slot_of(key);
+
+    // linear probing; the load limit guarantees a free slot
+    while (1) {
+        struct scan_device* device = &table->devices[i];
+
+        if (device->key == key)
+            return device;
+        if (device->key == 0) {
+            if (table->count >= SCAN_TABLE_MAX)
+                return NULL;
+            device->key = key;
+            table->count++;
+            return device;
+        }
+        i = (i + 1) & (SCAN_TABLE_SIZE - 1);
+    }
+}
+
+
+// data is NULL for a fragment that does not complete the advertising data
+static void add_report(struct scan_table* table, int kind, uint8_t addr_type,
+                       const uint8_t* addr, int8_t rssi,
+                       const uint8_t* data, int len, uint64_t now)
+{
+    uint64_t key = SCAN_KEY_USED | (uint64_t) addr_type << 48 |
+                   (uint64_t) bt_get_le32(addr) | (uint64_t) bt_get_le16(addr + 4) << 32;
+    struct scan_device* device = find_device(table, key);
+
+    if (!device) {
+        table->dropped++;
+        return;
+    }
+
+    now -= table->start;
+    if (device->reports == 0)
+        device->first_seen = now;
+    device->last_seen = now;
+    device->reports++;
+    device->kinds |= kind;
+
+    if (rssi != SCAN_RSSI_NONE) {
+        if (!device->have_rssi) {
+            device->rssi_min  = device->rssi_max = rssi;
+            device->rssi_ewma = rssi * 256;
+            device->have_rssi = 1;
+        } else {
+            if (rssi < device->rssi_min)
+                device->rssi_min = rssi;
+            if (rssi > device->rssi_max)
+                device->rssi_max = rssi;
+            device->rssi_ewma += (rssi * 256 - device->rssi_ewma) / 8;
+        }
+    }
+
+    if (data) {
+        uint32_t hash = fnv1a(data, len);
+
+        if (device->have_data && hash != device->data_hash)
+            device->data_changes++;
+        device->data_hash = hash;
+        device->have_data = 1;
+    }
+}
+
+
+// LE Advertising Report: the reports follow each other, each one
+// event type, address type, address, data length, data and RSSI
+static void legacy_reports(struct scan_table* table, const uint8_t* ptr, int len, uint64_t now)
+{
+    int num, i;
+
+    if (len < 1)
+        return;
+    num = ptr[0];
+    ptr++;
+    len--;
+
+    for (i = 0; i < num; i++) {
+        int data_len;
+
+        if (len < 10 || len < 10 + ptr[8]) {
+            table->dropped += num - i;
+            return;
+        }
+        data_len = ptr[8];
+
+        add_report(table, SCAN_LEGACY, ptr[1], ptr + 2, (int8_t) ptr[9 + data_len],
+                   ptr + 9, data_len, now);
+        table->reports[0]++;
+
+        ptr += 10 + data_len;
+        len -= 10 + data_len;
+    }
+}
+
+
+// LE Extended Advertising Report: 24 bytes of fixed fields per report,
+// then its data; bits 5-6 of the event type tell whether more data of
+// the same advertisement follows in another report
+static void extended_reports(struct scan_table* table, const uint8_t* ptr, int len, uint64_t now)
+{
+    int num, i;
+
+    if (len < 1)
+        return;
+    num = ptr[0];
+    ptr++;
+    len--;
+
+    for (i = 0; i < num; i++) {
+        int data_len, complete;
+
+        if (len < 24 || len < 24 + ptr[23]) {
+            table->dropped += num - i;
+            return;
+        }
+        data_len = ptr[23];
+        complete = ((bt_get_le16(ptr) >> 5) & 0x03) == 0;
+
+        add_report(table, SCAN_EXTENDED, ptr[2], ptr + 3, (int8_t) ptr[13],
+                   complete ? ptr + 24 : NULL, data_len, now);
+        table->reports[1]++;
+
+        ptr += 24 + data_len;
+        len -= 24 + data_len;
+    }
+}
+
+
+void scan_event(struct scan_table* table, const uint8_t* buf, int len, uint64_t now)
+{
+    const hci_event_hdr* hdr;
+    const uint8_t* ptr;
+
+    if (len < HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE + 1 || buf[0] != HCI_EVENT_PKT)
+        return;
+
+    hdr = (const void*) (buf + HCI_TYPE_LEN);
+    ptr = buf + HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE;
+    len -= HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE;
+    if (hdr->evt != EVT_LE_META_EVENT || hdr->plen > len || hdr->plen < 1)
+        return;
+    len = hdr->plen;
+
+    table->events++;
+    if (ptr[0] == EVT_LE_ADVERTISING_REPORT)
+        legacy_reports(table, ptr + 1, len - 1, now);
+    else if (ptr[0] == SCAN_EVT_EXT_ADVERTISING_REPORT)
+        extended_reports(table, ptr + 1, len - 1, now);
+}
+
+
+
+// scan setup ----------------------------------------------------------------
+
+struct scan_setup {
+    le_read_local_supported_features_rp  features;
+    int                                  extended;
+    int                                  enable;
+};
+
+
+static void add_enable(struct hci_pipeline* pipeline, struct scan_setup* setup)
+{
+    if (setup->extended) {
+        // own address public, accept all, 1M PHY: passive, 10 ms every 10 ms
+        uint8_t params[8] = { 0x00, 0x00, 0x01, 0x00, 0x10, 0x00, 0x10, 0x00 };
+        // no duplicate filter, no duration, no period
+        uint8_t enable[6] = { setup->enable, 0x00 };
+
+        if (setup->enable)
+            hci_pipeline_add(pipeline, OGF_LE_CTL, SCAN_OCF_SET_EXT_SCAN_PARAMETERS,
+                             params, sizeof(params), NULL, 0, NULL, NULL);
+        hci_pipeline_add(pipeline, OGF_LE_CTL, SCAN_OCF_SET_EXT_SCAN_ENABLE,
+                         enable, sizeof(enable), NULL, 0, NULL, NULL);
+    } else {
+        le_set_scan_parameters_cp params = { 0x00, htobs(0x0010), htobs(0x0010), 0x00, 0x00 };
+        le_set_scan_enable_cp enable = { setup->enable, 0x00 };
+
+        if (setup->enable)
+            hci_pipeline_add(pipeline, OGF_LE_CTL, OCF_LE_SET_SCAN_PARAMETERS,
+                             &params, LE_SET_SCAN_PARAMETERS_CP_SIZE, NULL, 0, NULL, NULL);
+        hci_pipeline_add(pipeline, OGF_LE_CTL, OCF_LE_SET_SCAN_ENABLE,
+                         &enable, LE_SET_SCAN_ENABLE_CP_SIZE, NULL, 0, NULL, NULL);
+    }
+}
+
+
+// the features decide between legacy and extended scanning
+static void on_le_features(struct hci_pipeline* pipeline, struct hci_pipeline_cmd* cmd)
+{
+    struct scan_setup* setup = cmd->user;
+
+    setup->extended = SCAN_LE_EXT_ADV(setup->features.features) != 0;
+    add_enable(pipeline, setup);
+}
+
+
+// runs the commands of setup; -1 with errno set if one failed
+static int run_setup(struct transport_dev* dev, struct scan_setup* setup, int query)
+{
+    struct hci_pipeline pipeline;
+    int i;
+
+    hci_pipeline_init(&pipeline, dev);
+
+    if (query)
+        hci_pipeline_add(&pipeline, OGF_LE_CTL, OCF_LE_READ_LOCAL_SUPPORTED_FEATURES,
+                         NULL, 0, &setup->features, LE_READ_LOCAL_SUPPORTED_FEATURES_RP_SIZE,
+                         on_le_features, setup);
+    else
+        add_enable(&pipeline, setup);
+
+    int ret = hci_pipeline_run(&pipeline, 1000);
+    int timed_out = ret < 0 && errno == ETIMEDOUT;
+    int err = ret < 0 ? errno : 0;
+
+    for (i = 0; i < pipeline.count; i++) {
+        struct hci_pipeline_cmd* cmd = &pipeline.cmds[i];
+
+        if (cmd->answered)
+            trace_record(dev->dev_id, cmd->opcode, cmd->sent, cmd->answered, 0);
+        else if (cmd->sent && timed_out)
+            trace_record(dev->dev_id, cmd->opcode, cmd->sent, trace_now(), 1);
+
+        // e.g. Command Disallowed while the kernel scans itself
+        if (!err && cmd->state != HCI_CMD_DONE)
+            err = EIO;
+    }
+
+    errno = err;
+    return err ? -1 : 0;
+}
+
+
+static volatile sig_atomic_t scan_stop = 0;
+
+static void on_sigint(int sig)
+{
+    scan_stop = 1;
+}
+
+
+int scan_run(struct transport* transport, int dev_id, double duration,
+             struct scan_table* table)
+{
+    uint8_t buf[SCAN_BATCH * SCAN_PKT_SIZE];
+    struct scan_setup setup;
+    struct transport_dev dev;
+    struct hci_filter filter;
+    struct sigaction action, old_action;
+    uint64_t end;
+    int lens[SCAN_BATCH];
+    int err = 0;
+    int n, i;
+
+    scan_table_init(table, deadline_now());
+    if (transport_open(transport, dev_id, &dev) < 0)
+        return -1;
+
+    memset(&setup, 0x00, sizeof(setup));
+    setup.enable = 1;
+    if (run_setup(&dev, &setup, 1) < 0) {
+        err = errno;
+        transport_close(&dev);
+        errno = err;
+        return -1;
+    }
+
+    // the command events stay in for switching the scan off again
+    hci_filter_clear(&filter);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &filter);
+    hci_filter_set_event(EVT_CMD_STATUS, &filter);
+    hci_filter_set_event(EVT_CMD_COMPLETE, &filter);
+    hci_filter_set_event(EVT_LE_META_EVENT, &filter);
+    if (transport_set_filter(&dev, &filter) < 0)
+        err = errno;
+
+    // ^C ends the scan like the time running out
+    memset(&action, 0x00, sizeof(action));
+    action.sa_handler = on_sigint;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &old_action);
+    scan_stop = 0;
+
+    table->start = deadline_now();
+    end = table->start + (uint64_t) (duration * 1e9);
+
+    while (!err && !scan_stop) {
+        uint64_t now;
+        int wait = deadline_remaining_ms(end, 100);
+
+        if (wait == 0)
+            break;
+
+        n = transport_read_events(&dev, buf, SCAN_PKT_SIZE, lens, SCAN_BATCH, wait);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            // a fast replay runs out of recorded events before the time does
+            if (errno != EPROTO)
+                err = errno;
+            break;
+        }
+
+        now = deadline_now();
+        for (i = 0; i < n; i++)
+            scan_event(table, buf + i * SCAN_PKT_SIZE, lens[i], now);
+        table->parse_ns += deadline_now() - now;
+    }
+
+    table->duration = deadline_now() - table->start;
+    sigaction(SIGINT, &old_action, NULL);
+
+    setup.enable = 0;
+    if (run_setup(&dev, &setup, 0) < 0 && !err)
+        err = errno;
+
+    transport_close(&dev);
+    errno = err;
+    return err ? -1 : 0;
+}
+
+
+
+// output --------------------------------------------------------------------
+
+static int compare_reports(const void* a, const void* b)
+{
+    const struct scan_device* x = *(const struct scan_device* const*) a;
+    const struct scan_device* y = *(const struct scan_device* const*) b;
+
+    if (x->reports != y->reports)
+        return x->reports < y->reports ? 1 : -1;
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+
+static const char* addr_type_name(uint8_t type)
+{
+    switch (type) {
+    case 0x00: return "public";
+    case 0x01: return "random";
+    case 0x02: return "public-id";
+    case 0x03: return "random-id";
+    case 0xff: return "anonymous";
+    }
+    return "?";
+}
+
+
+void scan_print(struct outbuf* out, int dev_id, const struct scan_table* table)
+{
+    const struct scan_device** sorted;
+    double seconds = table->duration / 1e9;
+    uint64_t reports = table->reports[0] + table->reports[1];
+    int i, n = 0;
+
+    out_printf(out, "hci%d: %llu reports (%llu legacy, %llu extended) in %.1f s, "
+               "%.0f/s, %d devices, %llu dropped, %.0f ns/report\n",
+               dev_id, (unsigned long long) reports,
+               (unsigned long long) table->reports[0], (unsigned long long) table->reports[1],
+               seconds, seconds > 0 ? reports / seconds : 0.0, table->count,
+               (unsigned long long) table->dropped,
+               reports ? (double) table->parse_ns / reports : 0.0);
+    if (table->count == 0)
+        return;
+
+    // the table order is the hash order
+    sorted = malloc(table->count * sizeof(*sorted));
+    if (!sorted) {
+        out->failed = 1;
+        return;
+    }
+    for (i = 0; i < SCAN_TABLE_SIZE; i++)
+        if (table->devices[i].key)
+            sorted[n++] = &table->devices[i];
+    qsort(sorted, n, sizeof(*sorted), compare_reports);
+
+    out_printf(out, "    %-17s %-9s %8s %5s %6s %5s %9s %9s %-8s %7s %s\n",
+               "address", "type", "reports", "min", "RSSI", "max",
+               "first s", "last s", "data", "changes", "kind");
+
+    for (i = 0; i < n; i++) {
+        const struct scan_device* device = sorted[i];
+        bdaddr_t addr;
+        char str[18];
+
+        bt_put_le32((uint32_t) device->key, addr.b);
+        bt_put_le16((uint16_t) (device->key >> 32), addr.b + 4);
+        ba2str(&addr, str);
+
+        out_printf(out, "    %-17s %-9s %8u ", str,
+                   addr_type_name((device->key >> 48) & 0xff), device->reports);
+        if (device->have_rssi)
+            out_printf(out, "%5d %6.1f %5d ", device->rssi_min,
+                       device->rssi_ewma / 256.0, device->rssi_max);
+        else
+            out_printf(out, "%5s %6s %5s ", "-", "-", "-");
+        out_printf(out, "%9.3f %9.3f %08x %7u %s\n",
+                   device->first_seen / 1e9, device->last_seen / 1e9,
+                   device->data_hash, device->data_changes,
+                   device->kinds == (SCAN_LEGACY | SCAN_EXTENDED) ? "both" :
+                   device->kinds == SCAN_EXTENDED ? "extended" : "legacy");
+    }
+
+    free(sorted);
+}
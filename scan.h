@@ -0,0 +1,86 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdint.h>
+
+#include "output.h"
+#include "transport.h"
+
+
+// LE scan mode: enables scanning on one adapter and folds every legacy and
+// extended LE Advertising Report into per-address state. Reports are read
+// in batches and parsed in place; the device table is allocated once and
+// never grows, a full table counts the reports of new addresses as dropped.
+
+#define SCAN_TABLE_BITS  13
+#define SCAN_TABLE_SIZE  (1 << SCAN_TABLE_BITS)
+#define SCAN_TABLE_MAX   (SCAN_TABLE_SIZE / 4 * 3)   // keeps probe chains short
+
+// scan_device.kinds
+#define SCAN_LEGACY    0x01
+#define SCAN_EXTENDED  0x02
+
+struct scan_device {
+    uint64_t  key;           // address, type << 48 and bit 63; 0 = free slot
+    uint64_t  first_seen;    // ns since the scan started
+    uint64_t  last_seen;
+    uint32_t  reports;
+    uint32_t  data_hash;     // FNV-1a of the last complete advertising data
+    uint32_t  data_changes;
+    int32_t   rssi_ewma;     // 1/256 dB, weight 1/8 for a new sample
+    int8_t    rssi_min;
+    int8_t    rssi_max;
+    uint8_t   have_rssi;
+    uint8_t   have_data;
+    uint8_t   kinds;
+};
+
+struct scan_table {
+    uint64_t            start;         // CLOCK_MONOTONIC ns
+    uint64_t            duration;      // ns, set by scan_run
+    uint64_t            events;
+    uint64_t            reports[2];    // legacy, extended
+    uint64_t            dropped;       // table full or malformed
+    uint64_t            parse_ns;      // time spent in scan_event
+    int                 count;
+    struct scan_device  devices[SCAN_TABLE_SIZE];
+};
+
+
+void scan_table_init(struct scan_table* table, uint64_t start);
+
+// folds one HCI packet into the table; anything but an advertising report
+// is ignored. now is CLOCK_MONOTONIC ns.
+void scan_event(struct scan_table* table, const uint8_t* buf, int len, uint64_t now);
+
+// scans on adapter dev_id for duration seconds or until SIGINT, passively
+// and without duplicate filtering; extended scanning if the controller
+// supports it. Returns 0 or -1 with errno set; the table holds whatever
+// was seen until then.
+int scan_run(struct transport* transport, int dev_id, double duration,
+             struct scan_table* table);
+
+// renders the devices, most reports first
+void scan_print(struct outbuf* out, int dev_id, const struct scan_table* table);
+
+#endif
@@ -0,0 +1,462 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "adapter.h"
+#include "deadline.h"
+#include "exporter.h"
+#include "output.h"
+#include "server.h"
+
+
+// a probe that is running, or its result while it is fresh
+struct flight {
+    int            in_use;
+    int            running;
+    int            waiters;      // requests waiting for the running probe
+    unsigned int   generation;   // counts the probes of this slot
+    int            dev_id;
+    unsigned int   fields;
+    uint64_t       done_at;      // deadline_now() when the result came
+    int            status;       // errno of the probe, 0 = ok
+    struct outbuf  result;       // the tlv part of the response
+};
+
+// HCI commands a controller may still get, refilled with rate per second
+struct bucket {
+    int            dev_id;
+    double         tokens;
+    uint64_t       updated;
+};
+
+struct server {
+    struct btdi_context*        ctx;
+    const struct btdi_filter*   filter;
+    uint64_t                    ttl;      // ns
+    int                         rate;     // commands per second, 0 = unlimited
+    int                         clients;
+
+    pthread_mutex_t             lock;
+    pthread_cond_t              done;     // a probe finished
+    struct flight               flights[SERVER_MAX_FLIGHTS];
+    struct bucket               buckets[MAX_ADAPTERS];
+    int                         num_buckets;
+};
+
+struct client {
+    struct server*  srv;
+    int             fd;
+};
+
+
+// the probe's throttle (see btdevinfo.h): waits until the controller may
+// get cost more commands. The commands are booked right away, so concurrent
+// probes of one adapter queue up behind each other instead of all waking up
+// at once, while the probes of different adapters wait side by side. What a
+// probe sent beyond its estimate is booked without waiting and delays the
+// next one.
+static void rate_wait(void* arg, int dev_id, int cost, int wait_for_it)
+{
+    struct server* srv = arg;
+    struct bucket* bucket = NULL;
+    uint64_t now;
+    double wait = 0;
+    int i;
+
+    if (srv->rate <= 0 || cost == 0)
+        return;
+    // a single probe must be able to start
+    if (wait_for_it && cost > srv->rate)
+        cost = srv->rate;
+
+    pthread_mutex_lock(&srv->lock);
+    now = deadline_now();
+
+    for (i = 0; i < srv->num_buckets; i++)
+        if (srv->buckets[i].dev_id == dev_id)
+            bucket = &srv->buckets[i];
+    if (!bucket) {
+        // a full table starts over; forgetting costs one burst at most
+        if (srv->num_buckets == MAX_ADAPTERS)
+            srv->num_buckets = 0;
+        bucket = &srv->buckets[srv->num_buckets++];
+        bucket->dev_id  = dev_id;
+        bucket->tokens  = srv->rate;
+        bucket->updated = now;
+    }
+
+    bucket->tokens += (now - bucket->updated) * 1e-9 * srv->rate;
+    if (bucket->tokens > srv->rate)
+        bucket->tokens = srv->rate;
+    bucket->updated = now;
+    bucket->tokens -= cost;
+    if (bucket->tokens > srv->rate)
+        bucket->tokens = srv->rate;
+    if (bucket->tokens < 0)
+        wait = -bucket->tokens / srv->rate;
+
+    pthread_mutex_unlock(&srv->lock);
+
+    if (wait_for_it && wait > 0) {
+        struct timespec ts = { (time_t) wait, (long) ((wait - (time_t) wait) * 1e9) };
+
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+
+// probes dev_id (or all adapters) for fields into payload; the errno of a
+// failed enumeration, else 0 (a failed probe is part of the payload)
+static int probe(struct server* srv, int dev_id, unsigned int fields, struct outbuf* payload)
+{
+    struct btdi_context ctx = *srv->ctx;
+    struct adapter_info* infos;
+    int count, i;
+
+    ctx.fields = fields;
+    if (srv->rate > 0) {
+        ctx.throttle     = rate_wait;
+        ctx.throttle_arg = srv;
+    }
+    payload->len = 0;
+    tlv_emitter.begin(payload);
+
+    if (dev_id != SERVER_ALL_ADAPTERS) {
+        struct adapter_info info;
+
+        btdi_probe(&ctx, dev_id, 0, &info);
+        tlv_emitter.adapter(payload, &info, 0);
+        return 0;
+    }
+
+    infos = malloc(MAX_ADAPTERS * sizeof(*infos));
+    if (!infos)
+        return ENOMEM;
+
+    count = btdi_list_info(&ctx, infos, MAX_ADAPTERS, srv->filter);
+    if (count < 0) {
+        int err = errno;
+
+        free(infos);
+        payload->len = 0;
+        return err;
+    }
+
+    btdi_probe_all(&ctx, infos, count, 0);
+
+    for (i = 0; i < count; i++)
+        tlv_emitter.adapter(payload, &infos[i], i);
+    free(infos);
+    return 0;
+}
+
+
+// the answer to one request: a fresh result that covers the fields, the
+// result of a probe for them that is already running, or a new probe
+static int answer(struct server* srv, int dev_id, unsigned int fields,
+                  struct outbuf* payload, int* cached)
+{
+    struct flight* slot = NULL;
+    struct flight* f;
+    uint64_t now;
+    int status, i;
+
+    pthread_mutex_lock(&srv->lock);
+    now = deadline_now();
+    *cached = 0;
+
+    for (i = 0; i < SERVER_MAX_FLIGHTS; i++) {
+        f = &srv->flights[i];
+        if (!f->in_use || f->dev_id != dev_id || (f->fields & fields) != fields)
+            continue;
+
+        if (!f->running && now - f->done_at < srv->ttl) {
+            *cached = 1;
+            goto copy;
+        }
+
+        if (f->running) {
+            unsigned int generation = f->generation;
+
+            f->waiters++;
+            while (f->generation == generation)
+                pthread_cond_wait(&srv->done, &srv->lock);
+            f->waiters--;
+            goto copy;
+        }
+    }
+
+    // a free slot, else the oldest result nobody waits for; with all of
+    // them busy the probe runs without being shared
+    for (i = 0; i < SERVER_MAX_FLIGHTS; i++) {
+        f = &srv->flights[i];
+        if (f->running || f->waiters)
+            continue;
+        if (!slot || !f->in_use || (slot->in_use && f->done_at < slot->done_at))
+            slot = f;
+        if (!f->in_use)
+            break;
+    }
+    if (slot) {
+        slot->in_use  = 1;
+        slot->running = 1;
+        slot->dev_id  = dev_id;
+        slot->fields  = fields;
+    }
+    pthread_mutex_unlock(&srv->lock);
+
+    status = probe(srv, dev_id, fields, payload);
+    if (!slot)
+        return status;
+
+    pthread_mutex_lock(&srv->lock);
+    slot->result.len = 0;
+    out_write(&slot->result, payload->data, payload->len);
+    slot->status  = status;
+    slot->done_at = deadline_now();
+    slot->running = 0;
+    slot->generation++;
+    pthread_cond_broadcast(&srv->done);
+    pthread_mutex_unlock(&srv->lock);
+    return status;
+
+copy:
+    payload->len = 0;
+    out_write(payload, f->result.data, f->result.len);
+    status = f->status;
+    pthread_mutex_unlock(&srv->lock);
+    return status;
+}
+
+
+static int send_all(int fd, const void* data, size_t len)
+{
+    const uint8_t* p = data;
+
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p   += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+// -1 with errno ECONNRESET if the peer closed the connection first
+static int recv_all(int fd, void* data, size_t len)
+{
+    uint8_t* p = data;
+
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0)
+                errno = ECONNRESET;
+            return -1;
+        }
+        p   += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+static int send_response(int fd, int flags, int status, const struct outbuf* payload)
+{
+    uint8_t hdr[SERVER_RESPONSE_SIZE] = { SERVER_VERSION, flags };
+    size_t len = status || !payload ? 0 : payload->len;
+
+    bt_put_le32(status, &hdr[4]);
+    bt_put_le32(len, &hdr[8]);
+    if (send_all(fd, hdr, sizeof(hdr)) < 0)
+        return -1;
+    return len ? send_all(fd, payload->data, len) : 0;
+}
+
+
+static void* serve_client(void* arg)
+{
+    struct client* client = arg;
+    struct server* srv = client->srv;
+    struct timeval idle = { 10, 0 };
+    uint8_t request[SERVER_REQUEST_SIZE];
+    struct outbuf payload;
+
+    // a client that keeps its connection without asking gives it up
+    setsockopt(client->fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    outbuf_init(&payload, 4096);
+
+    while (recv_all(client->fd, request, sizeof(request)) == 0) {
+        unsigned int fields = bt_get_le32(&request[4]) & BTDI_ALL_FIELDS;
+        int dev_id = bt_get_le16(&request[2]);
+        int cached, status;
+
+        if (request[0] != SERVER_VERSION) {
+            send_response(client->fd, 0, EPROTO, NULL);
+            break;
+        }
+
+        status = answer(srv, dev_id, fields ? fields : BTDI_ALL_FIELDS, &payload, &cached);
+        if (send_response(client->fd, cached ? SERVER_CACHED : 0, status, &payload) < 0)
+            break;
+    }
+
+    outbuf_free(&payload);
+    close(client->fd);
+    __sync_fetch_and_sub(&srv->clients, 1);
+    free(client);
+    return NULL;
+}
+
+
+int server_run(struct btdi_context* ctx, const struct btdi_filter* filter,
+               const char* path, int ttl, int rate)
+{
+    static struct server srv;
+    pthread_attr_t attr;
+    int fd, i;
+
+    srv.ctx    = ctx;
+    srv.filter = filter;
+    srv.ttl    = (uint64_t) ttl * 1000000;
+    srv.rate   = rate;
+    pthread_mutex_init(&srv.lock, NULL);
+    pthread_cond_init(&srv.done, NULL);
+    for (i = 0; i < SERVER_MAX_FLIGHTS; i++)
+        outbuf_init(&srv.flights[i].result, 4096);
+
+    fd = listen_unix(path);
+    if (fd < 0) {
+        fprintf(stderr, "Can't listen on %s: %s (%d)\n", path, strerror(errno), errno);
+        return -1;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while (1) {
+        struct client* client;
+        pthread_t thread;
+        int conn = accept(fd, NULL, NULL);
+
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE)
+                continue;
+            fprintf(stderr, "Can't accept: %s (%d)\n", strerror(errno), errno);
+            break;
+        }
+
+        // beyond the limit a client is turned away right away instead of
+        // waiting behind the others
+        if (__sync_add_and_fetch(&srv.clients, 1) > SERVER_MAX_CLIENTS ||
+                !(client = malloc(sizeof(*client)))) {
+            send_response(conn, 0, EBUSY, NULL);
+            close(conn);
+            __sync_fetch_and_sub(&srv.clients, 1);
+            continue;
+        }
+
+        client->srv = &srv;
+        client->fd  = conn;
+        errno = pthread_create(&thread, &attr, serve_client, client);
+        if (errno) {
+            send_response(conn, 0, errno, NULL);
+            close(conn);
+            free(client);
+            __sync_fetch_and_sub(&srv.clients, 1);
+        }
+    }
+
+    close(fd);
+    return -1;
+}
+
+
+int server_query(const char* path, int dev_id, unsigned int fields,
+                 struct adapter_info* infos, int max)
+{
+    uint8_t request[SERVER_REQUEST_SIZE] = { SERVER_VERSION };
+    uint8_t response[SERVER_RESPONSE_SIZE];
+    struct sockaddr_un addr;
+    uint8_t* data = NULL;
+    uint32_t status, len;
+    int fd, count = -1, err;
+
+    memset(&addr, 0x00, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0)
+        goto done;
+
+    bt_put_le16(dev_id, &request[2]);
+    bt_put_le32(fields, &request[4]);
+    if (send_all(fd, request, sizeof(request)) < 0 ||
+            recv_all(fd, response, sizeof(response)) < 0)
+        goto done;
+
+    status = bt_get_le32(&response[4]);
+    len    = bt_get_le32(&response[8]);
+    if (response[0] != SERVER_VERSION) {
+        errno = EPROTO;
+        goto done;
+    }
+    if (status) {
+        errno = status;
+        goto done;
+    }
+
+    data = malloc(len ? len : 1);
+    if (!data || recv_all(fd, data, len) < 0)
+        goto done;
+    count = tlv_parse(data, len, infos, max);
+
+done:
+    err = errno;
+    free(data);
+    close(fd);
+    errno = err;
+    return count;
+}
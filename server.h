@@ -0,0 +1,73 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+
+#include "adapter.h"
+#include "btdevinfo.h"
+
+
+// Probe daemon (--serve): answers probe requests on a unix socket, so that
+// many clients starting at once do not each send the same HCI commands.
+//
+// - Requests for the same adapter and fields that arrive while a probe for
+//   them runs wait for that probe instead of starting their own.
+// - Results are kept for ttl ms and answer any request for a subset of
+//   their fields.
+// - Every controller gets at most rate HCI commands per second; a probe
+//   waits for its share before it starts, so its timeout is not spent
+//   waiting. The adapters of one request wait in parallel, and the feature
+//   pages and retries a probe sent on top are charged to the next one.
+//
+// Protocol, all integers little endian; a connection may send any number
+// of requests, each answered in order:
+//
+//   request   u8 version (SERVER_VERSION), u8 0, u16 dev_id or
+//             SERVER_ALL_ADAPTERS, u32 fields (FIELD_BIT mask, 0 = all)
+//   response  u8 version, u8 SERVER_CACHED or 0, u16 0, u32 errno (0 = ok),
+//             u32 length, then length bytes in the tlv format of output.h:
+//             one TLV_ADAPTER, or one per adapter for SERVER_ALL_ADAPTERS
+
+#define SERVER_VERSION        1
+#define SERVER_REQUEST_SIZE   8
+#define SERVER_RESPONSE_SIZE  12
+
+#define SERVER_ALL_ADAPTERS   0xffff   // every adapter the daemon's filter passes
+#define SERVER_CACHED         0x01     // served from a result of an earlier probe
+
+// probes running or kept at once, and connections served at once
+#define SERVER_MAX_FLIGHTS    64
+#define SERVER_MAX_CLIENTS    64
+
+// serves requests on the unix socket path with the probe set up in ctx
+// until killed; filter selects the adapters of SERVER_ALL_ADAPTERS. Returns
+// only on error.
+int server_run(struct btdi_context* ctx, const struct btdi_filter* filter,
+               const char* path, int ttl, int rate);
+
+// asks the daemon on path for dev_id (or SERVER_ALL_ADAPTERS) and fields;
+// returns the number of infos filled, or -1 with errno set
+int server_query(const char* path, int dev_id, unsigned int fields,
+                 struct adapter_info* infos, int max);
+
+#endif
@@ -0,0 +1,355 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "decode.h"
+#include "snapshot.h"
+
+
+static const char* const counter_names[WATCH_NUM_COUNTERS] = {
+    "err_rx", "err_tx", "cmd_tx", "evt_rx", "acl_tx",
+    "acl_rx", "sco_tx", "sco_rx", "byte_rx", "byte_tx"
+};
+
+
+void snapshot_fill(struct snapshot_record* record, const struct hci_dev_info* di)
+{
+    // zeroed first, so the name's tail and everything else compare equal
+    memset(record, 0x00, sizeof(*record));
+    bacpy(&record->bdaddr, &di->bdaddr);
+    record->in_use      = 1;
+    record->type        = di->type;
+    strncpy(record->name, di->name, sizeof(record->name));
+    record->flags       = di->flags;
+    memcpy(record->features, di->features, sizeof(record->features));
+    record->pkt_type    = di->pkt_type;
+    record->link_policy = di->link_policy;
+    record->link_mode   = di->link_mode;
+    record->acl_mtu     = di->acl_mtu;
+    record->acl_pkts    = di->acl_pkts;
+    record->sco_mtu     = di->sco_mtu;
+    record->sco_pkts    = di->sco_pkts;
+    memcpy(record->stats, &di->stat, sizeof(record->stats));
+    record->dev_id      = di->dev_id;
+}
+
+
+static int same_adapter(const struct snapshot_record* a, const struct snapshot_record* b)
+{
+    if (bacmp(&a->bdaddr, &b->bdaddr) != 0)
+        return 0;
+    return bacmp(&a->bdaddr, BDADDR_ANY) != 0 || a->dev_id == b->dev_id;
+}
+
+
+// the adapter is one the run listed, whatever its flags
+static int listed(const struct btdi_filter* filter, const struct snapshot_record* record)
+{
+    struct btdi_filter any = *filter;
+
+    any.flags_set   = 0;
+    any.flags_clear = 0;
+    return btdi_filter_match(&any, record->dev_id, &record->bdaddr, record->flags);
+}
+
+
+static int reported(const struct btdi_filter* filter, const struct snapshot_record* record)
+{
+    return btdi_filter_match(filter, record->dev_id, &record->bdaddr, record->flags);
+}
+
+
+
+// rendering -----------------------------------------------------------------
+
+static void begin_record(struct outbuf* out, int json, const char* event,
+                         const struct snapshot_record* record)
+{
+    if (json) {
+        out_printf(out, "{\"event\":\"%s\",\"dev_id\":%d,\"bdaddr\":\"", event, record->dev_id);
+        out_bdaddr(out, &record->bdaddr);
+        out_write(out, "\"", 1);
+    } else {
+        out_printf(out, "%-7s hci%d ", event, record->dev_id);
+        out_bdaddr(out, &record->bdaddr);
+    }
+}
+
+
+static void put_uint(struct outbuf* out, int json, const char* key, unsigned int value)
+{
+    out_printf(out, json ? ",\"%s\":%u" : " %s=%u", key, value);
+}
+
+
+static void put_hex(struct outbuf* out, int json, const char* key,
+                    const uint8_t* data, int len)
+{
+    out_printf(out, json ? ",\"%s\":\"" : " %s=", key);
+    out_hex(out, data, len);
+    if (json)
+        out_write(out, "\"", 1);
+}
+
+
+static void put_name(struct outbuf* out, int json, const struct snapshot_record* record)
+{
+    size_t len = strnlen(record->name, sizeof(record->name));
+
+    if (json) {
+        out_write(out, ",\"name\":", 8);
+        out_json_string(out, record->name, len);
+    } else {
+        out_write(out, " name=", 6);
+        out_write(out, record->name, len);
+    }
+}
+
+
+// the flag names in text, the value in JSON
+static void put_flags(struct outbuf* out, int json, uint32_t flags)
+{
+    struct bit_iter it;
+    int bit, first = 1;
+
+    if (json) {
+        put_uint(out, json, "flags", flags);
+        return;
+    }
+
+    out_write(out, " flags=", 7);
+    bit_iter_init_value(&it, flags);
+    while ((bit = bit_iter_next(&it)) >= 0) {
+        const char* name = bit_table_name(&dev_flags_table, bit);
+
+        if (name)
+            out_printf(out, "%s%s", first ? "" : ",", name);
+        else
+            out_printf(out, "%s%d", first ? "" : ",", bit);
+        first = 0;
+    }
+    if (first)
+        out_write(out, "-", 1);
+}
+
+
+// the counters that moved, as deltas; all of them, as they are, for a new
+// adapter. A replugged adapter (same address, new dev_id) starts from zero,
+// otherwise a smaller value is a wrapped 32 bit counter.
+static void put_stats(struct outbuf* out, int json, const struct snapshot_record* old,
+                      const struct snapshot_record* record)
+{
+    int restarted = old && old->dev_id != record->dev_id;
+    int i, first = 1;
+
+    for (i = 0; i < (int) WATCH_NUM_COUNTERS; i++) {
+        uint32_t value = record->stats[i];
+
+        if (old && !restarted)
+            value -= old->stats[i];
+        if (old && value == 0)
+            continue;
+
+        if (json)
+            out_printf(out, "%s\"%s\":%u", first ? ",\"stats\":{" : ",", counter_names[i], value);
+        else
+            out_printf(out, old ? " %s=+%u" : " %s=%u", counter_names[i], value);
+        first = 0;
+    }
+    if (json && !first)
+        out_write(out, "}", 1);
+}
+
+
+// every field of a new adapter (old NULL), else only those that differ
+static void put_fields(struct outbuf* out, int json, const struct snapshot_record* old,
+                       const struct snapshot_record* record)
+{
+    if (!old || memcmp(old->name, record->name, sizeof(record->name)) != 0)
+        put_name(out, json, record);
+    if (!old || old->type != record->type)
+        put_uint(out, json, "type", record->type);
+    if (!old || old->flags != record->flags)
+        put_flags(out, json, record->flags);
+    if (!old || memcmp(old->features, record->features, sizeof(record->features)) != 0)
+        put_hex(out, json, "features", record->features, sizeof(record->features));
+    if (!old || old->pkt_type != record->pkt_type)
+        put_uint(out, json, "pkt_type", record->pkt_type);
+    if (!old || old->link_policy != record->link_policy)
+        put_uint(out, json, "link_policy", record->link_policy);
+    if (!old || old->link_mode != record->link_mode)
+        put_uint(out, json, "link_mode", record->link_mode);
+    if (!old || old->acl_mtu != record->acl_mtu)
+        put_uint(out, json, "acl_mtu", record->acl_mtu);
+    if (!old || old->acl_pkts != record->acl_pkts)
+        put_uint(out, json, "acl_pkts", record->acl_pkts);
+    if (!old || old->sco_mtu != record->sco_mtu)
+        put_uint(out, json, "sco_mtu", record->sco_mtu);
+    if (!old || old->sco_pkts != record->sco_pkts)
+        put_uint(out, json, "sco_pkts", record->sco_pkts);
+    put_stats(out, json, old, record);
+}
+
+
+static void end_record(struct outbuf* out, int json)
+{
+    out_write(out, json ? "}\n" : "\n", json ? 2 : 1);
+}
+
+
+
+// the snapshot file ---------------------------------------------------------
+
+static int header_valid(const struct snapshot_file* file)
+{
+    return memcmp(file->magic, SNAPSHOT_MAGIC, sizeof(file->magic)) == 0 &&
+           file->version == SNAPSHOT_VERSION &&
+           file->record_size == sizeof(struct snapshot_record) &&
+           file->num_records == SNAPSHOT_RECORDS;
+}
+
+
+int snapshot_changes(const char* path, const struct adapter_info* infos, int count,
+                     const struct btdi_filter* filter, int json, struct outbuf* out)
+{
+    static struct snapshot_record records[SNAPSHOT_RECORDS];
+    uint8_t matched[SNAPSHOT_RECORDS];
+    struct snapshot_file* file;
+    struct stat st;
+    int fd, num_records = 0, changes = 0;
+    int i, j, err;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+
+    // a concurrent run must not see half of our update
+    if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0)
+        goto fail;
+
+    // new file or one written by another version: every adapter is new
+    if (st.st_size != sizeof(struct snapshot_file)) {
+        if (ftruncate(fd, 0) < 0 || ftruncate(fd, sizeof(struct snapshot_file)) < 0)
+            goto fail;
+    }
+
+    file = mmap(NULL, sizeof(struct snapshot_file), PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+    if (file == MAP_FAILED)
+        goto fail;
+
+    if (!header_valid(file)) {
+        memset(file, 0x00, sizeof(struct snapshot_file));
+        memcpy(file->magic, SNAPSHOT_MAGIC, sizeof(file->magic));
+        file->version     = SNAPSHOT_VERSION;
+        file->record_size = sizeof(struct snapshot_record);
+        file->num_records = SNAPSHOT_RECORDS;
+    }
+
+    memset(matched, 0x00, sizeof(matched));
+
+    for (i = 0; i < count && num_records < SNAPSHOT_RECORDS; i++) {
+        struct snapshot_record* record = &records[num_records];
+        struct snapshot_record* old = NULL;
+
+        // nothing known now: the old record stays as it is
+        if (infos[i].fields[FIELD_DEVINFO] != FIELD_OK) {
+            for (j = 0; j < SNAPSHOT_RECORDS; j++) {
+                if (file->records[j].in_use && file->records[j].dev_id == infos[i].dev_id &&
+                        num_records < SNAPSHOT_RECORDS) {
+                    matched[j] = 1;
+                    records[num_records++] = file->records[j];
+                }
+            }
+            continue;
+        }
+
+        snapshot_fill(record, &infos[i].hciDevInfo);
+        num_records++;
+
+        for (j = 0; j < SNAPSHOT_RECORDS; j++) {
+            if (file->records[j].in_use && !matched[j] &&
+                    same_adapter(&file->records[j], record)) {
+                old = &file->records[j];
+                matched[j] = 1;
+                break;
+            }
+        }
+
+        // outside the filter before and now: the old record stays as it is
+        if (!reported(filter, record) && !(old && reported(filter, old))) {
+            if (old)
+                *record = *old;
+            else
+                num_records--;
+            continue;
+        }
+
+        // the common case: nothing moved at all
+        if (old && memcmp(old, record, sizeof(*record)) == 0)
+            continue;
+
+        begin_record(out, json, old ? "changed" : "added", record);
+        put_fields(out, json, old, record);
+        end_record(out, json);
+        changes++;
+    }
+
+    for (j = 0; j < SNAPSHOT_RECORDS; j++) {
+        if (!file->records[j].in_use || matched[j])
+            continue;
+
+        // another --dev's adapter: kept for the run that lists it
+        if (!listed(filter, &file->records[j])) {
+            if (num_records < SNAPSHOT_RECORDS)
+                records[num_records++] = file->records[j];
+            continue;
+        }
+
+        if (reported(filter, &file->records[j])) {
+            begin_record(out, json, "removed", &file->records[j]);
+            end_record(out, json);
+            changes++;
+        }
+    }
+
+    memcpy(file->records, records, num_records * sizeof(records[0]));
+    memset(file->records + num_records, 0x00,
+           (SNAPSHOT_RECORDS - num_records) * sizeof(records[0]));
+
+    munmap(file, sizeof(struct snapshot_file));
+    flock(fd, LOCK_UN);
+    close(fd);
+    return changes;
+
+fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+}
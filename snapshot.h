@@ -0,0 +1,85 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "adapter.h"
+#include "btdevinfo.h"
+#include "output.h"
+#include "watch.h"
+
+
+// Change-only output (--changes): the device info of every adapter is kept
+// in a snapshot file between runs, and a run prints only what differs from
+// it. Each adapter is one fixed-layout record without padding, zeroed before
+// it is filled, so an unchanged adapter costs one memcmp. Adapters are keyed
+// by address, since the dev_id changes when a dongle is plugged in again;
+// adapters without an address fall back to the dev_id.
+
+#define SNAPSHOT_MAGIC    "BTDISNAP"
+#define SNAPSHOT_VERSION  1
+#define SNAPSHOT_RECORDS  MAX_ADAPTERS
+
+struct snapshot_record {
+    bdaddr_t  bdaddr;
+    uint8_t   in_use;
+    uint8_t   type;
+    char      name[8];
+    uint32_t  flags;
+    uint8_t   features[8];
+    uint32_t  pkt_type;
+    uint32_t  link_policy;
+    uint32_t  link_mode;
+    uint16_t  acl_mtu;
+    uint16_t  acl_pkts;
+    uint16_t  sco_mtu;
+    uint16_t  sco_pkts;
+    uint32_t  stats[WATCH_NUM_COUNTERS];   // raw, in struct hci_dev_stats order
+    int32_t   dev_id;
+};
+
+struct snapshot_file {
+    char                    magic[8];
+    uint32_t                version;
+    uint32_t                record_size;   // detects a changed struct layout
+    uint32_t                num_records;
+    uint32_t                padding;
+    struct snapshot_record  records[SNAPSHOT_RECORDS];
+};
+
+void snapshot_fill(struct snapshot_record* record, const struct hci_dev_info* di);
+
+// Compares the adapters with the snapshot at path (created if missing),
+// renders one "added", "changed" or "removed" record per adapter that
+// differs, and stores the adapters as the new snapshot. A changed record
+// has only the fields that changed, with the counters as deltas. Adapters
+// whose device info could not be read keep their old record.
+// infos are all adapters of filter's dev_id and address, whatever their
+// flags; only those that pass the filter before or after are reported, so
+// an adapter that goes down is a flags change. Records of other adapters
+// are kept as they are. JSON is one object per line, text one line per
+// record. Returns the number of records or -1 with errno set.
+int snapshot_changes(const char* path, const struct adapter_info* infos, int count,
+                     const struct btdi_filter* filter, int json, struct outbuf* out);
+
+#endif
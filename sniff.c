@@ -0,0 +1,613 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+// recvmmsg
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "analyze.h"
+#include "deadline.h"
+#include "output.h"
+#include "sniff.h"
+#include "trace.h"
+#include "transport.h"
+
+
+// room for the direction and the timestamp the raw socket attaches
+#define SNIFF_CONTROL  (CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(struct timeval)))
+
+// the loop wakes up at least this often to check the interval
+#define SNIFF_MAX_WAIT 1000
+
+struct sniff_counts {
+    uint64_t  frames;
+    uint64_t  bytes;
+    uint64_t  truncated;     // longer than SNIFF_FRAME_SIZE
+    uint64_t  reads;         // recvmmsg calls that returned frames
+};
+
+// what the counters were at the last report, for the interval's deltas
+struct sniff_last {
+    struct sniff_counts     counts;
+    uint64_t                malformed;     // and beyond the tables
+    uint64_t                events[256];
+    struct analyze_link     links[ANALYZE_LINK_SIZE];
+    struct analyze_command  commands[ANALYZE_COMMAND_SIZE];
+};
+
+struct sniff_state {
+    int                     fd;
+    int                     dev_id;
+    int                     eof;
+    uint64_t                start;     // CLOCK_MONOTONIC ns
+    uint64_t                last_report;
+    struct sniff_counts     counts;
+    struct analyze_result*  result;    // since the start, as adapter 0
+    struct sniff_last       last;
+    struct outbuf           out;
+    // the ring recvmmsg fills
+    struct mmsghdr          msgs[SNIFF_RING];
+    struct iovec            iov[SNIFF_RING];
+    uint8_t                 control[SNIFF_RING][SNIFF_CONTROL];
+    uint8_t                 frames[SNIFF_RING][SNIFF_FRAME_SIZE];
+};
+
+static volatile sig_atomic_t sniff_stop = 0;
+
+
+static void on_sigint(int sig)
+{
+    (void) sig;
+    sniff_stop = 1;
+}
+
+
+int sniff_parse_filter(const char* spec, struct hci_filter* filter)
+{
+    char copy[256];
+    char* save = NULL;
+    char* name;
+
+    hci_filter_clear(filter);
+    if (!spec || !*spec) {
+        hci_filter_all_ptypes(filter);
+        hci_filter_all_events(filter);
+        return 0;
+    }
+
+    if (strlen(spec) >= sizeof(copy))
+        return -1;
+    strcpy(copy, spec);
+
+    for (name = strtok_r(copy, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        char* end;
+        unsigned long code;
+
+        if (strcasecmp(name, "cmd") == 0) {
+            hci_filter_set_ptype(HCI_COMMAND_PKT, filter);
+        } else if (strcasecmp(name, "evt") == 0) {
+            hci_filter_set_ptype(HCI_EVENT_PKT, filter);
+            hci_filter_all_events(filter);
+        } else if (strcasecmp(name, "acl") == 0) {
+            hci_filter_set_ptype(HCI_ACLDATA_PKT, filter);
+        } else if (strcasecmp(name, "sco") == 0) {
+            hci_filter_set_ptype(HCI_SCODATA_PKT, filter);
+        } else if (strcasecmp(name, "iso") == 0) {
+            hci_filter_set_ptype(ANALYZE_ISO_PKT, filter);
+        } else {
+            code = strtoul(name, &end, 0);
+            if (end == name || *end || code > 0xff)
+                return -1;
+            hci_filter_set_ptype(HCI_EVENT_PKT, filter);
+            hci_filter_set_event(code, filter);
+        }
+    }
+
+    // the answers the command latencies are measured to
+    if (hci_filter_test_ptype(HCI_COMMAND_PKT, filter)) {
+        hci_filter_set_ptype(HCI_EVENT_PKT, filter);
+        hci_filter_set_event(EVT_CMD_COMPLETE, filter);
+        hci_filter_set_event(EVT_CMD_STATUS, filter);
+    }
+    return 0;
+}
+
+
+int sniff_open(int dev_id, const struct hci_filter* filter)
+{
+    int on = 1;
+    int fd = hci_open_dev(dev_id);
+
+    if (fd < 0)
+        return -1;
+
+    if (setsockopt(fd, SOL_HCI, HCI_DATA_DIR, &on, sizeof(on)) < 0 ||
+            setsockopt(fd, SOL_HCI, HCI_TIME_STAMP, &on, sizeof(on)) < 0 ||
+            setsockopt(fd, SOL_HCI, HCI_FILTER, filter, sizeof(*filter)) < 0) {
+        int err = errno;
+        hci_close_dev(fd);
+        errno = err;
+        return -1;
+    }
+
+    return fd;
+}
+
+
+
+// receiving -----------------------------------------------------------------
+
+static int64_t wall_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+
+static void prepare_ring(struct sniff_state* state)
+{
+    int i;
+
+    memset(state->msgs, 0x00, sizeof(state->msgs));
+    for (i = 0; i < SNIFF_RING; i++) {
+        state->iov[i].iov_base = state->frames[i];
+        state->iov[i].iov_len  = SNIFF_FRAME_SIZE;
+        state->msgs[i].msg_hdr.msg_iov        = &state->iov[i];
+        state->msgs[i].msg_hdr.msg_iovlen     = 1;
+        state->msgs[i].msg_hdr.msg_control    = state->control[i];
+        state->msgs[i].msg_hdr.msg_controllen = SNIFF_CONTROL;
+    }
+}
+
+
+// the direction and timestamp (µs) the raw socket attached, if it did
+static void frame_meta(struct msghdr* hdr, int* received, int64_t* ts)
+{
+    struct cmsghdr* cmsg;
+
+    for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_HCI)
+            continue;
+        if (cmsg->cmsg_type == HCI_CMSG_DIR) {
+            int dir;
+
+            memcpy(&dir, CMSG_DATA(cmsg), sizeof(dir));
+            *received = dir != 0;
+        } else if (cmsg->cmsg_type == HCI_CMSG_TSTAMP) {
+            struct timeval tv;
+
+            memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+            *ts = tv.tv_sec * 1000000LL + tv.tv_usec;
+        }
+    }
+}
+
+
+// one recvmmsg for everything queued, folded into the tables in place;
+// returns the number of frames, 0 on timeout or -1 with errno set
+static int read_frames(struct sniff_state* state, int timeout)
+{
+    struct pollfd p;
+    int64_t now;
+    int n, i;
+
+    p.fd = state->fd;
+    p.events = POLLIN;
+    p.revents = 0;
+
+    n = poll(&p, 1, timeout);
+    if (n <= 0)
+        return n;
+
+    n = recvmmsg(state->fd, state->msgs, SNIFF_RING, MSG_DONTWAIT, NULL);
+    if (n < 0)
+        return errno == EAGAIN ? 0 : -1;
+
+    state->counts.reads++;
+    now = wall_us();
+
+    for (i = 0; i < n; i++) {
+        struct msghdr* hdr = &state->msgs[i].msg_hdr;
+        const uint8_t* frame = state->frames[i];
+        uint32_t len = state->msgs[i].msg_len;
+        int64_t ts = now;
+        int received;
+
+        // the raw socket never hands out an empty frame, a closed
+        // socketpair does
+        if (len == 0) {
+            state->eof = 1;
+            break;
+        }
+
+        // without the socket's direction only commands go to the controller
+        received = frame[0] != HCI_COMMAND_PKT;
+        frame_meta(hdr, &received, &ts);
+        if (hdr->msg_flags & MSG_TRUNC)
+            state->counts.truncated++;
+
+        state->counts.frames++;
+        state->counts.bytes += len;
+        analyze_packet(state->result, 0, frame[0], received,
+                       frame + HCI_TYPE_LEN, len - HCI_TYPE_LEN, ts);
+
+        hdr->msg_controllen = SNIFF_CONTROL;
+        hdr->msg_flags      = 0;
+    }
+
+    return n;
+}
+
+
+
+// report --------------------------------------------------------------------
+
+static int compare_keys(const void* a, const void* b)
+{
+    uint32_t ka = **(const uint32_t* const*) a;
+    uint32_t kb = **(const uint32_t* const*) b;
+
+    return ka < kb ? -1 : ka > kb;
+}
+
+
+// the links with traffic in the interval, and their rates
+static void report_links(struct sniff_state* state, double seconds)
+{
+    const struct analyze_link* sorted[ANALYZE_LINK_SIZE];
+    int i, n;
+
+    // slots never move, so a link is in the same slot as at the last report
+    for (i = n = 0; i < ANALYZE_LINK_SIZE; i++) {
+        const struct analyze_link* link = &state->result->link_table[i];
+        const struct analyze_link* last = &state->last.links[i];
+
+        if (link->key && (link->packets[0] != last->packets[0] ||
+                          link->packets[1] != last->packets[1]))
+            sorted[n++] = link;
+    }
+    if (!n)
+        return;
+    qsort(sorted, n, sizeof(sorted[0]), compare_keys);
+
+    out_printf(&state->out, "    %-6s %10s %10s %10s %10s\n",
+               "handle", "tx pkt/s", "tx kbit/s", "rx pkt/s", "rx kbit/s");
+    for (i = 0; i < n; i++) {
+        const struct analyze_link* link = sorted[i];
+        const struct analyze_link* last = &state->last.links[link - state->result->link_table];
+
+        out_printf(&state->out, "    0x%04x %10.1f %10.1f %10.1f %10.1f\n", link->key & 0x0fff,
+                   (link->packets[0] - last->packets[0]) / seconds,
+                   (link->bytes[0] - last->bytes[0]) * 8 / seconds / 1e3,
+                   (link->packets[1] - last->packets[1]) / seconds,
+                   (link->bytes[1] - last->bytes[1]) * 8 / seconds / 1e3);
+    }
+}
+
+
+static void report_events(struct sniff_state* state, double seconds)
+{
+    int i, n = 0;
+
+    for (i = 0; i < 256; i++) {
+        uint64_t count = state->result->events[i] - state->last.events[i];
+
+        if (!count)
+            continue;
+        if (n++ == 0)
+            out_printf(&state->out, "    events/s:");
+        out_printf(&state->out, " 0x%02x %.1f", i, count / seconds);
+    }
+    if (n)
+        out_printf(&state->out, "\n");
+}
+
+
+// the commands sent or answered in the interval; the latencies are those
+// of the interval, max is since the start
+static void report_commands(struct sniff_state* state)
+{
+    const struct analyze_command* sorted[ANALYZE_COMMAND_SIZE];
+    struct trace_histogram latency;
+    char buf[32];
+    int i, j, n;
+
+    for (i = n = 0; i < ANALYZE_COMMAND_SIZE; i++) {
+        const struct analyze_command* command = &state->result->command_table[i];
+        const struct analyze_command* last = &state->last.commands[i];
+
+        if (command->key && (command->sent != last->sent ||
+                             command->latency.count != last->latency.count))
+            sorted[n++] = command;
+    }
+    if (!n)
+        return;
+    qsort(sorted, n, sizeof(sorted[0]), compare_keys);
+
+    out_printf(&state->out, "    %-34s %6s %6s %8s %8s %8s\n",
+               "command", "sent", "failed", "p50", "p99", "max");
+    for (i = 0; i < n; i++) {
+        const struct analyze_command* command = sorted[i];
+        const struct analyze_command* last =
+            &state->last.commands[command - state->result->command_table];
+
+        out_printf(&state->out, "    %-34s %6llu %6llu",
+                   trace_op_name(command->key & 0xffff, buf, sizeof(buf)),
+                   (unsigned long long) (command->sent - last->sent),
+                   (unsigned long long) (command->failed - last->failed));
+
+        latency.count = command->latency.count - last->latency.count;
+        latency.max   = command->latency.max;
+        if (latency.count) {
+            for (j = 0; j < TRACE_BUCKETS; j++)
+                latency.buckets[j] = command->latency.buckets[j] - last->latency.buckets[j];
+            trace_print_latency(&state->out, trace_percentile(&latency, 0.50));
+            trace_print_latency(&state->out, trace_percentile(&latency, 0.99));
+            trace_print_latency(&state->out, latency.max);
+        }
+        out_printf(&state->out, "\n");
+    }
+}
+
+
+static int report(struct sniff_state* state, uint64_t now)
+{
+    const struct sniff_counts* counts = &state->counts;
+    const struct sniff_counts* last = &state->last.counts;
+    double seconds = (now - state->last_report) / 1e9;
+    uint64_t malformed = state->result->malformed + state->result->overflow;
+
+    if (seconds <= 0)
+        return 0;
+
+    out_printf(&state->out, "%9.3f hci%d: %llu frames in %llu reads, %.1f kB/s, "
+               "%llu truncated, %llu malformed or beyond the tables\n",
+               (now - state->start) / 1e9, state->dev_id,
+               (unsigned long long) (counts->frames - last->frames),
+               (unsigned long long) (counts->reads - last->reads),
+               (counts->bytes - last->bytes) / seconds / 1e3,
+               (unsigned long long) (counts->truncated - last->truncated),
+               (unsigned long long) (malformed - state->last.malformed));
+    report_links(state, seconds);
+    report_events(state, seconds);
+    report_commands(state);
+
+    state->last.counts    = *counts;
+    state->last.malformed = malformed;
+    memcpy(state->last.events, state->result->events, sizeof(state->last.events));
+    memcpy(state->last.links, state->result->link_table, sizeof(state->last.links));
+    memcpy(state->last.commands, state->result->command_table, sizeof(state->last.commands));
+    state->last_report = now;
+
+    return outbuf_flush(&state->out, STDOUT_FILENO);
+}
+
+
+int sniff_run(int fd, int dev_id, double interval, double duration)
+{
+    struct sigaction action, old_action;
+    struct sniff_state* state;
+    uint64_t step = interval * 1e9;
+    uint64_t next, end = 0;
+    int err = 0;
+
+    state = calloc(1, sizeof(*state));
+    if (!state || !(state->result = calloc(1, sizeof(*state->result)))) {
+        free(state);
+        errno = ENOMEM;
+        return -1;
+    }
+    state->fd     = fd;
+    state->dev_id = dev_id;
+    prepare_ring(state);
+    outbuf_init(&state->out, 16384);
+
+    // ^C ends the analysis like the time running out
+    memset(&action, 0x00, sizeof(action));
+    action.sa_handler = on_sigint;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &old_action);
+    sniff_stop = 0;
+
+    state->start = state->last_report = deadline_now();
+    next = state->start + step;
+    if (duration > 0)
+        end = state->start + (uint64_t) (duration * 1e9);
+
+    while (!sniff_stop && !state->eof) {
+        uint64_t now = deadline_now();
+        uint64_t until = end && end < next ? end : next;
+
+        if (now >= next) {
+            if (report(state, now) < 0) {
+                err = errno;
+                break;
+            }
+            // a report late by a whole interval is not made up for
+            next += step;
+            if (next <= now)
+                next = now + step;
+            continue;
+        }
+        if (end && now >= end)
+            break;
+
+        if (read_frames(state, deadline_remaining_ms(until, SNIFF_MAX_WAIT)) < 0 &&
+                errno != EINTR) {
+            err = errno;
+            break;
+        }
+    }
+
+    // the rest of the last interval
+    if (!err && state->counts.frames != state->last.counts.frames &&
+            report(state, deadline_now()) < 0)
+        err = errno;
+
+    sigaction(SIGINT, &old_action, NULL);
+    outbuf_free(&state->out);
+    free(state->result);
+    free(state);
+    errno = err;
+    return err ? -1 : 0;
+}
+
+
+
+// feeding a recording ---------------------------------------------------------
+
+// what the kernel's filter of a raw socket lets through
+static int filter_passes(const struct hci_filter* filter, uint8_t type,
+                         const uint8_t* data, uint32_t len)
+{
+    struct hci_filter copy = *filter;
+
+    if (!hci_filter_test_ptype(type, &copy))
+        return 0;
+    if (type != HCI_EVENT_PKT)
+        return 1;
+    return len > 0 && hci_filter_test_event(data[0], &copy);
+}
+
+
+int sniff_feed(int fd, const char* path, int dev_id, const struct hci_filter* filter,
+               int realtime)
+{
+    const struct transport_file_header* header;
+    const uint8_t* data = MAP_FAILED;
+    struct timespec base;
+    struct stat st;
+    size_t offset;
+    int file, err = 0;
+
+    file = open(path, O_RDONLY | O_CLOEXEC);
+    if (file < 0 || fstat(file, &st) < 0) {
+        err = errno;
+        goto out;
+    }
+    if (st.st_size > 0)
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    if (data == MAP_FAILED) {
+        err = st.st_size > 0 ? errno : EPROTO;
+        goto out;
+    }
+    madvise((void*) data, st.st_size, MADV_SEQUENTIAL);
+
+    header = (const void*) data;
+    if ((size_t) st.st_size < sizeof(*header) ||
+        memcmp(header->magic, TRANSPORT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != TRANSPORT_VERSION || header->byte_order != TRANSPORT_BYTE_ORDER) {
+        err = EPROTO;
+        goto out;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &base);
+
+    for (offset = sizeof(*header); offset + sizeof(struct transport_record) <= (size_t) st.st_size; ) {
+        const struct transport_record* rec = (const void*) (data + offset);
+        const uint8_t* payload = data + offset + sizeof(*rec);
+        struct msghdr msg;
+        struct iovec iov[2];
+        uint8_t type;
+
+        // a cut off record ends the recording
+        if (st.st_size - offset - sizeof(*rec) < TRANSPORT_ALIGN(rec->len))
+            break;
+        offset += sizeof(*rec) + TRANSPORT_ALIGN(rec->len);
+
+        if (rec->dev_id != dev_id)
+            continue;
+
+        // commands and ACL are recorded without the type byte the
+        // socket puts in front, read packets with it
+        memset(&msg, 0x00, sizeof(msg));
+        msg.msg_iov = iov;
+        if (rec->call == TRANSPORT_SEND_CMD || rec->call == TRANSPORT_SEND_ACL) {
+            if (rec->result < 0)
+                continue;
+            type = rec->call == TRANSPORT_SEND_CMD ? HCI_COMMAND_PKT : HCI_ACLDATA_PKT;
+            iov[0].iov_base = &type;
+            iov[0].iov_len  = HCI_TYPE_LEN;
+            iov[1].iov_base = (void*) payload;
+            iov[1].iov_len  = rec->len;
+            msg.msg_iovlen  = 2;
+        } else if (rec->call == TRANSPORT_READ_EVENT && rec->result > 0 && rec->len > 0) {
+            type = payload[0];
+            iov[0].iov_base = (void*) payload;
+            iov[0].iov_len  = rec->len;
+            msg.msg_iovlen  = 1;
+        } else {
+            continue;
+        }
+
+        if (!filter_passes(filter, type,
+                           msg.msg_iovlen == 2 ? payload : payload + HCI_TYPE_LEN,
+                           msg.msg_iovlen == 2 ? rec->len : rec->len - HCI_TYPE_LEN))
+            continue;
+
+        if (realtime) {
+            struct timespec at = base;
+            uint64_t ns = at.tv_nsec + rec->start;
+
+            at.tv_sec += ns / 1000000000ULL;
+            at.tv_nsec = ns % 1000000000ULL;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) == EINTR)
+                ;
+        }
+
+        while (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+            if (errno == EINTR)
+                continue;
+            // the reader is gone
+            err = errno == EPIPE ? 0 : errno;
+            goto out;
+        }
+    }
+
+out:
+    if (data != MAP_FAILED)
+        munmap((void*) data, st.st_size);
+    if (file >= 0)
+        close(file);
+    close(fd);
+    errno = err;
+    return err ? -1 : 0;
+}
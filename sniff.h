@@ -0,0 +1,71 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef SNIFF_H
+#define SNIFF_H
+
+#include <stdint.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+
+// Live traffic analysis: a raw HCI socket of one adapter sees the packets
+// of every process using it, in both directions. Its filter lets only the
+// packet and event types asked for through, so the kernel drops the rest.
+// The socket is drained with recvmmsg into a ring of frames allocated
+// once, and each frame goes through the capture analyzer's tables
+// (analyze_packet), so nothing is allocated per packet. Every interval the
+// per-handle rates, the event counts and the command latencies of the
+// interval are printed.
+
+// frames per recvmmsg
+#define SNIFF_RING        64
+// room per frame, more than the ACL buffers of any controller; longer
+// frames are counted as truncated
+#define SNIFF_FRAME_SIZE  4096
+
+
+// parses a comma separated list of packet types (cmd, evt, acl, sco, iso)
+// and event codes (0x13) into filter; an event code implies evt, and cmd
+// lets Command Complete and Command Status through for the latencies.
+// NULL or "" is everything. Returns 0 or -1 for an unknown name.
+int sniff_parse_filter(const char* spec, struct hci_filter* filter);
+
+// a raw socket on adapter dev_id with filter, reporting the direction and
+// timestamp of every packet; -1 with errno set
+int sniff_open(int dev_id, const struct hci_filter* filter);
+
+// reads packets from fd (a raw HCI socket or anything else handing out one
+// H4 packet per datagram) and prints their statistics to stdout every
+// interval seconds, for duration seconds (0: no limit), until SIGINT or the
+// end of fd. Without the socket's direction only commands count as sent.
+// Returns 0 or -1 with errno set.
+int sniff_run(int fd, int dev_id, double interval, double duration);
+
+// writes the packets of adapter dev_id in a transport recording (see
+// transport.h) that pass filter into fd, one datagram each, as the raw
+// socket would deliver them; with realtime at their recorded times. Closes
+// fd at the end. For testing sniff_run over a socketpair. Returns 0 or -1
+// with errno set.
+int sniff_feed(int fd, const char* path, int dev_id, const struct hci_filter* filter,
+               int realtime);
+
+#endif
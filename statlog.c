@@ -0,0 +1,640 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+// strptime
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "statlog.h"
+
+
+// record mask bits after the counters
+#define STATLOG_FLAGS   (1u << WATCH_NUM_COUNTERS)   // flags follow
+#define STATLOG_RESET   (1u << (WATCH_NUM_COUNTERS + 1))   // absolute values
+
+// a frame of every adapter with every counter and the flags set
+#define STATLOG_MAX_RECORD  (2 * 5 + (WATCH_NUM_COUNTERS + 1) * 5)
+#define STATLOG_MAX_FRAME   (2 * 10 + STATLOG_MAX_ADAPTERS * STATLOG_MAX_RECORD)
+
+
+static inline struct statlog_block* block_at(const struct statlog_header* header, uint32_t index)
+{
+    return (struct statlog_block*) ((uint8_t*) header + (size_t) (index + 1) * header->block_size);
+}
+
+
+static inline int put_varint(uint8_t* p, uint64_t value)
+{
+    int n = 0;
+
+    while (value >= 0x80) {
+        p[n++] = value | 0x80;
+        value >>= 7;
+    }
+    p[n++] = value;
+    return n;
+}
+
+
+// -1 if the varint runs past end
+static inline int get_varint(const uint8_t** p, const uint8_t* end, uint64_t* value)
+{
+    uint64_t v = 0;
+    int shift = 0;
+
+    while (*p < end && shift < 64) {
+        uint8_t byte = *(*p)++;
+
+        v |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = v;
+            return 0;
+        }
+        shift += 7;
+    }
+
+    return -1;
+}
+
+
+int64_t statlog_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+static int header_valid(const struct statlog_header* header, size_t size)
+{
+    return memcmp(header->magic, STATLOG_MAGIC, sizeof(header->magic)) == 0 &&
+           header->version == STATLOG_VERSION &&
+           header->block_size == STATLOG_BLOCK_SIZE &&
+           header->num_blocks > 0 && header->head < header->num_blocks &&
+           size == (size_t) (header->num_blocks + 1) * header->block_size;
+}
+
+
+int statlog_open(struct stat_log* log, const char* path, int writable)
+{
+    size_t size = (size_t) (STATLOG_BLOCKS + 1) * STATLOG_BLOCK_SIZE;
+    struct statlog_header header;
+    struct stat st;
+    uint32_t i;
+    int err;
+
+    memset(log, 0x00, sizeof(*log));
+    log->fd = open(path, (writable ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC, 0644);
+    if (log->fd < 0)
+        return -1;
+
+    if (writable && flock(log->fd, LOCK_EX | LOCK_NB) < 0)
+        goto fail;
+    if (fstat(log->fd, &st) < 0)
+        goto fail;
+
+    // a new log; anything else that is not a log is left alone
+    if (writable && st.st_size == 0) {
+        memset(&header, 0x00, sizeof(header));
+        memcpy(header.magic, STATLOG_MAGIC, sizeof(header.magic));
+        header.version    = STATLOG_VERSION;
+        header.block_size = STATLOG_BLOCK_SIZE;
+        header.num_blocks = STATLOG_BLOCKS;
+        if (ftruncate(log->fd, size) < 0 ||
+                pwrite(log->fd, &header, sizeof(header), 0) != sizeof(header))
+            goto fail;
+        st.st_size = size;
+    }
+
+    if ((size_t) st.st_size < sizeof(header) ||
+            pread(log->fd, &header, sizeof(header), 0) != sizeof(header) ||
+            !header_valid(&header, st.st_size)) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    log->size = st.st_size;
+    log->header = mmap(NULL, log->size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                       MAP_SHARED, log->fd, 0);
+    if (log->header == MAP_FAILED) {
+        log->header = NULL;
+        goto fail;
+    }
+
+    if (writable) {
+        log->header->writer_pid = getpid();
+        // the serials go on where the last writer stopped
+        for (i = 0; i < log->header->num_blocks; i++)
+            if (block_at(log->header, i)->serial > log->serial)
+                log->serial = block_at(log->header, i)->serial;
+    }
+
+    return 0;
+
+fail:
+    err = errno;
+    close(log->fd);
+    log->fd = -1;
+    errno = err;
+    return -1;
+}
+
+
+void statlog_close(struct stat_log* log)
+{
+    if (log->header)
+        munmap(log->header, log->size);
+    if (log->fd >= 0)
+        close(log->fd);
+    log->header = NULL;
+    log->fd = -1;
+}
+
+
+// recycles the oldest block; its serial is 0 while it is rewritten
+static void start_block(struct stat_log* log, int64_t time)
+{
+    struct statlog_header* header = log->header;
+    uint32_t index = header->head;
+    struct statlog_block* block;
+
+    if (log->serial > 0)
+        index = (index + 1) % header->num_blocks;
+    block = block_at(header, index);
+
+    __atomic_store_n(&block->serial, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    block->used       = 0;
+    block->frames     = 0;
+    block->restart    = log->block == NULL;
+    block->first_time = time;
+    block->last_time  = time;
+    __atomic_store_n(&block->serial, ++log->serial, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->head, index, __ATOMIC_RELEASE);
+
+    // the keyframe holds every adapter with absolute values
+    log->block     = block;
+    log->last_time = time;
+    memset(log->present, 0x00, sizeof(log->present));
+}
+
+
+// A frame is the time since the frame before (or the block's start) and
+// the number of records, all varints. A record is dev_id, a mask of the
+// values that follow (counter bits, STATLOG_FLAGS, STATLOG_RESET) and the
+// values: with STATLOG_RESET the counters themselves, else their growth.
+static int encode_frame(const struct stat_log* log, uint8_t* buf, int64_t time,
+                        const struct statlog_sample* samples, int count)
+{
+    uint8_t* p = buf;
+    unsigned int i;
+    int j, records = 0;
+
+    for (j = 0; j < count; j++)
+        records += samples[j].dev_id >= 0 && samples[j].dev_id < STATLOG_MAX_ADAPTERS;
+
+    p += put_varint(p, time - log->last_time);
+    p += put_varint(p, records);
+
+    for (j = 0; j < count; j++) {
+        const struct statlog_sample* sample = &samples[j];
+        const uint32_t* now = (const uint32_t*) &sample->stat;
+        uint32_t values[WATCH_NUM_COUNTERS];
+        int dev = sample->dev_id;
+        int reset;
+        uint32_t mask;
+
+        if (dev < 0 || dev >= STATLOG_MAX_ADAPTERS)
+            continue;
+
+        reset = !log->present[dev];
+        mask  = reset ? STATLOG_RESET : 0;
+        for (i = 0; i < WATCH_NUM_COUNTERS; i++) {
+            // wrapped counters grow by the unsigned 32 bit difference
+            values[i] = reset ? now[i] : now[i] - log->last[dev][i];
+            if (values[i])
+                mask |= 1u << i;
+        }
+        if (reset ? sample->flags != 0 : sample->flags != log->flags[dev])
+            mask |= STATLOG_FLAGS;
+
+        p += put_varint(p, dev);
+        p += put_varint(p, mask);
+        for (i = 0; i < WATCH_NUM_COUNTERS; i++)
+            if (mask & (1u << i))
+                p += put_varint(p, values[i]);
+        if (mask & STATLOG_FLAGS)
+            p += put_varint(p, sample->flags);
+    }
+
+    return p - buf;
+}
+
+
+int statlog_append(struct stat_log* log, int64_t time,
+                   const struct statlog_sample* samples, int count)
+{
+    uint8_t buf[STATLOG_MAX_FRAME];
+    struct statlog_block* block;
+    uint32_t used;
+    int len, j;
+
+    if (count > STATLOG_MAX_ADAPTERS)
+        count = STATLOG_MAX_ADAPTERS;
+
+    // block times only grow, or the search for a time would miss blocks
+    if (!log->block || time < log->last_time)
+        start_block(log, time);
+
+    len = encode_frame(log, buf, time, samples, count);
+    if (len > (int) (STATLOG_BLOCK_DATA - log->block->used)) {
+        start_block(log, time);
+        len = encode_frame(log, buf, time, samples, count);
+    }
+
+    block = log->block;
+    used  = block->used;
+    memcpy(block->data + used, buf, len);
+    block->frames++;
+    block->last_time = time;
+    __atomic_store_n(&block->used, used + len, __ATOMIC_RELEASE);
+
+    memset(log->present, 0x00, sizeof(log->present));
+    for (j = 0; j < count; j++) {
+        int dev = samples[j].dev_id;
+
+        if (dev < 0 || dev >= STATLOG_MAX_ADAPTERS)
+            continue;
+        log->present[dev] = 1;
+        log->flags[dev]   = samples[j].flags;
+        memcpy(log->last[dev], &samples[j].stat, sizeof(log->last[dev]));
+    }
+    log->last_time = time;
+
+    return 0;
+}
+
+
+// the decoder follows the frames of consecutive blocks
+struct decoder {
+    int64_t   time;
+    uint8_t   present[STATLOG_MAX_ADAPTERS];       // in the frame before
+    uint8_t   seen[STATLOG_MAX_ADAPTERS];          // in this frame
+    uint8_t   have_delta[STATLOG_MAX_ADAPTERS];
+    uint32_t  flags[STATLOG_MAX_ADAPTERS];
+    uint32_t  value[STATLOG_MAX_ADAPTERS][WATCH_NUM_COUNTERS];
+    uint32_t  delta[STATLOG_MAX_ADAPTERS][WATCH_NUM_COUNTERS];
+};
+
+// the sum of one step of one adapter
+struct bucket {
+    int       have;
+    uint32_t  flags;
+    int64_t   span;      // ms covered by the deltas
+    uint64_t  sum[WATCH_NUM_COUNTERS];
+};
+
+struct query {
+    int64_t                from;
+    int64_t                to;
+    int64_t                step;
+    int                    dev_id;
+    int64_t                bucket_time;    // start of the current step
+    struct outbuf*         out;
+    struct statlog_stats*  stats;
+    struct bucket          buckets[STATLOG_MAX_ADAPTERS];
+};
+
+
+// a consistent copy of the frames of a block; 0 if it is being rewritten
+static int copy_block(const struct statlog_block* block, struct statlog_block* copy)
+{
+    uint32_t begin, end, used;
+
+    begin = __atomic_load_n(&block->serial, __ATOMIC_ACQUIRE);
+    if (begin == 0)
+        return 0;
+
+    used = __atomic_load_n(&block->used, __ATOMIC_ACQUIRE);
+    if (used > STATLOG_BLOCK_DATA)
+        return 0;
+    memcpy(copy, (const void*) block, sizeof(*block) + used);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    end = __atomic_load_n(&block->serial, __ATOMIC_RELAXED);
+
+    copy->used = used;
+    return begin == end;
+}
+
+
+// -1 on a corrupt frame
+static int decode_frame(struct decoder* dec, const uint8_t** p, const uint8_t* end)
+{
+    uint64_t dt, records, dev, mask, v;
+    unsigned int i;
+
+    if (get_varint(p, end, &dt) < 0 || get_varint(p, end, &records) < 0)
+        return -1;
+    dec->time += dt;
+
+    memset(dec->seen, 0x00, sizeof(dec->seen));
+    memset(dec->have_delta, 0x00, sizeof(dec->have_delta));
+
+    while (records--) {
+        if (get_varint(p, end, &dev) < 0 || dev >= STATLOG_MAX_ADAPTERS ||
+                get_varint(p, end, &mask) < 0)
+            return -1;
+
+        for (i = 0; i < WATCH_NUM_COUNTERS; i++) {
+            v = 0;
+            if ((mask & (1u << i)) && get_varint(p, end, &v) < 0)
+                return -1;
+
+            // a keyframe continues the frame before unless the writer restarted
+            if (mask & STATLOG_RESET) {
+                dec->delta[dev][i] = (uint32_t) v - dec->value[dev][i];
+                dec->value[dev][i] = v;
+            } else {
+                dec->delta[dev][i] = v;
+                dec->value[dev][i] += v;
+            }
+        }
+
+        if (mask & STATLOG_FLAGS) {
+            if (get_varint(p, end, &v) < 0)
+                return -1;
+            dec->flags[dev] = v;
+        } else if (mask & STATLOG_RESET)
+            dec->flags[dev] = 0;
+
+        dec->seen[dev]       = 1;
+        dec->have_delta[dev] = dec->present[dev];
+    }
+
+    memcpy(dec->present, dec->seen, sizeof(dec->present));
+    return 0;
+}
+
+
+static void print_header(struct outbuf* out)
+{
+    out_printf(out, "%-19s %-6s %10s %10s %8s %8s %8s %8s %8s %8s %6s %6s %s\n",
+               "time", "dev",
+               "byte_rx/s", "byte_tx/s", "acl_rx/s", "acl_tx/s",
+               "sco_rx/s", "sco_tx/s", "evt_rx/s", "cmd_tx/s",
+               "err_rx", "err_tx", "state");
+}
+
+
+// one row per adapter with samples in the step starting at time
+static void flush_buckets(struct query* query, int64_t time)
+{
+    char stamp[32];
+    struct tm tm;
+    time_t seconds = time / 1000;
+    int dev;
+
+    localtime_r(&seconds, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+
+    for (dev = 0; dev < STATLOG_MAX_ADAPTERS; dev++) {
+        struct bucket* bucket = &query->buckets[dev];
+        double dt = bucket->span / 1e3;
+        uint64_t* d = bucket->sum;
+
+        if (!bucket->have)
+            continue;
+
+        out_printf(query->out, "%-19s hci%-3d %10.0f %10.0f %8.1f %8.1f %8.1f %8.1f "
+                   "%8.1f %8.1f %6llu %6llu %s\n",
+                   stamp, dev,
+                   d[BYTE_RX] / dt, d[BYTE_TX] / dt,
+                   d[ACL_RX]  / dt, d[ACL_TX]  / dt,
+                   d[SCO_RX]  / dt, d[SCO_TX]  / dt,
+                   d[EVT_RX]  / dt, d[CMD_TX]  / dt,
+                   (unsigned long long) d[ERR_RX],
+                   (unsigned long long) d[ERR_TX],
+                   bucket->flags & (1 << HCI_UP) ? "up" : "down");
+        query->stats->rows++;
+        memset(bucket, 0x00, sizeof(*bucket));
+    }
+}
+
+
+// folds the deltas of a decoded frame into the current step
+static void add_frame(struct query* query, const struct decoder* dec, int64_t dt)
+{
+    unsigned int i;
+    int dev;
+
+    if (dec->time < query->from || dec->time >= query->to || dt <= 0)
+        return;
+
+    if (query->step == 0)
+        query->bucket_time = dec->time;
+    else if (dec->time >= query->bucket_time + query->step) {
+        flush_buckets(query, query->bucket_time);
+        query->bucket_time += (dec->time - query->bucket_time) / query->step * query->step;
+    }
+
+    for (dev = 0; dev < STATLOG_MAX_ADAPTERS; dev++) {
+        struct bucket* bucket = &query->buckets[dev];
+
+        if (!dec->have_delta[dev] || (query->dev_id >= 0 && dev != query->dev_id))
+            continue;
+
+        bucket->have   = 1;
+        bucket->flags  = dec->flags[dev];
+        bucket->span  += dt;
+        for (i = 0; i < WATCH_NUM_COUNTERS; i++)
+            bucket->sum[i] += dec->delta[dev][i];
+    }
+
+    if (query->step == 0)
+        flush_buckets(query, dec->time);
+}
+
+
+// index of the n-th block in log order, the oldest first
+static inline uint32_t log_order(const struct statlog_header* header, uint32_t head, uint32_t n)
+{
+    return (head + 1 + n) % header->num_blocks;
+}
+
+
+int statlog_query(const struct stat_log* log, int64_t from, int64_t to, int64_t step,
+                  int dev_id, struct outbuf* out, struct statlog_stats* stats)
+{
+    const struct statlog_header* header = log->header;
+    uint32_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    uint32_t n = header->num_blocks;
+    uint32_t lo, hi, mid, serial = 0;
+    struct statlog_block* copy;
+    struct decoder* dec;
+    struct query* query;
+
+    copy  = malloc(STATLOG_BLOCK_SIZE);
+    dec   = calloc(1, sizeof(*dec));
+    query = calloc(1, sizeof(*query));
+    if (!copy || !dec || !query) {
+        free(copy);
+        free(dec);
+        free(query);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memset(stats, 0x00, sizeof(*stats));
+    query->from        = from;
+    query->to          = to;
+    query->step        = step;
+    query->dev_id      = dev_id;
+    query->bucket_time = from;
+    query->out         = out;
+    query->stats       = stats;
+
+    // blocks never written come first in log order, before the first wrap
+    lo = 0;
+    hi = n;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (block_at(header, log_order(header, head, mid))->serial == 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    // the first block that reaches into the range
+    hi = n;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (block_at(header, log_order(header, head, mid))->last_time < from)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    print_header(out);
+
+    for (; lo < n; lo++) {
+        const struct statlog_block* block = block_at(header, log_order(header, head, lo));
+        const uint8_t* p;
+        const uint8_t* end;
+        uint32_t frame;
+
+        if (!copy_block(block, copy) || copy->first_time >= to)
+            break;
+        // a block rewritten since the search ends the consecutive ones
+        if (serial && copy->serial != serial + 1)
+            break;
+        if (copy->restart || !serial)
+            memset(dec->present, 0x00, sizeof(dec->present));
+        serial = copy->serial;
+        stats->blocks++;
+
+        p   = copy->data;
+        end = copy->data + copy->used;
+        for (frame = 0; frame < copy->frames && p < end; frame++) {
+            // the keyframe's time is relative to the block's start
+            int64_t before = dec->time;
+
+            if (frame == 0)
+                dec->time = copy->first_time;
+            if (decode_frame(dec, &p, end) < 0)
+                break;
+            stats->frames++;
+            add_frame(query, dec, dec->time - before);
+        }
+    }
+
+    if (step)
+        flush_buckets(query, query->bucket_time);
+
+    free(copy);
+    free(dec);
+    free(query);
+    return 0;
+}
+
+
+int64_t statlog_parse_time(const char* text, int64_t now)
+{
+    const char* rest;
+    char* end;
+    struct tm tm;
+    time_t t;
+
+    if (strcmp(text, "now") == 0)
+        return now;
+
+    // -90s, -15m, -2h, -7d
+    if (text[0] == '-') {
+        double value = strtod(text + 1, &end);
+        int64_t unit;
+
+        if (end == text + 1 || value < 0)
+            return -1;
+        switch (*end) {
+        case '\0':
+        case 's': unit = 1000;     break;
+        case 'm': unit = 60000;    break;
+        case 'h': unit = 3600000;  break;
+        case 'd': unit = 86400000; break;
+        default:  return -1;
+        }
+        if (*end && end[1])
+            return -1;
+        return now - (int64_t) (value * unit);
+    }
+
+    // unix seconds
+    if (strspn(text, "0123456789") == strlen(text) && *text)
+        return strtoll(text, NULL, 10) * 1000;
+
+    memset(&tm, 0x00, sizeof(tm));
+    rest = strptime(text, "%Y-%m-%d", &tm);
+    if (!rest)
+        return -1;
+    if (*rest == ' ' || *rest == 'T') {
+        rest = strptime(rest + 1, "%H:%M", &tm);
+        if (rest && *rest == ':')
+            rest = strptime(rest + 1, "%S", &tm);
+        if (!rest)
+            return -1;
+    }
+    if (*rest)
+        return -1;
+
+    tm.tm_isdst = -1;
+    t = mktime(&tm);
+    return t == (time_t) -1 ? -1 : (int64_t) t * 1000;
+}
@@ -0,0 +1,121 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef STATLOG_H
+#define STATLOG_H
+
+#include <stdint.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "output.h"
+#include "watch.h"
+
+
+// History of the adapter counters in a fixed-size memory-mapped file:
+// a ring of blocks, each starting with a keyframe (absolute values) that
+// is followed by frames holding only what changed since the frame before,
+// as varints. A query finds its first block by binary search over the
+// block times and decodes from that keyframe on. One writer (--watch
+// with --log) and any number of readers; like the published records,
+// every block has a serial that tells a reader it was overwritten.
+
+#define STATLOG_MAGIC       "BTDISLOG"
+#define STATLOG_VERSION     1
+#define STATLOG_BLOCK_SIZE  4096
+#define STATLOG_BLOCKS      4096     // 16 MB, ~10 days of 1 s samples of a few adapters
+
+// adapters with a higher dev_id are not logged
+#define STATLOG_MAX_ADAPTERS  HCI_MAX_DEV
+
+struct statlog_header {
+    char      magic[8];
+    uint32_t  version;
+    uint32_t  block_size;
+    uint32_t  num_blocks;
+    uint32_t  head;           // index of the block being written
+    uint32_t  writer_pid;
+    uint32_t  pad;
+};
+
+struct statlog_block {
+    uint32_t  serial;         // position in the log, 0 = never written
+    uint32_t  used;           // bytes of data in frames
+    uint32_t  frames;
+    uint32_t  restart;        // first block of a writer: no deltas across
+    int64_t   first_time;     // ms since the epoch, of the keyframe
+    int64_t   last_time;      // of the last frame
+    uint8_t   data[];
+};
+
+#define STATLOG_BLOCK_DATA  (STATLOG_BLOCK_SIZE - sizeof(struct statlog_block))
+
+// one adapter of a sample
+struct statlog_sample {
+    int                   dev_id;
+    uint32_t              flags;
+    struct hci_dev_stats  stat;
+};
+
+struct stat_log {
+    int                     fd;
+    size_t                  size;
+    struct statlog_header*  header;
+
+    // writer only: the open block and what the last frame held
+    struct statlog_block*   block;
+    uint32_t                serial;
+    int64_t                 last_time;
+    uint8_t                 present[STATLOG_MAX_ADAPTERS];
+    uint32_t                flags[STATLOG_MAX_ADAPTERS];
+    uint32_t                last[STATLOG_MAX_ADAPTERS][WATCH_NUM_COUNTERS];
+};
+
+
+// opens (and for a writer creates) the log at path; a writer holds an
+// exclusive lock until statlog_close. -1 with errno set, EINVAL if the
+// file is not a log, EWOULDBLOCK if another writer has it
+int statlog_open(struct stat_log* log, const char* path, int writable);
+void statlog_close(struct stat_log* log);
+
+// appends the adapters sampled at time (ms since the epoch)
+int statlog_append(struct stat_log* log, int64_t time,
+                   const struct statlog_sample* samples, int count);
+
+struct statlog_stats {
+    int       blocks;         // decoded
+    uint64_t  frames;
+    uint64_t  rows;
+};
+
+// renders the rates of the samples in [from, to), summed into steps of
+// step ms (0: every sample), of adapter dev_id (-1: all)
+int statlog_query(const struct stat_log* log, int64_t from, int64_t to, int64_t step,
+                  int dev_id, struct outbuf* out, struct statlog_stats* stats);
+
+// ms since the epoch for "now", "-<n>[smhd]" (ago), unix seconds or a
+// local "YYYY-MM-DD[ HH:MM[:SS]]"; -1 if text is none of them
+int64_t statlog_parse_time(const char* text, int64_t now);
+
+// CLOCK_REALTIME in ms
+int64_t statlog_now(void);
+
+#endif
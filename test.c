@@ -0,0 +1,1524 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+// Behaviour tests of the parts that need no bluetooth hardware: the bitmap
+// decoders, the command pipeline against a scripted controller, hotplug
+// with recorded monitor frames, the parallel probe, the capability cache,
+// the statistics log, the binary format, --changes and the fleet diff.
+// Adapters come from the stub transport. Every case runs in this process;
+// a failed check is reported with its line and the case goes on. The
+// arguments are name prefixes of the cases to run, none for all. Exits
+// with 1 if any check failed.
+
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "adapter.h"
+#include "btdevinfo.h"
+#include "cache.h"
+#include "deadline.h"
+#include "decode.h"
+#include "fingerprint.h"
+#include "hci_pipeline.h"
+#include "hotplug.h"
+#include "output.h"
+#include "server.h"
+#include "snapshot.h"
+#include "statlog.h"
+#include "transport.h"
+
+
+struct test_case {
+    const char*  name;
+    void (*run)(void);
+};
+
+static int checks;
+static int failures;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static int check(int ok, const char* what, int line)
+{
+    checks++;
+    if (!ok) {
+        failures++;
+        printf("    test.c:%d: %s\n", line, what);
+    }
+    return ok;
+}
+
+
+// a file name in /tmp that does not exist yet
+static void temp_path(char* path, size_t size)
+{
+    int fd;
+
+    snprintf(path, size, "/tmp/btdi-test-XXXXXX");
+    fd = mkstemp(path);
+    if (fd >= 0) {
+        close(fd);
+        unlink(path);
+    }
+}
+
+
+// probes stub adapter dev_id with everything
+static int probe_stub(struct transport* transport, int dev_id, struct adapter_info* info)
+{
+    struct btdi_context ctx;
+
+    btdi_init(&ctx, transport);
+    return btdi_probe(&ctx, dev_id, 0, info);
+}
+
+
+
+// a scripted controller -------------------------------------------------------
+
+// answers the pipeline with the events queued beforehand, whatever it
+// sends, and logs what was sent by the time each event was read
+#define SCRIPT_MAX 16
+
+struct script {
+    struct transport  base;
+    uint8_t           events[SCRIPT_MAX][HCI_MAX_EVENT_SIZE];
+    int               lens[SCRIPT_MAX];
+    int               count;
+    int               next;
+    uint16_t          sent[SCRIPT_MAX];
+    uint8_t           sent_param[SCRIPT_MAX][HCI_PIPELINE_MAX_PARAM];
+    int               num_sent;
+    int               sent_at_read[SCRIPT_MAX];
+};
+
+
+static int script_dev_list(struct transport* transport, struct hci_dev_req* devs, int max)
+{
+    return 0;
+}
+
+
+static int script_dev_info(struct transport* transport, int dev_id, struct hci_dev_info* di)
+{
+    errno = ENODEV;
+    return -1;
+}
+
+
+static int script_conn_list(struct transport* transport, int dev_id,
+                            struct hci_conn_info* conns, int max)
+{
+    return 0;
+}
+
+
+static int script_open(struct transport* transport, int dev_id, struct transport_dev* dev)
+{
+    dev->transport = transport;
+    dev->dev_id    = dev_id;
+    dev->fd        = -1;
+    dev->priv      = NULL;
+    return 0;
+}
+
+
+static void script_close(struct transport_dev* dev)
+{
+}
+
+
+static int script_send_cmd(struct transport_dev* dev, uint16_t opcode, uint8_t plen, const void* param)
+{
+    struct script* script = (struct script*) dev->transport;
+
+    if (script->num_sent == SCRIPT_MAX) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    script->sent[script->num_sent] = opcode;
+    memcpy(script->sent_param[script->num_sent], param, plen);
+    script->num_sent++;
+    return 0;
+}
+
+
+static int script_send_acl(struct transport_dev* dev, const void* pkt, int len)
+{
+    errno = ENOTCONN;
+    return -1;
+}
+
+
+// an empty script times out at once
+static int script_read_event(struct transport_dev* dev, void* buf, int len, int timeout)
+{
+    struct script* script = (struct script*) dev->transport;
+
+    if (script->next == script->count)
+        return 0;
+
+    script->sent_at_read[script->next] = script->num_sent;
+    if (script->lens[script->next] < len)
+        len = script->lens[script->next];
+    memcpy(buf, script->events[script->next], len);
+    script->next++;
+    return len;
+}
+
+
+static int script_read_events(struct transport_dev* dev, uint8_t* buf, int size,
+                              int* lens, int count, int timeout)
+{
+    lens[0] = script_read_event(dev, buf, size, timeout);
+    return lens[0] > 0 ? 1 : lens[0];
+}
+
+
+static int script_set_filter(struct transport_dev* dev, const struct hci_filter* filter)
+{
+    return 0;
+}
+
+
+static void script_destroy(struct transport* transport)
+{
+}
+
+
+static const struct transport_ops script_ops = {
+    script_dev_list, script_dev_info, script_conn_list, script_open, script_close,
+    script_send_cmd, script_send_acl, script_read_event, script_read_events,
+    script_set_filter, script_destroy
+};
+
+
+static void script_init(struct script* script, struct transport_dev* dev)
+{
+    memset(script, 0x00, sizeof(*script));
+    script->base.ops = &script_ops;
+    transport_open(&script->base, 0, dev);
+}
+
+
+static void script_event(struct script* script, uint8_t evt, const void* param, int plen)
+{
+    uint8_t* pkt = script->events[script->count];
+
+    pkt[0] = HCI_EVENT_PKT;
+    pkt[1] = evt;
+    pkt[2] = plen;
+    memcpy(pkt + 3, param, plen);
+    script->lens[script->count++] = HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE + plen;
+}
+
+
+static void script_complete(struct script* script, uint8_t ncmd, uint16_t opcode,
+                            const void* rparam, int rlen)
+{
+    uint8_t param[EVT_CMD_COMPLETE_SIZE + 64];
+    evt_cmd_complete* cc = (void*) param;
+
+    cc->ncmd   = ncmd;
+    cc->opcode = htobs(opcode);
+    memcpy(param + EVT_CMD_COMPLETE_SIZE, rparam, rlen);
+    script_event(script, EVT_CMD_COMPLETE, param, EVT_CMD_COMPLETE_SIZE + rlen);
+}
+
+
+static void script_status(struct script* script, uint8_t status, uint8_t ncmd, uint16_t opcode)
+{
+    evt_cmd_status cs;
+
+    cs.status = status;
+    cs.ncmd   = ncmd;
+    cs.opcode = htobs(opcode);
+    script_event(script, EVT_CMD_STATUS, &cs, EVT_CMD_STATUS_SIZE);
+}
+
+
+
+// decode ----------------------------------------------------------------------
+
+static void test_bit_iter(void)
+{
+    static const int bits[] = { 0, 7, 8, 63, 64, 200, 511 };
+    uint8_t bitmap[64];
+    struct bit_iter it;
+    unsigned int i;
+
+    memset(bitmap, 0x00, sizeof(bitmap));
+    for (i = 0; i < sizeof(bits) / sizeof(bits[0]); i++)
+        bitmap[bits[i] / 8] |= 1 << (bits[i] % 8);
+
+    bit_iter_init(&it, bitmap, sizeof(bitmap));
+    for (i = 0; i < sizeof(bits) / sizeof(bits[0]); i++)
+        CHECK(bit_iter_next(&it) == bits[i]);
+    CHECK(bit_iter_next(&it) == -1);
+    CHECK(bit_iter_next(&it) == -1);
+
+    // a bitmap that is not a multiple of 8 bytes must not be read past
+    memset(bitmap, 0x00, sizeof(bitmap));
+    bitmap[10] = 0x80;
+    bitmap[11] = 0xff;
+    bit_iter_init(&it, bitmap, 11);
+    CHECK(bit_iter_next(&it) == 87);
+    CHECK(bit_iter_next(&it) == -1);
+
+    bit_iter_init(&it, bitmap, 0);
+    CHECK(bit_iter_next(&it) == -1);
+
+    bit_iter_init_value(&it, 0x8000000000000001ull);
+    CHECK(bit_iter_next(&it) == 0);
+    CHECK(bit_iter_next(&it) == 63);
+    CHECK(bit_iter_next(&it) == -1);
+
+    bit_iter_init_value(&it, 0);
+    CHECK(bit_iter_next(&it) == -1);
+}
+
+
+// the names are where the specification puts them, and the precomputed
+// widths are right
+static void test_bit_tables(void)
+{
+    const struct bit_table* tables[] = {
+        &dev_flags_table, &lmp_features_table, &le_features_table, &commands_table,
+        &acl_ptype_table, &sco_ptype_table, &link_policy_table
+    };
+    unsigned int i;
+    int bit, page;
+
+    CHECK(lmp_features_table.nbits == 64);
+    CHECK(commands_table.nbits <= 512);
+    CHECK(!strcmp(bit_table_name(&dev_flags_table, HCI_UP), "UP"));
+    CHECK(!strcmp(bit_table_name(&lmp_features_table, 0), "3-slot packets"));
+    CHECK(!strcmp(bit_table_name(&commands_table, 26 * 8 + 3), "LE Set Scan Enable"));
+    CHECK(bit_table_name(&lmp_features_table, 64) == NULL);
+    CHECK(bit_table_name(&commands_table, 1000) == NULL);
+
+    for (i = 0; i < sizeof(tables) / sizeof(tables[0]); i++)
+        for (bit = 0; bit < tables[i]->nbits; bit++)
+            if (tables[i]->names[bit].name)
+                CHECK(tables[i]->names[bit].width == strlen(tables[i]->names[bit].name));
+
+    for (page = 0; page < lmp_ext_features_pages; page++)
+        for (bit = 0; bit < lmp_ext_features_tables[page].nbits; bit++)
+            if (lmp_ext_features_tables[page].names[bit].name)
+                CHECK(lmp_ext_features_tables[page].names[bit].width ==
+                      strlen(lmp_ext_features_tables[page].names[bit].name));
+}
+
+
+static void test_decode(void)
+{
+    struct adapter_caps caps;
+    struct hci_version ver;
+    read_local_version_rp vrp;
+    read_local_ext_features_rp erp;
+
+    memset(&vrp, 0x00, sizeof(vrp));
+    vrp.hci_ver      = 0x0b;
+    vrp.hci_rev      = htobs(0x1234);
+    vrp.lmp_ver      = 0x0a;
+    vrp.manufacturer = htobs(0x0002);
+    vrp.lmp_subver   = htobs(0xbeef);
+    decode_local_version(&ver, &vrp);
+    CHECK(ver.hci_ver == 0x0b && ver.hci_rev == 0x1234);
+    CHECK(ver.lmp_ver == 0x0a && ver.lmp_subver == 0xbeef);
+    CHECK(ver.manufacturer == 2);
+
+    memset(&caps, 0x00, sizeof(caps));
+    memset(&erp, 0x00, sizeof(erp));
+    erp.page_num     = 2;
+    erp.max_page_num = 2;
+    erp.features[0]  = 0x5a;
+    CHECK(decode_ext_features(&caps, &erp) == 2);
+    CHECK(caps.ext_page_mask == 0x04);
+    CHECK(caps.max_ext_page == 2);
+    CHECK(caps.ext_features[2][0] == 0x5a);
+
+    erp.page_num = MAX_EXT_FEATURE_PAGES;
+    CHECK(decode_ext_features(&caps, &erp) == -1);
+    CHECK(caps.ext_page_mask == 0x04);
+}
+
+
+
+// the command pipeline --------------------------------------------------------
+
+#define OP_VERSION   cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_LOCAL_VERSION)
+#define OP_BUFFER    cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_BUFFER_SIZE)
+#define OP_BDADDR    cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_BD_ADDR)
+#define OP_RSSI      cmd_opcode_pack(OGF_STATUS_PARAM, 0x0005)
+
+// a command is sent only with a credit, and an answer grants as many as
+// its Num_HCI_Command_Packets says
+static void test_pipeline_credits(void)
+{
+    static struct script script;
+    struct transport_dev dev;
+    struct hci_pipeline pipeline;
+    uint8_t version[] = { 0x00, 0x0b }, buffer[] = { 0x00, 0x01 }, bdaddr[] = { 0x00, 0x02 };
+    uint8_t r0[2], r1[2], r2[2];
+
+    script_init(&script, &dev);
+    hci_pipeline_init(&pipeline, &dev);
+    hci_pipeline_add(&pipeline, OGF_INFO_PARAM, OCF_READ_LOCAL_VERSION, NULL, 0, r0, 2, NULL, NULL);
+    hci_pipeline_add(&pipeline, OGF_INFO_PARAM, OCF_READ_BUFFER_SIZE, NULL, 0, r1, 2, NULL, NULL);
+    hci_pipeline_add(&pipeline, OGF_INFO_PARAM, OCF_READ_BD_ADDR, NULL, 0, r2, 2, NULL, NULL);
+
+    // the later ones answered out of order
+    script_complete(&script, 3, OP_VERSION, version, 2);
+    script_complete(&script, 1, OP_BDADDR, bdaddr, 2);
+    script_complete(&script, 1, OP_BUFFER, buffer, 2);
+
+    CHECK(hci_pipeline_run(&pipeline, 100) == 0);
+    CHECK(script.num_sent == 3);
+    CHECK(script.sent_at_read[0] == 1);
+    CHECK(script.sent_at_read[1] == 3);
+    CHECK(pipeline.cmds[0].state == HCI_CMD_DONE && r0[1] == 0x0b);
+    CHECK(pipeline.cmds[1].state == HCI_CMD_DONE && r1[1] == 0x01);
+    CHECK(pipeline.cmds[2].state == HCI_CMD_DONE && r2[1] == 0x02);
+
+    // no credit: nothing is sent until an event grants one, even one that
+    // answers no command
+    script_init(&script, &dev);
+    hci_pipeline_init(&pipeline, &dev);
+    hci_pipeline_add(&pipeline, OGF_INFO_PARAM, OCF_READ_LOCAL_VERSION, NULL, 0, r0, 2, NULL, NULL);
+    hci_pipeline_add(&pipeline, OGF_INFO_PARAM, OCF_READ_BUFFER_SIZE, NULL, 0, r1, 2, NULL, NULL);
+
+    script_status(&script, 0x00, 0, OP_VERSION);
+    script_complete(&script, 0, OP_VERSION, version, 2);
+    script_complete(&script, 1, 0x0000, NULL, 0);
+    script_complete(&script, 1, OP_BUFFER, buffer, 2);
+
+    CHECK(hci_pipeline_run(&pipeline, 100) == 0);
+    CHECK(script.sent_at_read[1] == 1);
+    CHECK(script.sent_at_read[2] == 1);
+    CHECK(script.sent_at_read[3] == 2);
+    CHECK(pipeline.cmds[0].state == HCI_CMD_DONE);
+    CHECK(pipeline.cmds[1].state == HCI_CMD_DONE);
+}
+
+
+// answers of one opcode go to the oldest command, or with echo to the one
+// whose parameters they repeat
+static void test_pipeline_echo(void)
+{
+    static struct script script;
+    struct transport_dev dev;
+    struct hci_pipeline pipeline;
+    uint8_t h1[] = { 0x01, 0x00 }, h2[] = { 0x02, 0x00 };
+    uint8_t a1[] = { 0x00, 0x01, 0x00, 0xc4 }, a2[] = { 0x00, 0x02, 0x00, 0xd8 };
+    uint8_t r0[4], r1[4];
+
+    script_init(&script, &dev);
+    hci_pipeline_init(&pipeline, &dev);
+    hci_pipeline_add(&pipeline, OGF_STATUS_PARAM, 0x0005, h1, 2, r0, 4, NULL, NULL)->echo = 2;
+    hci_pipeline_add(&pipeline, OGF_STATUS_PARAM, 0x0005, h2, 2, r1, 4, NULL, NULL)->echo = 2;
+
+    script_status(&script, 0x00, 1, OP_RSSI);
+    script_complete(&script, 1, OP_RSSI, a2, 4);
+    script_complete(&script, 1, OP_RSSI, a1, 4);
+
+    CHECK(hci_pipeline_run(&pipeline, 100) == 0);
+    CHECK(script.num_sent == 2 && script.sent_param[1][0] == 0x02);
+    CHECK(pipeline.cmds[0].state == HCI_CMD_DONE && r0[1] == 0x01 && r0[3] == 0xc4);
+    CHECK(pipeline.cmds[1].state == HCI_CMD_DONE && r1[1] == 0x02 && r1[3] == 0xd8);
+
+    // without echo the first answer is the first command's
+    script_init(&script, &dev);
+    hci_pipeline_init(&pipeline, &dev);
+    hci_pipeline_add(&pipeline, OGF_STATUS_PARAM, 0x0005, h1, 2, r0, 4, NULL, NULL);
+    hci_pipeline_add(&pipeline, OGF_STATUS_PARAM, 0x0005, h2, 2, r1, 4, NULL, NULL);
+
+    script_status(&script, 0x00, 1, OP_RSSI);
+    script_complete(&script, 1, OP_RSSI, a2, 4);
+    script_complete(&script, 1, OP_RSSI, a1, 4);
+
+    CHECK(hci_pipeline_run(&pipeline, 100) == 0);
+    CHECK(r0[1] == 0x02 && r1[1] == 0x01);
+}
+
+
+// a failing Command Status or an error without the echoed parameters ends
+// the command; the others go on
+static void test_pipeline_failures(void)
+{
+    static struct script script;
+    struct transport_dev dev;
+    struct hci_pipeline pipeline;
+    uint8_t h1[] = { 0x01, 0x00 }, version[] = { 0x00, 0x0b };
+    uint8_t error = 0x02;
+    uint8_t r0[2], r1[4];
+
+    script_init(&script, &dev);
+    hci_pipeline_init(&pipeline, &dev);
+    hci_pipeline_add(&pipeline, OGF_INFO_PARAM, OCF_READ_BUFFER_SIZE, NULL, 0, r0, 2, NULL, NULL);
+    hci_pipeline_add(&pipeline, OGF_STATUS_PARAM, 0x0005, h1, 2, r1, 4, NULL, NULL)->echo = 2;
+    hci_pipeline_add(&pipeline, OGF_INFO_PARAM, OCF_READ_LOCAL_VERSION, NULL, 0, r0, 2, NULL, NULL);
+
+    script_status(&script, 0x0c, 3, OP_BUFFER);
+    script_complete(&script, 1, OP_RSSI, &error, 1);
+    script_complete(&script, 1, OP_VERSION, version, 2);
+
+    CHECK(hci_pipeline_run(&pipeline, 100) == 0);
+    CHECK(pipeline.cmds[0].state == HCI_CMD_FAILED && pipeline.cmds[0].status == 0x0c);
+    CHECK(pipeline.cmds[1].state == HCI_CMD_FAILED && pipeline.cmds[1].status == 0x02);
+    CHECK(pipeline.cmds[2].state == HCI_CMD_DONE);
+
+    // a controller that never answers
+    script_init(&script, &dev);
+    hci_pipeline_init(&pipeline, &dev);
+    hci_pipeline_add(&pipeline, OGF_INFO_PARAM, OCF_READ_LOCAL_VERSION, NULL, 0, r0, 2, NULL, NULL);
+    hci_pipeline_add(&pipeline, OGF_INFO_PARAM, OCF_READ_BUFFER_SIZE, NULL, 0, r0, 2, NULL, NULL);
+
+    errno = 0;
+    CHECK(hci_pipeline_run(&pipeline, 100) == -1 && errno == ETIMEDOUT);
+    CHECK(pipeline.cmds[0].state == HCI_CMD_FAILED);
+    CHECK(pipeline.cmds[1].state == HCI_CMD_FAILED);
+    CHECK(script.num_sent == 1);
+}
+
+
+
+// hotplug ---------------------------------------------------------------------
+
+#define HOTPLUG_LOG 16
+
+// what the monitor callbacks saw; is_up says yes from the up_after-th
+// question on, never if 0
+struct hotplug_test {
+    int  changes[HOTPLUG_LOG][2];      // index, change
+    int  count;
+    int  asked[2];
+    int  asked_when_up[2];
+    int  up_after[2];
+    int  writer;                       // closed once an adapter is up, -1 = no
+};
+
+
+static int hotplug_is_up(int index, void* user)
+{
+    struct hotplug_test* test = user;
+
+    test->asked[index]++;
+    return test->up_after[index] && test->asked[index] >= test->up_after[index];
+}
+
+
+static void hotplug_changed(struct hotplug_table* table, int index,
+                            enum hotplug_change change, void* user)
+{
+    struct hotplug_test* test = user;
+
+    if (test->count < HOTPLUG_LOG) {
+        test->changes[test->count][0] = index;
+        test->changes[test->count][1] = change;
+        test->count++;
+    }
+    if (change == HOTPLUG_UP) {
+        test->asked_when_up[index] = test->asked[index];
+        if (test->writer >= 0) {
+            close(test->writer);
+            test->writer = -1;
+        }
+    }
+}
+
+
+static void send_frame(int fd, uint16_t opcode, uint16_t index, const void* param, int plen)
+{
+    uint8_t frame[HCI_MON_HDR_SIZE + 32];
+    struct hci_mon_hdr* hdr = (void*) frame;
+
+    hdr->opcode = htobs(opcode);
+    hdr->index  = htobs(index);
+    hdr->len    = htobs(plen);
+    memcpy(frame + HCI_MON_HDR_SIZE, param, plen);
+    send(fd, frame, HCI_MON_HDR_SIZE + plen, 0);
+}
+
+
+static void send_new_index(int fd, uint16_t index)
+{
+    struct hci_mon_new_index ni;
+
+    memset(&ni, 0x00, sizeof(ni));
+    ni.bus = HCI_USB;
+    ni.bdaddr.b[0] = index;
+    snprintf(ni.name, sizeof(ni.name), "hci%u", index);
+    send_frame(fd, HCI_MON_NEW_INDEX, index, &ni, HCI_MON_NEW_INDEX_SIZE);
+}
+
+
+static int hotplug_logged(const struct hotplug_test* test, int n, int index, int change)
+{
+    return n < test->count && test->changes[n][0] == index && test->changes[n][1] == change;
+}
+
+
+// monitor frames as the kernel sends them for a dongle plugged in: the
+// adapter is up once its init traffic is through, not when it is opened,
+// and the traffic does not make the monitor ask any more often
+static void test_hotplug_frames(void)
+{
+    static struct hotplug_table table;
+    struct hotplug_test test;
+    uint8_t cmd[3] = { 0x03, 0x0c, 0x00 };     // HCI Reset
+    struct hci_mon_index_info ii;
+    int fds[2], i;
+
+    if (!CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == 0))
+        return;
+    memset(&table, 0x00, sizeof(table));
+    memset(&test, 0x00, sizeof(test));
+    memset(&ii, 0x00, sizeof(ii));
+    table.is_up = hotplug_is_up;
+    test.up_after[0] = 3;
+    test.writer = fds[1];
+
+    send_new_index(fds[1], 0);
+    send_new_index(fds[1], 1);
+    send_frame(fds[1], HCI_MON_OPEN_INDEX, 0, NULL, 0);
+    for (i = 0; i < 50; i++)
+        send_frame(fds[1], 2, 0, cmd, sizeof(cmd));      // command traffic
+    send_frame(fds[1], HCI_MON_INDEX_INFO, 0, &ii, HCI_MON_INDEX_INFO_SIZE);
+    // hci1 is closed again before its setup finished
+    send_frame(fds[1], HCI_MON_OPEN_INDEX, 1, NULL, 0);
+    send_frame(fds[1], HCI_MON_CLOSE_INDEX, 1, NULL, 0);
+    send_frame(fds[1], HCI_MON_DEL_INDEX, 1, NULL, 0);
+
+    CHECK(hotplug_run(fds[0], &table, hotplug_changed, &test) == 0);
+    close(fds[0]);
+
+    CHECK(test.count == 5);
+    CHECK(hotplug_logged(&test, 0, 0, HOTPLUG_ADDED));
+    CHECK(hotplug_logged(&test, 1, 1, HOTPLUG_ADDED));
+    CHECK(hotplug_logged(&test, 2, 0, HOTPLUG_INFO));
+    CHECK(hotplug_logged(&test, 3, 1, HOTPLUG_REMOVED));
+    CHECK(hotplug_logged(&test, 4, 0, HOTPLUG_UP));
+    CHECK(test.asked_when_up[0] == 3 && test.asked[1] == 0);
+    CHECK(table.count == 1 && table.opening == 0);
+    CHECK(table.adapters[0].up && !table.adapters[1].up);
+}
+
+
+// no frame follows the open: the adapter is checked on a timer
+static void test_hotplug_poll(void)
+{
+    static struct hotplug_table table;
+    struct hotplug_test test;
+    uint64_t start;
+    int fds[2];
+
+    if (!CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == 0))
+        return;
+    memset(&table, 0x00, sizeof(table));
+    memset(&test, 0x00, sizeof(test));
+    table.is_up = hotplug_is_up;
+    test.up_after[0] = 3;
+    test.writer = fds[1];
+
+    send_new_index(fds[1], 0);
+    send_frame(fds[1], HCI_MON_OPEN_INDEX, 0, NULL, 0);
+
+    start = deadline_now();
+    CHECK(hotplug_run(fds[0], &table, hotplug_changed, &test) == 0);
+    close(fds[0]);
+
+    CHECK(test.count == 2);
+    CHECK(hotplug_logged(&test, 1, 0, HOTPLUG_UP));
+    CHECK(test.asked_when_up[0] == 3);
+    CHECK(deadline_now() - start >= 2 * HOTPLUG_POLL_MS * 1000000ull);
+
+    // without is_up an adapter is up when opened
+    if (!CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == 0))
+        return;
+    memset(&table, 0x00, sizeof(table));
+    memset(&test, 0x00, sizeof(test));
+    test.writer = -1;
+    send_new_index(fds[1], 0);
+    send_frame(fds[1], HCI_MON_OPEN_INDEX, 0, NULL, 0);
+    send_frame(fds[1], HCI_MON_CLOSE_INDEX, 0, NULL, 0);
+    close(fds[1]);
+
+    CHECK(hotplug_run(fds[0], &table, hotplug_changed, &test) == 0);
+    close(fds[0]);
+    CHECK(test.count == 3);
+    CHECK(hotplug_logged(&test, 1, 0, HOTPLUG_UP));
+    CHECK(hotplug_logged(&test, 2, 0, HOTPLUG_DOWN));
+}
+
+
+
+// statistics log --------------------------------------------------------------
+
+#define LOG_T0   1700000000000ll     // ms since the epoch
+#define LOG_STEP 1000
+#define LOG_DELTA 200000000u         // per counter and step; wraps 32 bits fast
+
+static void log_samples(struct statlog_sample* samples, int count, uint32_t n)
+{
+    int i;
+    unsigned int c;
+
+    for (i = 0; i < count; i++) {
+        uint32_t* stat = (uint32_t*) &samples[i].stat;
+
+        samples[i].dev_id = i;
+        samples[i].flags  = 1 << HCI_UP | 1 << HCI_RUNNING;
+        for (c = 0; c < WATCH_NUM_COUNTERS; c++)
+            stat[c] = n * LOG_DELTA;
+    }
+}
+
+
+// rows of the query that show byte_rx/s; -1 if one has another rate
+static int log_rows(const struct outbuf* out, double rate)
+{
+    const char* line = memchr(out->data, '\n', out->len);
+    const char* end = out->data + out->len;
+    int rows = 0;
+
+    while (line && ++line < end) {
+        double byte_rx;
+
+        if (sscanf(line, "%*s %*s %*s %lf", &byte_rx) != 1 || byte_rx != rate)
+            return -1;
+        rows++;
+        line = memchr(line, '\n', end - line);
+    }
+    return rows;
+}
+
+
+static void test_statlog(void)
+{
+    struct statlog_sample samples[STATLOG_MAX_ADAPTERS];
+    struct statlog_stats stats;
+    struct stat_log log;
+    struct outbuf out;
+    char path[64];
+    uint32_t n, total;
+
+    temp_path(path, sizeof(path));
+    if (!CHECK(statlog_open(&log, path, 1) == 0))
+        return;
+    outbuf_init(&out, 4096);
+
+    // a few samples of one adapter come back as rates
+    for (n = 0; n < 10; n++) {
+        log_samples(samples, 1, n);
+        CHECK(statlog_append(&log, LOG_T0 + n * LOG_STEP, samples, 1) == 0);
+    }
+    CHECK(statlog_query(&log, 0, INT64_MAX, 0, -1, &out, &stats) == 0);
+    CHECK(stats.frames == 10);
+    CHECK(stats.rows == 9);
+    CHECK(log_rows(&out, LOG_DELTA) == 9);
+
+    // summed into steps of 3 s, the last one partial
+    out.len = 0;
+    CHECK(statlog_query(&log, LOG_T0, INT64_MAX, 3 * LOG_STEP, 0, &out, &stats) == 0);
+    CHECK(stats.rows == 4);
+    CHECK(log_rows(&out, LOG_DELTA) == 4);
+
+    // fill the ring more than once with all adapters: the oldest blocks
+    // are gone, everything still there decodes and nothing is reported twice
+    for (total = n; total < 10 + 40000; total++) {
+        log_samples(samples, STATLOG_MAX_ADAPTERS, total);
+        if (statlog_append(&log, LOG_T0 + total * LOG_STEP, samples, STATLOG_MAX_ADAPTERS) < 0)
+            break;
+    }
+    CHECK(total == 10 + 40000);
+    CHECK(log.header->head < STATLOG_BLOCKS);
+
+    out.len = 0;
+    CHECK(statlog_query(&log, 0, INT64_MAX, 0, 0, &out, &stats) == 0);
+    CHECK(stats.blocks > STATLOG_BLOCKS - 2 && stats.blocks <= STATLOG_BLOCKS);
+    CHECK(stats.frames > 0 && stats.frames < total);
+    CHECK(stats.rows > 0 && stats.rows <= stats.frames);
+    CHECK(log_rows(&out, LOG_DELTA) == (int) stats.rows);
+
+    // the first samples are overwritten, the last ones are there
+    out.len = 0;
+    CHECK(statlog_query(&log, LOG_T0, LOG_T0 + 10 * LOG_STEP, 0, 0, &out, &stats) == 0);
+    CHECK(stats.rows == 0);
+    out.len = 0;
+    CHECK(statlog_query(&log, LOG_T0 + (total - 10) * LOG_STEP, INT64_MAX, 0, 0,
+                        &out, &stats) == 0);
+    CHECK(stats.rows == 10);
+
+    outbuf_free(&out);
+    statlog_close(&log);
+    unlink(path);
+}
+
+
+
+// parallel probe --------------------------------------------------------------
+
+// stub adapters that each take SLOW_OPEN_MS to open
+#define SLOW_OPEN_MS 100
+
+struct slow_transport {
+    struct transport      base;
+    struct transport_ops  ops;
+    struct transport*     inner;
+    int                   dev_infos;        // device info ioctls asked for
+    int                   fail_dev_info;    // fail them with EIO
+    int                   opens;            // adapters opened
+};
+
+
+static int slow_dev_list(struct transport* transport, struct hci_dev_req* devs, int max)
+{
+    return transport_dev_list(((struct slow_transport*) transport)->inner, devs, max);
+}
+
+
+static int slow_dev_info(struct transport* transport, int dev_id, struct hci_dev_info* di)
+{
+    struct slow_transport* slow = (struct slow_transport*) transport;
+
+    __sync_add_and_fetch(&slow->dev_infos, 1);
+    if (slow->fail_dev_info) {
+        errno = EIO;
+        return -1;
+    }
+    return transport_dev_info(slow->inner, dev_id, di);
+}
+
+
+static int slow_conn_list(struct transport* transport, int dev_id,
+                          struct hci_conn_info* conns, int max)
+{
+    return transport_conn_list(((struct slow_transport*) transport)->inner, dev_id, conns, max);
+}
+
+
+// the opened adapter belongs to the inner transport from then on
+static int slow_open(struct transport* transport, int dev_id, struct transport_dev* dev)
+{
+    __sync_add_and_fetch(&((struct slow_transport*) transport)->opens, 1);
+    usleep(SLOW_OPEN_MS * 1000);
+    return transport_open(((struct slow_transport*) transport)->inner, dev_id, dev);
+}
+
+
+static void slow_destroy(struct transport* transport)
+{
+    transport_destroy(((struct slow_transport*) transport)->inner);
+}
+
+
+static void slow_init(struct slow_transport* slow, int count)
+{
+    memset(slow, 0x00, sizeof(*slow));
+    slow->inner = transport_stub(count);
+    slow->ops = *slow->inner->ops;
+    slow->ops.dev_list  = slow_dev_list;
+    slow->ops.dev_info  = slow_dev_info;
+    slow->ops.conn_list = slow_conn_list;
+    slow->ops.open      = slow_open;
+    slow->ops.destroy   = slow_destroy;
+    slow->base.ops = &slow->ops;
+}
+
+
+// many slow adapters take as long as one, not as long as all of them
+static void test_probe_all(void)
+{
+    static struct adapter_info infos[MAX_ADAPTERS];
+    struct slow_transport slow;
+    struct btdi_context ctx;
+    uint64_t start, took;
+    int i, count = 64;
+
+    slow_init(&slow, count);
+    btdi_init(&ctx, &slow.base);
+    for (i = 0; i < count; i++)
+        infos[i].dev_id = i;
+
+    start = deadline_now();
+    CHECK(btdi_probe_all(&ctx, infos, count, 0) == 0);
+    took = (deadline_now() - start) / 1000000;
+
+    CHECK(took < 3 * SLOW_OPEN_MS);
+    for (i = 0; i < count; i++)
+        CHECK(infos[i].failed == PROBE_OK && infos[i].fields[FIELD_COMMANDS] == FIELD_OK);
+
+    transport_destroy(&slow.base);
+}
+
+
+// what the adapter list has is not read again, and not lost either
+static void test_probe_list(void)
+{
+    struct adapter_info infos[4];
+    struct slow_transport slow;
+    struct btdi_context ctx;
+    struct btdi_filter filter;
+    struct hci_dev_info di;
+    int i, count;
+
+    slow_init(&slow, 4);
+    btdi_init(&ctx, &slow.base);
+    ctx.fields  = FIELD_BIT(FIELD_DEVINFO);
+    ctx.retries = 0;
+
+    // the flags are in the list, the device info fails
+    count = btdi_list_info(&ctx, infos, 4, NULL);
+    CHECK(count == 4 && slow.dev_infos == 0);
+    slow.fail_dev_info = 1;
+    CHECK(btdi_probe_all(&ctx, infos, count, 0) == count);
+    CHECK(slow.dev_infos == count);
+    for (i = 0; i < count; i++)
+        CHECK(infos[i].fields[FIELD_DEVINFO] == FIELD_FAILED &&
+              (infos[i].hciDevInfo.flags & (1 << HCI_UP)));
+
+    // the bdaddr filter read the device info already
+    slow.fail_dev_info = 0;
+    CHECK(transport_dev_info(slow.inner, 2, &di) == 0);
+    btdi_filter_init(&filter);
+    filter.have_bdaddr = 1;
+    bacpy(&filter.bdaddr, &di.bdaddr);
+    slow.dev_infos = 0;
+    count = btdi_list_info(&ctx, infos, 4, &filter);
+    CHECK(count == 1 && infos[0].dev_id == 2 && slow.dev_infos == 4);
+    CHECK(btdi_probe_all(&ctx, infos, count, 0) == 0);
+    CHECK(slow.dev_infos == 4 && infos[0].fields[FIELD_DEVINFO] == FIELD_OK);
+
+    transport_destroy(&slow.base);
+}
+
+
+// what the throttle was asked for, per adapter
+struct throttled {
+    int  waited[MAX_ADAPTERS];
+    int  booked[MAX_ADAPTERS];
+};
+
+
+static void test_throttle_fn(void* arg, int dev_id, int commands, int wait)
+{
+    struct throttled* throttled = arg;
+
+    if (wait) {
+        __sync_add_and_fetch(&throttled->waited[dev_id], commands);
+        usleep(SLOW_OPEN_MS * 1000);
+    } else
+        __sync_add_and_fetch(&throttled->booked[dev_id], commands);
+}
+
+
+// the throttle pays for every command sent, and adapters wait side by side
+static void test_probe_throttle(void)
+{
+    static struct adapter_info infos[MAX_ADAPTERS];
+    static struct throttled throttled;
+    struct transport* transport = transport_stub(8);
+    struct btdi_context ctx;
+    uint64_t start, took;
+    int i, count = 8;
+
+    if (!CHECK(transport != NULL))
+        return;
+    btdi_init(&ctx, transport);
+    ctx.throttle     = test_throttle_fn;
+    ctx.throttle_arg = &throttled;
+    for (i = 0; i < count; i++)
+        infos[i].dev_id = i;
+
+    start = deadline_now();
+    CHECK(btdi_probe_all(&ctx, infos, count, 0) == 0);
+    took = (deadline_now() - start) / 1000000;
+
+    CHECK(took < 3 * SLOW_OPEN_MS);
+    // one command per field up front, the second feature page afterwards
+    for (i = 0; i < count; i++)
+        CHECK(throttled.waited[i] == PROBE_NUM_FIELDS - 1 && throttled.booked[i] == 1);
+
+    // the device info alone sends nothing
+    ctx.fields = FIELD_BIT(FIELD_DEVINFO);
+    memset(&throttled, 0x00, sizeof(throttled));
+    CHECK(btdi_probe(&ctx, 0, 0, &infos[0]) == 0);
+    CHECK(throttled.waited[0] == 0 && throttled.booked[0] == 0);
+
+    transport_destroy(transport);
+}
+
+
+
+// probe daemon ----------------------------------------------------------------
+
+#define SERVER_TEST_TTL   1000     // ms
+#define SERVER_TEST_RATE  2        // commands per second and adapter
+
+static char server_path[64];
+
+struct server_ask {
+    int                  dev_id;
+    unsigned int         fields;
+    int                  count;
+    struct adapter_info  info;
+};
+
+
+// runs until the test program ends
+static void* server_thread(void* arg)
+{
+    server_run(arg, NULL, server_path, SERVER_TEST_TTL, SERVER_TEST_RATE);
+    return NULL;
+}
+
+
+static void* server_ask(void* arg)
+{
+    struct server_ask* ask = arg;
+
+    ask->count = server_query(server_path, ask->dev_id, ask->fields, &ask->info, 1);
+    return NULL;
+}
+
+
+// how long the answer took, in ms
+static int server_timed(struct server_ask* ask)
+{
+    uint64_t start = deadline_now();
+
+    server_ask(ask);
+    return (deadline_now() - start) / 1000000;
+}
+
+
+// sends a raw request and reads the response header; -1 if the daemon
+// closed the connection instead, or did not answer within a second
+static int server_raw(const uint8_t* request, int len, uint8_t* response)
+{
+    struct timeval timeout = { 1, 0 };
+    struct sockaddr_un addr;
+    int fd, got = 0;
+    ssize_t n;
+
+    memset(&addr, 0x00, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, server_path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    send(fd, request, len, MSG_NOSIGNAL);
+    shutdown(fd, SHUT_WR);
+
+    while (got < SERVER_RESPONSE_SIZE &&
+           (n = recv(fd, response + got, SERVER_RESPONSE_SIZE - got, 0)) > 0)
+        got += n;
+    close(fd);
+    return got == SERVER_RESPONSE_SIZE ? 0 : -1;
+}
+
+
+// concurrent requests share one probe, a repeat comes from memory, the
+// limiter holds back the probe beyond its budget, and a bad request is
+// answered with an error
+static void test_server(void)
+{
+    static struct slow_transport slow;
+    static struct btdi_context ctx;
+    static struct server_ask asks[8];
+    struct server_ask ask;
+    uint8_t request[SERVER_REQUEST_SIZE] = { 99 };
+    uint8_t response[SERVER_RESPONSE_SIZE];
+    pthread_t threads[8], server;
+    int i, fast, took, slowest;
+
+    slow_init(&slow, 3);
+    btdi_init(&ctx, &slow.base);
+    temp_path(server_path, sizeof(server_path));
+    if (!CHECK(pthread_create(&server, NULL, server_thread, &ctx) == 0))
+        return;
+    pthread_detach(server);
+
+    // hci2's device info alone tells when the daemon listens
+    memset(&ask, 0x00, sizeof(ask));
+    ask.dev_id = 2;
+    ask.fields = FIELD_BIT(FIELD_DEVINFO);
+    for (i = 0; i < 100; i++) {
+        server_ask(&ask);
+        if (ask.count == 1)
+            break;
+        usleep(10000);
+    }
+    if (!CHECK(ask.count == 1))
+        return;
+
+    // all at once for everything of hci0: one probe
+    for (i = 0; i < 8; i++) {
+        asks[i].dev_id = 0;
+        asks[i].fields = 0;
+        pthread_create(&threads[i], NULL, server_ask, &asks[i]);
+    }
+    for (i = 0; i < 8; i++) {
+        pthread_join(threads[i], NULL);
+        CHECK(asks[i].count == 1 && asks[i].info.fields[FIELD_COMMANDS] == FIELD_OK);
+    }
+    CHECK(slow.opens == 1);
+
+    // a part of it within the ttl: the adapter is not opened again
+    ask.dev_id = 0;
+    ask.fields = FIELD_BIT(FIELD_VERSION);
+    server_timed(&ask);
+    CHECK(ask.count == 1 && ask.info.fields[FIELD_VERSION] == FIELD_OK && slow.opens == 1);
+
+    // one command each: hci1's bucket covers two, the third waits
+    ask.dev_id = 1;
+    ask.fields = FIELD_BIT(FIELD_VERSION);
+    fast = server_timed(&ask);
+    ask.fields = FIELD_BIT(FIELD_COMMANDS);
+    took = server_timed(&ask);
+    if (took > fast)
+        fast = took;
+    ask.fields = FIELD_BIT(FIELD_BUFFER_SIZE);
+    slowest = server_timed(&ask);
+    CHECK(ask.count == 1 && ask.info.fields[FIELD_BUFFER_SIZE] == FIELD_OK);
+    CHECK(slow.opens == 4);
+    CHECK(slowest >= fast + 1000 / SERVER_TEST_RATE / 2);
+
+    // a request of another version, and one cut short: an error, or the
+    // connection closed, but no hang
+    CHECK(server_raw(request, sizeof(request), response) == 0);
+    CHECK(bt_get_le32(&response[4]) == EPROTO);
+    request[0] = SERVER_VERSION;
+    CHECK(server_raw(request, 3, response) < 0);
+
+    // the daemon keeps listening on the socket it has
+    unlink(server_path);
+}
+
+
+
+// capability cache ------------------------------------------------------------
+
+// the commands a probe sent: what it planned plus what it booked after
+static void count_sent(void* arg, int dev_id, int commands, int wait)
+{
+    (void) dev_id;
+    (void) wait;
+    *(int*) arg += commands;
+}
+
+
+static void test_cache(void)
+{
+    struct transport* transport = transport_stub(1);
+    struct adapter_info info, first;
+    struct btdi_context ctx;
+    struct caps_cache cache;
+    struct adapter_caps caps;
+    struct hci_version ver;
+    char path[64];
+    int field, sent = 0;
+
+    if (!CHECK(transport != NULL))
+        return;
+    temp_path(path, sizeof(path));
+    if (!CHECK(cache_open(&cache, path) == 0))
+        return;
+    btdi_init(&ctx, transport);
+    ctx.cache = &cache;
+
+    // the first probe fills the cache, the second is served from it with
+    // the same result
+    CHECK(btdi_probe(&ctx, 0, 0, &first) == 0);
+    CHECK(!first.from_cache);
+    CHECK(btdi_probe(&ctx, 0, 0, &info) == 0);
+    CHECK(info.from_cache);
+    CHECK(!memcmp(info.fields, first.fields, sizeof(info.fields)));
+    CHECK(!memcmp(&info.caps, &first.caps, sizeof(info.caps)));
+    for (field = 0; field < PROBE_NUM_FIELDS; field++)
+        CHECK(info.fields[field] == FIELD_OK);
+
+    // another firmware with the same features and buffers misses
+    ver = first.hciVersion;
+    CHECK(cache_lookup(&cache, &first.hciDevInfo, &ver, &caps) ==
+          (FIELD_BIT(FIELD_COMMANDS) | FIELD_BIT(FIELD_BUFFER_SIZE) |
+           FIELD_BIT(FIELD_EXT_FEATURES) | FIELD_BIT(FIELD_LE_FEATURES) |
+           FIELD_BIT(FIELD_LE_BUFFER_SIZE)));
+    ver.lmp_subver++;
+    CHECK(cache_lookup(&cache, &first.hciDevInfo, &ver, &caps) == 0);
+
+    // a rejected command is not kept, so it is asked again
+    cache_store(&cache, &first.hciDevInfo, &first.hciVersion, &first.caps,
+                FIELD_BIT(FIELD_BUFFER_SIZE));
+    CHECK(cache_lookup(&cache, &first.hciDevInfo, &first.hciVersion, &caps) ==
+          FIELD_BIT(FIELD_BUFFER_SIZE));
+    CHECK(btdi_probe(&ctx, 0, 0, &info) == 0);
+    CHECK(info.from_cache);
+    CHECK(!memcmp(&info.caps, &first.caps, sizeof(info.caps)));
+    CHECK(cache_lookup(&cache, &first.hciDevInfo, &first.hciVersion, &caps) ==
+          (FIELD_BIT(FIELD_COMMANDS) | FIELD_BIT(FIELD_BUFFER_SIZE) |
+           FIELD_BIT(FIELD_EXT_FEATURES) | FIELD_BIT(FIELD_LE_FEATURES) |
+           FIELD_BIT(FIELD_LE_BUFFER_SIZE)));
+
+    // a --fields run that reads what was missing keeps what it did not ask
+    // for, so the next full run sends nothing but the version
+    cache_store(&cache, &first.hciDevInfo, &first.hciVersion, &first.caps,
+                FIELD_BIT(FIELD_COMMANDS) | FIELD_BIT(FIELD_EXT_FEATURES) |
+                FIELD_BIT(FIELD_LE_FEATURES) | FIELD_BIT(FIELD_LE_BUFFER_SIZE));
+    ctx.fields = FIELD_BIT(FIELD_DEVINFO) | FIELD_BIT(FIELD_BUFFER_SIZE);
+    CHECK(btdi_probe(&ctx, 0, 0, &info) == 0);
+    CHECK(!info.from_cache && info.fields[FIELD_BUFFER_SIZE] == FIELD_OK);
+    ctx.fields = BTDI_ALL_FIELDS;
+    ctx.throttle     = count_sent;
+    ctx.throttle_arg = &sent;
+    CHECK(btdi_probe(&ctx, 0, 0, &info) == 0);
+    CHECK(info.from_cache && sent == 1);
+    CHECK(!memcmp(&info.caps, &first.caps, sizeof(info.caps)));
+
+    cache_close(&cache);
+    unlink(path);
+    transport_destroy(transport);
+}
+
+
+
+// binary format ---------------------------------------------------------------
+
+static void test_tlv(void)
+{
+    struct transport* transport = transport_stub(2);
+    struct adapter_info infos[2], parsed[3];
+    struct capvec a, b;
+    struct outbuf out;
+    int i;
+
+    if (!CHECK(transport != NULL))
+        return;
+    CHECK(probe_stub(transport, 0, &infos[0]) == 0);
+    CHECK(probe_stub(transport, 1, &infos[1]) == 0);
+    // one that failed after its device info
+    infos[1].failed = PROBE_FAILED_VERSION;
+    infos[1].status = ETIMEDOUT;
+    infos[1].fields[FIELD_VERSION] = FIELD_TIMEOUT;
+
+    outbuf_init(&out, 4096);
+    tlv_emitter.begin(&out);
+    for (i = 0; i < 2; i++)
+        tlv_emitter.adapter(&out, &infos[i], i);
+    tlv_emitter.end(&out);
+
+    memset(parsed, 0xee, sizeof(parsed));
+    CHECK(tlv_parse((uint8_t*) out.data, out.len, parsed, 3) == 2);
+    for (i = 0; i < 2; i++) {
+        const struct hci_dev_info* di = &infos[i].hciDevInfo;
+        const struct hci_dev_info* pdi = &parsed[i].hciDevInfo;
+
+        CHECK(parsed[i].dev_id == infos[i].dev_id);
+        CHECK(parsed[i].failed == infos[i].failed);
+        CHECK(parsed[i].status == infos[i].status);
+        CHECK(!memcmp(parsed[i].fields, infos[i].fields, sizeof(infos[i].fields)));
+        CHECK(!strcmp(pdi->name, di->name));
+        CHECK(!bacmp(&pdi->bdaddr, &di->bdaddr));
+        CHECK(pdi->flags == di->flags && pdi->acl_mtu == di->acl_mtu);
+        CHECK(!memcmp(&pdi->stat, &di->stat, sizeof(di->stat)));
+
+        // the vector covers the version and every capability
+        capvec_build(&a, &infos[i]);
+        capvec_build(&b, &parsed[i]);
+        CHECK(capvec_distance(&a, &b) == 0);
+    }
+    CHECK(parsed[0].caps.le_acl_mtu == infos[0].caps.le_acl_mtu);
+    CHECK(parsed[0].caps.acl_max_pkt == infos[0].caps.acl_max_pkt);
+
+    // anything cut short or not ours is rejected
+    errno = 0;
+    CHECK(tlv_parse((uint8_t*) out.data, out.len - 1, parsed, 3) == -1 && errno == EBADMSG);
+    errno = 0;
+    CHECK(tlv_parse((uint8_t*) "BTDX\001", 5, parsed, 3) == -1 && errno == EBADMSG);
+    CHECK(tlv_parse((uint8_t*) out.data, 5, parsed, 3) == 0);
+
+    outbuf_free(&out);
+    transport_destroy(transport);
+}
+
+
+
+// --changes -------------------------------------------------------------------
+
+static int count_lines(const struct outbuf* out, const char* prefix)
+{
+    const char* line = out->data;
+    const char* end = out->data + out->len;
+    int count = 0;
+
+    while (line < end) {
+        if (!strncmp(line, prefix, strlen(prefix)))
+            count++;
+        line = memchr(line, '\n', end - line);
+        if (!line)
+            break;
+        line++;
+    }
+    return count;
+}
+
+
+static void test_snapshot(void)
+{
+    struct transport* transport = transport_stub(2);
+    struct adapter_info infos[2];
+    struct btdi_filter filter;
+    struct outbuf out;
+    char path[64];
+    int i;
+
+    if (!CHECK(transport != NULL))
+        return;
+    temp_path(path, sizeof(path));
+    outbuf_init(&out, 4096);
+    btdi_filter_init(&filter);
+
+    for (i = 0; i < 2; i++) {
+        memset(&infos[i], 0x00, sizeof(infos[i]));
+        infos[i].dev_id = i;
+        CHECK(transport_dev_info(transport, i, &infos[i].hciDevInfo) == 0);
+        infos[i].fields[FIELD_DEVINFO] = FIELD_OK;
+    }
+
+    // everything is new, then nothing changed
+    CHECK(snapshot_changes(path, infos, 2, &filter, 0, &out) == 2);
+    CHECK(count_lines(&out, "added") == 2);
+    out.len = 0;
+    CHECK(snapshot_changes(path, infos, 2, &filter, 0, &out) == 0);
+    CHECK(out.len == 0);
+
+    // only what changed, counters as deltas
+    infos[1].hciDevInfo.flags &= ~(1 << HCI_PSCAN);
+    infos[1].hciDevInfo.stat.cmd_tx += 3;
+    out.len = 0;
+    CHECK(snapshot_changes(path, infos, 2, &filter, 1, &out) == 1);
+    out_write(&out, "", 1);
+    CHECK(strstr(out.data, "\"event\":\"changed\",\"dev_id\":1") != NULL);
+    CHECK(strstr(out.data, "\"cmd_tx\":3}") != NULL);
+    CHECK(strstr(out.data, "\"flags\"") != NULL);
+    CHECK(strstr(out.data, "\"name\"") == NULL);
+
+    // an unreadable adapter keeps its record, a vanished one is removed
+    infos[1].fields[FIELD_DEVINFO] = FIELD_FAILED;
+    out.len = 0;
+    CHECK(snapshot_changes(path, &infos[1], 1, &filter, 0, &out) == 1);
+    CHECK(count_lines(&out, "removed hci0") == 1);
+
+    // plugged in again under another dev_id: the same adapter, counters
+    // from zero
+    infos[1].fields[FIELD_DEVINFO] = FIELD_OK;
+    infos[1].dev_id = infos[1].hciDevInfo.dev_id = 5;
+    out.len = 0;
+    CHECK(snapshot_changes(path, &infos[1], 1, &filter, 0, &out) == 1);
+    CHECK(count_lines(&out, "changed hci5") == 1);
+
+    // going down is a flags change; down since then, nothing is reported
+    infos[1].hciDevInfo.flags &= ~(1 << HCI_UP);
+    out.len = 0;
+    CHECK(snapshot_changes(path, &infos[1], 1, &filter, 1, &out) == 1);
+    out_write(&out, "", 1);
+    CHECK(strstr(out.data, "\"event\":\"changed\",\"dev_id\":5") != NULL);
+    CHECK(strstr(out.data, "\"flags\"") != NULL);
+    infos[1].hciDevInfo.stat.cmd_tx += 3;
+    out.len = 0;
+    CHECK(snapshot_changes(path, &infos[1], 1, &filter, 0, &out) == 0);
+
+    // another adapter's run keeps the record, which is still the down one
+    filter.dev_id = 7;
+    CHECK(snapshot_changes(path, NULL, 0, &filter, 0, &out) == 0);
+    filter.dev_id = -1;
+    infos[1].hciDevInfo.flags |= 1 << HCI_UP;
+    CHECK(snapshot_changes(path, &infos[1], 1, &filter, 0, &out) == 1);
+    CHECK(count_lines(&out, "changed hci5") == 1);
+
+    outbuf_free(&out);
+    unlink(path);
+    transport_destroy(transport);
+}
+
+
+
+// fleet diff ------------------------------------------------------------------
+
+static int write_json(const char* path, const struct adapter_info* infos, int count)
+{
+    struct outbuf out;
+    FILE* file;
+    int i, ret;
+
+    outbuf_init(&out, 4096);
+    json_emitter.begin(&out);
+    for (i = 0; i < count; i++)
+        json_emitter.adapter(&out, &infos[i], i);
+    json_emitter.end(&out);
+
+    file = fopen(path, "w");
+    ret = file && fwrite(out.data, 1, out.len, file) == out.len ? 0 : -1;
+    if (file)
+        fclose(file);
+    outbuf_free(&out);
+    return ret;
+}
+
+
+static void test_fleet(void)
+{
+    struct transport* transport = transport_stub(3);
+    struct adapter_info infos[3];
+    char paths[3][64];
+    const char* names[3] = { paths[0], paths[1], paths[2] };
+    uint8_t bytes[CAPVEC_BYTES];
+    char hex[CAPVEC_HEX + 1];
+    struct capvec a, b;
+    struct fleet fleet;
+    struct outbuf out;
+    int i;
+
+    if (!CHECK(transport != NULL))
+        return;
+    for (i = 0; i < 3; i++)
+        CHECK(probe_stub(transport, i, &infos[i]) == 0);
+    // same version on all three, one lacks a feature
+    infos[1].hciVersion.hci_rev = infos[2].hciVersion.hci_rev = infos[0].hciVersion.hci_rev;
+    infos[2].hciDevInfo.features[0] &= ~LMP_3SLOT;
+
+    // the vector survives its hex form
+    capvec_build(&a, &infos[2]);
+    capvec_pack(&a, bytes);
+    for (i = 0; i < CAPVEC_BYTES; i++)
+        sprintf(hex + 2 * i, "%02x", bytes[i]);
+    CHECK(capvec_parse(&b, hex) == 0);
+    CHECK(capvec_distance(&a, &b) == 0);
+    CHECK(capvec_fingerprint(&a) == capvec_fingerprint(&b));
+    CHECK(capvec_parse(&b, "00") == -1);
+
+    capvec_build(&b, &infos[0]);
+    CHECK(capvec_distance(&a, &b) == 1);
+
+    temp_path(paths[0], sizeof(paths[0]));
+    temp_path(paths[1], sizeof(paths[1]));
+    temp_path(paths[2], sizeof(paths[2]));
+    CHECK(write_json(paths[0], &infos[0], 2) == 0);
+    CHECK(write_json(paths[1], &infos[2], 1) == 0);
+
+    // the missing third file is reported and counted
+    CHECK(fleet_load(&fleet, names, 3) == 0);
+    CHECK(fleet.failed_files == 1);
+    CHECK(fleet.count == 3);
+    CHECK(fleet.num_groups == 2);
+    if (fleet.num_groups == 2) {
+        CHECK(fleet.groups[0].count == 2 && fleet.groups[1].count == 1);
+        CHECK(fleet.groups[0].fingerprint == capvec_fingerprint(&b));
+        CHECK(fleet.groups[1].fingerprint == capvec_fingerprint(&a));
+        CHECK(fleet.records[fleet.groups[1].first].file == 1);
+    }
+
+    outbuf_init(&out, 4096);
+    fleet_print(&out, &fleet, 1);
+    out_write(&out, "", 1);
+    CHECK(strstr(out.data, "3 adapters in 2 files, 2 capability sets") != NULL);
+    CHECK(strstr(out.data, "1 bits differ from set 1") != NULL);
+    CHECK(strstr(out.data, "3-slot packets") != NULL);
+
+    outbuf_free(&out);
+    fleet_free(&fleet);
+    unlink(paths[0]);
+    unlink(paths[1]);
+    transport_destroy(transport);
+}
+
+
+
+static const struct test_case cases[] = {
+    { "decode/bit_iter",         test_bit_iter },
+    { "decode/tables",           test_bit_tables },
+    { "decode/capabilities",     test_decode },
+    { "pipeline/credits",        test_pipeline_credits },
+    { "pipeline/echo",           test_pipeline_echo },
+    { "pipeline/failures",       test_pipeline_failures },
+    { "hotplug/frames",          test_hotplug_frames },
+    { "hotplug/poll",            test_hotplug_poll },
+    { "statlog/round_trip",      test_statlog },
+    { "probe/parallel",          test_probe_all },
+    { "probe/list",              test_probe_list },
+    { "probe/throttle",          test_probe_throttle },
+    { "server/singleflight",     test_server },
+    { "cache/revalidate",        test_cache },
+    { "output/tlv",              test_tlv },
+    { "snapshot/changes",        test_snapshot },
+    { "fingerprint/fleet",       test_fleet },
+    { NULL, NULL }
+};
+
+
+static int selected(const char* name, int argc, char** argv)
+{
+    int i;
+
+    if (argc < 2)
+        return 1;
+    for (i = 1; i < argc; i++)
+        if (!strncmp(name, argv[i], strlen(argv[i])))
+            return 1;
+    return 0;
+}
+
+
+int main(int argc, char** argv)
+{
+    int i, failed_cases = 0, run = 0;
+
+    for (i = 0; cases[i].name; i++) {
+        int before = failures;
+
+        if (!selected(cases[i].name, argc, argv))
+            continue;
+
+        cases[i].run();
+        run++;
+        if (failures > before)
+            failed_cases++;
+        printf("%-4s %s\n", failures > before ? "FAIL" : "ok", cases[i].name);
+    }
+
+    printf("%d of %d cases failed, %d checks\n", failed_cases, run, checks);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,377 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *
+ *  A lot of this code comes from tools/libs of the bluez project
+ *  (http://www.bluez.org; especially helpful in the process were
+ *  tools/hcitool.c, tools/hcieventmask.c and lib/hci.c)
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "adapter.h"
+#include "decode.h"
+#include "fingerprint.h"
+#include "output.h"
+#include "text.h"
+
+
+struct text_options text_options;
+
+static char ESC=27;
+void switch_to_style(struct outbuf* out, char* color)
+{
+    if(text_options.color)
+        out_printf(out, "%c%s" , ESC, color);
+}
+
+
+// prints the names of the bits set in a little endian bitmap, or with -u
+// every named bit and its value; unnamed set bits are shown by number
+void printBits(struct outbuf* out, const char* label,
+               const struct bit_table* table, const uint8_t* bitmap, int nbytes)
+{
+    static const char padding[] = "                                                                ";
+    struct bit_iter it;
+    int bit;
+
+    switch_to_style(out, STYLE_LABEL);
+    out_printf(out, "    %s:\n", label);
+    switch_to_style(out, STYLE_TEXT);
+
+    // print all features
+    if(text_options.unsupported) {
+        for (bit = 0; bit < table->nbits; bit++) {
+            const struct bit_name* name = &table->names[bit];
+            int pad;
+
+            if (!name->name)
+                continue;
+
+            pad = table->column > name->width ? table->column - name->width : 1;
+            out_write(out, "        ", 8);
+            out_write(out, name->name, name->width);
+            out_write(out, ":", 1);
+            out_write(out, padding, pad);
+            out_write(out, bit < nbytes * 8 && bitmap_test(bitmap, bit) ? "1\n" : "0\n", 2);
+        }
+        return;
+    }
+
+    // only print features supported by the adapter
+    bit_iter_init(&it, bitmap, nbytes);
+    while ((bit = bit_iter_next(&it)) >= 0) {
+        const char* name = bit_table_name(table, bit);
+
+        if (name) {
+            out_write(out, "        ", 8);
+            out_write(out, name, table->names[bit].width);
+            out_write(out, "\n", 1);
+        } else {
+            out_printf(out, "        bit %d\n", bit);
+        }
+    }
+}
+
+
+void printBitValue(struct outbuf* out, const char* label,
+                   const struct bit_table* table, uint32_t value)
+{
+    uint32_t le = htole32(value);
+
+    printBits(out, label, table, (const uint8_t*) &le, sizeof(le));
+}
+
+
+// hciVersion is NULL if it could not be read
+void printCapabilities(struct outbuf* out, const struct hci_version* hciVersion,
+                       const struct adapter_caps* caps)
+{
+    // hci version
+    switch_to_style(out, STYLE_LABEL);
+    out_printf(out, "    HCI version:\t");
+    switch_to_style(out, STYLE_TEXT);
+    if (hciVersion) {
+        char *hci_ver = hci_vertostr(hciVersion->hci_ver);
+        out_printf(out, "%s (0x%x) [rev 0x%x]\n",
+               hci_ver ? hci_ver : "n/a",
+               hciVersion->hci_ver, hciVersion->hci_rev);
+        if (hci_ver)
+            bt_free(hci_ver);
+    } else
+        out_printf(out, "n/a\n");
+
+    // extended lmp features (page 0 is printed as LMP features)
+    if (caps->ext_page_mask & ~0x01) {
+        static const struct bit_table unnamed = { NULL, 0, 0 };
+        char label[32];
+        int page;
+
+        for (page = 1; page < MAX_EXT_FEATURE_PAGES; page++) {
+            if (!(caps->ext_page_mask & (1 << page)))
+                continue;
+            snprintf(label, sizeof(label), "ext. LMP features page %d", page);
+            printBits(out, label, page < lmp_ext_features_pages ?
+                      &lmp_ext_features_tables[page] : &unnamed,
+                      caps->ext_features[page], 8);
+        }
+    }
+
+    // controller buffers
+    if (caps->have_buffer_size) {
+        switch_to_style(out, STYLE_LABEL);
+        out_printf(out, "    buffer size:\n");
+        switch_to_style(out, STYLE_TEXT);
+        out_printf(out, "        ACL:\t\t%u x %u\n", caps->acl_mtu, caps->acl_max_pkt);
+        out_printf(out, "        SCO:\t\t%u x %u\n", caps->sco_mtu, caps->sco_max_pkt);
+    }
+
+    // low energy
+    if (caps->have_le_buffer_size) {
+        switch_to_style(out, STYLE_LABEL);
+        out_printf(out, "    LE buffer size:\t");
+        switch_to_style(out, STYLE_TEXT);
+        out_printf(out, "%u x %u\n", caps->le_acl_mtu, caps->le_max_pkt);
+    }
+
+    if (caps->have_le_features)
+        printBits(out, "LE features", &le_features_table, caps->le_features, 8);
+
+    // supported hci commands
+    if (caps->have_commands)
+        printBits(out, "supported commands", &commands_table,
+                  caps->commands, sizeof(caps->commands));
+}
+
+
+// TODO (simon): implement unsupported option
+void printVerbose(struct outbuf* out, struct hci_dev_info hciDevInfo,
+                  const struct hci_version* hciVersion, const struct adapter_caps* caps)
+{
+    printBitValue(out, "flags", &dev_flags_table, hciDevInfo.flags);
+
+    printBits(out, "LMP features", &lmp_features_table, hciDevInfo.features, 8);
+
+    printBitValue(out, "ACL packet types", &acl_ptype_table, hciDevInfo.pkt_type);
+
+    printBitValue(out, "SCO packet types", &sco_ptype_table, hciDevInfo.pkt_type);
+
+    printBitValue(out, "link_policy", &link_policy_table, hciDevInfo.link_policy);
+
+    // link mode
+    switch_to_style(out, STYLE_LABEL);
+    out_printf(out, "    link_mode:\t\t");
+    switch_to_style(out, STYLE_TEXT);
+    out_printf(out, "%s\n", hci_lmtostr(hciDevInfo.link_mode));
+
+    // asynchronous connection-less mtu
+    switch_to_style(out, STYLE_LABEL);
+    out_printf(out, "    acl_mtu:\t\t");
+    switch_to_style(out, STYLE_TEXT);
+    out_printf(out, "%u\n", hciDevInfo.acl_mtu);
+
+    // asynchronous connection-less packets
+    switch_to_style(out, STYLE_LABEL);
+    out_printf(out, "    acl_pkts:\t\t");
+    switch_to_style(out, STYLE_TEXT);
+    out_printf(out, "%u\n", hciDevInfo.acl_pkts);
+
+    // synchronous connection-based mtu
+    switch_to_style(out, STYLE_LABEL);
+    out_printf(out, "    sco_mtu:\t\t");
+    switch_to_style(out, STYLE_TEXT);
+    out_printf(out, "%u\n", hciDevInfo.sco_mtu);
+
+    // synchronous connection-based packets
+    switch_to_style(out, STYLE_LABEL);
+    out_printf(out, "    sco_pkts:\t\t");
+    switch_to_style(out, STYLE_TEXT);
+    out_printf(out, "%u\n", hciDevInfo.sco_pkts);
+
+    // device statistcs
+    switch_to_style(out, STYLE_LABEL);
+    out_printf(out, "    device stats:\t\n");
+    switch_to_style(out, STYLE_TEXT);
+    struct hci_dev_stats hciDevStats = hciDevInfo.stat;
+    out_printf(out, "        err_rx:\t\t%u\n", hciDevStats.err_rx);
+    out_printf(out, "        err_tx:\t\t%u\n", hciDevStats.err_tx);
+    out_printf(out, "        cmd_tx:\t\t%u\n", hciDevStats.cmd_tx);
+    out_printf(out, "        evt_rx:\t\t%u\n", hciDevStats.evt_rx);
+    out_printf(out, "        acl_tx:\t\t%u\n", hciDevStats.acl_tx);
+    out_printf(out, "        acl_rx:\t\t%u\n", hciDevStats.acl_rx);
+    out_printf(out, "        sco_tx:\t\t%u\n", hciDevStats.sco_tx);
+    out_printf(out, "        sco_rx:\t\t%u\n", hciDevStats.sco_rx);
+    out_printf(out, "        byte_rx:\t%u\n", hciDevStats.byte_rx);
+    out_printf(out, "        byte_tx:\t%u\n", hciDevStats.byte_tx);
+
+    printCapabilities(out, hciVersion, caps);
+}
+
+
+void print_adapter_info(struct outbuf* out, const struct adapter_info* info)
+{
+    struct hci_dev_info hciDevInfo = info->hciDevInfo;
+    struct hci_version  hciVersion = info->hciVersion;
+
+    // Link Management Protocol features
+    uint8_t* lmp_features = &hciDevInfo.features;
+
+    switch_to_style(out, STYLE_HEADLINE);
+    out_printf(out, "\n%s ------------------------------------------- \n",   hciDevInfo.name);
+
+    // device id
+    switch_to_style(out, STYLE_LABEL);
+    out_printf(out, "    device id:\t\t");
+    switch_to_style(out, STYLE_TEXT);
+    out_printf(out, "%u\n", hciDevInfo.dev_id);
+
+    // manufacturer and lmp version (link management protocol); a failed
+    // probe may have the device info only
+    int have_version = info->fields[FIELD_VERSION] == FIELD_OK;
+    const char* missing = field_status_name(info->fields[FIELD_VERSION]);
+
+    switch_to_style(out, STYLE_LABEL);
+    out_printf(out, "    Manufacturer:\t");
+    switch_to_style(out, STYLE_TEXT);
+    if (have_version)
+        out_printf(out, "%s (%d)\n",
+               bt_compidtostr(hciVersion.manufacturer),
+               hciVersion.manufacturer);
+    else
+        out_printf(out, "n/a (%s)\n", missing);
+
+    switch_to_style(out, STYLE_LABEL);
+    out_printf(out, "    LMP version:");
+    switch_to_style(out, STYLE_TEXT);
+    if (have_version) {
+        char *ver = lmp_vertostr(hciVersion.lmp_ver);
+        out_printf(out, "\t%s (0x%x) [subver 0x%x]\n",
+               ver ? ver : "n/a",
+               hciVersion.lmp_ver, hciVersion.lmp_subver);
+        if (ver)
+            bt_free(ver);
+    } else
+        out_printf(out, "\tn/a (%s)\n", missing);
+
+    // device type
+    switch_to_style(out, STYLE_LABEL);
+    out_printf(out, "    device type:\t");
+    switch_to_style(out, STYLE_TEXT);
+    if (((hciDevInfo.type & 0x30) >> 4) != HCI_AMP)
+        out_printf(out, "AMP\n");
+    else if (((hciDevInfo.type & 0x30) >> 4) != HCI_BREDR)
+        out_printf(out, "BR/EDR\n");
+    else
+        out_printf(out, "UNKNOWN\n");
+
+    // BLE
+    switch_to_style(out, STYLE_LABEL);
+    out_printf(out, "    BLE:\t\t");
+    switch_to_style(out, STYLE_TEXT);
+    if (!have_version)
+        out_printf(out, "n/a");
+    else if(hciVersion.lmp_ver >= 0x06) {
+
+        if (lmp_features[6] & LMP_LE_BREDR)
+            out_printf(out, "capable (dual mode)");
+        else if (lmp_features[4] & LMP_LE)
+            out_printf(out, "capable (single mode)");
+        else
+            out_printf(out, "UNKNOWN MODE");
+    } else
+        out_printf(out, "incapable");
+
+    out_printf(out, "\n");
+
+
+
+
+    // get bluetooth device address
+    bdaddr_t* bdaddr = &hciDevInfo.bdaddr;
+    switch_to_style(out, STYLE_LABEL);
+    out_printf(out, "    device address:\t");
+    switch_to_style(out, STYLE_TEXT);
+    int i;
+    for(i=5; i>1; i--) {
+        out_printf(out, "%02X:", bdaddr->b[i]);
+    }
+    out_printf(out, "%02X\n", bdaddr->b[0]);
+
+    if (text_options.verbose) {
+        struct capvec vec;
+
+        capvec_build(&vec, info);
+        switch_to_style(out, STYLE_LABEL);
+        out_printf(out, "    fingerprint:\t");
+        switch_to_style(out, STYLE_TEXT);
+        out_printf(out, "%016llx\n", (unsigned long long) capvec_fingerprint(&vec));
+    }
+
+
+    // what the probe could not read in time
+    int field, first = 1;
+    for (field = 0; field < PROBE_NUM_FIELDS; field++) {
+        if (info->fields[field] == FIELD_OK || info->fields[field] == FIELD_UNSUPPORTED)
+            continue;
+        if (first) {
+            switch_to_style(out, STYLE_LABEL);
+            out_printf(out, "    incomplete:\t\t");
+            switch_to_style(out, STYLE_TEXT);
+        }
+        out_printf(out, "%s%s (%s)", first ? "" : ", ", probe_field_name(field),
+                   field_status_name(info->fields[field]));
+        first = 0;
+    }
+    if (!first)
+        out_printf(out, "\n");
+
+    if(text_options.verbose)
+        printVerbose(out, hciDevInfo, have_version ? &hciVersion : NULL, &info->caps);
+
+    out_printf(out, "\n");
+}
+
+
+// the classic human readable output
+void text_begin(struct outbuf* out)
+{
+    switch_to_style(out, STYLE_TEXT);
+    out_printf(out, "Bluetooth adapter info:\n");
+}
+
+
+void text_adapter(struct outbuf* out, const struct adapter_info* info, int index)
+{
+    print_adapter_info(out, info);
+}
+
+
+void text_end(struct outbuf* out)
+{
+}
+
+
+const struct emitter text_emitter = {
+    "text", 0, text_begin, text_adapter, text_end
+};
@@ -0,0 +1,66 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef TEXT_H
+#define TEXT_H
+
+#include <stdint.h>
+
+#include "adapter.h"
+#include "decode.h"
+#include "output.h"
+
+
+// The classic human readable output (--format text). What it shows is set
+// in text_options before rendering.
+
+struct text_options {
+    int  verbose;        // all details of an adapter
+    int  unsupported;    // also the features an adapter does not have
+    int  color;
+};
+
+extern struct text_options text_options;
+
+// bash font styles vor colorized output mode
+#define STYLE_HEADLINE  "[1;35m"  // bold magenta
+#define STYLE_LABEL     "[21;32m" // normal green
+#define STYLE_TEXT      "[21;97m" // normal white
+
+void switch_to_style(struct outbuf* out, char* color);
+
+// prints the names of the bits set in a little endian bitmap, or with
+// text_options.unsupported every named bit and its value
+void printBits(struct outbuf* out, const char* label,
+               const struct bit_table* table, const uint8_t* bitmap, int nbytes);
+void printBitValue(struct outbuf* out, const char* label,
+                   const struct bit_table* table, uint32_t value);
+
+// hciVersion is NULL if it could not be read
+void printCapabilities(struct outbuf* out, const struct hci_version* hciVersion,
+                       const struct adapter_caps* caps);
+void printVerbose(struct outbuf* out, struct hci_dev_info hciDevInfo,
+                  const struct hci_version* hciVersion, const struct adapter_caps* caps);
+
+void print_adapter_info(struct outbuf* out, const struct adapter_info* info);
+
+extern const struct emitter text_emitter;
+
+#endif
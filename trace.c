@@ -0,0 +1,359 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "output.h"
+#include "trace.h"
+
+
+// adapter and operation pairs of one run; more are dropped
+#define TRACE_MAX_KEYS    128
+#define TRACE_MAX_EVENTS  65536
+
+struct trace_key {
+    int                     dev_id;
+    uint32_t                op;
+    struct trace_histogram  histogram;
+};
+
+struct trace_event {
+    int       dev_id;
+    uint32_t  op;
+    uint64_t  start;
+    uint64_t  end;
+    int       timed_out;
+};
+
+static int stats_enabled  = 0;
+static int events_enabled = 0;
+
+// the probe workers record concurrently
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct trace_key    keys[TRACE_MAX_KEYS];
+static int                 num_keys = 0;
+static struct trace_event* events = NULL;
+static int                 num_events = 0;
+static uint64_t            trace_start;
+
+// names of the commands the probe sends and a few common in captures
+static const struct {
+    uint32_t     op;
+    const char*  name;
+} op_names[] = {
+    { TRACE_OP_DEVLIST, "HCIGETDEVLIST" },
+    { TRACE_OP_DEVINFO, "HCIGETDEVINFO" },
+    { TRACE_OP_OPEN,    "hci_open_dev" },
+    { TRACE_OP_CONNLIST, "HCIGETCONNLIST" },
+    { 0x0405,           "Create Connection" },
+    { 0x0406,           "Disconnect" },
+    { 0x0c03,           "Reset" },
+    { 0x0c2d,           "Read Transmit Power Level" },
+    { 0x1001,           "Read Local Version Information" },
+    { 0x1002,           "Read Local Supported Commands" },
+    { 0x1003,           "Read Local Supported Features" },
+    { 0x1004,           "Read Local Extended Features" },
+    { 0x1005,           "Read Buffer Size" },
+    { 0x1009,           "Read BD ADDR" },
+    { 0x1403,           "Get Link Quality" },
+    { 0x1405,           "Read RSSI" },
+    { 0x1406,           "Read AFH Channel Map" },
+    { 0x2002,           "LE Read Buffer Size" },
+    { 0x2003,           "LE Read Local Supported Features" },
+    { 0x200b,           "LE Set Scan Parameters" },
+    { 0x200c,           "LE Set Scan Enable" },
+    { 0x200d,           "LE Create Connection" },
+    { 0x2041,           "LE Set Extended Scan Parameters" },
+    { 0x2042,           "LE Set Extended Scan Enable" },
+};
+
+
+const char* trace_op_name(uint32_t op, char* buf, size_t size)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(op_names) / sizeof(op_names[0]); i++)
+        if (op_names[i].op == op)
+            return op_names[i].name;
+
+    snprintf(buf, size, "OGF 0x%02x OCF 0x%03x", cmd_opcode_ogf(op), cmd_opcode_ocf(op));
+    return buf;
+}
+
+
+void trace_enable(int stats, int timeline)
+{
+    stats_enabled  = stats;
+    events_enabled = timeline;
+    trace_start    = trace_now();
+
+    if (events_enabled && !events) {
+        events = malloc(TRACE_MAX_EVENTS * sizeof(*events));
+        if (!events)
+            events_enabled = 0;
+    }
+}
+
+
+uint64_t trace_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+static int bucket_index(uint64_t value)
+{
+    int e;
+
+    if (value < (1 << TRACE_SUB_BITS))
+        return value;
+
+    e = 63 - __builtin_clzll(value);
+    return ((e - TRACE_SUB_BITS + 1) << TRACE_SUB_BITS) +
+           ((value >> (e - TRACE_SUB_BITS)) & ((1 << TRACE_SUB_BITS) - 1));
+}
+
+
+// smallest value of a bucket
+static uint64_t bucket_value(int index)
+{
+    int e, sub;
+
+    if (index < (1 << TRACE_SUB_BITS))
+        return index;
+
+    e   = (index >> TRACE_SUB_BITS) + TRACE_SUB_BITS - 1;
+    sub = index & ((1 << TRACE_SUB_BITS) - 1);
+    return (uint64_t) ((1 << TRACE_SUB_BITS) + sub) << (e - TRACE_SUB_BITS);
+}
+
+
+static struct trace_histogram* find_histogram(int dev_id, uint32_t op)
+{
+    int i;
+
+    for (i = 0; i < num_keys; i++)
+        if (keys[i].dev_id == dev_id && keys[i].op == op)
+            return &keys[i].histogram;
+
+    if (num_keys == TRACE_MAX_KEYS)
+        return NULL;
+
+    keys[num_keys].dev_id = dev_id;
+    keys[num_keys].op     = op;
+    return &keys[num_keys++].histogram;
+}
+
+
+void trace_histogram_add(struct trace_histogram* histogram, uint64_t latency)
+{
+    histogram->count++;
+    histogram->buckets[bucket_index(latency)]++;
+    if (latency > histogram->max)
+        histogram->max = latency;
+}
+
+
+void trace_histogram_merge(struct trace_histogram* into, const struct trace_histogram* from)
+{
+    int i;
+
+    into->count    += from->count;
+    into->timeouts += from->timeouts;
+    if (from->max > into->max)
+        into->max = from->max;
+    for (i = 0; i < TRACE_BUCKETS; i++)
+        into->buckets[i] += from->buckets[i];
+}
+
+
+void trace_record(int dev_id, uint32_t op, uint64_t start, uint64_t end, int timed_out)
+{
+    struct trace_histogram* histogram;
+    uint64_t latency = end - start;
+
+    if (!stats_enabled && !events_enabled)
+        return;
+
+    pthread_mutex_lock(&trace_lock);
+
+    if (stats_enabled && (histogram = find_histogram(dev_id, op))) {
+        if (timed_out)
+            histogram->timeouts++;
+        else
+            trace_histogram_add(histogram, latency);
+    }
+
+    if (events_enabled && num_events < TRACE_MAX_EVENTS) {
+        struct trace_event* event = &events[num_events++];
+        event->dev_id    = dev_id;
+        event->op        = op;
+        event->start     = start;
+        event->end       = end;
+        event->timed_out = timed_out;
+    }
+
+    pthread_mutex_unlock(&trace_lock);
+}
+
+
+uint64_t trace_percentile(const struct trace_histogram* histogram, double fraction)
+{
+    uint64_t rank = (uint64_t) (fraction * histogram->count + 0.5);
+    uint64_t seen = 0;
+    int i;
+
+    if (rank == 0)
+        rank = 1;
+
+    for (i = 0; i < TRACE_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            // the upper end of the bucket, but never beyond what was seen
+            uint64_t value = i + 1 < TRACE_BUCKETS ? bucket_value(i + 1) - 1 : histogram->max;
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+
+void trace_print_latency(struct outbuf* out, uint64_t ns)
+{
+    if (ns < 10000)
+        out_printf(out, " %7lluns", (unsigned long long) ns);
+    else if (ns < 10000000)
+        out_printf(out, " %7.1fus", ns / 1e3);
+    else
+        out_printf(out, " %7.1fms", ns / 1e6);
+}
+
+
+void trace_print_stats(int fd)
+{
+    struct outbuf out;
+    char buf[32];
+    int i;
+
+    outbuf_init(&out, 4096);
+    out_printf(&out, "%-8s %-34s %7s %8s %9s %9s %9s\n",
+               "adapter", "operation", "count", "timeouts", "p50", "p99", "max");
+
+    pthread_mutex_lock(&trace_lock);
+    for (i = 0; i < num_keys; i++) {
+        const struct trace_histogram* histogram = &keys[i].histogram;
+
+        if (keys[i].dev_id >= 0)
+            snprintf(buf, sizeof(buf), "hci%d", keys[i].dev_id);
+        else
+            strcpy(buf, "-");
+        out_printf(&out, "%-8s ", buf);
+        out_printf(&out, "%-34s %7llu %8llu", trace_op_name(keys[i].op, buf, sizeof(buf)),
+                   (unsigned long long) histogram->count,
+                   (unsigned long long) histogram->timeouts);
+
+        if (histogram->count) {
+            trace_print_latency(&out, trace_percentile(histogram, 0.50));
+            trace_print_latency(&out, trace_percentile(histogram, 0.99));
+            trace_print_latency(&out, histogram->max);
+        }
+        out_printf(&out, "\n");
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    outbuf_flush(&out, fd);
+    outbuf_free(&out);
+}
+
+
+int trace_write_events(const char* path)
+{
+    struct outbuf out;
+    char buf[32];
+    int lanes[HCI_MAX_DEV + 1];
+    int num_lanes = 0;
+    int pid = getpid();
+    int fd, i, j, ret;
+
+    outbuf_init(&out, 65536);
+    out_printf(&out, "{\"traceEvents\":[\n");
+
+    pthread_mutex_lock(&trace_lock);
+
+    // one timeline per adapter, named after it
+    for (i = 0; i < num_events; i++) {
+        for (j = 0; j < num_lanes && lanes[j] != events[i].dev_id; j++)
+            ;
+        if (j < num_lanes || num_lanes == HCI_MAX_DEV + 1)
+            continue;
+        lanes[num_lanes++] = events[i].dev_id;
+        if (events[i].dev_id >= 0)
+            snprintf(buf, sizeof(buf), "hci%d", events[i].dev_id);
+        else
+            strcpy(buf, "enumeration");
+        out_printf(&out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                         "\"args\":{\"name\":\"%s\"}},\n", pid, events[i].dev_id, buf);
+    }
+
+    for (i = 0; i < num_events; i++) {
+        const struct trace_event* event = &events[i];
+
+        out_printf(&out, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                         "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"timeout\":%s}}%s\n",
+                   trace_op_name(event->op, buf, sizeof(buf)),
+                   event->op >= TRACE_OP_DEVLIST ? "ioctl" : "hci",
+                   pid, event->dev_id,
+                   (event->start - trace_start) / 1e3,
+                   (event->end - event->start) / 1e3,
+                   event->timed_out ? "true" : "false",
+                   i + 1 < num_events ? "," : "");
+    }
+
+    pthread_mutex_unlock(&trace_lock);
+
+    out_printf(&out, "],\"displayTimeUnit\":\"ns\"}\n");
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        outbuf_free(&out);
+        return -1;
+    }
+
+    ret = outbuf_flush(&out, fd);
+    if (close(fd) < 0)
+        ret = -1;
+    outbuf_free(&out);
+    return ret;
+}
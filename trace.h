@@ -0,0 +1,81 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "output.h"
+
+
+// Latency of every HCI command and ioctl of a run, per adapter and
+// operation, in log-linear histograms (--stats) and optionally as a
+// Chrome trace-event timeline (--trace). Nothing is recorded unless
+// enabled.
+
+// operations that are not HCI commands; HCI commands use their opcode
+enum trace_op {
+    TRACE_OP_DEVLIST = 0x10000,    // HCIGETDEVLIST (hci_for_each_dev)
+    TRACE_OP_DEVINFO,              // HCIGETDEVINFO (hci_devinfo)
+    TRACE_OP_OPEN,                 // hci_open_dev
+    TRACE_OP_CONNLIST,             // HCIGETCONNLIST
+};
+
+// 8 linear buckets per power of two: the error is below 12.5 %
+#define TRACE_SUB_BITS  3
+#define TRACE_BUCKETS   ((64 - TRACE_SUB_BITS + 1) << TRACE_SUB_BITS)
+
+struct trace_histogram {
+    uint64_t  count;
+    uint64_t  timeouts;     // not part of the buckets
+    uint64_t  max;
+    uint32_t  buckets[TRACE_BUCKETS];
+};
+
+void trace_enable(int stats, int timeline);
+
+// CLOCK_MONOTONIC in ns
+uint64_t trace_now(void);
+
+// one finished (or timed out) operation on adapter dev_id (-1: none)
+void trace_record(int dev_id, uint32_t op, uint64_t start, uint64_t end, int timed_out);
+
+// the value below which the given fraction of the recorded latencies lies
+uint64_t trace_percentile(const struct trace_histogram* histogram, double fraction);
+
+// for histograms kept outside of a run's stats (the capture analyzer)
+void trace_histogram_add(struct trace_histogram* histogram, uint64_t latency);
+void trace_histogram_merge(struct trace_histogram* into, const struct trace_histogram* from);
+
+// " 123ns", " 12.3us" or " 1.2ms", right aligned in 10 characters
+void trace_print_latency(struct outbuf* out, uint64_t ns);
+
+// name of an HCI command or other operation, using buf if it has none
+const char* trace_op_name(uint32_t op, char* buf, size_t size);
+
+// prints count, timeouts, p50, p99 and max of every adapter and operation
+void trace_print_stats(int fd);
+
+// writes the recorded events as Chrome trace JSON; -1 with errno on error
+int trace_write_events(const char* path);
+
+#endif
@@ -0,0 +1,1282 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+// recvmmsg
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "transport.h"
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+int transport_dev_snapshot(struct transport* transport, struct hci_dev_req** devs)
+{
+    struct hci_dev_req* list = NULL;
+    struct hci_dev_req* grown;
+    int max = HCI_MAX_DEV;
+    int count, err;
+
+    while (1) {
+        grown = realloc(list, max * sizeof(*list));
+        if (!grown) {
+            free(list);
+            errno = ENOMEM;
+            return -1;
+        }
+        list = grown;
+
+        count = transport_dev_list(transport, list, max);
+        if (count < 0) {
+            err = errno;
+            free(list);
+            errno = err;
+            return -1;
+        }
+        if (count < max || max >= TRANSPORT_MAX_DEVS)
+            break;
+        max *= 2;
+    }
+
+    *devs = list;
+    return count;
+}
+
+
+/* live ----------------------------------------------------------------- */
+
+struct live_transport {
+    struct transport  base;
+    int               ctl;     // serves all ioctls
+};
+
+
+static int live_dev_list(struct transport* transport, struct hci_dev_req* devs, int max)
+{
+    struct live_transport* live = (struct live_transport*) transport;
+    struct hci_dev_list_req* req;
+    int count;
+
+    req = malloc(sizeof(*req) + max * sizeof(struct hci_dev_req));
+    if (!req)
+        return -1;
+
+    req->dev_num = max;
+    if (ioctl(live->ctl, HCIGETDEVLIST, (void*) req) < 0) {
+        free(req);
+        return -1;
+    }
+
+    count = req->dev_num;
+    memcpy(devs, req->dev_req, count * sizeof(struct hci_dev_req));
+    free(req);
+    return count;
+}
+
+
+static int live_dev_info(struct transport* transport, int dev_id, struct hci_dev_info* di)
+{
+    struct live_transport* live = (struct live_transport*) transport;
+
+    di->dev_id = dev_id;
+    return ioctl(live->ctl, HCIGETDEVINFO, (void*) di) < 0 ? -1 : 0;
+}
+
+
+static int live_conn_list(struct transport* transport, int dev_id,
+                          struct hci_conn_info* conns, int max)
+{
+    struct live_transport* live = (struct live_transport*) transport;
+    struct hci_conn_list_req* req;
+    int count;
+
+    req = malloc(sizeof(*req) + max * sizeof(struct hci_conn_info));
+    if (!req)
+        return -1;
+
+    req->dev_id   = dev_id;
+    req->conn_num = max;
+    if (ioctl(live->ctl, HCIGETCONNLIST, (void*) req) < 0) {
+        free(req);
+        return -1;
+    }
+
+    count = req->conn_num;
+    memcpy(conns, req->conn_info, count * sizeof(struct hci_conn_info));
+    free(req);
+    return count;
+}
+
+
+static int live_open(struct transport* transport, int dev_id, struct transport_dev* dev)
+{
+    struct hci_filter filter;
+
+    dev->transport = transport;
+    dev->dev_id    = dev_id;
+    dev->priv      = NULL;
+    dev->fd        = hci_open_dev(dev_id);
+    if (dev->fd < 0)
+        return -1;
+
+    // the socket is only used for commands, so nothing else is let through
+    hci_filter_clear(&filter);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &filter);
+    hci_filter_set_event(EVT_CMD_STATUS, &filter);
+    hci_filter_set_event(EVT_CMD_COMPLETE, &filter);
+    if (setsockopt(dev->fd, SOL_HCI, HCI_FILTER, &filter, sizeof(filter)) < 0) {
+        int err = errno;
+        hci_close_dev(dev->fd);
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void live_close(struct transport_dev* dev)
+{
+    hci_close_dev(dev->fd);
+    dev->fd = -1;
+}
+
+
+static int live_send_cmd(struct transport_dev* dev, uint16_t opcode, uint8_t plen, const void* param)
+{
+    return hci_send_cmd(dev->fd, cmd_opcode_ogf(opcode), cmd_opcode_ocf(opcode),
+                        plen, (void*) param);
+}
+
+
+static int live_send_acl(struct transport_dev* dev, const void* pkt, int len)
+{
+    uint8_t type = HCI_ACLDATA_PKT;
+    struct iovec iov[2] = { { &type, 1 }, { (void*) pkt, len } };
+
+    while (writev(dev->fd, iov, 2) < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            continue;
+        return -1;
+    }
+    return 0;
+}
+
+
+static int live_read_event(struct transport_dev* dev, void* buf, int len, int timeout)
+{
+    struct pollfd p;
+    ssize_t n;
+
+    p.fd = dev->fd;
+    p.events = POLLIN;
+    p.revents = 0;
+
+    n = poll(&p, 1, timeout);
+    if (n <= 0)
+        return n;
+
+    n = read(dev->fd, buf, len);
+    if (n == 0) {
+        errno = ENODEV;
+        return -1;
+    }
+    return n;
+}
+
+
+// one recvmmsg for everything the socket has queued, up to count packets
+static int live_read_events(struct transport_dev* dev, uint8_t* buf, int size,
+                            int* lens, int count, int timeout)
+{
+    struct mmsghdr msgs[TRANSPORT_MAX_BATCH];
+    struct iovec iov[TRANSPORT_MAX_BATCH];
+    struct pollfd p;
+    int n, i;
+
+    if (count > TRANSPORT_MAX_BATCH)
+        count = TRANSPORT_MAX_BATCH;
+
+    p.fd = dev->fd;
+    p.events = POLLIN;
+    p.revents = 0;
+
+    n = poll(&p, 1, timeout);
+    if (n <= 0)
+        return n;
+
+    memset(msgs, 0x00, count * sizeof(msgs[0]));
+    for (i = 0; i < count; i++) {
+        iov[i].iov_base = buf + i * size;
+        iov[i].iov_len  = size;
+        msgs[i].msg_hdr.msg_iov    = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    n = recvmmsg(dev->fd, msgs, count, MSG_DONTWAIT, NULL);
+    if (n < 0)
+        return errno == EAGAIN ? 0 : -1;
+
+    for (i = 0; i < n; i++)
+        lens[i] = msgs[i].msg_len;
+    return n;
+}
+
+
+static int live_set_filter(struct transport_dev* dev, const struct hci_filter* filter)
+{
+    return setsockopt(dev->fd, SOL_HCI, HCI_FILTER, filter, sizeof(*filter));
+}
+
+
+static void live_destroy(struct transport* transport)
+{
+    struct live_transport* live = (struct live_transport*) transport;
+
+    close(live->ctl);
+    free(live);
+}
+
+
+static const struct transport_ops live_ops = {
+    live_dev_list, live_dev_info, live_conn_list, live_open, live_close,
+    live_send_cmd, live_send_acl, live_read_event, live_read_events, live_set_filter, live_destroy
+};
+
+
+struct transport* transport_live(void)
+{
+    struct live_transport* live = malloc(sizeof(*live));
+
+    if (!live)
+        return NULL;
+
+    live->base.ops = &live_ops;
+    live->ctl = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI);
+    if (live->ctl < 0) {
+        free(live);
+        return NULL;
+    }
+
+    return &live->base;
+}
+
+
+/* recorder ------------------------------------------------------------- */
+
+struct recorder_transport {
+    struct transport   base;
+    struct transport*  inner;
+    FILE*              file;
+    uint64_t           start;
+    pthread_mutex_t    lock;     // the probe workers record concurrently
+};
+
+
+// appends one call; flushed right away, the long running modes only end
+// when they are killed
+static void record(struct recorder_transport* recorder, int call, int flags, int dev_id,
+                   int result, uint64_t start, const void* data, size_t len)
+{
+    static const uint8_t padding[8];
+    struct transport_record rec;
+    int err = errno;
+
+    memset(&rec, 0x00, sizeof(rec));
+    rec.call     = call;
+    rec.flags    = flags;
+    rec.dev_id   = dev_id;
+    rec.result   = result;
+    rec.error    = result < 0 ? err : 0;
+    rec.len      = len;
+    rec.start    = start - recorder->start;
+    rec.duration = now_ns() - start;
+
+    pthread_mutex_lock(&recorder->lock);
+    fwrite(&rec, sizeof(rec), 1, recorder->file);
+    if (len) {
+        fwrite(data, len, 1, recorder->file);
+        fwrite(padding, TRANSPORT_ALIGN(len) - len, 1, recorder->file);
+    }
+    fflush(recorder->file);
+    pthread_mutex_unlock(&recorder->lock);
+
+    errno = err;
+}
+
+
+static int recorder_dev_list(struct transport* transport, struct hci_dev_req* devs, int max)
+{
+    struct recorder_transport* recorder = (struct recorder_transport*) transport;
+    uint64_t start = now_ns();
+    int ret = transport_dev_list(recorder->inner, devs, max);
+
+    record(recorder, TRANSPORT_DEV_LIST, 0, -1, ret, start,
+           devs, ret > 0 ? ret * sizeof(*devs) : 0);
+    return ret;
+}
+
+
+static int recorder_dev_info(struct transport* transport, int dev_id, struct hci_dev_info* di)
+{
+    struct recorder_transport* recorder = (struct recorder_transport*) transport;
+    uint64_t start = now_ns();
+    int ret = transport_dev_info(recorder->inner, dev_id, di);
+
+    record(recorder, TRANSPORT_DEV_INFO, 0, dev_id, ret, start,
+           di, ret == 0 ? sizeof(*di) : 0);
+    return ret;
+}
+
+
+static int recorder_conn_list(struct transport* transport, int dev_id,
+                              struct hci_conn_info* conns, int max)
+{
+    struct recorder_transport* recorder = (struct recorder_transport*) transport;
+    uint64_t start = now_ns();
+    int ret = transport_conn_list(recorder->inner, dev_id, conns, max);
+
+    record(recorder, TRANSPORT_CONN_LIST, 0, dev_id, ret, start,
+           conns, ret > 0 ? ret * sizeof(*conns) : 0);
+    return ret;
+}
+
+
+static int recorder_open(struct transport* transport, int dev_id, struct transport_dev* dev)
+{
+    struct recorder_transport* recorder = (struct recorder_transport*) transport;
+    struct transport_dev* inner = malloc(sizeof(*inner));
+    uint64_t start = now_ns();
+    int ret;
+
+    if (!inner)
+        return -1;
+
+    ret = transport_open(recorder->inner, dev_id, inner);
+    record(recorder, TRANSPORT_OPEN, 0, dev_id, ret, start, NULL, 0);
+    if (ret < 0) {
+        free(inner);
+        return ret;
+    }
+
+    dev->transport = transport;
+    dev->dev_id    = dev_id;
+    dev->fd        = inner->fd;
+    dev->priv      = inner;
+    return ret;
+}
+
+
+static void recorder_close(struct transport_dev* dev)
+{
+    struct recorder_transport* recorder = (struct recorder_transport*) dev->transport;
+    uint64_t start = now_ns();
+
+    transport_close(dev->priv);
+    free(dev->priv);
+    dev->priv = NULL;
+    record(recorder, TRANSPORT_CLOSE, 0, dev->dev_id, 0, start, NULL, 0);
+}
+
+
+static int recorder_send_cmd(struct transport_dev* dev, uint16_t opcode, uint8_t plen, const void* param)
+{
+    struct recorder_transport* recorder = (struct recorder_transport*) dev->transport;
+    uint8_t cmd[HCI_COMMAND_HDR_SIZE + 255];
+    hci_command_hdr* hdr = (void*) cmd;
+    uint64_t start = now_ns();
+    int ret = transport_send_cmd(dev->priv, opcode, plen, param);
+
+    hdr->opcode = htobs(opcode);
+    hdr->plen   = plen;
+    if (plen)
+        memcpy(cmd + HCI_COMMAND_HDR_SIZE, param, plen);
+    record(recorder, TRANSPORT_SEND_CMD, 0, dev->dev_id, ret, start,
+           cmd, HCI_COMMAND_HDR_SIZE + plen);
+    return ret;
+}
+
+
+static int recorder_send_acl(struct transport_dev* dev, const void* pkt, int len)
+{
+    struct recorder_transport* recorder = (struct recorder_transport*) dev->transport;
+    uint64_t start = now_ns();
+    int ret = transport_send_acl(dev->priv, pkt, len);
+
+    record(recorder, TRANSPORT_SEND_ACL, 0, dev->dev_id, ret, start, pkt, len);
+    return ret;
+}
+
+
+static int recorder_read_event(struct transport_dev* dev, void* buf, int len, int timeout)
+{
+    struct recorder_transport* recorder = (struct recorder_transport*) dev->transport;
+    uint64_t start = now_ns();
+    int ret = transport_read_event(dev->priv, buf, len, timeout);
+
+    record(recorder, TRANSPORT_READ_EVENT, 0, dev->dev_id, ret, start, buf, ret > 0 ? ret : 0);
+    return ret;
+}
+
+
+// every packet becomes a record of its own, marked as part of the batch
+static int recorder_read_events(struct transport_dev* dev, uint8_t* buf, int size,
+                                int* lens, int count, int timeout)
+{
+    struct recorder_transport* recorder = (struct recorder_transport*) dev->transport;
+    uint64_t start = now_ns();
+    int ret = transport_read_events(dev->priv, buf, size, lens, count, timeout);
+    int i;
+
+    if (ret <= 0)
+        record(recorder, TRANSPORT_READ_EVENT, 0, dev->dev_id, ret, start, NULL, 0);
+    for (i = 0; i < ret; i++)
+        record(recorder, TRANSPORT_READ_EVENT, i ? TRANSPORT_FLAG_BATCH : 0, dev->dev_id,
+               lens[i], i ? now_ns() : start, buf + i * size, lens[i]);
+    return ret;
+}
+
+
+static int recorder_set_filter(struct transport_dev* dev, const struct hci_filter* filter)
+{
+    struct recorder_transport* recorder = (struct recorder_transport*) dev->transport;
+    uint64_t start = now_ns();
+    int ret = transport_set_filter(dev->priv, filter);
+
+    record(recorder, TRANSPORT_SET_FILTER, 0, dev->dev_id, ret, start, filter, sizeof(*filter));
+    return ret;
+}
+
+
+static void recorder_destroy(struct transport* transport)
+{
+    struct recorder_transport* recorder = (struct recorder_transport*) transport;
+
+    transport_destroy(recorder->inner);
+    fclose(recorder->file);
+    pthread_mutex_destroy(&recorder->lock);
+    free(recorder);
+}
+
+
+static const struct transport_ops recorder_ops = {
+    recorder_dev_list, recorder_dev_info, recorder_conn_list, recorder_open, recorder_close,
+    recorder_send_cmd, recorder_send_acl, recorder_read_event, recorder_read_events,
+    recorder_set_filter, recorder_destroy
+};
+
+
+struct transport* transport_recorder(struct transport* inner, const char* path)
+{
+    struct recorder_transport* recorder = malloc(sizeof(*recorder));
+    struct transport_file_header header;
+
+    if (!recorder)
+        return NULL;
+
+    recorder->file = fopen(path, "wbe");
+    if (!recorder->file) {
+        free(recorder);
+        return NULL;
+    }
+
+    memset(&header, 0x00, sizeof(header));
+    memcpy(header.magic, TRANSPORT_MAGIC, sizeof(header.magic));
+    header.version    = TRANSPORT_VERSION;
+    header.byte_order = TRANSPORT_BYTE_ORDER;
+    if (fwrite(&header, sizeof(header), 1, recorder->file) != 1) {
+        fclose(recorder->file);
+        free(recorder);
+        return NULL;
+    }
+
+    recorder->base.ops = &recorder_ops;
+    recorder->inner    = inner;
+    recorder->start    = now_ns();
+    pthread_mutex_init(&recorder->lock, NULL);
+    return &recorder->base;
+}
+
+
+/* replay --------------------------------------------------------------- */
+
+// every adapter (and the adapter list) is replayed as a stream of its own,
+// so the interleaving of the probe workers does not matter
+#define REPLAY_MAX_STREAMS 64
+
+struct replay_stream {
+    int     dev_id;
+    size_t  offset;    // first record not served yet
+};
+
+struct replay_transport {
+    struct transport      base;
+    uint8_t*              data;
+    size_t                size;
+    int                   realtime;
+    pthread_mutex_t       lock;
+    struct replay_stream  streams[REPLAY_MAX_STREAMS];
+    int                   num_streams;
+};
+
+
+// the next record of dev_id, which has to be a call; NULL with EPROTO if
+// the replayed run does something else than the recorded one
+static const struct transport_record* next_record(struct replay_transport* replay,
+                                                  int dev_id, int call, const void** data)
+{
+    const struct transport_record* rec = NULL;
+    struct replay_stream* stream = NULL;
+    size_t offset;
+    int i;
+
+    pthread_mutex_lock(&replay->lock);
+
+    for (i = 0; i < replay->num_streams; i++)
+        if (replay->streams[i].dev_id == dev_id)
+            stream = &replay->streams[i];
+
+    if (!stream && replay->num_streams < REPLAY_MAX_STREAMS) {
+        stream = &replay->streams[replay->num_streams++];
+        stream->dev_id = dev_id;
+        stream->offset = sizeof(struct transport_file_header);
+    }
+
+    for (offset = stream ? stream->offset : replay->size; offset < replay->size; ) {
+        const struct transport_record* r = (const void*) (replay->data + offset);
+
+        offset += sizeof(*r) + TRANSPORT_ALIGN(r->len);
+        if (r->dev_id != dev_id)
+            continue;
+        if (r->call == call) {
+            rec = r;
+            stream->offset = offset;
+        }
+        break;
+    }
+
+    pthread_mutex_unlock(&replay->lock);
+
+    if (!rec) {
+        errno = EPROTO;
+        return NULL;
+    }
+
+    if (replay->realtime) {
+        struct timespec duration = {
+            rec->duration / 1000000000ULL, rec->duration % 1000000000ULL
+        };
+        while (nanosleep(&duration, &duration) < 0 && errno == EINTR)
+            ;
+    }
+
+    *data = rec + 1;
+    errno = rec->error;
+    return rec;
+}
+
+
+// whether the next record of dev_id continues a read_events batch
+static int next_is_batch(struct replay_transport* replay, int dev_id)
+{
+    struct replay_stream* stream = NULL;
+    size_t offset;
+    int batch = 0;
+    int i;
+
+    pthread_mutex_lock(&replay->lock);
+
+    for (i = 0; i < replay->num_streams; i++)
+        if (replay->streams[i].dev_id == dev_id)
+            stream = &replay->streams[i];
+
+    for (offset = stream ? stream->offset : replay->size; offset < replay->size; ) {
+        const struct transport_record* r = (const void*) (replay->data + offset);
+
+        offset += sizeof(*r) + TRANSPORT_ALIGN(r->len);
+        if (r->dev_id != dev_id)
+            continue;
+        batch = r->call == TRANSPORT_READ_EVENT && (r->flags & TRANSPORT_FLAG_BATCH);
+        break;
+    }
+
+    pthread_mutex_unlock(&replay->lock);
+    return batch;
+}
+
+
+static int replay_dev_list(struct transport* transport, struct hci_dev_req* devs, int max)
+{
+    const void* data;
+    const struct transport_record* rec =
+        next_record((struct replay_transport*) transport, -1, TRANSPORT_DEV_LIST, &data);
+
+    if (!rec)
+        return -1;
+    if (rec->result < 0)
+        return -1;
+
+    if (rec->result < max)
+        max = rec->result;
+    memcpy(devs, data, max * sizeof(*devs));
+    return max;
+}
+
+
+static int replay_dev_info(struct transport* transport, int dev_id, struct hci_dev_info* di)
+{
+    const void* data;
+    const struct transport_record* rec =
+        next_record((struct replay_transport*) transport, dev_id, TRANSPORT_DEV_INFO, &data);
+
+    if (!rec)
+        return -1;
+    if (rec->result < 0)
+        return -1;
+
+    memcpy(di, data, sizeof(*di));
+    return 0;
+}
+
+
+static int replay_conn_list(struct transport* transport, int dev_id,
+                            struct hci_conn_info* conns, int max)
+{
+    const void* data;
+    const struct transport_record* rec =
+        next_record((struct replay_transport*) transport, dev_id, TRANSPORT_CONN_LIST, &data);
+
+    if (!rec)
+        return -1;
+    if (rec->result < 0)
+        return -1;
+
+    if (rec->result < max)
+        max = rec->result;
+    memcpy(conns, data, max * sizeof(*conns));
+    return max;
+}
+
+
+static int replay_open(struct transport* transport, int dev_id, struct transport_dev* dev)
+{
+    const void* data;
+    const struct transport_record* rec =
+        next_record((struct replay_transport*) transport, dev_id, TRANSPORT_OPEN, &data);
+
+    if (!rec)
+        return -1;
+
+    dev->transport = transport;
+    dev->dev_id    = dev_id;
+    dev->fd        = -1;
+    dev->priv      = NULL;
+    return rec->result;
+}
+
+
+static void replay_close(struct transport_dev* dev)
+{
+    const void* data;
+
+    next_record((struct replay_transport*) dev->transport, dev->dev_id, TRANSPORT_CLOSE, &data);
+}
+
+
+static int replay_send_cmd(struct transport_dev* dev, uint16_t opcode, uint8_t plen, const void* param)
+{
+    const void* data;
+    const struct transport_record* rec =
+        next_record((struct replay_transport*) dev->transport, dev->dev_id,
+                    TRANSPORT_SEND_CMD, &data);
+    const hci_command_hdr* hdr = data;
+
+    if (!rec)
+        return -1;
+
+    // the recording has the answers to a different command
+    if (rec->len != (uint32_t) HCI_COMMAND_HDR_SIZE + plen || btohs(hdr->opcode) != opcode ||
+            memcmp(hdr + 1, param, plen) != 0) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    return rec->result;
+}
+
+
+static int replay_send_acl(struct transport_dev* dev, const void* pkt, int len)
+{
+    const void* data;
+    const struct transport_record* rec =
+        next_record((struct replay_transport*) dev->transport, dev->dev_id,
+                    TRANSPORT_SEND_ACL, &data);
+
+    if (!rec)
+        return -1;
+
+    if (rec->len != (uint32_t) len || memcmp(data, pkt, len) != 0) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    return rec->result;
+}
+
+
+static int replay_read_event(struct transport_dev* dev, void* buf, int len, int timeout)
+{
+    const void* data;
+    const struct transport_record* rec =
+        next_record((struct replay_transport*) dev->transport, dev->dev_id,
+                    TRANSPORT_READ_EVENT, &data);
+
+    if (!rec)
+        return -1;
+    if (rec->result <= 0)
+        return rec->result;
+
+    if ((int) rec->len < len)
+        len = rec->len;
+    memcpy(buf, data, len);
+    return len;
+}
+
+
+// the packets of the recorded batch, so that a run reacting to them (the
+// loopback test) sends at the same points as the recorded one
+static int replay_read_events(struct transport_dev* dev, uint8_t* buf, int size,
+                              int* lens, int count, int timeout)
+{
+    struct replay_transport* replay = (struct replay_transport*) dev->transport;
+    int len = replay_read_event(dev, buf, size, timeout);
+    int n = 1;
+
+    if (len <= 0)
+        return len;
+    lens[0] = len;
+
+    while (n < count && next_is_batch(replay, dev->dev_id)) {
+        len = replay_read_event(dev, buf + n * size, size, 0);
+        if (len <= 0)
+            break;
+        lens[n++] = len;
+    }
+    return n;
+}
+
+
+static int replay_set_filter(struct transport_dev* dev, const struct hci_filter* filter)
+{
+    const void* data;
+    const struct transport_record* rec =
+        next_record((struct replay_transport*) dev->transport, dev->dev_id,
+                    TRANSPORT_SET_FILTER, &data);
+
+    return rec ? rec->result : -1;
+}
+
+
+static void replay_destroy(struct transport* transport)
+{
+    struct replay_transport* replay = (struct replay_transport*) transport;
+
+    pthread_mutex_destroy(&replay->lock);
+    free(replay->data);
+    free(replay);
+}
+
+
+static const struct transport_ops replay_ops = {
+    replay_dev_list, replay_dev_info, replay_conn_list, replay_open, replay_close,
+    replay_send_cmd, replay_send_acl, replay_read_event, replay_read_events,
+    replay_set_filter, replay_destroy
+};
+
+
+// reads the whole recording and checks that every record is complete
+static int load_recording(struct replay_transport* replay, const char* path)
+{
+    const struct transport_file_header* header;
+    struct stat st;
+    size_t offset, done = 0;
+    FILE* file;
+
+    file = fopen(path, "rbe");
+    if (!file)
+        return -1;
+
+    if (fstat(fileno(file), &st) < 0 || !(replay->data = malloc(st.st_size + 1))) {
+        fclose(file);
+        return -1;
+    }
+
+    replay->size = st.st_size;
+    while (done < replay->size) {
+        size_t n = fread(replay->data + done, 1, replay->size - done, file);
+        if (n == 0)
+            break;
+        done += n;
+    }
+    fclose(file);
+
+    header = (const void*) replay->data;
+    if (done != replay->size || replay->size < sizeof(*header) ||
+        memcmp(header->magic, TRANSPORT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != TRANSPORT_VERSION || header->byte_order != TRANSPORT_BYTE_ORDER) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    for (offset = sizeof(*header); offset < replay->size; ) {
+        const struct transport_record* rec = (const void*) (replay->data + offset);
+
+        if (replay->size - offset < sizeof(*rec) ||
+                replay->size - offset - sizeof(*rec) < TRANSPORT_ALIGN(rec->len)) {
+            // a recording cut off by killing the recorder is still fine
+            replay->size = offset;
+            break;
+        }
+        offset += sizeof(*rec) + TRANSPORT_ALIGN(rec->len);
+    }
+
+    return 0;
+}
+
+
+struct transport* transport_replay(const char* path, int realtime)
+{
+    struct replay_transport* replay = calloc(1, sizeof(*replay));
+
+    if (!replay)
+        return NULL;
+
+    if (load_recording(replay, path) < 0) {
+        int err = errno;
+        free(replay->data);
+        free(replay);
+        errno = err;
+        return NULL;
+    }
+
+    replay->base.ops = &replay_ops;
+    replay->realtime = realtime;
+    pthread_mutex_init(&replay->lock, NULL);
+    return &replay->base;
+}
+
+
+/* stub ----------------------------------------------------------------- */
+
+#define STUB_ACL_MTU   1021
+#define STUB_ACL_PKTS  8
+#define STUB_SCO_MTU   64
+#define STUB_SCO_PKTS  1
+#define STUB_LE_MTU    251
+#define STUB_LE_PKTS   8
+#define STUB_MAX_PAGE  2          // of the extended features
+#define STUB_HANDLE    0x0001     // of the loopback ACL link
+#define STUB_FLAGS     (1 << HCI_UP | 1 << HCI_RUNNING | 1 << HCI_PSCAN | 1 << HCI_ISCAN)
+
+// answers waiting to be read; a full window of echoes and their Number
+// Of Completed Packets events fits
+#define STUB_QUEUE     64
+#define STUB_PKT_SIZE  (HCI_TYPE_LEN + HCI_ACL_HDR_SIZE + STUB_ACL_MTU)
+
+// the testing commands are OGF 0x06 in the specification
+#define STUB_OPCODE_READ_LOOPBACK   cmd_opcode_pack(0x06, OCF_READ_LOOPBACK_MODE)
+#define STUB_OPCODE_WRITE_LOOPBACK  cmd_opcode_pack(0x06, OCF_WRITE_LOOPBACK_MODE)
+
+struct stub_transport {
+    struct transport  base;
+    int               count;
+    uint32_t*         ticks;     // device info reads per adapter
+};
+
+struct stub_dev {
+    uint8_t  loopback;       // loopback mode, 1 = local
+    int      head;
+    int      queued;
+    int      lens[STUB_QUEUE];
+    uint8_t  queue[STUB_QUEUE][STUB_PKT_SIZE];
+};
+
+
+static void stub_bdaddr(int dev_id, bdaddr_t* bdaddr)
+{
+    memset(bdaddr, 0x00, sizeof(*bdaddr));
+    bdaddr->b[5] = 0x5a;
+    bdaddr->b[0] = dev_id;
+}
+
+
+static int stub_dev_list(struct transport* transport, struct hci_dev_req* devs, int max)
+{
+    struct stub_transport* stub = (struct stub_transport*) transport;
+    int i;
+
+    for (i = 0; i < stub->count && i < max; i++) {
+        devs[i].dev_id  = i;
+        devs[i].dev_opt = STUB_FLAGS;
+    }
+    return i;
+}
+
+
+// every read sees the counters grown a bit further, faster on the higher
+// adapters
+static int stub_dev_info(struct transport* transport, int dev_id, struct hci_dev_info* di)
+{
+    struct stub_transport* stub = (struct stub_transport*) transport;
+    uint32_t t, n = dev_id + 1;
+
+    if (dev_id < 0 || dev_id >= stub->count) {
+        errno = ENODEV;
+        return -1;
+    }
+    t = __sync_add_and_fetch(&stub->ticks[dev_id], 1);
+
+    memset(di, 0x00, sizeof(*di));
+    di->dev_id = dev_id;
+    snprintf(di->name, sizeof(di->name), "stub%d", dev_id % 100);
+    stub_bdaddr(dev_id, &di->bdaddr);
+    di->type        = HCI_USB;
+    di->flags       = STUB_FLAGS;
+    memset(di->features, 0xff, sizeof(di->features));
+    di->pkt_type    = 0xffff;
+    di->link_policy = HCI_LP_RSWITCH | HCI_LP_HOLD | HCI_LP_SNIFF | HCI_LP_PARK;
+    di->link_mode   = HCI_LM_ACCEPT;
+    di->acl_mtu     = STUB_ACL_MTU;
+    di->acl_pkts    = STUB_ACL_PKTS;
+    di->sco_mtu     = STUB_SCO_MTU;
+    di->sco_pkts    = STUB_SCO_PKTS;
+
+    // the byte counters wrap after a few hundred reads
+    di->stat.err_rx  = t / 100;
+    di->stat.cmd_tx  = t * n;
+    di->stat.evt_rx  = t * n + t / 10;
+    di->stat.acl_tx  = t * 10 * n;
+    di->stat.acl_rx  = t * 12 * n;
+    di->stat.byte_tx = t * 10000019u * n;
+    di->stat.byte_rx = t * 12000017u * n;
+    return 0;
+}
+
+
+static int stub_conn_list(struct transport* transport, int dev_id,
+                          struct hci_conn_info* conns, int max)
+{
+    return 0;
+}
+
+
+static int stub_open(struct transport* transport, int dev_id, struct transport_dev* dev)
+{
+    struct stub_transport* stub = (struct stub_transport*) transport;
+
+    if (dev_id < 0 || dev_id >= stub->count) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    dev->transport = transport;
+    dev->dev_id    = dev_id;
+    dev->fd        = -1;
+    dev->priv      = calloc(1, sizeof(struct stub_dev));
+    return dev->priv ? 0 : -1;
+}
+
+
+static void stub_close(struct transport_dev* dev)
+{
+    free(dev->priv);
+    dev->priv = NULL;
+}
+
+
+// room for one more answer; NULL if nobody read the earlier ones
+static uint8_t* stub_push(struct stub_dev* sdev, int len)
+{
+    int slot;
+
+    if (sdev->queued == STUB_QUEUE)
+        return NULL;
+    slot = (sdev->head + sdev->queued++) % STUB_QUEUE;
+    sdev->lens[slot] = len;
+    return sdev->queue[slot];
+}
+
+
+static void stub_event(struct stub_dev* sdev, uint8_t evt, const void* param, int plen)
+{
+    uint8_t* pkt = stub_push(sdev, HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE + plen);
+
+    if (!pkt)
+        return;
+    pkt[0] = HCI_EVENT_PKT;
+    pkt[1] = evt;
+    pkt[2] = plen;
+    memcpy(pkt + 3, param, plen);
+}
+
+
+static void stub_complete(struct stub_dev* sdev, uint16_t opcode, const void* rparam, int rlen)
+{
+    uint8_t param[EVT_CMD_COMPLETE_SIZE + READ_LOCAL_COMMANDS_RP_SIZE];
+    evt_cmd_complete* cc = (void*) param;
+
+    cc->ncmd   = 1;
+    cc->opcode = htobs(opcode);
+    memcpy(param + EVT_CMD_COMPLETE_SIZE, rparam, rlen);
+    stub_event(sdev, EVT_CMD_COMPLETE, param, EVT_CMD_COMPLETE_SIZE + rlen);
+}
+
+
+// a controller that supports every command and feature; unknown commands
+// fail as on real hardware
+static int stub_send_cmd(struct transport_dev* dev, uint16_t opcode, uint8_t plen, const void* param)
+{
+    struct stub_dev* sdev = dev->priv;
+    uint8_t status = 0x00;
+
+    if (opcode == cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_LOCAL_VERSION)) {
+        read_local_version_rp rp;
+
+        memset(&rp, 0x00, sizeof(rp));
+        rp.hci_ver      = 0x09;
+        rp.hci_rev      = htobs(0x0100 + dev->dev_id);
+        rp.lmp_ver      = 0x09;
+        rp.manufacturer = htobs(0x0002);
+        rp.lmp_subver   = htobs(0x1234);
+        stub_complete(sdev, opcode, &rp, READ_LOCAL_VERSION_RP_SIZE);
+    } else if (opcode == cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_LOCAL_COMMANDS)) {
+        read_local_commands_rp rp;
+
+        rp.status = 0x00;
+        memset(rp.commands, 0xff, sizeof(rp.commands));
+        stub_complete(sdev, opcode, &rp, READ_LOCAL_COMMANDS_RP_SIZE);
+    } else if (opcode == cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_BUFFER_SIZE)) {
+        read_buffer_size_rp rp;
+
+        rp.status      = 0x00;
+        rp.acl_mtu     = htobs(STUB_ACL_MTU);
+        rp.sco_mtu     = STUB_SCO_MTU;
+        rp.acl_max_pkt = htobs(STUB_ACL_PKTS);
+        rp.sco_max_pkt = htobs(STUB_SCO_PKTS);
+        stub_complete(sdev, opcode, &rp, READ_BUFFER_SIZE_RP_SIZE);
+    } else if (opcode == cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_LOCAL_EXT_FEATURES)) {
+        read_local_ext_features_rp rp;
+        uint8_t page = plen ? *(const uint8_t*) param : 0xff;
+
+        if (page > STUB_MAX_PAGE) {
+            status = 0x12;     // Invalid HCI Command Parameters
+            stub_complete(sdev, opcode, &status, 1);
+            return 0;
+        }
+        rp.status       = 0x00;
+        rp.page_num     = page;
+        rp.max_page_num = STUB_MAX_PAGE;
+        memset(rp.features, 0xff, sizeof(rp.features));
+        stub_complete(sdev, opcode, &rp, READ_LOCAL_EXT_FEATURES_RP_SIZE);
+    } else if (opcode == cmd_opcode_pack(OGF_LE_CTL, OCF_LE_READ_LOCAL_SUPPORTED_FEATURES)) {
+        le_read_local_supported_features_rp rp;
+
+        rp.status = 0x00;
+        memset(rp.features, 0xff, sizeof(rp.features));
+        stub_complete(sdev, opcode, &rp, LE_READ_LOCAL_SUPPORTED_FEATURES_RP_SIZE);
+    } else if (opcode == cmd_opcode_pack(OGF_LE_CTL, OCF_LE_READ_BUFFER_SIZE)) {
+        le_read_buffer_size_rp rp;
+
+        rp.status  = 0x00;
+        rp.pkt_len = htobs(STUB_LE_MTU);
+        rp.max_pkt = STUB_LE_PKTS;
+        stub_complete(sdev, opcode, &rp, LE_READ_BUFFER_SIZE_RP_SIZE);
+    } else if (opcode == STUB_OPCODE_READ_LOOPBACK) {
+        read_loopback_mode_rp rp = { 0x00, sdev->loopback };
+
+        stub_complete(sdev, opcode, &rp, READ_LOOPBACK_MODE_RP_SIZE);
+    } else if (opcode == STUB_OPCODE_WRITE_LOOPBACK) {
+        uint8_t mode = plen ? *(const uint8_t*) param : 0xff;
+        evt_conn_complete conn;
+        evt_disconn_complete disconn;
+
+        if (mode > 0x02) {
+            status = 0x12;     // Invalid HCI Command Parameters
+            stub_complete(sdev, opcode, &status, 1);
+            return 0;
+        }
+        stub_complete(sdev, opcode, &status, 1);
+
+        // entering local loopback connects the host to itself
+        if (mode == 0x01 && sdev->loopback != 0x01) {
+            memset(&conn, 0x00, sizeof(conn));
+            conn.handle    = htobs(STUB_HANDLE);
+            conn.link_type = ACL_LINK;
+            stub_bdaddr(dev->dev_id, &conn.bdaddr);
+            stub_event(sdev, EVT_CONN_COMPLETE, &conn, EVT_CONN_COMPLETE_SIZE);
+        } else if (mode != 0x01 && sdev->loopback == 0x01) {
+            disconn.status = 0x00;
+            disconn.handle = htobs(STUB_HANDLE);
+            disconn.reason = 0x16;     // Connection Terminated By Local Host
+            stub_event(sdev, EVT_DISCONN_COMPLETE, &disconn, EVT_DISCONN_COMPLETE_SIZE);
+        }
+        sdev->loopback = mode;
+    } else {
+        status = 0x01;         // Unknown HCI Command
+        stub_complete(sdev, opcode, &status, 1);
+    }
+
+    return 0;
+}
+
+
+static int stub_send_acl(struct transport_dev* dev, const void* pkt, int len)
+{
+    struct stub_dev* sdev = dev->priv;
+    const hci_acl_hdr* hdr = pkt;
+    uint8_t done[5];
+    uint8_t* echo;
+
+    if (len < HCI_ACL_HDR_SIZE || len > HCI_ACL_HDR_SIZE + STUB_ACL_MTU ||
+            btohs(hdr->dlen) != len - HCI_ACL_HDR_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (sdev->loopback != 0x01 || acl_handle(btohs(hdr->handle)) != STUB_HANDLE) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    // the controller buffer is free again once the packet is back
+    echo = stub_push(sdev, HCI_TYPE_LEN + len);
+    if (!echo) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    echo[0] = HCI_ACLDATA_PKT;
+    memcpy(echo + 1, pkt, len);
+
+    done[0] = 1;
+    bt_put_le16(STUB_HANDLE, &done[1]);
+    bt_put_le16(1, &done[3]);
+    stub_event(sdev, EVT_NUM_COMP_PKTS, done, sizeof(done));
+    return 0;
+}
+
+
+// nothing arrives later: an empty queue waits for the timeout
+static int stub_read_event(struct transport_dev* dev, void* buf, int len, int timeout)
+{
+    struct stub_dev* sdev = dev->priv;
+
+    if (sdev->queued == 0) {
+        if (timeout > 0)
+            poll(NULL, 0, timeout);
+        return 0;
+    }
+
+    if (sdev->lens[sdev->head] < len)
+        len = sdev->lens[sdev->head];
+    memcpy(buf, sdev->queue[sdev->head], len);
+    sdev->head = (sdev->head + 1) % STUB_QUEUE;
+    sdev->queued--;
+    return len;
+}
+
+
+static int stub_read_events(struct transport_dev* dev, uint8_t* buf, int size,
+                            int* lens, int count, int timeout)
+{
+    struct stub_dev* sdev = dev->priv;
+    int n = 0;
+
+    if (sdev->queued == 0)
+        return stub_read_event(dev, buf, size, timeout);
+
+    while (n < count && sdev->queued > 0) {
+        lens[n] = stub_read_event(dev, buf + n * size, size, 0);
+        n++;
+    }
+    return n;
+}
+
+
+static int stub_set_filter(struct transport_dev* dev, const struct hci_filter* filter)
+{
+    return 0;
+}
+
+
+static void stub_destroy(struct transport* transport)
+{
+    struct stub_transport* stub = (struct stub_transport*) transport;
+
+    free(stub->ticks);
+    free(stub);
+}
+
+
+static const struct transport_ops stub_ops = {
+    stub_dev_list, stub_dev_info, stub_conn_list, stub_open, stub_close,
+    stub_send_cmd, stub_send_acl, stub_read_event, stub_read_events,
+    stub_set_filter, stub_destroy
+};
+
+
+struct transport* transport_stub(int count)
+{
+    struct stub_transport* stub = malloc(sizeof(*stub));
+
+    if (!stub)
+        return NULL;
+
+    stub->ticks = calloc(count > 0 ? count : 1, sizeof(*stub->ticks));
+    if (!stub->ticks) {
+        free(stub);
+        return NULL;
+    }
+    stub->base.ops = &stub_ops;
+    stub->count    = count;
+    return &stub->base;
+}
@@ -0,0 +1,216 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdint.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+
+// Everything the tool asks the kernel and the controllers goes through a
+// transport: the adapter list, device info and connection list ioctls,
+// opening an adapter
+// and the HCI command/event exchange. Besides the live kernel backend a
+// recorder writes every call and its result to a file, which the replay
+// backend serves back, as fast as possible or with the recorded timing.
+
+struct transport;
+
+// an opened adapter; events read from it are Command Complete/Status only,
+// unless set_filter lets others through
+struct transport_dev {
+    struct transport*  transport;
+    int                dev_id;
+    int                fd;        // backend specific
+    void*              priv;
+};
+
+// most packets read_events returns at once
+#define TRANSPORT_MAX_BATCH 64
+
+struct transport_ops {
+    // like HCIGETDEVLIST: dev_id and flags of at most max adapters;
+    // returns their number or -1 with errno set
+    int  (*dev_list)(struct transport* transport, struct hci_dev_req* devs, int max);
+    // like HCIGETDEVINFO; 0 or -1 with errno set
+    int  (*dev_info)(struct transport* transport, int dev_id, struct hci_dev_info* di);
+    // like HCIGETCONNLIST: at most max connections of an adapter; returns
+    // their number or -1 with errno set
+    int  (*conn_list)(struct transport* transport, int dev_id, struct hci_conn_info* conns, int max);
+    int  (*open)(struct transport* transport, int dev_id, struct transport_dev* dev);
+    void (*close)(struct transport_dev* dev);
+    // 0 or -1 with errno set
+    int  (*send_cmd)(struct transport_dev* dev, uint16_t opcode, uint8_t plen, const void* param);
+    // one ACL data packet, hci_acl_hdr and payload; 0 or -1 with errno set
+    int  (*send_acl)(struct transport_dev* dev, const void* pkt, int len);
+    // one HCI packet of at most len bytes; returns its length, 0 if none
+    // arrived within timeout ms or -1 with errno set
+    int  (*read_event)(struct transport_dev* dev, void* buf, int len, int timeout);
+    // up to count packets, each into its own size bytes of buf and its
+    // length into lens; waits at most timeout ms for the first one only.
+    // Returns the number of packets, 0 on timeout or -1 with errno set.
+    int  (*read_events)(struct transport_dev* dev, uint8_t* buf, int size,
+                        int* lens, int count, int timeout);
+    // replaces the socket's HCI filter; 0 or -1 with errno set
+    int  (*set_filter)(struct transport_dev* dev, const struct hci_filter* filter);
+    void (*destroy)(struct transport* transport);
+};
+
+struct transport {
+    const struct transport_ops*  ops;
+};
+
+
+// the kernel; NULL with errno set if there is no bluetooth support
+struct transport* transport_live(void);
+
+// passes every call on to inner and appends it with its result and timing
+// to the file path; takes over inner
+struct transport* transport_recorder(struct transport* inner, const char* path);
+
+// serves the calls recorded in path; with realtime each call takes as
+// long as it did when it was recorded. Calls that differ from the
+// recording fail with EPROTO.
+struct transport* transport_replay(const char* path, int realtime);
+
+// the adapter list in one HCIGETDEVLIST into a malloc'ed *devs: room for
+// HCI_MAX_DEV adapters first, doubled as long as the answer fills it (there
+// are more adapters, or some were added meanwhile). Returns the number of
+// adapters or -1 with errno set.
+int transport_dev_snapshot(struct transport* transport, struct hci_dev_req** devs);
+
+// the kernel answers at most two pages of struct hci_dev_req
+#define TRANSPORT_MAX_DEVS 1024
+
+// simulated controllers for tests without bluetooth hardware: count
+// adapters that are up, support every feature, answer the capability
+// queries and the loopback commands, and count a little more traffic on
+// every device info read; in local loopback every ACL packet comes back
+// together with a Number Of Completed Packets event
+struct transport* transport_stub(int count);
+
+
+static inline int transport_dev_list(struct transport* transport, struct hci_dev_req* devs, int max)
+{
+    return transport->ops->dev_list(transport, devs, max);
+}
+
+static inline int transport_dev_info(struct transport* transport, int dev_id, struct hci_dev_info* di)
+{
+    return transport->ops->dev_info(transport, dev_id, di);
+}
+
+static inline int transport_conn_list(struct transport* transport, int dev_id,
+                                      struct hci_conn_info* conns, int max)
+{
+    return transport->ops->conn_list(transport, dev_id, conns, max);
+}
+
+static inline int transport_open(struct transport* transport, int dev_id, struct transport_dev* dev)
+{
+    return transport->ops->open(transport, dev_id, dev);
+}
+
+static inline void transport_close(struct transport_dev* dev)
+{
+    dev->transport->ops->close(dev);
+}
+
+static inline int transport_send_cmd(struct transport_dev* dev, uint16_t opcode,
+                                     uint8_t plen, const void* param)
+{
+    return dev->transport->ops->send_cmd(dev, opcode, plen, param);
+}
+
+static inline int transport_send_acl(struct transport_dev* dev, const void* pkt, int len)
+{
+    return dev->transport->ops->send_acl(dev, pkt, len);
+}
+
+static inline int transport_read_event(struct transport_dev* dev, void* buf, int len, int timeout)
+{
+    return dev->transport->ops->read_event(dev, buf, len, timeout);
+}
+
+static inline int transport_read_events(struct transport_dev* dev, uint8_t* buf, int size,
+                                        int* lens, int count, int timeout)
+{
+    return dev->transport->ops->read_events(dev, buf, size, lens, count, timeout);
+}
+
+static inline int transport_set_filter(struct transport_dev* dev, const struct hci_filter* filter)
+{
+    return dev->transport->ops->set_filter(dev, filter);
+}
+
+static inline void transport_destroy(struct transport* transport)
+{
+    if (transport)
+        transport->ops->destroy(transport);
+}
+
+
+// recording file: a header followed by one record per call, each a
+// struct transport_record and len bytes of data, padded to 8 bytes.
+// Everything is in the byte order of the recording machine; byte_order
+// tells which one.
+#define TRANSPORT_MAGIC     "BTDIRECD"
+#define TRANSPORT_VERSION   1
+#define TRANSPORT_BYTE_ORDER 0x01020304
+
+#define TRANSPORT_ALIGN(len) (((len) + 7) & ~7)
+
+struct transport_file_header {
+    char      magic[8];
+    uint32_t  version;
+    uint32_t  byte_order;
+};
+
+enum transport_call {
+    TRANSPORT_DEV_LIST = 1,    // data: result x struct hci_dev_req
+    TRANSPORT_DEV_INFO,        // data: struct hci_dev_info if result is 0
+    TRANSPORT_OPEN,
+    TRANSPORT_CLOSE,
+    TRANSPORT_SEND_CMD,        // data: hci_command_hdr and parameters
+    TRANSPORT_READ_EVENT,      // data: the packet; result 0 = timeout; also
+                               // one record per packet of read_events
+    TRANSPORT_CONN_LIST,       // data: result x struct hci_conn_info
+    TRANSPORT_SET_FILTER,      // data: struct hci_filter
+    TRANSPORT_SEND_ACL,        // data: hci_acl_hdr and payload
+};
+
+// a packet that came with the one before in the same read_events
+#define TRANSPORT_FLAG_BATCH  0x01
+
+struct transport_record {
+    uint8_t   call;            // enum transport_call
+    uint8_t   flags;           // TRANSPORT_FLAG_*
+    int16_t   dev_id;          // -1 for the adapter list
+    int32_t   result;
+    int32_t   error;           // errno if result is -1
+    uint32_t  len;
+    uint64_t  start;           // ns since the recording started
+    uint64_t  duration;        // ns
+};
+
+#endif
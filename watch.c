@@ -0,0 +1,171 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "adapter.h"
+#include "statlog.h"
+#include "watch.h"
+
+
+// more adapters than a run handles are not watched
+#define WATCH_MAX_ADAPTERS MAX_ADAPTERS
+
+// stdout is flushed once per tick out of this buffer
+static char watch_stdout_buf[8192];
+
+
+void watch_update(struct watch_adapter* adapter, const struct hci_dev_stats* stats)
+{
+    const uint32_t* now = (const uint32_t*) stats;
+    unsigned int i;
+
+    for (i = 0; i < WATCH_NUM_COUNTERS; i++) {
+        // the first sample only sets the baseline
+        adapter->delta[i] = adapter->valid ? (uint32_t) (now[i] - adapter->last[i]) : 0;
+        adapter->total[i] += adapter->delta[i];
+        adapter->last[i] = now[i];
+    }
+
+    adapter->valid = 1;
+}
+
+
+static double elapsed(const struct timespec* from, const struct timespec* to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+
+static void print_header(void)
+{
+    printf("%9s %-6s %10s %10s %8s %8s %8s %8s %8s %8s %6s %6s %14s %14s\n",
+           "time", "dev",
+           "byte_rx/s", "byte_tx/s", "acl_rx/s", "acl_tx/s",
+           "sco_rx/s", "sco_tx/s", "evt_rx/s", "cmd_tx/s",
+           "err_rx", "err_tx", "byte_rx", "byte_tx");
+}
+
+
+static void print_sample(struct watch_adapter* adapter, double t, double dt)
+{
+    uint64_t* d = adapter->delta;
+
+    printf("%9.3f hci%-3d %10.0f %10.0f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f "
+           "%6llu %6llu %14llu %14llu\n",
+           t, adapter->dev_id,
+           d[BYTE_RX] / dt, d[BYTE_TX] / dt,
+           d[ACL_RX]  / dt, d[ACL_TX]  / dt,
+           d[SCO_RX]  / dt, d[SCO_TX]  / dt,
+           d[EVT_RX]  / dt, d[CMD_TX]  / dt,
+           (unsigned long long) d[ERR_RX],
+           (unsigned long long) d[ERR_TX],
+           (unsigned long long) adapter->total[BYTE_RX],
+           (unsigned long long) adapter->total[BYTE_TX]);
+}
+
+
+int watch_adapters(struct transport* transport, const int* dev_ids, int count,
+                   double interval, struct stat_log* log)
+{
+    struct watch_adapter adapters[WATCH_MAX_ADAPTERS];
+    struct statlog_sample samples[WATCH_MAX_ADAPTERS];
+    int num_samples, log_failed = 0;
+    struct hci_dev_info di;
+    struct timespec start, tick, now, last;
+    long interval_ns;
+    int i;
+
+    if (count > WATCH_MAX_ADAPTERS)
+        count = WATCH_MAX_ADAPTERS;
+
+    memset(adapters, 0x00, sizeof(adapters));
+    for (i = 0; i < count; i++)
+        adapters[i].dev_id = dev_ids[i];
+
+    setvbuf(stdout, watch_stdout_buf, _IOFBF, sizeof(watch_stdout_buf));
+
+    interval_ns = (long) (interval * 1e9);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    tick = start;
+    last = start;
+
+    print_header();
+
+    while (1) {
+        double t, dt;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        t  = elapsed(&start, &now);
+        dt = elapsed(&last, &now);
+        last = now;
+        num_samples = 0;
+
+        for (i = 0; i < count; i++) {
+            struct watch_adapter* adapter = &adapters[i];
+            int was_valid = adapter->valid;
+
+            if (transport_dev_info(transport, adapter->dev_id, &di) < 0) {
+                // start over with a new baseline once it is back
+                if (was_valid)
+                    printf("%9.3f hci%-3d %s\n", t, adapter->dev_id, strerror(errno));
+                adapter->valid = 0;
+                continue;
+            }
+
+            watch_update(adapter, &di.stat);
+            if (was_valid && dt > 0)
+                print_sample(adapter, t, dt);
+
+            samples[num_samples].dev_id = adapter->dev_id;
+            samples[num_samples].flags  = di.flags;
+            samples[num_samples].stat   = di.stat;
+            num_samples++;
+        }
+
+        // the log keeps the raw counters; a failed append is reported once
+        if (log && statlog_append(log, statlog_now(), samples, num_samples) < 0 && !log_failed) {
+            fprintf(stderr, "Can't append to the statistics log: %s (%d)\n",
+                    strerror(errno), errno);
+            log_failed = 1;
+        }
+
+        fflush(stdout);
+
+        // absolute deadlines keep the sampling period free of drift
+        tick.tv_nsec += interval_ns % 1000000000L;
+        tick.tv_sec  += interval_ns / 1000000000L + tick.tv_nsec / 1000000000L;
+        tick.tv_nsec %= 1000000000L;
+        if (elapsed(&now, &tick) < 0)
+            tick = now;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tick, NULL) == EINTR)
+            ;
+    }
+
+    return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ *  bt_device_info
+ *  Copyright 2014 Simon Wiesmann
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdint.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "transport.h"
+
+struct stat_log;
+
+
+// number of 32 bit counters in struct hci_dev_stats
+#define WATCH_NUM_COUNTERS (sizeof(struct hci_dev_stats) / sizeof(uint32_t))
+
+// order of the counters in struct hci_dev_stats
+enum {
+    ERR_RX, ERR_TX, CMD_TX, EVT_RX, ACL_TX, ACL_RX, SCO_TX, SCO_RX, BYTE_RX, BYTE_TX
+};
+
+// the counters of struct hci_dev_stats widened to 64 bit, so they keep
+// counting when the kernel's 32 bit counters (mostly byte_rx/byte_tx) wrap
+struct watch_adapter {
+    int       dev_id;
+    int       valid;                        // last sample succeeded
+    uint32_t  last[WATCH_NUM_COUNTERS];     // raw counters of the last sample
+    uint64_t  total[WATCH_NUM_COUNTERS];
+    uint64_t  delta[WATCH_NUM_COUNTERS];    // growth since the previous sample
+};
+
+
+// folds a new raw sample into the 64 bit counters; wrapped counters are
+// handled by the unsigned 32 bit subtraction
+void watch_update(struct watch_adapter* adapter, const struct hci_dev_stats* stats);
+
+// samples the given adapters every interval seconds until killed and prints
+// per second rates, and appends every sample to log unless it is NULL;
+// returns only on error
+int watch_adapters(struct transport* transport, const int* dev_ids, int count,
+                   double interval, struct stat_log* log);
+
+#endif